@@ -379,6 +379,22 @@ xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx*/
        */
 
 
+     PyAPI_FUNC(PyObject *) _PyObject_CallMethodArray(PyObject *o,
+                                                      PyObject *m,
+                                                      PyObject **args,
+                                                      Py_ssize_t nargs);
+
+       /*
+     Call the method named m of object o with the nargs arguments in
+     args.  Unless o.m is an attribute of the instance, or something
+     other than a function or a method descriptor, the method is
+     called without creating the bound method object:  see
+     _PyObject_GetMethod().  Returns the result of the call on
+     success, or NULL on failure.  This is the equivalent of the
+     Python expression: o.method(*args).
+       */
+
+
      /* Implemented elsewhere:
 
      long PyObject_Hash(PyObject *o);
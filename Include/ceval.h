@@ -23,6 +23,20 @@ PyAPI_FUNC(PyObject *) PyEval_CallMethod(PyObject *obj,
 PyAPI_FUNC(void) PyEval_SetProfile(Py_tracefunc, PyObject *);
 PyAPI_FUNC(void) PyEval_SetTrace(Py_tracefunc, PyObject *);
 
+/* Report a profiling event to the current thread's profile function.
+   Returns -1 with an exception set if the profile function failed. */
+PyAPI_FUNC(int) _PyEval_CallProfile(PyThreadState *, int, PyObject *);
+
+/* Compiled code reports function entry and exit with these.  func is the
+   function object being run; PyEval_PROFILE_RETURN is used for normal and
+   exceptional exits alike.  Both cost a flag test when nobody profiles. */
+#define PyEval_PROFILE_CALL(tstate, func)                               \
+    ((tstate)->use_tracing && (tstate)->c_profilefunc != NULL ?         \
+     _PyEval_CallProfile((tstate), PyTrace_CALL, (func)) : 0)
+#define PyEval_PROFILE_RETURN(tstate, func)                             \
+    ((tstate)->use_tracing && (tstate)->c_profilefunc != NULL ?         \
+     _PyEval_CallProfile((tstate), PyTrace_RETURN, (func)) : 0)
+
 struct _frame; /* Avoid including frameobject.h */
 
 PyAPI_FUNC(PyObject *) PyEval_GetBuiltins(void);
@@ -33,8 +47,17 @@ PyAPI_FUNC(int) PyEval_GetRestricted(void);
 
 PyAPI_FUNC(int) Py_FlushLine(void);
 
+/* Schedule func(arg) to be called by the main thread, soon.  Safe to call
+   from any thread, and from a signal handler.  Returns 0 if the call was
+   queued, or -1 if the queue was full:  the call is then dropped, and
+   counted in sys.getpendingcallstats().  Callers that can't afford to lose
+   it must try again later. */
 PyAPI_FUNC(int) Py_AddPendingCall(int (*func)(void *), void *arg);
 PyAPI_FUNC(int) Py_MakePendingCalls(void);
+/* Size the pending call queue; call before Py_Initialize().  The size is
+   rounded up to a power of 2.  Returns -1 if it cannot be changed. */
+PyAPI_FUNC(int) Py_SetPendingCallCapacity(int);
+PyAPI_FUNC(PyObject *) _PyEval_GetPendingCallStats(void);
 
 /* Protection against deeply nested recursive calls */
 PyAPI_FUNC(void) Py_SetRecursionLimit(int);
@@ -64,6 +87,11 @@ PyAPI_FUNC(PyObject *) PyEval_EvalFrameEx(struct _frame *f, int exc);
 PyAPI_DATA(volatile int) _Py_Ticker;
 PyAPI_DATA(int) _Py_CheckInterval;
 
+/* Compiled code calls this when _Py_Ticker goes negative.  It runs pending
+   calls and drops the GIL if another thread requested it.  Returns -1 with
+   an exception set on failure, 0 otherwise. */
+PyAPI_FUNC(int) _PyEval_HandleTick(void);
+
 /* Interface for threads.
 
    A module that plans to do a blocking system call (or something else
@@ -122,6 +150,22 @@ PyAPI_FUNC(void) PyEval_AcquireThread(PyThreadState *tstate);
 PyAPI_FUNC(void) PyEval_ReleaseThread(PyThreadState *tstate);
 PyAPI_FUNC(void) PyEval_ReInitThreads(void);
 
+/* Minimum time, in microseconds, a thread waits for the GIL before asking
+   the holder to drop it. */
+PyAPI_FUNC(void) _PyEval_SetSwitchInterval(unsigned long microseconds);
+PyAPI_FUNC(unsigned long) _PyEval_GetSwitchInterval(void);
+
+/* GIL contention statistics, see sys.getgilstats().  _PyEval_GetGILStats()
+   returns the process-wide figures; _PyEval_ResetGILStats() clears them
+   along with those of every thread. */
+PyAPI_FUNC(PyObject *) _PyEval_GetGILStats(void);
+PyAPI_FUNC(void) _PyEval_ResetGILStats(void);
+PyAPI_FUNC(PyObject *) _PyGILStats_AsDict(PyGILStats *);
+
+/* Thread ident of the thread holding the GIL, 0 while it is free.  Safe
+   to read from a signal handler, unlike _PyThreadState_Current. */
+PyAPI_DATA(volatile long) _PyEval_GILHolder;
+
 #define Py_BEGIN_ALLOW_THREADS { \
                         PyThreadState *_save; \
                         _save = PyEval_SaveThread();
@@ -19,6 +19,10 @@ typedef struct {
     PyObject	*cl_setattr;
     PyObject	*cl_delattr;
     PyObject    *cl_weakreflist; /* List of weak references */
+    PyDictKeysObject *cl_cached_keys; /* Shared by the instances' in_dict,
+                                         or NULL */
+    unsigned int cl_version_tag; /* Changes with cl_bases and cl_dict,
+                                    for the lookup cache */
 } PyClassObject;
 
 typedef struct {
@@ -64,6 +68,10 @@ PyAPI_FUNC(PyObject *) PyMethod_Class(PyObject *);
  */
 PyAPI_FUNC(PyObject *) _PyInstance_Lookup(PyObject *pinst, PyObject *name);
 
+/* _PyObject_GetMethod() for classic instances */
+PyAPI_FUNC(int) _PyInstance_GetMethod(PyObject *pinst, PyObject *name,
+                                      PyObject **method);
+
 /* Macros for direct access to these values. Type checks are *not*
    done, so use with care. */
 #define PyMethod_GET_FUNCTION(meth) \
@@ -75,6 +83,9 @@ PyAPI_FUNC(PyObject *) _PyInstance_Lookup(PyObject *pinst, PyObject *name);
 
 PyAPI_FUNC(int) PyClass_IsSubclass(PyObject *, PyObject *);
 
+/* Called when a dict watched by a class (see _PyDict_Watch()) changes. */
+PyAPI_FUNC(void) _PyClass_DictModified(PyObject *dict);
+
 PyAPI_FUNC(int) PyMethod_ClearFreeList(void);
 
 #ifdef __cplusplus
@@ -14,78 +14,76 @@ extern "C" {
 */
 
 /*
-There are three kinds of slots in the table:
-
-1. Unused.  me_key == me_value == NULL
-   Does not hold an active (key, value) pair now and never did.  Unused can
-   transition to Active upon key insertion.  This is the only case in which
-   me_key is NULL, and is each slot's initial state.
-
-2. Active.  me_key != NULL and me_key != dummy and me_value != NULL
-   Holds an active (key, value) pair.  Active can transition to Dummy upon
-   key deletion.  This is the only case in which me_value != NULL.
-
-3. Dummy.  me_key == dummy and me_value == NULL
-   Previously held an active (key, value) pair, but that was deleted and an
-   active pair has not yet overwritten the slot.  Dummy can transition to
-   Active upon key insertion.  Dummy slots cannot be made Unused again
-   (cannot have me_key set to NULL), else the probe sequence in case of
-   collision would have no way to know they were once active.
-
-Note: .popitem() abuses the me_hash field of an Unused or Dummy slot to
-hold a search finger.  The me_hash field of Unused or Dummy slots has no
-meaning otherwise.
+The table is compact:  a sparse hash index of small integers points into a
+dense array of PyDictEntry, to which new items are appended.  Iteration
+walks the entries array, so items come out in insertion order.  The
+layout of the table is private to Objects/dictobject.c.
+
+An entry in the array is in one of two states:
+
+1. Active.  me_key != NULL and me_value != NULL
+   Holds an active (key, value) pair.  Active can transition to Deleted
+   upon key deletion.
+
+2. Deleted.  me_key == me_value == NULL
+   Previously held an active (key, value) pair.  The entry stays a hole in
+   the array until the table is rebuilt; its slot in the hash index becomes
+   a dummy, so the probe sequence in case of collision still knows it was
+   once active.
 */
 
-/* PyDict_MINSIZE is the minimum size of a dictionary.  This many slots are
- * allocated directly in the dict object (in the ma_smalltable member).
+/* PyDict_MINSIZE is the minimum size of a dictionary's hash index.
  * It must be a power of 2, and at least 4.  8 allows dicts with no more
- * than 5 active entries to live in ma_smalltable (and so avoid an
- * additional malloc); instrumentation suggested this suffices for the
- * majority of dicts (consisting mostly of usually-small instance dicts and
- * usually-small dicts created to pass keyword arguments).
+ * than 5 active entries in the smallest table; instrumentation suggested
+ * this suffices for the majority of dicts (consisting mostly of
+ * usually-small instance dicts and usually-small dicts created to pass
+ * keyword arguments).
  */
 #define PyDict_MINSIZE 8
 
 typedef struct {
-    /* Cached hash code of me_key.  Note that hash codes are C longs.
-     * We have to use Py_ssize_t instead because dict_popitem() abuses
-     * me_hash to hold a search finger.
-     */
+    /* Cached hash code of me_key.  Note that hash codes are C longs. */
     Py_ssize_t me_hash;
     PyObject *me_key;
     PyObject *me_value;
 } PyDictEntry;
 
+typedef struct _dictkeysobject PyDictKeysObject;
+
 /*
-To ensure the lookup algorithm terminates, there must be at least one Unused
-slot (NULL key) in the table.
-The value ma_fill is the number of non-NULL keys (sum of Active and Dummy);
-ma_used is the number of non-NULL, non-dummy keys (== the number of non-NULL
-values == the number of Active items).
-To avoid slowing down lookups on a near-full table, we resize the table when
-it's two-thirds full.
+ma_used is the number of Active entries.  An empty dict shares a static,
+read-only keys object, so creating one doesn't allocate a table.
+
+A dict is either combined or split.  A combined table keeps the values in
+its entries.  A split table shares its keys object with other dicts --
+the instance dicts of a class, which mostly have the same keys -- and
+keeps its own values in ma_values, indexed like the shared entries.  Only
+string keys are shared.  A split dict holds values for a prefix of the
+shared entries; any change the shared keys can't express (an insertion in
+a different order, a non-string key, a deletion) first gives the dict a
+combined table of its own.
+
+ma_version_tag is set from a global counter when the dict is created and
+on every change to its contents, so no two dicts, nor two states of one
+dict, ever have the same tag.  Code caching what it found in a dict can
+check the tag instead of looking again.  Its low bit is set in dicts that
+_PyDict_Watch() was called on:  changing one of those calls
+_PyClass_DictModified().
 */
 typedef struct _dictobject PyDictObject;
 struct _dictobject {
     PyObject_HEAD
-    Py_ssize_t ma_fill;  /* # Active + # Dummy */
     Py_ssize_t ma_used;  /* # Active */
+    unsigned PY_LONG_LONG ma_version_tag;
 
-    /* The table contains ma_mask + 1 slots, and that's a power of 2.
-     * We store the mask instead of the size because the mask is more
-     * frequently needed.
+    /* The hash index and the entries, allocated together.  ma_keys is
+     * never NULL!  This rule saves repeated runtime null-tests in the
+     * workhorse getitem and setitem calls.
      */
-    Py_ssize_t ma_mask;
+    PyDictKeysObject *ma_keys;
 
-    /* ma_table points to ma_smalltable for small tables, else to
-     * additional malloc'ed memory.  ma_table is never NULL!  This rule
-     * saves repeated runtime null-tests in the workhorse getitem and
-     * setitem calls.
-     */
-    PyDictEntry *ma_table;
-    PyDictEntry *(*ma_lookup)(PyDictObject *mp, PyObject *key, long hash);
-    PyDictEntry ma_smalltable[PyDict_MINSIZE];
+    /* NULL for a combined table, else the values of a split table. */
+    PyObject **ma_values;
 };
 
 PyAPI_DATA(PyTypeObject) PyDict_Type;
@@ -123,8 +121,41 @@ PyAPI_FUNC(PyObject *) PyDict_Copy(PyObject *mp);
 PyAPI_FUNC(int) PyDict_Contains(PyObject *mp, PyObject *key);
 PyAPI_FUNC(int) _PyDict_Contains(PyObject *mp, PyObject *key, long hash);
 PyAPI_FUNC(PyObject *) _PyDict_NewPresized(Py_ssize_t minused);
+PyAPI_FUNC(PyObject *) _PyDict_GetItemHint(PyObject *mp, PyObject *key,
+                                           Py_ssize_t *hint);
 PyAPI_FUNC(void) _PyDict_MaybeUntrack(PyObject *mp);
 
+/* Key sharing for instance dicts.  A class owns a reference to the keys
+   object its instances' dicts share, in *cachedp, which the functions
+   below may replace with a larger one.  *cachedp may be NULL, in which
+   case they act on ordinary dicts. */
+PyAPI_FUNC(PyDictKeysObject *) _PyDict_NewKeysForClass(void);
+PyAPI_FUNC(void) _PyDictKeys_DecRef(PyDictKeysObject *keys);
+PyAPI_FUNC(PyObject *) _PyDict_NewShared(PyDictKeysObject *cached);
+PyAPI_FUNC(int) _PyDict_SetItemShared(PyDictKeysObject **cachedp,
+                                      PyObject *mp, PyObject *key,
+                                      PyObject *item);
+
+/* Version tags.  _PyDict_LoadGlobal() looks a name up in globals, then in
+   builtins (which may be NULL), the way LOAD_GLOBAL does, and remembers
+   where it found it in *cache.  While neither dict changes, later calls
+   with the same cache return the value after comparing the version tags.
+   The cache must start out zeroed, and be used with a single name.  The
+   value returned is borrowed; NULL means the name wasn't found, unless an
+   exception is set. */
+typedef struct {
+    unsigned PY_LONG_LONG globals_version;
+    unsigned PY_LONG_LONG builtins_version;  /* 0 if found in globals */
+    PyObject *value;                         /* borrowed */
+} _PyDictLookupCache;
+
+PyAPI_FUNC(unsigned PY_LONG_LONG) _PyDict_GetVersion(PyObject *mp);
+PyAPI_FUNC(void) _PyDict_Watch(PyObject *mp);
+PyAPI_FUNC(PyObject *) _PyDict_LoadGlobal(PyObject *globals,
+                                          PyObject *builtins,
+                                          PyObject *key,
+                                          _PyDictLookupCache *cache);
+
 /* PyDict_Update(mp, other) is equivalent to PyDict_Merge(mp, other, 1). */
 PyAPI_FUNC(int) PyDict_Update(PyObject *mp, PyObject *other);
 
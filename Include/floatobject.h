@@ -120,6 +120,8 @@ PyAPI_FUNC(double) _PyFloat_Unpack8(const unsigned char *p, int le);
 
 /* free list api */
 PyAPI_FUNC(int) PyFloat_ClearFreeList(void);
+PyAPI_FUNC(int) _PyFloat_TrimFreeList(void);
+PyAPI_FUNC(PyObject *) _PyFloat_GetFreeListStats(void);
 
 /* Format the object based on the format_spec, as defined in PEP 3101
    (Advanced String Formatting). */
@@ -425,6 +425,8 @@ typedef struct _heaptypeobject {
                                       see add_operators() in typeobject.c . */
     PyBufferProcs as_buffer;
     PyObject *ht_name, *ht_slots;
+    /* Keys shared by the instances' __dict__, or NULL */
+    struct _dictkeysobject *ht_cached_keys;
     /* here are optional user slots, followed by the members. */
 } PyHeapTypeObject;
 
@@ -500,6 +502,36 @@ PyAPI_FUNC(int)
 _PyObject_GenericSetAttrWithDict(PyObject *, PyObject *,
                                  PyObject *, PyObject *);
 
+/* Inline cache for PyObject_GetAttr() at a call site that always looks up
+   the same name, for objects using PyObject_GenericGetAttr().  While the
+   object's type and its version tag are the ones remembered, what
+   _PyType_Lookup() found is reused:  slots are read directly, and instance
+   dicts are searched at the position the name was last found in.  The
+   cache must start out zeroed.  hits and misses count the lookups done with
+   and without the remembered information. */
+typedef struct {
+    PyTypeObject *type;         /* borrowed; compared only */
+    unsigned int version;       /* type->tp_version_tag */
+    int kind;                   /* how the attribute is found */
+    PyObject *descr;            /* borrowed; kept alive by type */
+    Py_ssize_t offset;          /* of the slot, for members */
+    Py_ssize_t hint;            /* position in the instance dict */
+    Py_ssize_t hits;
+    Py_ssize_t misses;
+} _PyAttrCache;
+
+PyAPI_FUNC(PyObject *) _PyObject_GetAttrCached(PyObject *, PyObject *,
+                                               _PyAttrCache *);
+
+/* Look up obj.name to call it, without binding it to obj where the call
+   can take obj as its first argument instead:  for functions and method
+   descriptors found in the type, or functions in the class of a classic
+   instance.  Return 1, and set *method to the unbound object, in those
+   cases.  Otherwise return 0 and set *method to obj.name, or to NULL with
+   an exception set.  *method is a new reference either way. */
+PyAPI_FUNC(int) _PyObject_GetMethod(PyObject *obj, PyObject *name,
+                                    PyObject **method);
+
 
 /* PyObject_Dir(obj) acts like Python __builtin__.dir(obj), returning a
    list of strings.  PyObject_Dir(NULL) is like __builtin__.dir(),
@@ -687,12 +719,26 @@ complications in the deallocation function.  (This is actually a
 decision that's up to the implementer of each new type so if you want,
 you can count such references to the type object.)
 
-*** WARNING*** The Py_DECREF macro must have a side-effect-free argument
-since it may evaluate its argument multiple times.  (The alternative
-would be to mace it a proper function or assign it to a global temporary
-variable first, both of which are slower; and in a multi-threaded
-environment the global variable trick is not safe.)
+Py_INCREF and Py_DECREF are inline functions behind their macros, so
+they evaluate their argument only once.
+
+Objects whose reference count is at least _Py_IMMORTAL_MIN are immortal:
+Py_INCREF and Py_DECREF leave their count alone, so that they never write
+to them, and they are never deallocated.  _Py_SetImmortal() gives an
+object the count _Py_IMMORTAL_REFCNT, far enough inside the range that
+code which changes ob_refcnt directly cannot leave it.  None, True, False,
+NotImplemented, Ellipsis and the small ints are immortal from the start;
+gc.immortalize() makes everything alive at the time immortal.
 */
+#if SIZEOF_SIZE_T > 4
+#define _Py_IMMORTAL_MIN        ((Py_ssize_t)1 << 60)
+#define _Py_IMMORTAL_REFCNT     ((Py_ssize_t)3 << 60)
+#else
+#define _Py_IMMORTAL_MIN        ((Py_ssize_t)1 << 28)
+#define _Py_IMMORTAL_REFCNT     ((Py_ssize_t)3 << 28)
+#endif
+#define _Py_IsImmortal(op) (((PyObject*)(op))->ob_refcnt >= _Py_IMMORTAL_MIN)
+PyAPI_FUNC(void) _Py_SetImmortal(PyObject *);
 
 /* First define a pile of simple helper macros, one set per special
  * build symbol.  These either expand to the obvious things, or to
@@ -764,18 +810,29 @@ PyAPI_FUNC(void) _Py_AddToAllObjects(PyObject *, int force);
     (*Py_TYPE(op)->tp_dealloc)((PyObject *)(op)))
 #endif /* !Py_TRACE_REFS */
 
-#define Py_INCREF(op) (                         \
-    _Py_INC_REFTOTAL  _Py_REF_DEBUG_COMMA       \
-    ((PyObject*)(op))->ob_refcnt++)
-
-#define Py_DECREF(op)                                   \
-    do {                                                \
-        if (_Py_DEC_REFTOTAL  _Py_REF_DEBUG_COMMA       \
-        --((PyObject*)(op))->ob_refcnt != 0)            \
-            _Py_CHECK_REFCNT(op)                        \
-        else                                            \
-        _Py_Dealloc((PyObject *)(op));                  \
-    } while (0)
+Py_STATIC_INLINE(void)
+_Py_INCREF(PyObject *op)
+{
+    if (!_Py_IsImmortal(op)) {
+        _Py_INC_REFTOTAL;
+        op->ob_refcnt++;
+    }
+}
+
+Py_STATIC_INLINE(void)
+_Py_DECREF(PyObject *op)
+{
+    if (_Py_IsImmortal(op))
+        return;
+    _Py_DEC_REFTOTAL;
+    if (--op->ob_refcnt != 0)
+        _Py_CHECK_REFCNT(op)
+    else
+        _Py_Dealloc(op);
+}
+
+#define Py_INCREF(op) _Py_INCREF((PyObject *)(op))
+#define Py_DECREF(op) _Py_DECREF((PyObject *)(op))
 
 /* Safely decref `op` and set `op` to NULL, especially useful in tp_clear
  * and tp_dealloc implementatons.
@@ -101,6 +101,19 @@ PyAPI_FUNC(void) PyObject_Free(void *);
 
 /* Macros */
 #ifdef WITH_PYMALLOC
+/* Returning idle arena memory to the system; see Objects/obmalloc.c. */
+PyAPI_FUNC(void) _PyObject_SetArenaPurgeDelay(double);
+PyAPI_FUNC(double) _PyObject_GetArenaPurgeDelay(void);
+PyAPI_FUNC(size_t) _PyObject_PurgeArenas(int force);
+PyAPI_FUNC(PyObject *) _PyObject_GetArenaStats(void);
+/* Per size class allocator statistics, for sys.getallocstats(). */
+PyAPI_FUNC(PyObject *) _PyObject_GetAllocStats(void);
+/* gc_refs kept outside the objects during a collection, for
+   gc.set_side_refs(); see Objects/obmalloc.c. */
+#define _PyGC_SIDE_UNSET        PY_SSIZE_T_MIN
+PyAPI_FUNC(Py_ssize_t *) _PyObject_GCSideRefs(void *, int);
+PyAPI_FUNC(void) _PyObject_GCSideClear(void);
+
 #ifdef PYMALLOC_DEBUG   /* WITH_PYMALLOC && PYMALLOC_DEBUG */
 PyAPI_FUNC(void *) _PyObject_DebugMalloc(size_t nbytes);
 PyAPI_FUNC(void *) _PyObject_DebugRealloc(void *p, size_t nbytes);
@@ -302,6 +315,11 @@ extern PyGC_Head *_PyGC_generation0;
     (PyObject_IS_GC(obj) && \
         (!PyTuple_CheckExact(obj) || _PyObject_GC_IS_TRACKED(obj)))
 
+/* Untracking instances of heap types whose attributes are all atomic;
+   see Objects/typeobject.c. */
+PyAPI_FUNC(void) _PyObject_MaybeUntrack(PyObject *);
+PyAPI_FUNC(void) _PyObject_Retrack(PyObject *);
+
 
 PyAPI_FUNC(PyObject *) _PyObject_GC_Malloc(size_t);
 PyAPI_FUNC(PyObject *) _PyObject_GC_New(PyTypeObject *);
@@ -295,6 +295,21 @@ typedef Py_intptr_t     Py_ssize_t;
 #define Py_LOCAL_INLINE(type) static type
 #endif
 
+/* Py_STATIC_INLINE declares a function defined in a header, used where a
+ * macro would have to evaluate its arguments more than once.  Unlike
+ * Py_LOCAL_INLINE it always asks for inlining, since most files that
+ * include the header won't call the function.
+ */
+#if defined(_MSC_VER)
+#define Py_STATIC_INLINE(type) static __inline type
+#elif defined(__GNUC__)
+#define Py_STATIC_INLINE(type) static __inline__ type
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L
+#define Py_STATIC_INLINE(type) static inline type
+#else
+#define Py_STATIC_INLINE(type) static type
+#endif
+
 /* Py_MEMCPY can be used instead of memcpy in cases where the copied blocks
  * are often very short.  While most platforms have highly optimized code for
  * large transfers, the setup costs for memcpy are often quite high.  MEMCPY
@@ -53,6 +53,35 @@ typedef int (*Py_tracefunc)(PyObject *, struct _frame *, int, PyObject *);
 #define PyTrace_C_EXCEPTION 5
 #define PyTrace_C_RETURN 6
 
+/* GIL contention counters, kept per thread state and globally by
+   Python/ceval_gil.h and reported by sys.getgilstats().  Bucket i of
+   hold_hist counts GIL hold periods shorter than 2**i microseconds (and
+   at least 2**(i-1)); the last bucket collects everything longer. */
+#define PyGIL_HOLD_BUCKETS 20
+
+typedef struct {
+    long acquisitions;          /* times the GIL was taken */
+    long contended;             /* ... of which had to wait for it */
+    long forced_drops;          /* times it was dropped on request */
+    PY_LONG_LONG wait_ns;       /* total time spent waiting */
+    PY_LONG_LONG max_wait_ns;   /* longest single wait */
+    PY_LONG_LONG hold_ns;       /* total time spent holding it */
+    long hold_hist[PyGIL_HOLD_BUCKETS];
+} PyGILStats;
+
+/* A cheap record of the compiled functions a thread is executing, for the
+   sampling profiler (Modules/_sampleprof.c), which has no frame objects
+   to look at.  Generated code brackets each function body with
+   PyShadowStack_PUSH(tstate, "module.function") and
+   PyShadowStack_POP(tstate).  Names must be static strings.  Calls nested
+   deeper than PyShadowStack_MAXDEPTH are counted but not recorded. */
+#define PyShadowStack_MAXDEPTH 128
+
+typedef struct {
+    volatile int depth;
+    const char *names[PyShadowStack_MAXDEPTH];
+} PyShadowStack;
+
 typedef struct _ts {
     /* See Python/ceval.c for comments explaining most fields */
 
@@ -98,6 +127,9 @@ typedef struct _ts {
     int trash_delete_nesting;
     PyObject *trash_delete_later;
 
+    PyGILStats gil_stats;
+    PyShadowStack shadow_stack;
+
     /* XXX signal handlers should also be here */
 
 } PyThreadState;
@@ -122,6 +154,18 @@ PyAPI_FUNC(PyObject *) PyThreadState_GetDict(void);
 PyAPI_FUNC(int) PyThreadState_SetAsyncExc(long, PyObject *);
 
 
+/* The name is stored before depth is raised, so a signal handler reading
+   the stack of the interrupted thread never sees an unset entry. */
+#define PyShadowStack_PUSH(tstate, name)                                \
+    do {                                                                \
+        PyShadowStack *_ss = &(tstate)->shadow_stack;                   \
+        if (_ss->depth < PyShadowStack_MAXDEPTH)                        \
+            _ss->names[_ss->depth] = (name);                            \
+        _ss->depth++;                                                   \
+    } while (0)
+#define PyShadowStack_POP(tstate) ((tstate)->shadow_stack.depth--)
+
+
 /* Variable and macro for in-line access to current thread state */
 
 PyAPI_DATA(PyThreadState *) _PyThreadState_Current;
@@ -182,6 +226,14 @@ PyAPI_FUNC(PyThreadState *) PyGILState_GetThisThreadState(void);
 */
 PyAPI_FUNC(PyObject *) _PyThread_CurrentFrames(void);
 
+/* The per-thread half of sys.getgilstats() and sys.resetgilstats().
+   Returns a dict mapping thread id to that thread's GIL statistics.
+*/
+#ifdef WITH_THREAD
+PyAPI_FUNC(PyObject *) _PyThread_GILStats(void);
+PyAPI_FUNC(void) _PyThread_ResetGILStats(void);
+#endif
+
 /* Routines for advanced debuggers, requested by David Beazley.
    Don't use unless you know what you are doing! */
 PyAPI_FUNC(PyInterpreterState *) PyInterpreterState_Head(void);
@@ -0,0 +1,539 @@
+/* Signal-driven sampling profiler.
+
+   A POSIX timer (timer_create(), falling back to setitimer(ITIMER_PROF)
+   where there is none) sends SIGPROF to the process periodically.  The
+   handler looks at the thread holding the GIL (_PyEval_GILHolder)
+   and records its shadow stack -- the names the compiled code pushes with
+   PyShadowStack_PUSH() -- and, where the C library supports it, its
+   native stack.  If the signal was delivered to some other thread, it is
+   forwarded to the GIL holder with pthread_kill() so the native stack
+   belongs to the right thread.
+
+   Samples are appended to a preallocated buffer; the handler never
+   allocates, locks or calls into Python.  folded() aggregates them into
+   the "frame;frame;frame count" format read by flamegraph.pl and
+   compatible tools.
+*/
+
+#include "Python.h"
+#include "pythread.h"
+
+#ifdef HAVE_SIGNAL_H
+#include <signal.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <pthread.h>
+#include <time.h>
+
+#if defined(_POSIX_TIMERS) && (_POSIX_TIMERS + 0) > 0
+#define USE_POSIX_TIMER
+#endif
+
+#if defined(__GLIBC__) || defined(__APPLE__)
+#define HAVE_NATIVE_BACKTRACE
+#include <execinfo.h>
+#ifdef HAVE_DLFCN_H
+#include <dlfcn.h>
+#endif
+#endif
+
+/* Frames recorded per sample, counted from the root for the shadow stack
+   and from the leaf for the native one. */
+#define MAX_SHADOW_FRAMES 64
+#define MAX_NATIVE_FRAMES 64
+/* Frames belonging to the handler and the signal trampoline. */
+#define NATIVE_SKIP 2
+
+#define DEFAULT_CAPACITY (1 << 22)      /* words, i.e. 32 MB on LP64 */
+
+/* Each sample is stored as a header word holding the number of shadow
+   frames (low 16 bits) and native frames (high bits), followed by that
+   many name pointers and then that many return addresses.  The sample
+   whose space runs past the end of the buffer is replaced by a
+   SAMPLE_TRUNCATED word, after which the buffer holds nothing. */
+#define SAMPLE_TRUNCATED (~(Py_uintptr_t)0)
+#define SAMPLE_HEADER(nshadow, nnative) \
+    ((Py_uintptr_t)(nshadow) | ((Py_uintptr_t)(nnative) << 16))
+#define SAMPLE_NSHADOW(h) ((int)((h) & 0xffff))
+#define SAMPLE_NNATIVE(h) ((int)((h) >> 16))
+
+static void **sample_buf = NULL;
+static Py_ssize_t sample_capacity = 0;
+static volatile Py_ssize_t sample_used = 0;
+
+static volatile long samples_taken = 0;
+static volatile long samples_dropped = 0;   /* buffer full */
+static volatile long samples_released = 0;  /* nobody held the GIL */
+static volatile long samples_lost = 0;      /* forwarding went astray */
+
+static volatile sig_atomic_t forward_pending = 0;
+
+static volatile sig_atomic_t running = 0;
+static int record_native = 0;
+#ifdef USE_POSIX_TIMER
+static timer_t sample_timer;
+#endif
+
+
+static void
+record_sample(PyThreadState *tstate)
+{
+    void *native[MAX_NATIVE_FRAMES + NATIVE_SKIP];
+    int nshadow, nnative = 0, i;
+    Py_ssize_t start;
+    void **p;
+
+    nshadow = tstate->shadow_stack.depth;
+    if (nshadow > PyShadowStack_MAXDEPTH)
+        nshadow = PyShadowStack_MAXDEPTH;
+    if (nshadow > MAX_SHADOW_FRAMES)
+        nshadow = MAX_SHADOW_FRAMES;
+    if (nshadow < 0)
+        nshadow = 0;
+#ifdef HAVE_NATIVE_BACKTRACE
+    if (record_native) {
+        nnative = backtrace(native, MAX_NATIVE_FRAMES + NATIVE_SKIP);
+        nnative = nnative > NATIVE_SKIP ? nnative - NATIVE_SKIP : 0;
+    }
+#endif
+
+    start = __sync_fetch_and_add(&sample_used, 1 + nshadow + nnative);
+    if (start + 1 + nshadow + nnative > sample_capacity) {
+        if (start < sample_capacity)
+            sample_buf[start] = (void *)SAMPLE_TRUNCATED;
+        samples_dropped++;
+        return;
+    }
+    p = sample_buf + start;
+    *p++ = (void *)SAMPLE_HEADER(nshadow, nnative);
+    for (i = 0; i < nshadow; i++)
+        *p++ = (void *)tstate->shadow_stack.names[i];
+    for (i = 0; i < nnative; i++)
+        *p++ = native[NATIVE_SKIP + i];
+    samples_taken++;
+}
+
+static void
+sampler_handler(int signum)
+{
+    int save_errno = errno;
+    long holder = _PyEval_GILHolder;
+
+    /* Signals sent before stop() may still arrive:  ignore them. */
+    if (!running || sample_buf == NULL) {
+        errno = save_errno;
+        return;
+    }
+    if (holder == 0)
+        samples_released++;
+    else if (holder == PyThread_get_thread_ident()) {
+        /* Our own thread state can't go away while we interrupt it. */
+        PyThreadState *tstate = _PyThreadState_Current;
+        forward_pending = 0;
+        if (tstate != NULL)
+            record_sample(tstate);
+        else
+            samples_released++;
+    }
+    else if (forward_pending > 0) {
+        /* A forwarded signal reached a thread that no longer holds the
+           GIL, or a tick arrived while one is in flight.  Give up on it
+           after a couple of ticks rather than forwarding forever. */
+        if (--forward_pending == 0)
+            samples_lost++;
+    }
+    else {
+        forward_pending = 2;
+        pthread_kill((pthread_t)holder, SIGPROF);
+    }
+    errno = save_errno;
+}
+
+
+static PyObject *
+sampleprof_start(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"interval", "native", "capacity", "wall", 0};
+    double interval = 0.001;
+    int native = 1, wall = 0;
+    Py_ssize_t capacity = DEFAULT_CAPACITY;
+    struct sigaction sa;
+#ifdef USE_POSIX_TIMER
+    struct sigevent sev;
+    struct itimerspec its;
+#else
+    struct itimerval it;
+#endif
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|dini:start", kwlist,
+                                     &interval, &native, &capacity, &wall))
+        return NULL;
+    if (running) {
+        PyErr_SetString(PyExc_RuntimeError, "sampler is already running");
+        return NULL;
+    }
+    if (interval <= 0.0) {
+        PyErr_SetString(PyExc_ValueError, "interval must be positive");
+        return NULL;
+    }
+    if (capacity < 1024)
+        capacity = 1024;
+
+    /* Start from scratch. */
+    PyMem_Free(sample_buf);
+    sample_buf = PyMem_New(void *, capacity);
+    if (sample_buf == NULL)
+        return PyErr_NoMemory();
+    sample_capacity = capacity;
+    sample_used = 0;
+    samples_taken = samples_dropped = samples_released = samples_lost = 0;
+    forward_pending = 0;
+
+#ifdef HAVE_NATIVE_BACKTRACE
+    record_native = native;
+    if (record_native) {
+        /* The first call to backtrace() loads libgcc and may allocate,
+           which isn't safe from a signal handler; get that over with. */
+        void *dummy[1];
+        backtrace(dummy, 1);
+    }
+#else
+    record_native = 0;
+#endif
+
+    /* The handler stays installed after stop(), as a SIGPROF may still
+       be on its way; it ignores the signal while nothing is running. */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sampler_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, NULL) < 0)
+        return PyErr_SetFromErrno(PyExc_OSError);
+
+#ifdef USE_POSIX_TIMER
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_SIGNAL;
+    sev.sigev_signo = SIGPROF;
+    if (timer_create(wall ? CLOCK_MONOTONIC : CLOCK_PROCESS_CPUTIME_ID,
+                     &sev, &sample_timer) < 0)
+        return PyErr_SetFromErrno(PyExc_OSError);
+    its.it_interval.tv_sec = (time_t)interval;
+    its.it_interval.tv_nsec = (long)((interval - (time_t)interval) * 1e9);
+    if (its.it_interval.tv_sec == 0 && its.it_interval.tv_nsec == 0)
+        its.it_interval.tv_nsec = 1;
+    its.it_value = its.it_interval;
+    if (timer_settime(sample_timer, 0, &its, NULL) < 0) {
+        timer_delete(sample_timer);
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+#else
+    if (wall) {
+        PyErr_SetString(PyExc_ValueError,
+                        "wall-clock sampling needs timer_create()");
+        return NULL;
+    }
+    it.it_interval.tv_sec = (long)interval;
+    it.it_interval.tv_usec = (long)((interval - (long)interval) * 1e6);
+    if (it.it_interval.tv_sec == 0 && it.it_interval.tv_usec == 0)
+        it.it_interval.tv_usec = 1;
+    it.it_value = it.it_interval;
+    if (setitimer(ITIMER_PROF, &it, NULL) < 0)
+        return PyErr_SetFromErrno(PyExc_OSError);
+#endif
+    running = 1;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyDoc_STRVAR(start_doc,
+"start(interval=0.001, native=True, capacity=4194304, wall=False)\n\
+\n\
+Start sampling every `interval` seconds of process CPU time, or of\n\
+elapsed time if wall is true.  If native is true the C stack of the GIL\n\
+holder is recorded along with its shadow stack.  capacity is the size of\n\
+the sample buffer in words; samples that don't fit are counted as\n\
+dropped.  Previous samples are discarded.");
+
+static PyObject *
+sampleprof_stop(PyObject *self, PyObject *noargs)
+{
+    if (running) {
+#ifdef USE_POSIX_TIMER
+        timer_delete(sample_timer);
+#else
+        struct itimerval it;
+        memset(&it, 0, sizeof(it));
+        setitimer(ITIMER_PROF, &it, NULL);
+#endif
+        running = 0;
+    }
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyDoc_STRVAR(stop_doc,
+"stop()\n\
+\n\
+Stop sampling.  The samples taken so far are kept for folded().  The\n\
+SIGPROF handler stays installed, ignoring the signal until the next\n\
+start().");
+
+static PyObject *
+sampleprof_is_running(PyObject *self, PyObject *noargs)
+{
+    return PyBool_FromLong(running);
+}
+
+PyDoc_STRVAR(is_running_doc,
+"is_running() -> True if the sampler is active.");
+
+static PyObject *
+sampleprof_stats(PyObject *self, PyObject *noargs)
+{
+    Py_ssize_t used = sample_used;
+    if (used > sample_capacity)
+        used = sample_capacity;
+    return Py_BuildValue("{sl,sl,sl,sl,sn,sn}",
+                         "samples", samples_taken,
+                         "dropped", samples_dropped,
+                         "gil_released", samples_released,
+                         "lost", samples_lost,
+                         "buffer_used", used,
+                         "buffer_size", sample_capacity);
+}
+
+PyDoc_STRVAR(stats_doc,
+"stats() -> dict\n\
+\n\
+Return the number of samples recorded, dropped because the buffer was\n\
+full, taken while no thread held the GIL, and lost in forwarding.");
+
+static PyObject *
+sampleprof_clear(PyObject *self, PyObject *noargs)
+{
+    if (running) {
+        PyErr_SetString(PyExc_RuntimeError, "sampler is running");
+        return NULL;
+    }
+    PyMem_Free(sample_buf);
+    sample_buf = NULL;
+    sample_capacity = sample_used = 0;
+    samples_taken = samples_dropped = samples_released = samples_lost = 0;
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyDoc_STRVAR(clear_doc,
+"clear()\n\
+\n\
+Discard the recorded samples and free the sample buffer.");
+
+
+/* Return a new reference to a printable name for a return address,
+   caching it in `cache`. */
+static PyObject *
+native_frame_name(void *addr, PyObject *cache)
+{
+    PyObject *key, *name;
+
+    key = PyLong_FromVoidPtr(addr);
+    if (key == NULL)
+        return NULL;
+    name = PyDict_GetItem(cache, key);
+    if (name != NULL) {
+        Py_DECREF(key);
+        Py_INCREF(name);
+        return name;
+    }
+#if defined(HAVE_NATIVE_BACKTRACE) && defined(HAVE_DLFCN_H)
+    {
+        Dl_info info;
+        if (dladdr(addr, &info) && info.dli_sname != NULL)
+            name = PyString_FromString(info.dli_sname);
+        else if (info.dli_fname != NULL) {
+            const char *base = strrchr(info.dli_fname, '/');
+            name = PyString_FromFormat("%s+%p",
+                                       base ? base + 1 : info.dli_fname,
+                                       (void *)((char *)addr -
+                                                (char *)info.dli_fbase));
+        }
+        else
+            name = PyString_FromFormat("%p", addr);
+    }
+#else
+    name = PyString_FromFormat("%p", addr);
+#endif
+    if (name == NULL || PyDict_SetItem(cache, key, name) < 0) {
+        Py_DECREF(key);
+        Py_XDECREF(name);
+        return NULL;
+    }
+    Py_DECREF(key);
+    return name;
+}
+
+static int
+count_stack(PyObject *counts, PyObject *stack, long n)
+{
+    PyObject *old, *v;
+    int r;
+
+    old = PyDict_GetItem(counts, stack);
+    v = PyInt_FromLong((old != NULL ? PyInt_AS_LONG(old) : 0) + n);
+    if (v == NULL)
+        return -1;
+    r = PyDict_SetItem(counts, stack, v);
+    Py_DECREF(v);
+    return r;
+}
+
+static PyObject *
+sampleprof_folded(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"native", 0};
+    int native = 0;
+    PyObject *counts = NULL, *cache = NULL, *sep = NULL, *frames = NULL;
+    PyObject *lines = NULL, *result = NULL;
+    PyObject *key, *value;
+    Py_ssize_t pos, used, i = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i:folded", kwlist,
+                                     &native))
+        return NULL;
+
+    counts = PyDict_New();
+    cache = PyDict_New();
+    sep = PyString_FromString(";");
+    if (counts == NULL || cache == NULL || sep == NULL)
+        goto error;
+
+    used = sample_used;
+    if (used > sample_capacity)
+        used = sample_capacity;
+    while (i < used) {
+        Py_uintptr_t h = (Py_uintptr_t)sample_buf[i];
+        int nshadow = SAMPLE_NSHADOW(h), nnative = SAMPLE_NNATIVE(h);
+        void **shadow = sample_buf + i + 1;
+        void **addrs = shadow + nshadow;
+        PyObject *stack;
+        int j;
+
+        if (h == SAMPLE_TRUNCATED || i + 1 + nshadow + nnative > used)
+            break;
+        i += 1 + nshadow + nnative;
+
+        frames = PyList_New(0);
+        if (frames == NULL)
+            goto error;
+        if (native) {
+            /* backtrace() lists the leaf first. */
+            for (j = nnative - 1; j >= 0; j--) {
+                PyObject *name = native_frame_name(addrs[j], cache);
+                if (name == NULL || PyList_Append(frames, name) < 0) {
+                    Py_XDECREF(name);
+                    goto error;
+                }
+                Py_DECREF(name);
+            }
+        }
+        else {
+            for (j = 0; j < nshadow; j++) {
+                PyObject *name = PyString_FromString((char *)shadow[j]);
+                if (name == NULL || PyList_Append(frames, name) < 0) {
+                    Py_XDECREF(name);
+                    goto error;
+                }
+                Py_DECREF(name);
+            }
+        }
+        if (PyList_GET_SIZE(frames) == 0)
+            stack = PyString_FromString(native ? "[unknown]" : "[no frames]");
+        else
+            stack = _PyString_Join(sep, frames);
+        Py_CLEAR(frames);
+        if (stack == NULL)
+            goto error;
+        if (count_stack(counts, stack, 1) < 0) {
+            Py_DECREF(stack);
+            goto error;
+        }
+        Py_DECREF(stack);
+    }
+    if (samples_released > 0) {
+        PyObject *stack = PyString_FromString("[gil released]");
+        if (stack == NULL)
+            goto error;
+        if (count_stack(counts, stack, samples_released) < 0) {
+            Py_DECREF(stack);
+            goto error;
+        }
+        Py_DECREF(stack);
+    }
+
+    lines = PyList_New(0);
+    if (lines == NULL)
+        goto error;
+    pos = 0;
+    while (PyDict_Next(counts, &pos, &key, &value)) {
+        PyObject *line = PyString_FromFormat("%s %ld\n",
+                                             PyString_AS_STRING(key),
+                                             PyInt_AS_LONG(value));
+        if (line == NULL || PyList_Append(lines, line) < 0) {
+            Py_XDECREF(line);
+            goto error;
+        }
+        Py_DECREF(line);
+    }
+    if (PyList_Sort(lines) < 0)
+        goto error;
+    Py_DECREF(sep);
+    sep = PyString_FromString("");
+    if (sep == NULL)
+        goto error;
+    result = _PyString_Join(sep, lines);
+
+  error:
+    Py_XDECREF(counts);
+    Py_XDECREF(cache);
+    Py_XDECREF(sep);
+    Py_XDECREF(frames);
+    Py_XDECREF(lines);
+    return result;
+}
+
+PyDoc_STRVAR(folded_doc,
+"folded(native=False) -> string\n\
+\n\
+Aggregate the recorded samples into folded-stack lines, root frame\n\
+first, as read by flamegraph.pl.  With native=True the native stacks are\n\
+used instead of the shadow stacks.  Samples taken while no thread held\n\
+the GIL appear as \"[gil released]\".");
+
+
+static PyMethodDef sampleprof_methods[] = {
+    {"start",           (PyCFunction)sampleprof_start,
+        METH_VARARGS|METH_KEYWORDS, start_doc},
+    {"stop",            sampleprof_stop, METH_NOARGS, stop_doc},
+    {"is_running",      sampleprof_is_running, METH_NOARGS, is_running_doc},
+    {"stats",           sampleprof_stats, METH_NOARGS, stats_doc},
+    {"clear",           sampleprof_clear, METH_NOARGS, clear_doc},
+    {"folded",          (PyCFunction)sampleprof_folded,
+        METH_VARARGS|METH_KEYWORDS, folded_doc},
+    {NULL, NULL} /* sentinel */
+};
+
+PyDoc_STRVAR(module_doc,
+"Low-overhead sampling profiler for compiled code.\n\
+\n\
+The profiler interrupts the process with SIGPROF and records the stack\n\
+of whichever thread holds the GIL.  Use start() and stop() around the\n\
+code of interest and write folded() to a file for flamegraph tools.");
+
+PyMODINIT_FUNC
+init_sampleprof(void)
+{
+    Py_InitModule3("_sampleprof", sampleprof_methods, module_doc);
+}
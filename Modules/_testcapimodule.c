@@ -0,0 +1,1811 @@
+/*
+ * C Extension module to test Python interpreter C APIs.
+ *
+ * The 'test_*' functions exported by this module check invariants of the
+ * interpreter's internals that Python code can't get at.  Each returns
+ * None, or raises _testcapi.error naming the check that failed.  To run
+ * them all:
+ *
+ *     import _testcapi
+ *     for name in dir(_testcapi):
+ *         if name.startswith('test_'):
+ *             getattr(_testcapi, name)()
+ *
+ * The '*_bench' functions are microbenchmarks, and return their timings.
+ */
+
+#include "Python.h"
+#include <time.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+static PyObject *TestError;     /* set to exception object in init */
+
+/* Raise TestError with test_name + ": " + msg, and return NULL. */
+
+static PyObject *
+raiseTestError(const char* test_name, const char* msg)
+{
+    char buf[2048];
+
+    if (strlen(test_name) + strlen(msg) > sizeof(buf) - 50)
+        PyErr_SetString(TestError, "internal error msg too large");
+    else {
+        PyOS_snprintf(buf, sizeof(buf), "%s: %s", test_name, msg);
+        PyErr_SetString(TestError, buf);
+    }
+    return NULL;
+}
+
+/* Monotonic clock for the benchmarks, in seconds. */
+static double
+bench_clock(void)
+{
+#ifdef MS_WINDOWS
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER t;
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&t);
+    return (double)t.QuadPart / (double)freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+
+/* Dicts whose keys are all ints use lookdict_int(), which compares them
+   by value.  Equal longs and floats must still find them, and the first
+   other key must switch the dict back to the general lookup. */
+
+static PyObject *
+test_dict_int_keys(PyObject *self)
+{
+    PyObject *dict, *key, *value;
+    long i;
+
+#define CHECK(cond, msg)                                        \
+    if (!(cond)) {                                              \
+        Py_XDECREF(key);                                        \
+        Py_DECREF(dict);                                        \
+        return raiseTestError("test_dict_int_keys", msg);       \
+    }
+
+    dict = PyDict_New();
+    if (dict == NULL)
+        return NULL;
+    key = NULL;
+    for (i = -500; i < 500; i++) {
+        key = PyInt_FromLong(i);
+        value = PyInt_FromLong(2 * i);
+        if (key == NULL || value == NULL ||
+            PyDict_SetItem(dict, key, value) < 0) {
+            Py_XDECREF(key);
+            Py_XDECREF(value);
+            Py_DECREF(dict);
+            return NULL;
+        }
+        Py_DECREF(key);
+        Py_DECREF(value);
+    }
+    key = NULL;
+    for (i = -500; i < 500; i++) {
+        key = PyInt_FromLong(i);
+        value = PyDict_GetItem(dict, key);
+        CHECK(value != NULL && PyInt_AS_LONG(value) == 2 * i,
+              "int key not found");
+        Py_DECREF(key);
+        key = PyLong_FromLong(i);
+        CHECK(PyDict_GetItem(dict, key) == value, "long key not found");
+        Py_DECREF(key);
+        key = PyFloat_FromDouble((double)i);
+        CHECK(PyDict_GetItem(dict, key) == value, "float key not found");
+        Py_DECREF(key);
+    }
+    /* -1 hashes like -2; the entries must still be told apart */
+    key = PyInt_FromLong(-1);
+    value = PyDict_GetItem(dict, key);
+    CHECK(value != NULL && PyInt_AS_LONG(value) == -2, "-1 mismatched");
+    Py_DECREF(key);
+
+    key = PyString_FromString("x");
+    CHECK(key != NULL && PyDict_SetItem(dict, key, key) == 0,
+          "string key not inserted");
+    CHECK(PyDict_GetItem(dict, key) == key, "string key not found");
+    Py_DECREF(key);
+    key = PyInt_FromLong(499);
+    value = PyDict_GetItem(dict, key);
+    CHECK(value != NULL && PyInt_AS_LONG(value) == 998,
+          "int key lost after a string key");
+    Py_DECREF(key);
+    key = NULL;
+    CHECK(PyDict_Size(dict) == 1001, "wrong size");
+    Py_DECREF(dict);
+
+    /* a long key first, then an equal int */
+    dict = PyDict_New();
+    if (dict == NULL)
+        return NULL;
+    key = PyLong_FromLong(7);
+    CHECK(key != NULL && PyDict_SetItem(dict, key, Py_None) == 0,
+          "long key not inserted");
+    Py_DECREF(key);
+    key = PyInt_FromLong(7);
+    CHECK(PyDict_SetItem(dict, key, Py_True) == 0, "int key not inserted");
+    CHECK(PyDict_Size(dict) == 1 && PyDict_GetItem(dict, key) == Py_True,
+          "equal long and int keys not merged");
+    Py_DECREF(key);
+    Py_DECREF(dict);
+#undef CHECK
+
+    Py_RETURN_NONE;
+}
+
+/* Every change to a dict gives it a new version tag, and nothing else
+   does; _PyDict_LoadGlobal() relies on that to trust its cache. */
+
+static PyObject *
+test_dict_version_tags(PyObject *self)
+{
+    /* methods called on a dict holding 'a' and 'b', and whether they
+       change it */
+    static const struct {
+        const char *method, *format, *arg1, *arg2;
+        int changes;
+    } calls[] = {
+        {"get", "s", "a", NULL, 0},
+        {"__contains__", "s", "a", NULL, 0},
+        {"setdefault", "ss", "a", "x", 0},
+        {"pop", "ss", "zz", "x", 0},
+        {"copy", NULL, NULL, NULL, 0},
+        {"__setitem__", "ss", "a", "x", 1},
+        {"__setitem__", "ss", "c", "x", 1},
+        {"setdefault", "ss", "d", "x", 1},
+        {"__delitem__", "s", "c", NULL, 1},
+        {"pop", "s", "d", NULL, 1},
+        {"popitem", NULL, NULL, NULL, 1},
+        {"update", "{ss}", "e", "x", 1},
+        {"clear", NULL, NULL, NULL, 1},
+    };
+    PyObject *globals = NULL, *builtins = NULL, *name = NULL;
+    PyObject *one = NULL, *two = NULL, *r;
+    _PyDictLookupCache cache = {0, 0, NULL};
+    unsigned PY_LONG_LONG tag;
+    const char *msg = NULL;
+    char buf[100];
+    int i;
+
+    globals = PyDict_New();
+    builtins = PyDict_New();
+    if (globals == NULL || builtins == NULL)
+        goto error;
+    if (_PyDict_GetVersion(globals) == 0 ||
+        _PyDict_GetVersion(globals) == _PyDict_GetVersion(builtins)) {
+        msg = "new dicts must have distinct, non-zero tags";
+        goto error;
+    }
+    for (i = 0; i < (int)(sizeof(calls) / sizeof(calls[0])); i++) {
+        if (PyDict_SetItemString(globals, "a", Py_None) < 0 ||
+            PyDict_SetItemString(globals, "b", Py_None) < 0)
+            goto error;
+        tag = _PyDict_GetVersion(globals);
+        if (calls[i].format == NULL)
+            r = PyObject_CallMethod(globals, (char *)calls[i].method, NULL);
+        else
+            r = PyObject_CallMethod(globals, (char *)calls[i].method,
+                                    (char *)calls[i].format,
+                                    calls[i].arg1, calls[i].arg2);
+        if (r == NULL)
+            goto error;
+        Py_DECREF(r);
+        if ((_PyDict_GetVersion(globals) != tag) != calls[i].changes) {
+            PyOS_snprintf(buf, sizeof(buf), "dict.%s() %s the tag",
+                          calls[i].method,
+                          calls[i].changes ? "didn't change" : "changed");
+            msg = buf;
+            goto error;
+        }
+    }
+    /* a failed deletion */
+    tag = _PyDict_GetVersion(globals);
+    if (PyDict_DelItemString(globals, "zz") == 0) {
+        msg = "deleted a missing key";
+        goto error;
+    }
+    PyErr_Clear();
+    if (_PyDict_GetVersion(globals) != tag) {
+        msg = "failed deletion changed the tag";
+        goto error;
+    }
+    PyDict_Clear(globals);
+
+    /* _PyDict_LoadGlobal() and its cache */
+    name = PyString_InternFromString("len");
+    one = PyInt_FromLong(1);
+    two = PyInt_FromLong(2);
+    if (name == NULL || one == NULL || two == NULL ||
+        PyDict_SetItem(builtins, name, one) < 0)
+        goto error;
+#define LOAD(expected, what)                                            \
+    do {                                                                \
+        if (_PyDict_LoadGlobal(globals, builtins, name, &cache) !=      \
+            (expected)) {                                               \
+            if (!PyErr_Occurred())                                      \
+                msg = "wrong value " what;                              \
+            goto error;                                                 \
+        }                                                               \
+    } while (0)
+    LOAD(one, "from builtins");
+    if (cache.builtins_version != _PyDict_GetVersion(builtins)) {
+        msg = "builtins version not cached";
+        goto error;
+    }
+    LOAD(one, "from builtins, cached");
+    if (PyDict_SetItem(globals, name, two) < 0)
+        goto error;
+    LOAD(two, "after shadowing in globals");
+    if (cache.builtins_version != 0) {
+        msg = "builtins version cached for a global";
+        goto error;
+    }
+    LOAD(two, "from globals, cached");
+    if (PyDict_DelItem(globals, name) < 0)
+        goto error;
+    LOAD(one, "after deleting the global");
+    r = PyObject_CallMethod(builtins, "popitem", NULL);
+    if (r == NULL)
+        goto error;
+    Py_DECREF(r);
+    LOAD(NULL, "after deleting the builtin");
+    if (_PyDict_LoadGlobal(globals, NULL, name, &cache) != NULL ||
+        PyErr_Occurred()) {
+        msg = "wrong value without builtins";
+        goto error;
+    }
+#undef LOAD
+
+  error:
+    Py_XDECREF(globals);
+    Py_XDECREF(builtins);
+    Py_XDECREF(name);
+    Py_XDECREF(one);
+    Py_XDECREF(two);
+    if (msg != NULL)
+        return raiseTestError("test_dict_version_tags", msg);
+    if (PyErr_Occurred())
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+/* Return 1 if the keys of d are the items of expect, in that order, 0 if
+   not, or -1 with an exception set. */
+static int
+check_dict_keys(PyObject *d, PyObject *expect)
+{
+    PyObject *keys = PyDict_Keys(d);
+    int r;
+
+    if (keys == NULL)
+        return -1;
+    r = PyObject_RichCompareBool(keys, expect, Py_EQ);
+    Py_DECREF(keys);
+    return r;
+}
+
+/* Dicts keep their items in insertion order.  Replacing a value keeps its
+   place, deleting and reinserting a key moves it to the end, and neither
+   resizing, which drops the holes deletions leave, nor copying changes
+   the order.  popitem() takes the last item. */
+
+static PyObject *
+test_dict_insertion_order(PyObject *self)
+{
+    PyObject *d = NULL, *copy = NULL, *copy2 = NULL, *expect = NULL;
+    PyObject *key = NULL, *k, *value, *r;
+    Py_ssize_t pos, i, j;
+    const char *msg = NULL;
+    int ok;
+
+    d = PyDict_New();
+    expect = PyList_New(0);
+    if (d == NULL || expect == NULL)
+        goto error;
+    for (i = 0; i < 200; i++) {
+        /* ints and strings, to use the general lookup */
+        key = i % 2 ? PyInt_FromSsize_t(i) : PyString_FromFormat("k%zd", i);
+        if (key == NULL)
+            goto error;
+        if (PyDict_SetItem(d, key, key) < 0 ||
+            PyList_Append(expect, key) < 0)
+            goto error;
+        Py_CLEAR(key);
+        if (i == 99) {
+            /* leave holes, then fill some of them back at the end */
+            for (j = PyList_GET_SIZE(expect) - 1; j >= 0; j -= 3) {
+                k = PyList_GET_ITEM(expect, j);
+                Py_INCREF(k);
+                ok = PyDict_DelItem(d, k) == 0 &&
+                    PySequence_DelItem(expect, j) == 0 &&
+                    (j % 2 == 1 || (PyDict_SetItem(d, k, k) == 0 &&
+                                    PyList_Append(expect, k) == 0));
+                Py_DECREF(k);
+                if (!ok)
+                    goto error;
+            }
+            if ((ok = check_dict_keys(d, expect)) <= 0) {
+                msg = "order lost by deletions";
+                goto error;
+            }
+            /* replaced values keep their place */
+            if (PyDict_SetItem(d, PyList_GET_ITEM(expect, 1), Py_None) < 0)
+                goto error;
+        }
+    }
+    if ((ok = check_dict_keys(d, expect)) <= 0) {
+        msg = "order lost by resizing";
+        goto error;
+    }
+    pos = 0;
+    i = 0;
+    while (PyDict_Next(d, &pos, &k, &value)) {
+        if (k != PyList_GET_ITEM(expect, i) ||
+            value != (i == 1 ? Py_None : k)) {
+            msg = "PyDict_Next() out of order";
+            goto error;
+        }
+        i++;
+    }
+
+    /* copies, with holes in the table and without */
+    if (PyDict_DelItem(d, PyList_GET_ITEM(expect, 5)) < 0 ||
+        PySequence_DelItem(expect, 5) < 0)
+        goto error;
+    copy = PyDict_Copy(d);
+    copy2 = copy == NULL ? NULL : PyDict_Copy(copy);
+    if (copy2 == NULL)
+        goto error;
+    if ((ok = check_dict_keys(copy, expect)) <= 0 ||
+        (ok = check_dict_keys(copy2, expect)) <= 0) {
+        msg = "order lost by copying";
+        goto error;
+    }
+
+    r = PyObject_CallMethod(copy2, "popitem", NULL);
+    if (r == NULL)
+        goto error;
+    ok = PyTuple_GET_ITEM(r, 0) ==
+        PyList_GET_ITEM(expect, PyList_GET_SIZE(expect) - 1);
+    Py_DECREF(r);
+    if (!ok)
+        msg = "popitem() didn't take the last item";
+
+  error:
+    Py_XDECREF(d);
+    Py_XDECREF(copy);
+    Py_XDECREF(copy2);
+    Py_XDECREF(expect);
+    Py_XDECREF(key);
+    if (msg != NULL && !PyErr_Occurred())
+        return raiseTestError("test_dict_insertion_order", msg);
+    if (PyErr_Occurred())
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+/* Return d.__sizeof__(), or -1 with an exception set. */
+static Py_ssize_t
+dict_sizeof(PyObject *d)
+{
+    PyObject *r = PyObject_CallMethod(d, "__sizeof__", NULL);
+    Py_ssize_t size;
+
+    if (r == NULL)
+        return -1;
+    size = PyInt_AsSsize_t(r);
+    Py_DECREF(r);
+    return size;
+}
+
+/* Map the ints from start to stop - 1 to themselves in d (with lookups,
+   if lookup is set).  Return -1 with an exception set on failure. */
+static int
+fill_int_dict(PyObject *d, long start, long stop, int lookup)
+{
+    PyObject *key;
+    long i;
+
+    for (i = start; i < stop; i++) {
+        key = PyInt_FromLong(i);
+        if (key == NULL)
+            return -1;
+        if (lookup)
+            PyDict_GetItem(d, key);
+        else if (PyDict_SetItem(d, key, key) < 0) {
+            Py_DECREF(key);
+            return -1;
+        }
+        Py_DECREF(key);
+    }
+    return 0;
+}
+
+/* Return a dict mapping the ints 0 to *pn - 1 to themselves, caught just
+   after inserting the last one started an incremental resize.  Finishing
+   such a resize frees the old table, so a table that grows and then
+   shrinks back under lookups was resized incrementally; refilling a new
+   dict up to that insertion gives one still in the middle of it. */
+
+static PyObject *
+resizing_dict(Py_ssize_t *pn)
+{
+    PyObject *d;
+    Py_ssize_t size, grown;
+    long n;
+
+    d = PyDict_New();
+    if (d == NULL || (size = dict_sizeof(d)) < 0)
+        goto error;
+    for (n = 1; ; n++) {
+        if (fill_int_dict(d, n - 1, n, 0) < 0 ||
+            (grown = dict_sizeof(d)) < 0)
+            goto error;
+        if (grown > size) {
+            if (fill_int_dict(d, 0, n, 1) < 0 ||
+                (size = dict_sizeof(d)) < 0)
+                goto error;
+            if (size < grown)
+                break;
+        }
+        else
+            size = grown;
+        if (n > 10000000) {
+            PyErr_SetString(TestError, "dicts never resize incrementally");
+            goto error;
+        }
+    }
+    Py_DECREF(d);
+    d = PyDict_New();
+    if (d == NULL || fill_int_dict(d, 0, n, 0) < 0)
+        goto error;
+    *pn = n;
+    return d;
+
+  error:
+    Py_XDECREF(d);
+    return NULL;
+}
+
+/* Return 1 if iter gives the ints 0 to n - 1 but skip, in order, as keys
+   and values (kind 0 or 1) or as (key, value) pairs (kind 2); 0 if not;
+   -1 with an exception set if iterating fails. */
+
+static int
+check_int_order(PyObject *iter, long n, long skip, int kind)
+{
+    PyObject *item, *key, *value;
+    long expect = 0;
+    int ok = 1;
+
+    while ((item = PyIter_Next(iter)) != NULL) {
+        if (expect == skip)
+            expect++;
+        key = value = item;
+        if (kind == 2) {
+            key = PyTuple_GET_ITEM(item, 0);
+            value = PyTuple_GET_ITEM(item, 1);
+        }
+        if (!PyInt_Check(key) || PyInt_AS_LONG(key) != expect ||
+            !PyInt_Check(value) || PyInt_AS_LONG(value) != expect)
+            ok = 0;
+        Py_DECREF(item);
+        expect++;
+    }
+    if (PyErr_Occurred())
+        return -1;
+    return ok && expect == n;
+}
+
+/* Big dicts move their entries to a bigger table a few per lookup.  Until
+   they are all moved, deletions, popitem() and iteration must see both
+   tables, and iterating or trying to untrack the dict must not finish the
+   resize behind the caller's back. */
+
+static PyObject *
+test_dict_incremental_resize(PyObject *self)
+{
+    static const char *methods[] = {"iterkeys", "itervalues", "iteritems"};
+    PyObject *d = NULL, *key = NULL, *value, *list = NULL, *iter, *r;
+    Py_ssize_t n, pos, size, count;
+    const char *msg = NULL;
+    int i, ok;
+
+    d = resizing_dict(&n);
+    if (d == NULL || (size = dict_sizeof(d)) < 0)
+        goto error;
+
+    /* 3 has not been moved yet */
+    key = PyInt_FromLong(3);
+    if (key == NULL || PyDict_DelItem(d, key) < 0)
+        goto error;
+    Py_CLEAR(key);
+    pos = 0;
+    count = 0;
+    while (PyDict_Next(d, &pos, &key, &value)) {
+        if (count == 3)
+            count++;
+        if (PyInt_AS_LONG(key) != count || value != key) {
+            msg = "PyDict_Next() out of order";
+            key = NULL;
+            goto error;
+        }
+        /* replacing values is allowed while iterating */
+        if (count % 1000 == 0 && PyDict_SetItem(d, key, key) < 0) {
+            key = NULL;
+            goto error;
+        }
+        count++;
+    }
+    key = NULL;
+    if (count != n) {
+        msg = "PyDict_Next() missed entries";
+        goto error;
+    }
+    if ((size = dict_sizeof(d)) < 0)
+        goto error;
+    for (i = 0; i < 3; i++) {
+        iter = PyObject_CallMethod(d, (char *)methods[i], NULL);
+        if (iter == NULL)
+            goto error;
+        ok = check_int_order(iter, n, 3, i);
+        Py_DECREF(iter);
+        if (ok < 0)
+            goto error;
+        if (!ok) {
+            msg = "iterator out of order";
+            goto error;
+        }
+    }
+    if (dict_sizeof(d) != size) {
+        msg = "iterating finished the resize";
+        goto error;
+    }
+
+    /* a container value tracks d, and stays tracked until the
+       resize is done */
+    list = PyList_New(0);
+    key = PyInt_FromLong(1);
+    if (list == NULL || key == NULL || PyDict_SetItem(d, key, list) < 0 ||
+        PyDict_SetItem(d, key, key) < 0)
+        goto error;
+    Py_CLEAR(key);
+    if ((size = dict_sizeof(d)) < 0)
+        goto error;
+    _PyDict_MaybeUntrack(d);
+    if (!_PyObject_GC_IS_TRACKED(d) || dict_sizeof(d) != size) {
+        msg = "_PyDict_MaybeUntrack() finished the resize";
+        goto error;
+    }
+    if (fill_int_dict(d, 0, n, 1) < 0)
+        goto error;
+    _PyDict_MaybeUntrack(d);
+    if (_PyObject_GC_IS_TRACKED(d)) {
+        msg = "resized dict of ints still tracked";
+        goto error;
+    }
+    Py_CLEAR(d);
+
+    /* popitem() and deletions mid-resize */
+    d = resizing_dict(&n);
+    if (d == NULL)
+        goto error;
+    for (count = 0; count < n / 2; count++) {
+        r = PyObject_CallMethod(d, "popitem", NULL);
+        if (r == NULL)
+            goto error;
+        Py_DECREF(r);
+    }
+    for (count = 0; count < n; count += 3) {
+        key = PyInt_FromLong((long)count);
+        if (key == NULL)
+            goto error;
+        if (PyDict_DelItem(d, key) < 0) {
+            if (!PyErr_ExceptionMatches(PyExc_KeyError))
+                goto error;
+            PyErr_Clear();
+        }
+        Py_CLEAR(key);
+    }
+    pos = 0;
+    count = 0;
+    while (PyDict_Next(d, &pos, &key, &value)) {
+        if (PyDict_GetItem(d, key) != value) {
+            msg = "popitem() or deletion lost an entry";
+            key = NULL;
+            goto error;
+        }
+        count++;
+    }
+    key = NULL;
+    if (count != PyDict_Size(d))
+        msg = "len() disagrees with PyDict_Next()";
+
+  error:
+    Py_XDECREF(d);
+    Py_XDECREF(key);
+    Py_XDECREF(list);
+    if (msg != NULL)
+        return raiseTestError("test_dict_incremental_resize", msg);
+    if (PyErr_Occurred())
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+/* Return stats[key] as a long, for the dicts of statistics gc returns. */
+static long
+stat_long(PyObject *stats, const char *key)
+{
+    PyObject *v = PyDict_GetItemString(stats, key);
+    return v != NULL ? PyInt_AsLong(v) : -1;
+}
+
+/* With a pause budget, automatic full collections become incremental
+   passes made of several slices, which must still find the cycles that
+   made it to the oldest generation. */
+
+static PyObject *
+test_gc_incremental_slices(PyObject *self)
+{
+    PyObject *gc, *thresh = NULL, *budget = NULL, *keep = NULL;
+    PyObject *junk = NULL, *before = NULL, *after = NULL, *r;
+    PyObject *result = NULL;
+    int i;
+
+    gc = Py_ImportBuiltin("gc");
+    if (gc == NULL)
+        return NULL;
+    thresh = PyObject_CallMethod(gc, "get_threshold", NULL);
+    budget = PyObject_CallMethod(gc, "get_pause_budget", NULL);
+    keep = PyList_New(0);
+    junk = PyList_New(0);
+    if (thresh == NULL || budget == NULL || keep == NULL || junk == NULL)
+        goto error;
+
+    /* 5000 cycles of two lists each, moved to the oldest generation */
+    for (i = 0; i < 5000; i++) {
+        PyObject *a = PyList_New(0), *b = PyList_New(0);
+        int err = (a == NULL || b == NULL || PyList_Append(a, b) < 0 ||
+                   PyList_Append(b, a) < 0 || PyList_Append(keep, a) < 0);
+        Py_XDECREF(a);
+        Py_XDECREF(b);
+        if (err)
+            goto error;
+    }
+    r = PyObject_CallMethod(gc, "collect", NULL);
+    if (r == NULL)
+        goto error;
+    Py_DECREF(r);
+    r = PyObject_CallMethod(gc, "set_threshold", "iii", 100, 2, 2);
+    if (r == NULL)
+        goto restore;
+    Py_DECREF(r);
+    r = PyObject_CallMethod(gc, "set_pause_budget", "d", 1e-5);
+    if (r == NULL)
+        goto restore;
+    Py_DECREF(r);
+    before = PyObject_CallMethod(gc, "get_incremental_stats", NULL);
+    if (before == NULL)
+        goto restore;
+    Py_CLEAR(keep);
+
+    /* Allocate containers until a whole pass has run. */
+    for (i = 0; i < 1000000; i++) {
+        PyObject *l = PyList_New(0);
+        if (l == NULL || PyList_Append(junk, l) < 0) {
+            Py_XDECREF(l);
+            goto restore;
+        }
+        Py_DECREF(l);
+        if (i % 1000 == 0) {
+            Py_XDECREF(after);
+            after = PyObject_CallMethod(gc, "get_incremental_stats", NULL);
+            if (after == NULL)
+                goto restore;
+            if (stat_long(after, "passes") > stat_long(before, "passes"))
+                break;
+        }
+    }
+    if (stat_long(after, "passes") <= stat_long(before, "passes"))
+        raiseTestError("test_gc_incremental_slices",
+                       "no incremental pass completed");
+    else if (stat_long(after, "slices") - stat_long(before, "slices") < 2)
+        raiseTestError("test_gc_incremental_slices",
+                       "pass not split into slices");
+    else if (stat_long(after, "collected") -
+             stat_long(before, "collected") < 10000)
+        raiseTestError("test_gc_incremental_slices",
+                       "old cycles not collected by the pass");
+    else {
+        Py_INCREF(Py_None);
+        result = Py_None;
+    }
+
+  restore:
+    r = PyObject_CallMethod(gc, "set_pause_budget", "O", budget);
+    Py_XDECREF(r);
+    r = PyObject_CallMethod(gc, "set_threshold", "iii",
+                            (int)PyInt_AsLong(PyTuple_GET_ITEM(thresh, 0)),
+                            (int)PyInt_AsLong(PyTuple_GET_ITEM(thresh, 1)),
+                            (int)PyInt_AsLong(PyTuple_GET_ITEM(thresh, 2)));
+    Py_XDECREF(r);
+    if (result == NULL)
+        goto error;
+    Py_CLEAR(junk);
+    r = PyObject_CallMethod(gc, "collect", NULL);
+    if (r == NULL)
+        Py_CLEAR(result);
+    Py_XDECREF(r);
+  error:
+    Py_DECREF(gc);
+    Py_XDECREF(thresh);
+    Py_XDECREF(budget);
+    Py_XDECREF(keep);
+    Py_XDECREF(junk);
+    Py_XDECREF(before);
+    Py_XDECREF(after);
+    return result;
+}
+
+/* A new-style class with nothing in it, for tests that need instances. */
+static PyObject *
+new_class(const char *name, PyObject *base, PyObject *dict)
+{
+    return PyObject_CallFunction((PyObject *)&PyType_Type, "s(O)O",
+                                 name, base, dict);
+}
+
+/* Immortal objects keep their count through any number of Py_INCREF and
+   Py_DECREF calls, and keep everything they refer to alive, through
+   collections too. */
+
+static PyObject *
+test_immortal_objects(PyObject *self)
+{
+    PyObject *gc, *dict, *cls, *inst = NULL, *list = NULL, *wr = NULL, *r;
+    const char *msg = NULL;
+    int i;
+
+    if (!_Py_IsImmortal(Py_None) || !_Py_IsImmortal(Py_NotImplemented) ||
+        !_Py_IsImmortal(Py_Ellipsis))
+        return raiseTestError("test_immortal_objects",
+                              "singleton not immortal");
+    r = PyInt_FromLong(5);
+    i = _Py_IsImmortal(r);
+    Py_DECREF(r);
+    if (!i)
+        return raiseTestError("test_immortal_objects",
+                              "small int not immortal");
+
+    gc = Py_ImportBuiltin("gc");
+    if (gc == NULL)
+        return NULL;
+    dict = PyDict_New();
+    if (dict == NULL) {
+        Py_DECREF(gc);
+        return NULL;
+    }
+    cls = new_class("T", (PyObject *)&PyBaseObject_Type, dict);
+    Py_DECREF(dict);
+    if (cls == NULL)
+        goto error;
+    inst = PyObject_CallObject(cls, NULL);
+    list = PyList_New(0);
+    if (inst == NULL || list == NULL)
+        goto error;
+
+    /* mortal objects count as before */
+    Py_INCREF(list);
+    if (Py_REFCNT(list) != 2)
+        msg = "Py_INCREF of a mortal object";
+    Py_DECREF(list);
+
+    /* list <-> inst, with the list immortal */
+    if (PyList_Append(list, inst) < 0 ||
+        PyObject_SetAttrString(inst, "list", list) < 0)
+        goto error;
+    _Py_SetImmortal(list);
+    if (!_Py_IsImmortal(list) || Py_REFCNT(list) != _Py_IMMORTAL_REFCNT)
+        msg = "_Py_SetImmortal";
+    for (i = 0; i < 10; i++)
+        Py_INCREF(list);
+    for (i = 0; i < 100; i++)
+        Py_DECREF(list);
+    if (Py_REFCNT(list) != _Py_IMMORTAL_REFCNT)
+        msg = "Py_DECREF changed an immortal count";
+
+    wr = PyWeakref_NewRef(inst, NULL);
+    if (wr == NULL)
+        goto error;
+    Py_CLEAR(inst);
+    r = PyObject_CallMethod(gc, "collect", NULL);
+    if (r == NULL)
+        goto error;
+    Py_DECREF(r);
+    if (PyWeakref_GET_OBJECT(wr) == Py_None)
+        msg = "object referred to by an immortal one collected";
+    else if (PyList_GET_SIZE(list) != 1)
+        msg = "immortal object cleared by the collector";
+
+  error:
+    /* list leaks, by design */
+    Py_DECREF(gc);
+    Py_XDECREF(cls);
+    Py_XDECREF(inst);
+    Py_XDECREF(wr);
+    if (PyErr_Occurred())
+        return NULL;
+    if (msg != NULL)
+        return raiseTestError("test_immortal_objects", msg);
+    Py_RETURN_NONE;
+}
+
+/* Make an instance of cls with two atomic attributes, x and y. */
+static PyObject *
+atomic_instance(PyObject *cls)
+{
+    PyObject *inst = PyObject_CallObject(cls, NULL);
+    if (inst == NULL)
+        return NULL;
+    if (PyObject_SetAttrString(inst, "x", Py_None) < 0 ||
+        PyObject_SetAttrString(inst, "y", Py_Ellipsis) < 0) {
+        Py_DECREF(inst);
+        return NULL;
+    }
+    return inst;
+}
+
+/* A collection untracks the instances of an immortal class whose
+   attributes are all atomic.  Anything that could let such an instance
+   into a cycle -- a container attribute, its __dict__ escaping, a new
+   __class__ -- must track it again. */
+
+static PyObject *
+test_gc_untrack_instances(PyObject *self)
+{
+    PyObject *gc, *dict = NULL, *cls = NULL, *mortal = NULL, *other = NULL;
+    PyObject *insts[5] = {NULL, NULL, NULL, NULL, NULL};
+    PyObject *list = NULL, *wr = NULL, *r;
+    const char *msg = NULL;
+    int i;
+
+    gc = Py_ImportBuiltin("gc");
+    if (gc == NULL)
+        return NULL;
+    dict = PyDict_New();
+    if (dict == NULL)
+        goto error;
+    cls = new_class("Entity", (PyObject *)&PyBaseObject_Type, dict);
+    other = new_class("Other", (PyObject *)&PyBaseObject_Type, dict);
+    mortal = new_class("Mortal", (PyObject *)&PyBaseObject_Type, dict);
+    if (cls == NULL || other == NULL || mortal == NULL)
+        goto error;
+    _Py_SetImmortal(cls);
+    _Py_SetImmortal(other);
+    for (i = 0; i < 4; i++) {
+        if ((insts[i] = atomic_instance(cls)) == NULL)
+            goto error;
+    }
+    if ((insts[4] = atomic_instance(mortal)) == NULL)
+        goto error;
+    r = PyObject_CallMethod(gc, "collect", NULL);
+    if (r == NULL)
+        goto error;
+    Py_DECREF(r);
+    for (i = 0; i < 4; i++) {
+        if (_PyObject_GC_IS_TRACKED(insts[i]))
+            msg = "atomic instance of an immortal class still tracked";
+    }
+    if (!_PyObject_GC_IS_TRACKED(insts[4]))
+        msg = "instance of a mortal class untracked";
+    if (msg != NULL)
+        goto error;
+
+    /* an atomic attribute keeps it untracked, a container doesn't */
+    if (PyObject_SetAttrString(insts[0], "z", Py_None) < 0)
+        goto error;
+    if (_PyObject_GC_IS_TRACKED(insts[0]))
+        msg = "atomic setattr tracked the instance";
+    list = PyList_New(0);
+    if (list == NULL || PyObject_SetAttrString(insts[0], "l", list) < 0)
+        goto error;
+    if (!_PyObject_GC_IS_TRACKED(insts[0]))
+        msg = "container setattr left the instance untracked";
+
+    r = PyObject_GetAttrString(insts[1], "__dict__");
+    if (r == NULL)
+        goto error;
+    Py_DECREF(r);
+    if (!_PyObject_GC_IS_TRACKED(insts[1]))
+        msg = "fetching __dict__ left the instance untracked";
+
+    if (PyObject_SetAttrString(insts[2], "__class__", other) < 0)
+        goto error;
+    if (!_PyObject_GC_IS_TRACKED(insts[2]))
+        msg = "setting __class__ left the instance untracked";
+    if (msg != NULL)
+        goto error;
+
+    /* a cycle through a formerly untracked instance is collected */
+    if (PyList_Append(list, insts[3]) < 0 ||
+        PyObject_SetAttrString(insts[3], "l", list) < 0)
+        goto error;
+    wr = PyWeakref_NewRef(insts[3], NULL);
+    if (wr == NULL)
+        goto error;
+    Py_CLEAR(insts[3]);
+    Py_CLEAR(list);
+    Py_CLEAR(insts[0]);
+    r = PyObject_CallMethod(gc, "collect", NULL);
+    if (r == NULL)
+        goto error;
+    Py_DECREF(r);
+    if (PyWeakref_GET_OBJECT(wr) != Py_None)
+        msg = "cycle through a retracked instance not collected";
+
+  error:
+    /* cls and other leak, being immortal */
+    Py_DECREF(gc);
+    Py_XDECREF(dict);
+    Py_XDECREF(mortal);
+    for (i = 0; i < 5; i++)
+        Py_XDECREF(insts[i]);
+    Py_XDECREF(list);
+    Py_XDECREF(wr);
+    if (PyErr_Occurred())
+        return NULL;
+    if (msg != NULL)
+        return raiseTestError("test_gc_untrack_instances", msg);
+    Py_RETURN_NONE;
+}
+
+/* Set the attributes a, b and c of inst to 1, 2 and 3, in the order given
+   by names. */
+static int
+set_abc(PyObject *inst, const char *names)
+{
+    for (; *names; names++) {
+        char name[2] = {*names, '\0'};
+        PyObject *v = PyInt_FromLong(*names - 'a' + 1);
+        int err = v == NULL || PyObject_SetAttrString(inst, name, v) < 0;
+        Py_XDECREF(v);
+        if (err)
+            return -1;
+    }
+    return 0;
+}
+
+/* Return 1 if inst has a split __dict__ holding exactly the keys in
+   names, in that order, each with the value set_abc() gives it, 0 if not,
+   or -1 on error.  If split is 0, the dict must be combined instead. */
+static int
+check_abc(PyObject *inst, const char *names, int split)
+{
+    PyObject *dict = PyObject_GetAttrString(inst, "__dict__");
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    int ok;
+
+    if (dict == NULL)
+        return -1;
+    ok = PyDict_Size(dict) == (Py_ssize_t)strlen(names) &&
+         (((PyDictObject *)dict)->ma_values != NULL) == split;
+    while (ok && PyDict_Next(dict, &pos, &key, &value)) {
+        ok = PyString_Check(key) && PyString_GET_SIZE(key) == 1 &&
+             PyString_AS_STRING(key)[0] == *names &&
+             PyInt_Check(value) && PyInt_AS_LONG(value) == *names - 'a' + 1;
+        names++;
+    }
+    Py_DECREF(dict);
+    return ok;
+}
+
+/* Split tables are made combined by deletions and by insertions they
+   can't express.  That must keep the remaining items and their order, and
+   leave the other instances of the class, and the shared keys, alone. */
+
+static PyObject *
+test_split_table_unsharing(PyObject *self)
+{
+    static const struct {
+        const char *op;
+        const char *set, *expect;   /* attributes set, and left after op */
+    } cases[] = {
+        {"delattr", "abc", "ac"},
+        {"pop", "abc", "ac"},
+        {"popitem", "abc", "ab"},
+        {"non-string key", "abc", "abc"},
+        {"out of order", "ba", "ba"},
+    };
+    PyObject *classes[2] = {NULL, NULL};
+    PyObject *sibling = NULL, *inst = NULL, *dict = NULL, *r;
+    char msg[100];
+    int c, k, ok;
+
+    dict = PyDict_New();
+    if (dict == NULL)
+        return NULL;
+    classes[0] = new_class("Split", (PyObject *)&PyBaseObject_Type, dict);
+    Py_DECREF(dict);
+    r = PyTuple_New(0);
+    dict = PyDict_New();
+    if (r != NULL && dict != NULL) {
+        PyObject *name = PyString_FromString("Classic");
+        if (name != NULL)
+            classes[1] = PyClass_New(r, dict, name);
+        Py_XDECREF(name);
+    }
+    Py_XDECREF(r);
+    Py_CLEAR(dict);
+    if (classes[0] == NULL || classes[1] == NULL)
+        goto error;
+
+    for (k = 0; k < 2; k++) {
+        /* one instance sets the shared keys up */
+        sibling = PyObject_CallObject(classes[k], NULL);
+        if (sibling == NULL || set_abc(sibling, "abc") < 0)
+            goto error;
+        for (c = 0; c < (int)(sizeof(cases) / sizeof(cases[0])); c++) {
+            inst = PyObject_CallObject(classes[k], NULL);
+            if (inst == NULL || set_abc(inst, cases[c].set) < 0)
+                goto error;
+            dict = PyObject_GetAttrString(inst, "__dict__");
+            if (dict == NULL)
+                goto error;
+            switch (c) {
+            case 0:
+                r = PyObject_DelAttrString(inst, "b") < 0 ? NULL : Py_None;
+                Py_XINCREF(r);
+                break;
+            case 1:
+                r = PyObject_CallMethod(dict, "pop", "s", "b");
+                break;
+            case 2:
+                r = PyObject_CallMethod(dict, "popitem", NULL);
+                break;
+            case 3:
+                /* added and removed again */
+                r = PyInt_FromLong(0);
+                if (r != NULL && (PyDict_SetItem(dict, r, r) < 0 ||
+                                  PyDict_DelItem(dict, r) < 0))
+                    Py_CLEAR(r);
+                break;
+            default:
+                r = Py_None;
+                Py_INCREF(r);
+                break;
+            }
+            if (r == NULL)
+                goto error;
+            Py_DECREF(r);
+            Py_CLEAR(dict);
+            ok = check_abc(inst, cases[c].expect, 0);
+            if (ok < 0)
+                goto error;
+            if (!ok) {
+                PyOS_snprintf(msg, sizeof(msg), "%s (%s): wrong items",
+                              cases[c].op, k ? "classic" : "new-style");
+                raiseTestError("test_split_table_unsharing", msg);
+                goto error;
+            }
+            Py_CLEAR(inst);
+            /* the class's other instances and new ones stay split */
+            inst = PyObject_CallObject(classes[k], NULL);
+            if (inst == NULL || set_abc(inst, "abc") < 0)
+                goto error;
+            ok = check_abc(sibling, "abc", 1);
+            if (ok > 0)
+                ok = check_abc(inst, "abc", 1);
+            if (ok < 0)
+                goto error;
+            if (!ok) {
+                PyOS_snprintf(msg, sizeof(msg), "%s (%s): shared keys hurt",
+                              cases[c].op, k ? "classic" : "new-style");
+                raiseTestError("test_split_table_unsharing", msg);
+                goto error;
+            }
+            Py_CLEAR(inst);
+        }
+        Py_CLEAR(sibling);
+    }
+    Py_DECREF(classes[0]);
+    Py_DECREF(classes[1]);
+    Py_RETURN_NONE;
+
+  error:
+    Py_XDECREF(classes[0]);
+    Py_XDECREF(classes[1]);
+    Py_XDECREF(sibling);
+    Py_XDECREF(inst);
+    Py_XDECREF(dict);
+    return NULL;
+}
+
+/* Set obj.name to the int value.  Return -1 with an exception set on
+   failure. */
+static int
+set_int_attr(PyObject *obj, const char *name, long value)
+{
+    PyObject *v = PyInt_FromLong(value);
+    int err = v == NULL || PyObject_SetAttrString(obj, name, v) < 0;
+    Py_XDECREF(v);
+    return err ? -1 : 0;
+}
+
+/* The getter of the property used by test_attr_cache_invalidation(). */
+static PyObject *
+attr_cache_getter(PyObject *self, PyObject *obj)
+{
+    return PyInt_FromLong(42);
+}
+
+static PyMethodDef attr_cache_getter_def = {
+    "getter", attr_cache_getter, METH_O, NULL
+};
+
+/* _PyObject_GetAttrCached() must give what PyObject_GetAttr() would,
+   whatever happens to the instance, its class or the class's bases
+   between lookups. */
+
+static PyObject *
+test_attr_cache_invalidation(PyObject *self)
+{
+    _PyAttrCache cx = {0}, cp = {0}, ca = {0}, cz = {0}, cs = {0};
+    PyObject *names[4] = {NULL, NULL, NULL, NULL};
+    PyObject *getter = NULL, *dict = NULL, *prop = NULL, *slots = NULL;
+    PyObject *C = NULL, *D = NULL, *S = NULL;
+    PyObject *o = NULL, *o2 = NULL, *d = NULL, *s = NULL, *y = NULL;
+    PyObject *x, *p, *a, *z, *v;
+    const char *msg = NULL;
+    int i, ok;
+
+    names[0] = x = PyString_InternFromString("x");
+    names[1] = p = PyString_InternFromString("p");
+    names[2] = a = PyString_InternFromString("a");
+    names[3] = z = PyString_InternFromString("z");
+    getter = PyCFunction_New(&attr_cache_getter_def, NULL);
+    dict = PyDict_New();
+    if (x == NULL || p == NULL || a == NULL || z == NULL ||
+        getter == NULL || dict == NULL)
+        goto error;
+    prop = PyObject_CallFunctionObjArgs((PyObject *)&PyProperty_Type,
+                                        getter, NULL);
+    if (prop == NULL || PyDict_SetItem(dict, p, prop) < 0)
+        goto error;
+    C = new_class("C", (PyObject *)&PyBaseObject_Type, dict);
+    if (C == NULL || set_int_attr(C, "x", 1) < 0)
+        goto error;
+    Py_CLEAR(dict);
+    if ((dict = PyDict_New()) == NULL)
+        goto error;
+    D = new_class("D", C, dict);
+    o = PyObject_CallObject(C, NULL);
+    o2 = PyObject_CallObject(C, NULL);
+    d = PyObject_CallObject(D, NULL);
+    if (D == NULL || o == NULL || o2 == NULL || d == NULL ||
+        set_int_attr(o, "a", 5) < 0 ||
+        set_int_attr(o, "x", 7) < 0 ||
+        set_int_attr(o2, "x", 8) < 0 ||
+        set_int_attr(o2, "a", 6) < 0)
+        goto error;
+
+/* Look up obj.name through cache, expecting the int expected, or an
+   AttributeError if expected is -1. */
+#define GET(obj, name, cache, expected, what)                           \
+    do {                                                                \
+        v = _PyObject_GetAttrCached(obj, name, &(cache));               \
+        if (v == NULL && (expected) == -1 &&                            \
+            PyErr_ExceptionMatches(PyExc_AttributeError))               \
+            PyErr_Clear();                                              \
+        else if (v == NULL)                                             \
+            goto error;                                                 \
+        else {                                                          \
+            ok = PyInt_Check(v) && PyInt_AS_LONG(v) == (expected);      \
+            Py_DECREF(v);                                               \
+            if (!ok) {                                                  \
+                msg = what;                                             \
+                goto error;                                             \
+            }                                                           \
+        }                                                               \
+    } while (0)
+
+    /* the same site, with instances of the same class */
+    for (i = 0; i < 4; i++) {
+        GET(i & 1 ? o2 : o, x, cx, i & 1 ? 8 : 7, "instance attribute");
+        GET(i & 1 ? o2 : o, a, ca, i & 1 ? 6 : 5, "instance attribute");
+        GET(o, p, cp, 42, "property");
+        GET(o, z, cz, -1, "missing attribute");
+    }
+    if (cx.hits == 0 || ca.hits == 0 || cp.hits == 0) {
+        msg = "cache never used";
+        goto error;
+    }
+
+    /* instance changes */
+    if (PyObject_DelAttr(o, x) < 0)
+        goto error;
+    GET(o, x, cx, 1, "deleted instance attribute");
+    y = PyObject_CallObject(C, NULL);
+    if (y == NULL || PyObject_SetAttrString(y, "q", Py_None) < 0 ||
+        set_int_attr(y, "a", 77) < 0 ||
+        PyObject_DelAttrString(y, "q") < 0)
+        goto error;
+    GET(y, a, ca, 77, "attribute moved in a combined dict");
+    GET(o, a, ca, 5, "attribute of a split dict");
+
+    /* class changes */
+    if (set_int_attr(C, "z", 9) < 0)
+        goto error;
+    GET(o, z, cz, 9, "attribute added to the class");
+    if (set_int_attr(C, "p", 3) < 0 ||
+        set_int_attr(o, "p", 4) < 0)
+        goto error;
+    GET(o, p, cp, 4, "property replaced by a class attribute");
+
+    /* base class changes */
+    GET(d, x, cx, 1, "inherited attribute");
+    if (set_int_attr(C, "x", 2) < 0)
+        goto error;
+    GET(d, x, cx, 2, "attribute changed in the base");
+    if (PyObject_DelAttr(C, z) < 0)
+        goto error;
+    GET(d, z, cz, -1, "attribute deleted from the base");
+
+    /* slots */
+    Py_CLEAR(dict);
+    dict = PyDict_New();
+    slots = Py_BuildValue("(s)", "x");
+    if (dict == NULL || slots == NULL ||
+        PyDict_SetItemString(dict, "__slots__", slots) < 0)
+        goto error;
+    S = new_class("S", (PyObject *)&PyBaseObject_Type, dict);
+    s = S == NULL ? NULL : PyObject_CallObject(S, NULL);
+    if (s == NULL)
+        goto error;
+    GET(s, x, cs, -1, "empty slot");
+    if (set_int_attr(s, "x", 11) < 0)
+        goto error;
+    GET(s, x, cs, 11, "slot");
+    GET(s, x, cs, 11, "slot");
+    if (set_int_attr(S, "x", 12) < 0)
+        goto error;
+    GET(s, x, cs, 12, "slot replaced by a class attribute");
+#undef GET
+
+  error:
+    for (i = 0; i < 4; i++)
+        Py_XDECREF(names[i]);
+    Py_XDECREF(getter);
+    Py_XDECREF(dict);
+    Py_XDECREF(prop);
+    Py_XDECREF(slots);
+    Py_XDECREF(o);
+    Py_XDECREF(o2);
+    Py_XDECREF(d);
+    Py_XDECREF(s);
+    Py_XDECREF(y);
+    Py_XDECREF(C);
+    Py_XDECREF(D);
+    Py_XDECREF(S);
+    if (msg != NULL)
+        return raiseTestError("test_attr_cache_invalidation", msg);
+    if (PyErr_Occurred())
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+
+/* A classic class with a single base, or none. */
+static PyObject *
+new_classic(const char *name, PyObject *base)
+{
+    PyObject *bases, *dict, *cname, *cls = NULL;
+
+    bases = base ? PyTuple_Pack(1, base) : PyTuple_New(0);
+    dict = PyDict_New();
+    cname = PyString_FromString(name);
+    if (bases != NULL && dict != NULL && cname != NULL)
+        cls = PyClass_New(bases, dict, cname);
+    Py_XDECREF(bases);
+    Py_XDECREF(dict);
+    Py_XDECREF(cname);
+    return cls;
+}
+
+/* Classic classes cache what a walk of their bases finds.  Whatever
+   changes a base -- its attributes, its __dict__ changed directly or
+   replaced, its __bases__ -- the cached answer must follow. */
+
+static PyObject *
+test_classic_class_cache(PyObject *self)
+{
+    enum { DEPTH = 6, NINTS = 10 };
+    PyObject *cls[DEPTH] = {NULL}, *ints[NINTS] = {NULL}, *dicts[DEPTH];
+    PyObject *inst = NULL, *base = NULL, *bases = NULL, *dict = NULL, *v;
+    const char *msg = NULL;
+    int i, ok;
+
+    for (i = 0; i < NINTS; i++) {
+        if ((ints[i] = PyInt_FromLong(i)) == NULL)
+            goto error;
+    }
+    for (i = 0; i < DEPTH; i++) {
+        cls[i] = new_classic("C", i ? cls[i - 1] : NULL);
+        if (cls[i] == NULL)
+            goto error;
+        dicts[i] = ((PyClassObject *)cls[i])->cl_dict;
+    }
+    inst = PyInstance_New(cls[DEPTH - 1], NULL, NULL);
+    if (inst == NULL || PyDict_SetItemString(dicts[0], "m", ints[1]) < 0)
+        goto error;
+
+/* Look up obj.name, expecting ints[expected], or an AttributeError if
+   expected is -1. */
+#define GET(obj, name, expected, what)                                  \
+    do {                                                                \
+        v = PyObject_GetAttrString(obj, name);                          \
+        if (v == NULL && (expected) == -1 &&                            \
+            PyErr_ExceptionMatches(PyExc_AttributeError))               \
+            PyErr_Clear();                                              \
+        else if (v == NULL)                                             \
+            goto error;                                                 \
+        else {                                                          \
+            ok = (expected) != -1 && v == ints[(expected)];             \
+            Py_DECREF(v);                                               \
+            if (!ok) {                                                  \
+                msg = what;                                             \
+                goto error;                                             \
+            }                                                           \
+        }                                                               \
+    } while (0)
+
+    for (i = 0; i < 2; i++) {
+        GET(inst, "m", 1, "attribute of the root class");
+        GET(inst, "zz", -1, "missing attribute");
+    }
+    if (PyObject_SetAttrString(cls[2], "m", ints[2]) < 0)
+        goto error;
+    GET(inst, "m", 2, "attribute set on a base");
+
+    /* the dicts of the bases changed directly */
+    if (PyDict_SetItemString(dicts[3], "m", ints[3]) < 0)
+        goto error;
+    GET(inst, "m", 3, "attribute added to a base's dict");
+    if (PyDict_SetItemString(dicts[1], "zz", ints[4]) < 0)
+        goto error;
+    GET(inst, "zz", 4, "missing attribute added to a base's dict");
+    if (PyDict_DelItemString(dicts[1], "zz") < 0)
+        goto error;
+    GET(inst, "zz", -1, "attribute deleted from a base's dict");
+    if (PyDict_SetItemString(dicts[DEPTH - 1], "m", ints[5]) < 0)
+        goto error;
+    GET(inst, "m", 5, "attribute added to the class's dict");
+    if (PyDict_DelItemString(dicts[DEPTH - 1], "m") < 0)
+        goto error;
+    GET(inst, "m", 3, "attribute deleted from the class's dict");
+    PyDict_Clear(dicts[3]);
+    GET(inst, "m", 2, "base's dict cleared");
+
+    /* a base given new bases, and a new __dict__ */
+    base = new_classic("B", NULL);
+    if (base == NULL ||
+        PyDict_SetItemString(((PyClassObject *)base)->cl_dict, "m",
+                             ints[6]) < 0 ||
+        (bases = PyTuple_Pack(1, base)) == NULL ||
+        PyObject_SetAttrString(cls[3], "__bases__", bases) < 0)
+        goto error;
+    GET(inst, "m", 6, "attribute of a new base");
+    if (PyDict_SetItemString(((PyClassObject *)base)->cl_dict, "m",
+                             ints[7]) < 0)
+        goto error;
+    GET(inst, "m", 7, "attribute changed in a new base's dict");
+    dict = PyDict_New();
+    if (dict == NULL || PyDict_SetItemString(dict, "m", ints[8]) < 0 ||
+        PyObject_SetAttrString(cls[4], "__dict__", dict) < 0)
+        goto error;
+    GET(inst, "m", 8, "attribute of a base's new __dict__");
+    if (PyDict_SetItemString(dict, "m", ints[9]) < 0)
+        goto error;
+    GET(inst, "m", 9, "attribute changed in a base's new __dict__");
+    GET(cls[DEPTH - 1], "m", 9, "class attribute");
+    if (PyObject_SetAttrString(inst, "m", ints[0]) < 0)
+        goto error;
+    GET(inst, "m", 0, "instance attribute");
+#undef GET
+
+  error:
+    for (i = 0; i < DEPTH; i++)
+        Py_XDECREF(cls[i]);
+    for (i = 0; i < NINTS; i++)
+        Py_XDECREF(ints[i]);
+    Py_XDECREF(inst);
+    Py_XDECREF(base);
+    Py_XDECREF(bases);
+    Py_XDECREF(dict);
+    if (msg != NULL)
+        return raiseTestError("test_classic_class_cache", msg);
+    if (PyErr_Occurred())
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+
+/* A function for test_call_method_array() to put in classes and
+   instances:  returns (self, args), self being None unless set. */
+static PyObject *
+call_args(PyObject *self, PyObject *args)
+{
+    return PyTuple_Pack(2, self != NULL ? self : Py_None, args);
+}
+
+static PyMethodDef call_args_def = {
+    "call_args", call_args, METH_VARARGS, NULL
+};
+
+/* _PyObject_CallMethodArray() on obj.name, with the name as a C string. */
+static PyObject *
+call_method_array(PyObject *obj, const char *name, PyObject **args,
+                  Py_ssize_t nargs)
+{
+    PyObject *pyname = PyString_InternFromString(name), *r;
+
+    if (pyname == NULL)
+        return NULL;
+    r = _PyObject_CallMethodArray(obj, pyname, args, nargs);
+    Py_DECREF(pyname);
+    return r;
+}
+
+/* Return 1 if r is what call_args() returns for self and the nargs
+   arguments in args, 0 if not.  Steals the reference to r. */
+static int
+check_call_args(PyObject *r, PyObject *self, PyObject **args,
+                Py_ssize_t nargs)
+{
+    PyObject *t;
+    Py_ssize_t i;
+    int ok;
+
+    if (r == NULL)
+        return 0;
+    ok = PyTuple_Check(r) && PyTuple_GET_SIZE(r) == 2 &&
+        PyTuple_GET_ITEM(r, 0) == self;
+    if (ok) {
+        t = PyTuple_GET_ITEM(r, 1);
+        ok = PyTuple_Check(t) && PyTuple_GET_SIZE(t) == nargs;
+        for (i = 0; ok && i < nargs; i++)
+            ok = PyTuple_GET_ITEM(t, i) == args[i];
+    }
+    Py_DECREF(r);
+    return ok;
+}
+
+/* _PyObject_CallMethodArray() calls method descriptors of every calling
+   convention without binding them, and must otherwise behave exactly like
+   getattr() followed by a call:  for instance attributes, for functions
+   that don't bind, for classic instances, and when the call fails.
+   Python functions, the other case it doesn't bind, need the compiler and
+   aren't covered here. */
+
+static PyObject *
+test_call_method_array(PyObject *self)
+{
+    PyObject *args[3] = {NULL, NULL, NULL};
+    PyObject *list = NULL, *dict = NULL, *L = NULL, *sub = NULL;
+    PyObject *X = NULL, *x = NULL, *func = NULL, *bound = NULL;
+    PyObject *bases = NULL, *cname = NULL, *O = NULL, *inst = NULL;
+    PyObject *name = NULL, *method, *r;
+    const char *msg = NULL;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if ((args[i] = PyInt_FromLong(i)) == NULL)
+            goto error;
+    }
+
+/* Check that calling obj.name with n arguments returns None, or raises
+   exc. */
+#define CALL_NONE(obj, name, a, n, what)                                \
+    do {                                                                \
+        if ((r = call_method_array(obj, name, a, n)) == NULL)           \
+            goto error;                                                 \
+        Py_DECREF(r);                                                   \
+        if (r != Py_None) {                                             \
+            msg = what;                                                 \
+            goto error;                                                 \
+        }                                                               \
+    } while (0)
+#define CALL_RAISES(obj, name, a, n, exc, what)                         \
+    do {                                                                \
+        if ((r = call_method_array(obj, name, a, n)) != NULL) {         \
+            Py_DECREF(r);                                               \
+            msg = what;                                                 \
+            goto error;                                                 \
+        }                                                               \
+        if (!PyErr_ExceptionMatches(exc))                               \
+            goto error;                                                 \
+        PyErr_Clear();                                                  \
+    } while (0)
+
+    /* list methods: METH_O, METH_VARARGS, METH_NOARGS and
+       METH_VARARGS | METH_KEYWORDS */
+    list = PyList_New(0);
+    if (list == NULL)
+        goto error;
+    CALL_NONE(list, "append", args, 1, "list.append(0)");
+    CALL_NONE(list, "append", args + 1, 1, "list.append(1)");
+    CALL_NONE(list, "insert", args + 1, 2, "list.insert(1, 2)");
+    CALL_NONE(list, "reverse", NULL, 0, "list.reverse()");
+    if (PyList_GET_SIZE(list) != 3 || PyList_GET_ITEM(list, 0) != args[1] ||
+        PyList_GET_ITEM(list, 1) != args[2]) {
+        msg = "list methods called wrong";
+        goto error;
+    }
+    CALL_NONE(list, "sort", NULL, 0, "list.sort()");
+    if (PyList_GET_ITEM(list, 0) != args[0]) {
+        msg = "list.sort() not called";
+        goto error;
+    }
+    CALL_RAISES(list, "append", args, 2, PyExc_TypeError,
+         "list.append() with 2 arguments");
+    CALL_RAISES(list, "reverse", args, 1, PyExc_TypeError,
+         "list.reverse() with an argument");
+    CALL_RAISES(list, "nope", args, 1, PyExc_AttributeError,
+         "missing method");
+
+    /* a list subclass, whose instances have a dict */
+    dict = PyDict_New();
+    if (dict == NULL)
+        goto error;
+    L = new_class("L", (PyObject *)&PyList_Type, dict);
+    sub = L == NULL ? NULL : PyObject_CallObject(L, NULL);
+    name = PyString_InternFromString("append");
+    if (sub == NULL || name == NULL)
+        goto error;
+    i = _PyObject_GetMethod(sub, name, &method);
+    if (method == NULL)
+        goto error;
+    if (i != 1 || Py_TYPE(method) != &PyMethodDescr_Type)
+        msg = "inherited list.append bound";
+    Py_DECREF(method);
+    if (msg != NULL)
+        goto error;
+    CALL_NONE(sub, "append", args, 1, "inherited list.append()");
+    if (PyList_GET_SIZE(sub) != 1) {
+        msg = "inherited list.append() not called";
+        goto error;
+    }
+    func = PyCFunction_New(&call_args_def, NULL);
+    bound = PyCFunction_New(&call_args_def, list);
+    if (func == NULL || bound == NULL ||
+        PyObject_SetAttrString(sub, "append", bound) < 0)
+        goto error;
+    if (!check_call_args(call_method_array(sub, "append", args, 2),
+                         list, args, 2)) {
+        msg = "list.append not shadowed by the instance";
+        goto error;
+    }
+
+    /* a C function, which doesn't bind, and a method descriptor of
+       another type in a class */
+    if (PyDict_SetItemString(dict, "f", func) < 0 ||
+        PyDict_SetItemString(dict, "append",
+                             PyDict_GetItemString(PyList_Type.tp_dict,
+                                                  "append")) < 0)
+        goto error;
+    X = new_class("X", (PyObject *)&PyBaseObject_Type, dict);
+    x = X == NULL ? NULL : PyObject_CallObject(X, NULL);
+    if (x == NULL)
+        goto error;
+    if (!check_call_args(call_method_array(x, "f", args, 3),
+                         Py_None, args, 3)) {
+        msg = "C function in a class bound";
+        goto error;
+    }
+    CALL_RAISES(x, "append", args, 1, PyExc_TypeError,
+         "list.append on another type");
+
+    /* classic instances */
+    bases = PyTuple_New(0);
+    cname = PyString_FromString("O");
+    if (bases == NULL || cname == NULL ||
+        (O = PyClass_New(bases, dict, cname)) == NULL ||
+        (inst = PyInstance_New(O, NULL, NULL)) == NULL)
+        goto error;
+    if (!check_call_args(call_method_array(inst, "f", args, 1),
+                         Py_None, args, 1)) {
+        msg = "C function in a classic class bound";
+        goto error;
+    }
+    if (!check_call_args(call_method_array(inst, "f", NULL, 0),
+                         Py_None, NULL, 0)) {
+        msg = "C function in a classic class called with no arguments";
+        goto error;
+    }
+    CALL_RAISES(inst, "append", args, 1, PyExc_TypeError,
+         "list.append on a classic instance");
+    CALL_RAISES(inst, "nope", args, 1, PyExc_AttributeError,
+         "missing method of a classic instance");
+    if (PyObject_SetAttrString(inst, "f", bound) < 0)
+        goto error;
+    if (!check_call_args(call_method_array(inst, "f", args, 2),
+                         list, args, 2)) {
+        msg = "classic class function not shadowed by the instance";
+        goto error;
+    }
+#undef CALL_NONE
+#undef CALL_RAISES
+
+  error:
+    for (i = 0; i < 3; i++)
+        Py_XDECREF(args[i]);
+    Py_XDECREF(list);
+    Py_XDECREF(dict);
+    Py_XDECREF(L);
+    Py_XDECREF(sub);
+    Py_XDECREF(X);
+    Py_XDECREF(x);
+    Py_XDECREF(func);
+    Py_XDECREF(bound);
+    Py_XDECREF(bases);
+    Py_XDECREF(cname);
+    Py_XDECREF(O);
+    Py_XDECREF(inst);
+    Py_XDECREF(name);
+    if (msg != NULL)
+        return raiseTestError("test_call_method_array", msg);
+    if (PyErr_Occurred())
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+
+/* dict_int_bench(n, loops) times PyDict_GetItem(), PyDict_SetItem() and
+   PyDict_Contains() on a dict of n int keys, looked up loops times each,
+   once while the dict uses lookdict_int() and once after a string lookup
+   has switched the same table to lookdict().  The keys looked up are equal
+   to the stored ones but not identical, so the comparison isn't skipped.
+   Returns a dict mapping each operation to a (specialized, general) pair
+   of nanoseconds per call. */
+
+static PyObject *
+dict_int_bench(PyObject *self, PyObject *args)
+{
+    PyObject *dict = NULL, *keys = NULL, *probes = NULL, *result = NULL;
+    PyObject *nope = NULL;
+    double times[2][3], t0, ops;
+    int n = 1000, loops = 1000, i, r, round;
+
+    if (!PyArg_ParseTuple(args, "|ii:dict_int_bench", &n, &loops))
+        return NULL;
+    if (n <= 0 || loops <= 0) {
+        PyErr_SetString(PyExc_ValueError, "n and loops must be positive");
+        return NULL;
+    }
+    dict = PyDict_New();
+    keys = PyList_New(n);
+    probes = PyList_New(n);
+    nope = PyString_FromString("nope");
+    if (dict == NULL || keys == NULL || probes == NULL || nope == NULL)
+        goto error;
+    for (i = 0; i < n; i++) {
+        /* spread out, and past the small int cache */
+        long v = (long)i * 7919 + 1000;
+        PyObject *k = PyInt_FromLong(v), *p = PyInt_FromLong(v);
+        if (k == NULL || p == NULL) {
+            Py_XDECREF(k);
+            Py_XDECREF(p);
+            goto error;
+        }
+        PyList_SET_ITEM(keys, i, k);
+        PyList_SET_ITEM(probes, i, p);
+        if (PyDict_SetItem(dict, k, Py_None) < 0)
+            goto error;
+    }
+
+    for (round = 0; round < 2; round++) {
+        if (round == 1) {
+            /* from now on, dict uses the general lookup */
+            (void)PyDict_GetItem(dict, nope);
+        }
+        t0 = bench_clock();
+        for (r = 0; r < loops; r++) {
+            for (i = 0; i < n; i++) {
+                if (PyDict_GetItem(dict, PyList_GET_ITEM(probes, i)) == NULL)
+                    goto lost;
+            }
+        }
+        times[round][0] = bench_clock() - t0;
+        t0 = bench_clock();
+        for (r = 0; r < loops; r++) {
+            for (i = 0; i < n; i++) {
+                if (PyDict_SetItem(dict, PyList_GET_ITEM(probes, i),
+                                   Py_True) < 0)
+                    goto error;
+            }
+        }
+        times[round][1] = bench_clock() - t0;
+        t0 = bench_clock();
+        for (r = 0; r < loops; r++) {
+            for (i = 0; i < n; i++) {
+                if (PyDict_Contains(dict, PyList_GET_ITEM(probes, i)) != 1)
+                    goto lost;
+            }
+        }
+        times[round][2] = bench_clock() - t0;
+    }
+
+    ops = (double)n * loops / 1e9;
+    result = Py_BuildValue("{s(dd)s(dd)s(dd)}",
+                           "get", times[0][0] / ops, times[1][0] / ops,
+                           "set", times[0][1] / ops, times[1][1] / ops,
+                           "contains", times[0][2] / ops, times[1][2] / ops);
+    goto done;
+
+  lost:
+    if (!PyErr_Occurred())
+        raiseTestError("dict_int_bench", "key not found");
+  error:
+  done:
+    Py_XDECREF(dict);
+    Py_XDECREF(keys);
+    Py_XDECREF(probes);
+    Py_XDECREF(nope);
+    return result;
+}
+
+
+static PyMethodDef TestMethods[] = {
+    {"test_attr_cache_invalidation",
+     (PyCFunction)test_attr_cache_invalidation,                  METH_NOARGS},
+    {"test_call_method_array",
+     (PyCFunction)test_call_method_array,                        METH_NOARGS},
+    {"test_classic_class_cache",
+     (PyCFunction)test_classic_class_cache,                      METH_NOARGS},
+    {"test_dict_insertion_order",
+     (PyCFunction)test_dict_insertion_order,                     METH_NOARGS},
+    {"test_dict_int_keys",      (PyCFunction)test_dict_int_keys, METH_NOARGS},
+    {"test_dict_incremental_resize",
+     (PyCFunction)test_dict_incremental_resize,                  METH_NOARGS},
+    {"test_dict_version_tags",
+     (PyCFunction)test_dict_version_tags,                        METH_NOARGS},
+    {"test_gc_incremental_slices",
+     (PyCFunction)test_gc_incremental_slices,                    METH_NOARGS},
+    {"test_gc_untrack_instances",
+     (PyCFunction)test_gc_untrack_instances,                     METH_NOARGS},
+    {"test_immortal_objects",
+     (PyCFunction)test_immortal_objects,                         METH_NOARGS},
+    {"test_split_table_unsharing",
+     (PyCFunction)test_split_table_unsharing,                    METH_NOARGS},
+    {"dict_int_bench",          dict_int_bench,                  METH_VARARGS},
+    {NULL, NULL} /* sentinel */
+};
+
+PyMODINIT_FUNC
+init_testcapi(void)
+{
+    PyObject *m;
+
+    m = Py_InitModule("_testcapi", TestMethods);
+    if (m == NULL)
+        return;
+
+    TestError = PyErr_NewException("_testcapi.error", NULL, NULL);
+    Py_INCREF(TestError);
+    PyModule_AddObject(m, "error", TestError);
+}
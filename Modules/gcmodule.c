@@ -20,6 +20,10 @@
 
 #include "Python.h"
 
+#ifdef MS_WINDOWS
+#include <windows.h>
+#endif
+
 /* Get an object's GC head */
 #define AS_GC(o) ((PyGC_Head *)(o)-1)
 
@@ -48,6 +52,10 @@ static struct gc_generation generations[NUM_GENERATIONS] = {
 
 PyGC_Head *_PyGC_generation0 = GEN_HEAD(0);
 
+/* objects moved out of the generations by gc.freeze(); never collected */
+static PyGC_Head permanent_generation = {{&permanent_generation,
+                                          &permanent_generation, 0}};
+
 static int enabled = 1; /* automatic collection enabled? */
 
 /* true if we are currently running the collector */
@@ -110,6 +118,88 @@ static Py_ssize_t long_lived_pending = 0;
     http://mail.python.org/pipermail/python-dev/2008-June/080579.html
 */
 
+/*
+   NOTE: about incremental collection of the oldest generation.
+
+   A full collection examines every tracked object, so its pause grows
+   with the heap.  When a pause budget is set (gc.set_pause_budget()),
+   automatic full collections are instead spread over a "pass" of short
+   slices.  Each slice collects an increment: the two young generations
+   plus a chunk of the oldest one, grown along references from the
+   objects already in it (so that a garbage cycle seeded into the
+   increment is usually found whole), until the number of objects
+   expected to fit in the budget is reached.
+
+   An increment is collected exactly like a generation: references from
+   anything outside it keep its objects alive.  That is what keeps
+   slices correct while the program mutates objects between them, and no
+   write barrier is needed.  The price is that a cycle only partly inside
+   an increment survives that slice; it is found by a later pass or by an
+   explicit gc.collect(), which always runs a full collection.  Objects
+   are traversed whole, so a slice holding a container with millions of
+   items takes time proportional to it whatever the budget.
+
+   Survivors of a slice move to the 'visited' list, and carry the mark
+   GC_VISITED(pass_parity) in gc_refs so the increment does not grow into
+   them again.  The pass ends when the oldest generation is empty; the
+   visited list then becomes the oldest generation, and flipping
+   pass_parity turns the old marks into plain reachable objects for the
+   next pass without touching them.
+*/
+
+/* seconds a slice may take; 0 disables incremental collection */
+static double pause_budget = 0.0;
+
+/* survivors of the slices of the current pass */
+static PyGC_Head visited = {{&visited, &visited, 0}};
+
+static int pass_active = 0;
+static int pass_parity = 0;
+static Py_ssize_t pass_survivors = 0;
+
+/* Estimated cost of collecting one object, refined after each slice.  The
+   increment size is the budget divided by this, and at least the young
+   generations plus GC_MIN_INCREMENT objects of the oldest one. */
+static double ns_per_object = 100.0;
+#define GC_MIN_INCREMENT        1000
+
+/* Per-generation statistics for gc.get_stats().  Bucket i of pause_hist
+   counts collections that took less than 2**i microseconds (and at least
+   2**(i-1)); the last bucket collects everything longer.  Slices of an
+   incremental pass count as collections of the oldest generation. */
+#define GC_PAUSE_BUCKETS        24
+
+struct gc_generation_stats {
+    long collections;
+    Py_ssize_t examined;        /* objects examined */
+    Py_ssize_t collected;
+    Py_ssize_t uncollectable;
+    PY_LONG_LONG total_ns;
+    PY_LONG_LONG max_ns;
+    long pause_hist[GC_PAUSE_BUCKETS];
+};
+
+static struct gc_generation_stats generation_stats[NUM_GENERATIONS];
+
+/* What one collection did, for gc.callbacks and gc.get_stats(). */
+typedef struct {
+    Py_ssize_t examined;
+    Py_ssize_t collected;
+    Py_ssize_t uncollectable;
+} collect_result;
+
+/* list of callables invoked around each collection (gc.callbacks) */
+static PyObject *callbacks = NULL;
+
+/* statistics for gc.get_incremental_stats() */
+static long inc_slices = 0;
+static long inc_passes = 0;
+static Py_ssize_t inc_objects = 0;
+static Py_ssize_t inc_collected = 0;
+static double inc_total_time = 0.0;
+static double inc_last_pause = 0.0;
+static double inc_max_pause = 0.0;
+
 /*
    NOTE: about untracking of mutable objects.
 
@@ -203,16 +293,76 @@ GC_TENTATIVELY_UNREACHABLE
     Only objects with GC_TENTATIVELY_UNREACHABLE still set are candidates
     for collection.  If it's decided not to collect such an object (e.g.,
     it has a __del__ method), its gc_refs is restored to GC_REACHABLE again.
+
+GC_VISITED(0), GC_VISITED(1)
+    Between slices of an incremental pass, objects in the visited list and
+    in the increment being built have the mark of the current pass parity
+    instead of GC_REACHABLE.  Marks of the other parity are left over from
+    an earlier pass and mean GC_REACHABLE.  Collections treat both like
+    GC_REACHABLE.
+
+GC_FROZEN
+    Objects in the permanent generation have this instead of GC_REACHABLE,
+    so that incremental collection does not pull them into an increment.
+    Collections treat it like GC_REACHABLE.
+
+In side-table mode (gc.set_side_refs()), a collection keeps the temporary
+states of objects that live in obmalloc pools in a side table instead (see
+_PyObject_GCSideRefs()), and their PyGC_Head keeps its value from before
+the collection.  GC_REFS() and SET_GC_REFS() pick the right place; the
+states between collections are always stored in the object.
 ----------------------------------------------------------------------------
 */
 #define GC_UNTRACKED                    _PyGC_REFS_UNTRACKED
 #define GC_REACHABLE                    _PyGC_REFS_REACHABLE
 #define GC_TENTATIVELY_UNREACHABLE      _PyGC_REFS_TENTATIVELY_UNREACHABLE
+#define GC_VISITED(parity)              (-5 - (parity))
+#define GC_FROZEN                       (-7)
+
+#define IS_VISITED_MARK(refs) \
+    ((refs) == GC_VISITED(0) || (refs) == GC_VISITED(1))
+
+static int side_refs = 0;       /* use the side table? */
+
+#ifdef WITH_PYMALLOC
+static int side_active = 0;     /* ... in the current collection */
+
+static Py_ssize_t
+gc_get_refs(PyGC_Head *gc)
+{
+    Py_ssize_t refs = gc->gc.gc_refs;
+    if (side_active && refs != GC_UNTRACKED) {
+        Py_ssize_t *slot = _PyObject_GCSideRefs(gc, 0);
+        if (slot != NULL && *slot != _PyGC_SIDE_UNSET)
+            refs = *slot;
+    }
+    return refs;
+}
+
+static void
+gc_set_refs(PyGC_Head *gc, Py_ssize_t refs)
+{
+    if (side_active) {
+        Py_ssize_t *slot = _PyObject_GCSideRefs(gc, 1);
+        if (slot != NULL) {
+            *slot = refs;
+            return;
+        }
+    }
+    gc->gc.gc_refs = refs;
+}
+
+#define GC_REFS(gc) gc_get_refs(gc)
+#define SET_GC_REFS(gc, refs) gc_set_refs((gc), (refs))
+#else
+#define GC_REFS(gc) ((gc)->gc.gc_refs)
+#define SET_GC_REFS(gc, refs) ((gc)->gc.gc_refs = (refs))
+#endif
 
 #define IS_TRACKED(o) ((AS_GC(o))->gc.gc_refs != GC_UNTRACKED)
-#define IS_REACHABLE(o) ((AS_GC(o))->gc.gc_refs == GC_REACHABLE)
+#define IS_REACHABLE(o) (GC_REFS(AS_GC(o)) == GC_REACHABLE)
 #define IS_TENTATIVELY_UNREACHABLE(o) ( \
-    (AS_GC(o))->gc.gc_refs == GC_TENTATIVELY_UNREACHABLE)
+    GC_REFS(AS_GC(o)) == GC_TENTATIVELY_UNREACHABLE)
 
 /*** list functions ***/
 
@@ -320,15 +470,17 @@ append_objects(PyObject *py_list, PyGC_Head *gc_list)
 
 /* Set all gc_refs = ob_refcnt.  After this, gc_refs is > 0 for all objects
  * in containers, and is GC_REACHABLE for all tracked gc objects not in
- * containers.
+ * containers.  Returns the number of objects in containers.
  */
-static void
+static Py_ssize_t
 update_refs(PyGC_Head *containers)
 {
+    Py_ssize_t n = 0;
     PyGC_Head *gc = containers->gc.gc_next;
-    for (; gc != containers; gc = gc->gc.gc_next) {
-        assert(gc->gc.gc_refs == GC_REACHABLE);
-        gc->gc.gc_refs = Py_REFCNT(FROM_GC(gc));
+    for (; gc != containers; gc = gc->gc.gc_next, n++) {
+        assert(gc->gc.gc_refs == GC_REACHABLE
+               || IS_VISITED_MARK(gc->gc.gc_refs));
+        SET_GC_REFS(gc, Py_REFCNT(FROM_GC(gc)));
         /* Python's cyclic gc should never see an incoming refcount
          * of 0:  if something decref'ed to 0, it should have been
          * deallocated immediately at that time.
@@ -347,8 +499,9 @@ update_refs(PyGC_Head *containers)
          * so serious that maybe this should be a release-build
          * check instead of an assert?
          */
-        assert(gc->gc.gc_refs != 0);
+        assert(GC_REFS(gc) != 0);
     }
+    return n;
 }
 
 /* A traversal callback for subtract_refs. */
@@ -362,9 +515,10 @@ visit_decref(PyObject *op, void *data)
          * generation being collected, which can be recognized
          * because only they have positive gc_refs.
          */
-        assert(gc->gc.gc_refs != 0); /* else refcount was too small */
-        if (gc->gc.gc_refs > 0)
-            gc->gc.gc_refs--;
+        const Py_ssize_t gc_refs = GC_REFS(gc);
+        assert(gc_refs != 0); /* else refcount was too small */
+        if (gc_refs > 0)
+            SET_GC_REFS(gc, gc_refs - 1);
     }
     return 0;
 }
@@ -393,7 +547,7 @@ visit_reachable(PyObject *op, PyGC_Head *reachable)
 {
     if (PyObject_IS_GC(op)) {
         PyGC_Head *gc = AS_GC(op);
-        const Py_ssize_t gc_refs = gc->gc.gc_refs;
+        const Py_ssize_t gc_refs = GC_REFS(gc);
 
         if (gc_refs == 0) {
             /* This is in move_unreachable's 'young' list, but
@@ -401,7 +555,7 @@ visit_reachable(PyObject *op, PyGC_Head *reachable)
              * we need to do is tell move_unreachable that it's
              * reachable.
              */
-            gc->gc.gc_refs = 1;
+            SET_GC_REFS(gc, 1);
         }
         else if (gc_refs == GC_TENTATIVELY_UNREACHABLE) {
             /* This had gc_refs = 0 when move_unreachable got
@@ -411,7 +565,7 @@ visit_reachable(PyObject *op, PyGC_Head *reachable)
              * again.
              */
             gc_list_move(gc, reachable);
-            gc->gc.gc_refs = 1;
+            SET_GC_REFS(gc, 1);
         }
         /* Else there's nothing to do.
          * If gc_refs > 0, it must be in move_unreachable's 'young'
@@ -424,7 +578,9 @@ visit_reachable(PyObject *op, PyGC_Head *reachable)
          else {
             assert(gc_refs > 0
                    || gc_refs == GC_REACHABLE
-                   || gc_refs == GC_UNTRACKED);
+                   || gc_refs == GC_UNTRACKED
+                   || gc_refs == GC_FROZEN
+                   || IS_VISITED_MARK(gc_refs));
          }
     }
     return 0;
@@ -455,7 +611,7 @@ move_unreachable(PyGC_Head *young, PyGC_Head *unreachable)
     while (gc != young) {
         PyGC_Head *next;
 
-        if (gc->gc.gc_refs) {
+        if (GC_REFS(gc)) {
             /* gc is definitely reachable from outside the
              * original 'young'.  Mark it as such, and traverse
              * its pointers to find any other objects that may
@@ -466,8 +622,8 @@ move_unreachable(PyGC_Head *young, PyGC_Head *unreachable)
              */
             PyObject *op = FROM_GC(gc);
             traverseproc traverse = Py_TYPE(op)->tp_traverse;
-            assert(gc->gc.gc_refs > 0);
-            gc->gc.gc_refs = GC_REACHABLE;
+            assert(GC_REFS(gc) > 0);
+            SET_GC_REFS(gc, GC_REACHABLE);
             (void) traverse(op,
                             (visitproc)visit_reachable,
                             (void *)young);
@@ -486,12 +642,494 @@ move_unreachable(PyGC_Head *young, PyGC_Head *unreachable)
              */
             next = gc->gc.gc_next;
             gc_list_move(gc, unreachable);
-            gc->gc.gc_refs = GC_TENTATIVELY_UNREACHABLE;
+            SET_GC_REFS(gc, GC_TENTATIVELY_UNREACHABLE);
         }
         gc = next;
     }
 }
 
+/* Mark stacks are grown with malloc() itself:  PyMem_MALLOC may not be
+   thread-safe in debug builds, and parallel marking pushes from helper
+   threads. */
+typedef struct {
+    PyObject **items;
+    Py_ssize_t size;
+    Py_ssize_t allocated;
+} mark_stack;
+
+static int
+mark_push(mark_stack *stack, PyObject *op)
+{
+    if (stack->size == stack->allocated) {
+        Py_ssize_t n = stack->allocated ? stack->allocated * 2 : 1024;
+        PyObject **items = (PyObject **)realloc(stack->items,
+                                                n * sizeof(PyObject *));
+        if (items == NULL)
+            return -1;
+        stack->items = items;
+        stack->allocated = n;
+    }
+    stack->items[stack->size++] = op;
+    return 0;
+}
+
+#ifdef WITH_PYMALLOC
+static int side_overflow;       /* mark_reachable() could not push */
+
+/* A traversal callback for mark_reachable. */
+static int
+visit_side(PyObject *op, mark_stack *stack)
+{
+    if (PyObject_IS_GC(op)) {
+        PyGC_Head *gc = AS_GC(op);
+        if (GC_REFS(gc) >= 0) {
+            /* In young and not marked yet.  If it can't be pushed,
+             * leave it as a root for another walk. */
+            if (mark_push(stack, op) < 0) {
+                SET_GC_REFS(gc, 1);
+                side_overflow = 1;
+            }
+            else
+                SET_GC_REFS(gc, GC_REACHABLE);
+        }
+    }
+    return 0;
+}
+
+/* The side-table counterpart of move_unreachable():  mark everything
+ * reachable from the objects in young with gc_refs > 0, depth first, then
+ * move the objects left unmarked to unreachable.  Unlike move_unreachable(),
+ * this leaves the surviving objects where they are, so their headers are
+ * only read, and it does not untrack tuples.
+ */
+static void
+mark_reachable(PyGC_Head *young, PyGC_Head *unreachable)
+{
+    mark_stack stack = {NULL, 0, 0};
+    PyGC_Head *gc, *next;
+
+    /* A failed push leaves an object with gc_refs == 1, possibly behind
+     * the walk, so walk again until none is left. */
+    do {
+        side_overflow = 0;
+        for (gc = young->gc.gc_next; gc != young; gc = gc->gc.gc_next) {
+            PyObject *op;
+            if (GC_REFS(gc) <= 0)
+                continue;
+            SET_GC_REFS(gc, GC_REACHABLE);
+            op = FROM_GC(gc);
+            for (;;) {
+                (void) Py_TYPE(op)->tp_traverse(op, (visitproc)visit_side,
+                                                (void *)&stack);
+                if (stack.size == 0)
+                    break;
+                op = stack.items[--stack.size];
+            }
+        }
+    } while (side_overflow);
+    free(stack.items);
+
+    for (gc = young->gc.gc_next; gc != young; gc = next) {
+        next = gc->gc.gc_next;
+        if (GC_REFS(gc) == GC_REACHABLE) {
+            /* Objects outside the pools keep their state inline. */
+            if (gc->gc.gc_refs != GC_REACHABLE &&
+                !IS_VISITED_MARK(gc->gc.gc_refs))
+                gc->gc.gc_refs = GC_REACHABLE;
+        }
+        else {
+            gc_list_move(gc, unreachable);
+            SET_GC_REFS(gc, GC_TENTATIVELY_UNREACHABLE);
+        }
+    }
+}
+#endif /* WITH_PYMALLOC */
+
+/*** Parallel marking for full collections ***
+
+   With gc.set_mark_threads(n), full collections of at least
+   GC_PARALLEL_MIN objects compute the unreachable set with n threads: the
+   collecting thread and n-1 helpers started for the collection.  The
+   world is already stopped, since the collecting thread holds the GIL;
+   the helpers only run tp_traverse and never touch the Python API.
+
+   One walk of the generation records every GC_CHUNK-th object, cutting the
+   list into chunks that the threads claim one at a time.  Four phases,
+   separated by barriers, then replace update_refs(), subtract_refs() and
+   move_unreachable():
+
+   1. gc_refs = ob_refcnt for every object.
+   2. Subtract internal references.  Several threads may decrement the
+      same object, so this uses atomic operations.
+   3. Mark from the objects with gc_refs > 0:  a thread that swings an
+      object's gc_refs from >= 0 to GC_REACHABLE pushes it on its own
+      stack and traverses it later.  Threads that run dry take work from a
+      shared stack, which busy threads fill while anyone is idle.
+   4. Split every chunk into a list of reachable objects and a list of
+      unreachable ones (gc_refs still >= 0), which the collecting thread
+      then concatenates.
+
+   Unlike move_unreachable(), this does not untrack tuples; younger
+   collections do that.  If a mark stack cannot grow, the result is
+   thrown away and the collection runs sequentially.
+*/
+
+/* number of threads computing reachability in full collections */
+static int mark_threads = 1;
+
+#if defined(WITH_THREAD) && defined(HAVE_PTHREAD_H) && defined(__GNUC__)
+#define GC_PARALLEL
+#endif
+
+#ifdef GC_PARALLEL
+#include <pthread.h>
+#include <signal.h>
+
+#define GC_CHUNK                4096    /* objects per unit of work */
+#define GC_PARALLEL_MIN         (16 * GC_CHUNK)
+#define GC_SHARE_BATCH          256     /* objects moved to the shared stack */
+#define GC_MAX_MARK_THREADS     256
+
+typedef struct {
+    PyGC_Head *reach_first, *reach_last;
+    PyGC_Head *unreach_first, *unreach_last;
+} chunk_result;
+
+static struct {
+    PyGC_Head *young;
+    PyGC_Head **bounds;         /* first object of each chunk */
+    chunk_result *results;
+    Py_ssize_t nchunks;
+    volatile Py_ssize_t next[4];        /* next chunk to claim, per phase */
+    int nthreads;
+    int started;
+    int arrived;                /* threads waiting at the barrier */
+    unsigned long barrier_gen;
+    mark_stack shared;
+    volatile int idle;          /* threads waiting for shared work */
+    volatile int overflow;      /* a mark stack could not grow */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} par = {NULL, NULL, NULL, 0, {0, 0, 0, 0}, 0, 0, 0, 0, {NULL, 0, 0},
+         0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static PyGC_Head *
+chunk_end(Py_ssize_t i)
+{
+    return i + 1 < par.nchunks ? par.bounds[i + 1] : par.young;
+}
+
+static void
+par_barrier(void)
+{
+    unsigned long gen;
+
+    pthread_mutex_lock(&par.lock);
+    gen = par.barrier_gen;
+    if (++par.arrived == par.nthreads) {
+        par.arrived = 0;
+        par.barrier_gen++;
+        pthread_cond_broadcast(&par.cond);
+    }
+    else {
+        while (gen == par.barrier_gen)
+            pthread_cond_wait(&par.cond, &par.lock);
+    }
+    pthread_mutex_unlock(&par.lock);
+}
+
+static int
+visit_decref_atomic(PyObject *op, void *data)
+{
+    if (PyObject_IS_GC(op)) {
+        PyGC_Head *gc = AS_GC(op);
+        /* gc_refs never drops below 0 in the young set, so the test
+           only has to tell it from other generations. */
+        if (gc->gc.gc_refs > 0)
+            __sync_fetch_and_sub(&gc->gc.gc_refs, 1);
+    }
+    return 0;
+}
+
+static int
+visit_mark(PyObject *op, mark_stack *stack)
+{
+    if (PyObject_IS_GC(op)) {
+        PyGC_Head *gc = AS_GC(op);
+        Py_ssize_t refs = gc->gc.gc_refs;
+        if (refs >= 0 &&
+            __sync_bool_compare_and_swap(&gc->gc.gc_refs, refs, GC_REACHABLE)
+            && mark_push(stack, op) < 0)
+            par.overflow = 1;
+    }
+    return 0;
+}
+
+/* Move the top GC_SHARE_BATCH objects of stack to the shared stack. */
+static void
+share_work(mark_stack *stack)
+{
+    Py_ssize_t i;
+
+    pthread_mutex_lock(&par.lock);
+    for (i = 0; i < GC_SHARE_BATCH; i++) {
+        if (mark_push(&par.shared, stack->items[stack->size - 1]) < 0)
+            break;
+        stack->size--;
+    }
+    pthread_cond_broadcast(&par.cond);
+    pthread_mutex_unlock(&par.lock);
+}
+
+/* Take a batch of shared work, waiting for some if need be.  Returns 0 when
+ * every thread is idle, which ends the mark phase. */
+static int
+take_work(mark_stack *stack)
+{
+    Py_ssize_t i;
+
+    pthread_mutex_lock(&par.lock);
+    for (;;) {
+        if (par.shared.size > 0) {
+            for (i = 0; i < GC_SHARE_BATCH && par.shared.size > 0; i++) {
+                if (mark_push(stack,
+                              par.shared.items[par.shared.size - 1]) < 0) {
+                    par.overflow = 1;
+                    break;
+                }
+                par.shared.size--;
+            }
+            pthread_mutex_unlock(&par.lock);
+            return 1;
+        }
+        par.idle++;
+        if (par.idle == par.nthreads) {
+            pthread_cond_broadcast(&par.cond);
+            pthread_mutex_unlock(&par.lock);
+            return 0;
+        }
+        pthread_cond_wait(&par.cond, &par.lock);
+        if (par.idle == par.nthreads) {
+            pthread_mutex_unlock(&par.lock);
+            return 0;
+        }
+        par.idle--;
+    }
+}
+
+static void
+drain(mark_stack *stack)
+{
+    Py_ssize_t count = 0;
+
+    while (stack->size > 0) {
+        PyObject *op = stack->items[--stack->size];
+        (void) Py_TYPE(op)->tp_traverse(op, (visitproc)visit_mark,
+                                        (void *)stack);
+        if ((++count & 63) == 0 && par.idle > 0 &&
+            stack->size > 2 * GC_SHARE_BATCH)
+            share_work(stack);
+    }
+}
+
+/* The work of one thread, collecting or helper. */
+static void
+par_run(void)
+{
+    mark_stack stack = {NULL, 0, 0};
+    PyGC_Head *gc, *end, *next;
+    Py_ssize_t i;
+
+    /* 1. update_refs */
+    while ((i = __sync_fetch_and_add(&par.next[0], 1)) < par.nchunks) {
+        end = chunk_end(i);
+        for (gc = par.bounds[i]; gc != end; gc = gc->gc.gc_next)
+            gc->gc.gc_refs = Py_REFCNT(FROM_GC(gc));
+    }
+    par_barrier();
+
+    /* 2. subtract_refs */
+    while ((i = __sync_fetch_and_add(&par.next[1], 1)) < par.nchunks) {
+        end = chunk_end(i);
+        for (gc = par.bounds[i]; gc != end; gc = gc->gc.gc_next)
+            (void) Py_TYPE(FROM_GC(gc))->tp_traverse(FROM_GC(gc),
+                                        (visitproc)visit_decref_atomic,
+                                        NULL);
+    }
+    par_barrier();
+
+    /* 3. mark what is reachable from outside */
+    for (;;) {
+        i = __sync_fetch_and_add(&par.next[2], 1);
+        if (i < par.nchunks) {
+            end = chunk_end(i);
+            for (gc = par.bounds[i]; gc != end; gc = gc->gc.gc_next) {
+                Py_ssize_t refs = gc->gc.gc_refs;
+                if (refs > 0 &&
+                    __sync_bool_compare_and_swap(&gc->gc.gc_refs, refs,
+                                                 GC_REACHABLE) &&
+                    mark_push(&stack, FROM_GC(gc)) < 0)
+                    par.overflow = 1;
+            }
+        }
+        else if (!take_work(&stack))
+            break;
+        drain(&stack);
+    }
+    free(stack.items);
+    par_barrier();
+    if (par.overflow)
+        return;
+
+    /* 4. split the chunks; read gc_next before relinking each object */
+    while ((i = __sync_fetch_and_add(&par.next[3], 1)) < par.nchunks) {
+        chunk_result *r = &par.results[i];
+        r->reach_first = r->reach_last = NULL;
+        r->unreach_first = r->unreach_last = NULL;
+        end = chunk_end(i);
+        for (gc = par.bounds[i]; gc != end; gc = next) {
+            next = gc->gc.gc_next;
+            if (gc->gc.gc_refs == GC_REACHABLE) {
+                gc->gc.gc_prev = r->reach_last;
+                if (r->reach_last == NULL)
+                    r->reach_first = gc;
+                else
+                    r->reach_last->gc.gc_next = gc;
+                r->reach_last = gc;
+            }
+            else {
+                gc->gc.gc_refs = GC_TENTATIVELY_UNREACHABLE;
+                gc->gc.gc_prev = r->unreach_last;
+                if (r->unreach_last == NULL)
+                    r->unreach_first = gc;
+                else
+                    r->unreach_last->gc.gc_next = gc;
+                r->unreach_last = gc;
+            }
+        }
+    }
+}
+
+static void *
+par_helper(void *arg)
+{
+    pthread_mutex_lock(&par.lock);
+    while (!par.started)
+        pthread_cond_wait(&par.cond, &par.lock);
+    pthread_mutex_unlock(&par.lock);
+    par_run();
+    return NULL;
+}
+
+/* Append the sublist first..last to list. */
+static void
+gc_list_append_run(PyGC_Head *first, PyGC_Head *last, PyGC_Head *list)
+{
+    PyGC_Head *tail = list->gc.gc_prev;
+    tail->gc.gc_next = first;
+    first->gc.gc_prev = tail;
+    last->gc.gc_next = list;
+    list->gc.gc_prev = last;
+}
+
+/* Do the work of update_refs(), subtract_refs() and move_unreachable() with
+ * mark_threads threads.  Returns the number of objects in young, or -1 if
+ * the caller has to do it sequentially. */
+static Py_ssize_t
+parallel_mark(PyGC_Head *young, PyGC_Head *unreachable)
+{
+    PyGC_Head *gc;
+    PyGC_Head **bounds = NULL;
+    pthread_t threads[GC_MAX_MARK_THREADS];
+    sigset_t all_signals, old_mask;
+    Py_ssize_t n = 0, nchunks = 0, allocated = 0, i;
+    size_t nbytes;
+    int nthreads, created = 0;
+
+    for (gc = young->gc.gc_next; gc != young; gc = gc->gc.gc_next, n++) {
+        if (n % GC_CHUNK)
+            continue;
+        if (nchunks == allocated) {
+            PyGC_Head **b;
+            allocated = allocated ? allocated * 2 : 64;
+            nbytes = allocated * sizeof(PyGC_Head *);
+            b = (PyGC_Head **)PyMem_REALLOC(bounds, nbytes);
+            if (b == NULL) {
+                PyMem_FREE(bounds);
+                return -1;
+            }
+            bounds = b;
+        }
+        bounds[nchunks++] = gc;
+    }
+    if (n < GC_PARALLEL_MIN) {
+        PyMem_FREE(bounds);
+        return -1;
+    }
+    nbytes = nchunks * sizeof(chunk_result);
+    par.results = (chunk_result *)PyMem_MALLOC(nbytes);
+    if (par.results == NULL) {
+        PyMem_FREE(bounds);
+        return -1;
+    }
+
+    par.young = young;
+    par.bounds = bounds;
+    par.nchunks = nchunks;
+    for (i = 0; i < 4; i++)
+        par.next[i] = 0;
+    par.idle = 0;
+    par.overflow = 0;
+    par.shared.size = 0;
+
+    nthreads = mark_threads < nchunks ? mark_threads : (int)nchunks;
+    /* The helpers have no thread state; keep signal handlers, such as
+       the sampling profiler's, off them.  They inherit this mask. */
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_mask);
+    while (created < nthreads - 1 &&
+           pthread_create(&threads[created], NULL, par_helper, NULL) == 0)
+        created++;
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    pthread_mutex_lock(&par.lock);
+    par.nthreads = created + 1;
+    par.started = 1;
+    pthread_cond_broadcast(&par.cond);
+    pthread_mutex_unlock(&par.lock);
+
+    par_run();
+    for (i = 0; i < created; i++)
+        pthread_join(threads[i], NULL);
+    par.started = 0;
+
+    if (par.overflow) {
+        /* The young list is still intact; start over sequentially. */
+        for (gc = young->gc.gc_next; gc != young; gc = gc->gc.gc_next)
+            gc->gc.gc_refs = GC_REACHABLE;
+        n = -1;
+    }
+    else {
+        gc_list_init(young);
+        for (i = 0; i < nchunks; i++) {
+            chunk_result *r = &par.results[i];
+            if (r->reach_first != NULL)
+                gc_list_append_run(r->reach_first, r->reach_last, young);
+            if (r->unreach_first != NULL)
+                gc_list_append_run(r->unreach_first, r->unreach_last,
+                                   unreachable);
+        }
+    }
+    free(par.shared.items);
+    par.shared.items = NULL;
+    par.shared.allocated = 0;
+    PyMem_FREE(par.results);
+    PyMem_FREE(bounds);
+    par.results = NULL;
+    par.bounds = NULL;
+    return n;
+}
+#endif /* GC_PARALLEL */
+
 /* Return true if object has a finalization method.
  * CAUTION:  An instance of an old-style class has to be checked for a
  *__del__ method, and earlier versions of this used to call PyObject_HasAttr,
@@ -512,7 +1150,8 @@ has_finalizer(PyObject *op)
         return 0;
 }
 
-/* Try to untrack all currently tracked dictionaries */
+/* Try to untrack all currently tracked dictionaries, and the instances
+ * whose __dict__ is untracked by then or before */
 static void
 untrack_dicts(PyGC_Head *head)
 {
@@ -522,6 +1161,8 @@ untrack_dicts(PyGC_Head *head)
         next = gc->gc.gc_next;
         if (PyDict_CheckExact(op))
             _PyDict_MaybeUntrack(op);
+        else
+            _PyObject_MaybeUntrack(op);
         gc = next;
     }
 }
@@ -547,7 +1188,7 @@ move_finalizers(PyGC_Head *unreachable, PyGC_Head *finalizers)
 
         if (has_finalizer(op)) {
             gc_list_move(gc, finalizers);
-            gc->gc.gc_refs = GC_REACHABLE;
+            SET_GC_REFS(gc, GC_REACHABLE);
         }
     }
 }
@@ -560,7 +1201,7 @@ visit_move(PyObject *op, PyGC_Head *tolist)
         if (IS_TENTATIVELY_UNREACHABLE(op)) {
             PyGC_Head *gc = AS_GC(op);
             gc_list_move(gc, tolist);
-            gc->gc.gc_refs = GC_REACHABLE;
+            SET_GC_REFS(gc, GC_REACHABLE);
         }
     }
     return 0;
@@ -675,7 +1316,9 @@ handle_weakrefs(PyGC_Head *unreachable, PyGC_Head *old)
      */
             if (IS_TENTATIVELY_UNREACHABLE(wr))
                 continue;
-            assert(IS_REACHABLE(wr));
+            assert(IS_REACHABLE(wr)
+                   || AS_GC(wr)->gc.gc_refs == GC_FROZEN
+                   || IS_VISITED_MARK(AS_GC(wr)->gc.gc_refs));
 
             /* Create a new reference so that wr can't go away
              * before we can process it again.
@@ -700,7 +1343,9 @@ handle_weakrefs(PyGC_Head *unreachable, PyGC_Head *old)
 
         gc = wrcb_to_call.gc.gc_next;
         op = FROM_GC(gc);
-        assert(IS_REACHABLE(op));
+        assert(IS_REACHABLE(op)
+               || gc->gc.gc_refs == GC_FROZEN
+               || IS_VISITED_MARK(gc->gc.gc_refs));
         assert(PyWeakref_Check(op));
         wr = (PyWeakReference *)op;
         callback = wr->wr_callback;
@@ -821,7 +1466,7 @@ delete_garbage(PyGC_Head *collectable, PyGC_Head *old)
         if (collectable->gc.gc_next == gc) {
             /* object is still alive, move it, it may die later */
             gc_list_move(gc, old);
-            gc->gc.gc_refs = GC_REACHABLE;
+            SET_GC_REFS(gc, GC_REACHABLE);
         }
     }
 }
@@ -844,6 +1489,16 @@ clear_freelists(void)
     (void)PyFloat_ClearFreeList();
 }
 
+/* Trim the int and float free lists after a young collection, releasing
+ * the objects that sat unused since the previous trim.
+ */
+static void
+trim_freelists(void)
+{
+    (void)_PyInt_TrimFreeList();
+    (void)_PyFloat_TrimFreeList();
+}
+
 static double
 get_time(void)
 {
@@ -862,16 +1517,38 @@ get_time(void)
     return result;
 }
 
-/* This is the main function.  Read this to understand how the
- * collection process works. */
+/* Monotonic clock for timing slices, in nanoseconds. */
+static PY_LONG_LONG
+gc_clock_ns(void)
+{
+#ifdef MS_WINDOWS
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER t;
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&t);
+    return (PY_LONG_LONG)((double)t.QuadPart * 1e9 / (double)freq.QuadPart);
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (PY_LONG_LONG)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (PY_LONG_LONG)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
+/* Collect the objects in young; survivors end up in old (which may be
+ * young itself).  generation is the generation young belongs to, or -1
+ * for an increment of an incremental pass.  Returns the number of
+ * unreachable objects found, and fills in *result. */
 static Py_ssize_t
-collect(int generation)
+collect_list(PyGC_Head *young, PyGC_Head *old, int generation,
+             collect_result *result)
 {
-    int i;
     Py_ssize_t m = 0; /* # objects collected */
     Py_ssize_t n = 0; /* # unreachable objects that couldn't be collected */
-    PyGC_Head *young; /* the generation we are examining */
-    PyGC_Head *old; /* next older generation */
     PyGC_Head unreachable; /* non-problematic unreachable trash */
     PyGC_Head finalizers;  /* objects with, & reachable from, __del__ */
     PyGC_Head *gc;
@@ -884,8 +1561,14 @@ collect(int generation)
     }
 
     if (debug & DEBUG_STATS) {
-        PySys_WriteStderr("gc: collecting generation %d...\n",
-                          generation);
+        int i;
+        if (generation < 0)
+            PySys_WriteStderr("gc: collecting increment of %"
+                              PY_FORMAT_SIZE_T "d objects...\n",
+                              gc_list_size(young));
+        else
+            PySys_WriteStderr("gc: collecting generation %d...\n",
+                              generation);
         PySys_WriteStderr("gc: objects in each generation:");
         for (i = 0; i < NUM_GENERATIONS; i++)
             PySys_WriteStderr(" %" PY_FORMAT_SIZE_T "d",
@@ -894,43 +1577,52 @@ collect(int generation)
         PySys_WriteStderr("\n");
     }
 
-    /* update collection and allocation counters */
-    if (generation+1 < NUM_GENERATIONS)
-        generations[generation+1].count += 1;
-    for (i = 0; i <= generation; i++)
-        generations[i].count = 0;
-
-    /* merge younger generations with one we are currently collecting */
-    for (i = 0; i < generation; i++) {
-        gc_list_merge(GEN_HEAD(i), GEN_HEAD(generation));
-    }
-
-    /* handy references */
-    young = GEN_HEAD(generation);
-    if (generation < NUM_GENERATIONS-1)
-        old = GEN_HEAD(generation+1);
-    else
-        old = young;
-
     /* Using ob_refcnt and gc_refs, calculate which objects in the
      * container set are reachable from outside the set (i.e., have a
      * refcount greater than 0 when all the references within the
      * set are taken into account).
      */
-    update_refs(young);
-    subtract_refs(young);
-
-    /* Leave everything reachable from outside young in young, and move
-     * everything else (in young) to unreachable.
-     * NOTE:  This used to move the reachable objects into a reachable
-     * set instead.  But most things usually turn out to be reachable,
-     * so it's more efficient to move the unreachable things.
-     */
     gc_list_init(&unreachable);
-    move_unreachable(young, &unreachable);
+#ifdef WITH_PYMALLOC
+    side_active = side_refs;
+#endif
+#ifdef GC_PARALLEL
+    if (mark_threads > 1 && generation == NUM_GENERATIONS-1 && !side_active)
+        result->examined = parallel_mark(young, &unreachable);
+    else
+        result->examined = -1;
+    if (result->examined < 0)
+#endif
+    {
+        result->examined = update_refs(young);
+        subtract_refs(young);
+
+        /* Leave everything reachable from outside young in young, and
+         * move everything else (in young) to unreachable.
+         * NOTE:  This used to move the reachable objects into a reachable
+         * set instead.  But most things usually turn out to be reachable,
+         * so it's more efficient to move the unreachable things.
+         */
+#ifdef WITH_PYMALLOC
+        if (side_active)
+            mark_reachable(young, &unreachable);
+        else
+#endif
+        move_unreachable(young, &unreachable);
+    }
 
     /* Move reachable objects to next generation. */
-    if (young != old) {
+    if (generation < 0) {
+        /* Survivors of an increment are marked visited, so later
+           increments of this pass leave them alone. */
+        for (gc = young->gc.gc_next; gc != young; gc = gc->gc.gc_next) {
+            gc->gc.gc_refs = GC_VISITED(pass_parity);
+            pass_survivors++;
+        }
+        untrack_dicts(young);
+        gc_list_merge(young, old);
+    }
+    else if (young != old) {
         if (generation == NUM_GENERATIONS - 2) {
             long_lived_pending += gc_list_size(young);
         }
@@ -1010,11 +1702,15 @@ collect(int generation)
      */
     (void)handle_finalizers(&finalizers, old);
 
-    /* Clear free list only during the collection of the highest
-     * generation */
-    if (generation == NUM_GENERATIONS-1) {
-        clear_freelists();
+#ifdef WITH_PYMALLOC
+    if (side_active) {
+        side_active = 0;
+        _PyObject_GCSideClear();
     }
+#endif
+
+    result->collected = m;
+    result->uncollectable = n;
 
     if (PyErr_Occurred()) {
         if (gc_str == NULL)
@@ -1025,6 +1721,250 @@ collect(int generation)
     return n+m;
 }
 
+/* Give up on the current incremental pass, if any, and put the objects it
+ * visited back into the oldest generation. */
+static void
+abandon_pass(void)
+{
+    if (!pass_active)
+        return;
+    gc_list_merge(&visited, GEN_HEAD(NUM_GENERATIONS-1));
+    pass_parity ^= 1;
+    pass_active = 0;
+}
+
+/* This is the main function.  Read this to understand how the
+ * collection process works. */
+static Py_ssize_t
+collect(int generation, collect_result *result)
+{
+    int i;
+    Py_ssize_t n;
+    PyGC_Head *young; /* the generation we are examining */
+    PyGC_Head *old; /* next older generation */
+
+    /* a full collection supersedes an incremental pass */
+    if (generation == NUM_GENERATIONS-1)
+        abandon_pass();
+
+    /* update collection and allocation counters */
+    if (generation+1 < NUM_GENERATIONS)
+        generations[generation+1].count += 1;
+    for (i = 0; i <= generation; i++)
+        generations[i].count = 0;
+
+    /* merge younger generations with one we are currently collecting */
+    for (i = 0; i < generation; i++) {
+        gc_list_merge(GEN_HEAD(i), GEN_HEAD(generation));
+    }
+
+    /* handy references */
+    young = GEN_HEAD(generation);
+    if (generation < NUM_GENERATIONS-1)
+        old = GEN_HEAD(generation+1);
+    else
+        old = young;
+
+    n = collect_list(young, old, generation, result);
+
+    /* Clear free list only during the collection of the highest
+     * generation */
+    if (generation == NUM_GENERATIONS-1) {
+        clear_freelists();
+    }
+    else {
+        trim_freelists();
+    }
+    return n;
+}
+
+typedef struct {
+    PyGC_Head *list;
+    Py_ssize_t mark;
+    Py_ssize_t size;
+    Py_ssize_t limit;
+} increment_state;
+
+/* A traversal callback for collect_increment: pull a referent that has not
+ * been visited yet into the increment. */
+static int
+visit_increment(PyObject *op, increment_state *state)
+{
+    if (PyObject_IS_GC(op) && state->size < state->limit) {
+        PyGC_Head *gc = AS_GC(op);
+        if (gc->gc.gc_refs != GC_UNTRACKED &&
+            gc->gc.gc_refs != GC_FROZEN &&
+            gc->gc.gc_refs != state->mark) {
+            gc_list_move(gc, state->list);
+            gc->gc.gc_refs = state->mark;
+            state->size++;
+        }
+    }
+    return 0;
+}
+
+/* Run one slice of an incremental pass over the oldest generation, and
+ * end the pass if that leaves the generation empty. */
+static Py_ssize_t
+collect_increment(collect_result *result)
+{
+    int i;
+    Py_ssize_t n;
+    PyGC_Head increment;
+    PyGC_Head *oldest = GEN_HEAD(NUM_GENERATIONS-1);
+    PyGC_Head *gc, *scan;
+    increment_state state;
+    PY_LONG_LONG t0, elapsed;
+    double limit;
+
+    t0 = gc_clock_ns();
+    if (!pass_active) {
+        pass_active = 1;
+        pass_survivors = 0;
+    }
+    for (i = 0; i < NUM_GENERATIONS; i++)
+        generations[i].count = 0;
+
+    /* The young generations go in whole. */
+    gc_list_init(&increment);
+    state.list = &increment;
+    state.mark = GC_VISITED(pass_parity);
+    state.size = 0;
+    for (i = 0; i < NUM_GENERATIONS-1; i++)
+        gc_list_merge(GEN_HEAD(i), &increment);
+    for (gc = increment.gc.gc_next; gc != &increment; gc = gc->gc.gc_next) {
+        gc->gc.gc_refs = state.mark;
+        state.size++;
+    }
+
+    limit = pause_budget * 1e9 / ns_per_object;
+    if (limit < (double)(state.size + GC_MIN_INCREMENT))
+        limit = (double)(state.size + GC_MIN_INCREMENT);
+    state.limit = limit < (double)PY_SSIZE_T_MAX ?
+        (Py_ssize_t)limit : PY_SSIZE_T_MAX;
+
+    /* Grow the increment along the references of the objects already in
+     * it; when nothing is left to follow, seed it with the next object
+     * of the oldest generation. */
+    scan = &increment;
+    while (state.size < state.limit) {
+        if (scan->gc.gc_next == &increment) {
+            if (gc_list_is_empty(oldest))
+                break;
+            gc = oldest->gc.gc_next;
+            gc_list_move(gc, &increment);
+            gc->gc.gc_refs = state.mark;
+            state.size++;
+        }
+        scan = scan->gc.gc_next;
+        (void) Py_TYPE(FROM_GC(scan))->tp_traverse(FROM_GC(scan),
+                                      (visitproc)visit_increment,
+                                      (void *)&state);
+    }
+
+    n = collect_list(&increment, &visited, -1, result);
+
+    if (gc_list_is_empty(oldest)) {
+        /* The pass is complete. */
+        gc_list_merge(&visited, oldest);
+        pass_parity ^= 1;
+        pass_active = 0;
+        inc_passes++;
+        long_lived_pending = 0;
+        long_lived_total = pass_survivors;
+        clear_freelists();
+    }
+    else {
+        trim_freelists();
+    }
+
+    elapsed = gc_clock_ns() - t0;
+    if (state.size > 0)
+        ns_per_object = (ns_per_object + (double)elapsed / state.size) / 2;
+    inc_slices++;
+    inc_objects += state.size;
+    inc_collected += n;
+    inc_last_pause = elapsed * 1e-9;
+    inc_total_time += inc_last_pause;
+    if (inc_last_pause > inc_max_pause)
+        inc_max_pause = inc_last_pause;
+    return n;
+}
+
+/* Call each callable in gc.callbacks with phase ("start" or "stop") and
+ * a dict describing the collection. */
+static void
+invoke_gc_callback(const char *phase, int generation, int incremental,
+                   collect_result *result)
+{
+    Py_ssize_t i;
+    PyObject *info = NULL;
+
+    /* we may get called very early */
+    if (callbacks == NULL || PyList_GET_SIZE(callbacks) == 0)
+        return;
+    info = Py_BuildValue("{sisNsnsn}",
+                         "generation", generation,
+                         "incremental", PyBool_FromLong(incremental),
+                         "collected", result->collected,
+                         "uncollectable", result->uncollectable);
+    if (info == NULL) {
+        PyErr_WriteUnraisable(NULL);
+        return;
+    }
+    for (i = 0; i < PyList_GET_SIZE(callbacks); i++) {
+        PyObject *r, *cb = PyList_GET_ITEM(callbacks, i);
+        Py_INCREF(cb); /* make sure cb doesn't go away */
+        r = PyObject_CallFunction(cb, "sO", phase, info);
+        if (r == NULL)
+            PyErr_WriteUnraisable(cb);
+        else
+            Py_DECREF(r);
+        Py_DECREF(cb);
+    }
+    Py_DECREF(info);
+}
+
+/* Run a collection of the given generation, or a slice of an incremental
+ * pass, between the gc.callbacks calls, and account for it in
+ * gc.get_stats(). */
+static Py_ssize_t
+collect_with_callback(int generation, int incremental)
+{
+    Py_ssize_t n;
+    collect_result result = {0, 0, 0};
+    struct gc_generation_stats *st = &generation_stats[generation];
+    PY_LONG_LONG t0, elapsed, us;
+    int bucket = 0;
+
+    invoke_gc_callback("start", generation, incremental, &result);
+    t0 = gc_clock_ns();
+    if (incremental)
+        n = collect_increment(&result);
+    else
+        n = collect(generation, &result);
+    elapsed = gc_clock_ns() - t0;
+
+    st->collections++;
+    st->examined += result.examined;
+    st->collected += result.collected;
+    st->uncollectable += result.uncollectable;
+    st->total_ns += elapsed;
+    if (elapsed > st->max_ns)
+        st->max_ns = elapsed;
+    for (us = elapsed / 1000; us > 0 && bucket < GC_PAUSE_BUCKETS - 1;
+         us >>= 1)
+        bucket++;
+    st->pause_hist[bucket]++;
+
+#ifdef WITH_PYMALLOC
+    /* Collections free memory, and keep running when nothing else does. */
+    (void)_PyObject_PurgeArenas(0);
+#endif
+    invoke_gc_callback("stop", generation, incremental, &result);
+    return n;
+}
+
 static Py_ssize_t
 collect_generations(void)
 {
@@ -1043,7 +1983,14 @@ collect_generations(void)
             if (i == NUM_GENERATIONS - 1
                 && long_lived_pending < long_lived_total / 4)
                 continue;
-            n = collect(i);
+            /* With a pause budget, a full collection starts an
+               incremental pass, and while it lasts every collection
+               beyond the youngest generation is a slice of it. */
+            if (pause_budget > 0 &&
+                (i == NUM_GENERATIONS - 1 || (i > 0 && pass_active)))
+                n = collect_with_callback(NUM_GENERATIONS - 1, 1);
+            else
+                n = collect_with_callback(i, 0);
             break;
         }
     }
@@ -1114,7 +2061,7 @@ gc_collect(PyObject *self, PyObject *args, PyObject *kws)
         n = 0; /* already collecting, don't do anything */
     else {
         collecting = 1;
-        n = collect(genarg);
+        n = collect_with_callback(genarg, 0);
         collecting = 0;
     }
 
@@ -1210,6 +2157,190 @@ gc_get_count(PyObject *self, PyObject *noargs)
                          generations[2].count);
 }
 
+PyDoc_STRVAR(gc_set_pause_budget__doc__,
+"set_pause_budget(seconds) -> None\n"
+"\n"
+"Spread automatic full collections over slices that should each take\n"
+"about the given time.  Zero, the default, makes every automatic full\n"
+"collection run in one go.  gc.collect() always runs in one go.\n");
+
+static PyObject *
+gc_set_pause_budget(PyObject *self, PyObject *args)
+{
+    double budget;
+
+    if (!PyArg_ParseTuple(args, "d:set_pause_budget", &budget))
+        return NULL;
+    if (budget < 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "pause budget must be non-negative");
+        return NULL;
+    }
+    pause_budget = budget;
+    if (budget == 0 && !collecting)
+        abandon_pass();
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyDoc_STRVAR(gc_get_pause_budget__doc__,
+"get_pause_budget() -> seconds\n"
+"\n"
+"Return the time budget of incremental collection slices.\n");
+
+static PyObject *
+gc_get_pause_budget(PyObject *self, PyObject *noargs)
+{
+    return PyFloat_FromDouble(pause_budget);
+}
+
+PyDoc_STRVAR(gc_get_incremental_stats__doc__,
+"get_incremental_stats() -> dict\n"
+"\n"
+"Return statistics of incremental collection: the number of slices and\n"
+"of completed passes, the objects examined and found unreachable by all\n"
+"slices, their total time, the longest and the last pause in seconds,\n"
+"and whether a pass is in progress.\n");
+
+static PyObject *
+gc_get_incremental_stats(PyObject *self, PyObject *noargs)
+{
+    return Py_BuildValue("{slslsnsnsdsdsdsi}",
+                         "slices", inc_slices,
+                         "passes", inc_passes,
+                         "objects", inc_objects,
+                         "collected", inc_collected,
+                         "total_time", inc_total_time,
+                         "max_pause", inc_max_pause,
+                         "last_pause", inc_last_pause,
+                         "in_progress", pass_active);
+}
+
+PyDoc_STRVAR(gc_set_mark_threads__doc__,
+"set_mark_threads(n) -> None\n"
+"\n"
+"Use n threads to find the unreachable objects in full collections of\n"
+"large heaps.  1, the default, keeps all collections single-threaded.\n"
+"This has no effect on platforms without POSIX threads.\n");
+
+static PyObject *
+gc_set_mark_threads(PyObject *self, PyObject *args)
+{
+    int n;
+
+    if (!PyArg_ParseTuple(args, "i:set_mark_threads", &n))
+        return NULL;
+    if (n < 1) {
+        PyErr_SetString(PyExc_ValueError,
+                        "number of threads must be at least 1");
+        return NULL;
+    }
+#ifdef GC_PARALLEL
+    if (n > GC_MAX_MARK_THREADS)
+        n = GC_MAX_MARK_THREADS;
+#endif
+    mark_threads = n;
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyDoc_STRVAR(gc_get_mark_threads__doc__,
+"get_mark_threads() -> n\n"
+"\n"
+"Return the number of threads used to mark in full collections.\n");
+
+static PyObject *
+gc_get_mark_threads(PyObject *self, PyObject *noargs)
+{
+    return PyInt_FromLong(mark_threads);
+}
+
+PyDoc_STRVAR(gc_set_side_refs__doc__,
+"set_side_refs(flag) -> None\n"
+"\n"
+"If flag is true, collections keep their per-object bookkeeping in a\n"
+"side table instead of in the objects, and leave the objects that survive\n"
+"in place, so that they don't write to the memory of those objects.  This\n"
+"keeps the pages a forked child shares with its parent shared, at some\n"
+"cost in collection time.  Objects larger than 512 bytes, and the\n"
+"survivors of incremental collection, are still written to.  Parallel\n"
+"marking is not used in this mode.  This has no effect without pymalloc.\n");
+
+static PyObject *
+gc_set_side_refs(PyObject *self, PyObject *args)
+{
+    int flag;
+
+    if (!PyArg_ParseTuple(args, "i:set_side_refs", &flag))
+        return NULL;
+    side_refs = flag != 0;
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyDoc_STRVAR(gc_get_side_refs__doc__,
+"get_side_refs() -> flag\n"
+"\n"
+"Return true if collections keep their bookkeeping in a side table.\n");
+
+static PyObject *
+gc_get_side_refs(PyObject *self, PyObject *noargs)
+{
+    return PyBool_FromLong(side_refs);
+}
+
+PyDoc_STRVAR(gc_get_stats__doc__,
+"get_stats() -> [...]\n"
+"\n"
+"Return a list with a dictionary of statistics for each generation:\n"
+"the number of collections, the objects they examined, collected and\n"
+"found uncollectable, their total and longest pause in seconds, and\n"
+"'pause_histogram', where item i counts the pauses shorter than 2**i\n"
+"microseconds (the last item counts all longer ones).  Slices of\n"
+"incremental collection count for the oldest generation.\n");
+
+static PyObject *
+gc_get_stats(PyObject *self, PyObject *noargs)
+{
+    int i, j;
+    PyObject *result, *hist, *stats;
+
+    result = PyList_New(NUM_GENERATIONS);
+    if (result == NULL)
+        return NULL;
+    for (i = 0; i < NUM_GENERATIONS; i++) {
+        struct gc_generation_stats *st = &generation_stats[i];
+
+        hist = PyTuple_New(GC_PAUSE_BUCKETS);
+        if (hist == NULL)
+            goto error;
+        for (j = 0; j < GC_PAUSE_BUCKETS; j++) {
+            PyObject *v = PyInt_FromLong(st->pause_hist[j]);
+            if (v == NULL) {
+                Py_DECREF(hist);
+                goto error;
+            }
+            PyTuple_SET_ITEM(hist, j, v);
+        }
+        stats = Py_BuildValue("{slsnsnsnsdsdsN}",
+                              "collections", st->collections,
+                              "examined", st->examined,
+                              "collected", st->collected,
+                              "uncollectable", st->uncollectable,
+                              "total_time", st->total_ns * 1e-9,
+                              "max_pause", st->max_ns * 1e-9,
+                              "pause_histogram", hist);
+        if (stats == NULL)
+            goto error;
+        PyList_SET_ITEM(result, i, stats);
+    }
+    return result;
+
+  error:
+    Py_DECREF(result);
+    return NULL;
+}
+
 static int
 referrersvisit(PyObject* obj, PyObject *objs)
 {
@@ -1256,6 +2387,11 @@ gc_get_referrers(PyObject *self, PyObject *args)
             return NULL;
         }
     }
+    if (!(gc_referrers_for(args, &visited, result)) ||
+        !(gc_referrers_for(args, &permanent_generation, result))) {
+        Py_DECREF(result);
+        return NULL;
+    }
     return result;
 }
 
@@ -1317,6 +2453,11 @@ gc_get_objects(PyObject *self, PyObject *noargs)
             return NULL;
         }
     }
+    if (append_objects(result, &visited) ||
+        append_objects(result, &permanent_generation)) {
+        Py_DECREF(result);
+        return NULL;
+    }
     return result;
 }
 
@@ -1340,6 +2481,134 @@ gc_is_tracked(PyObject *self, PyObject *obj)
     return result;
 }
 
+PyDoc_STRVAR(gc_freeze__doc__,
+"freeze() -> None\n"
+"\n"
+"Move all objects tracked by the collector into a permanent generation\n"
+"that collections ignore.  Calling this after start-up, and before\n"
+"fork() on POSIX, keeps collections from touching the pages of those\n"
+"objects, which keeps them shared with the child processes.\n");
+
+static PyObject *
+gc_freeze(PyObject *self, PyObject *noargs)
+{
+    int i;
+    PyGC_Head *gc;
+
+    abandon_pass();
+    for (i = 0; i < NUM_GENERATIONS; i++) {
+        for (gc = GEN_HEAD(i)->gc.gc_next; gc != GEN_HEAD(i);
+             gc = gc->gc.gc_next)
+            gc->gc.gc_refs = GC_FROZEN;
+        gc_list_merge(GEN_HEAD(i), &permanent_generation);
+        generations[i].count = 0;
+    }
+    long_lived_total = 0;
+    long_lived_pending = 0;
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyDoc_STRVAR(gc_unfreeze__doc__,
+"unfreeze() -> None\n"
+"\n"
+"Move the objects of the permanent generation back into the oldest\n"
+"generation.\n");
+
+static PyObject *
+gc_unfreeze(PyObject *self, PyObject *noargs)
+{
+    PyGC_Head *gc;
+    Py_ssize_t n = 0;
+
+    for (gc = permanent_generation.gc.gc_next; gc != &permanent_generation;
+         gc = gc->gc.gc_next) {
+        gc->gc.gc_refs = GC_REACHABLE;
+        n++;
+    }
+    gc_list_merge(&permanent_generation, GEN_HEAD(NUM_GENERATIONS-1));
+    long_lived_total += n;
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyDoc_STRVAR(gc_get_freeze_count__doc__,
+"get_freeze_count() -> n\n"
+"\n"
+"Return the number of objects in the permanent generation.\n");
+
+static PyObject *
+gc_get_freeze_count(PyObject *self, PyObject *noargs)
+{
+    return PyInt_FromSsize_t(gc_list_size(&permanent_generation));
+}
+
+/* A traversal callback for immortalize_list.  Tracked objects are left to
+ * the walk of their list. */
+static int
+visit_immortalize(PyObject *op, void *data)
+{
+    if (_Py_IsImmortal(op))
+        return 0;
+    if (PyObject_IS_GC(op)) {
+        if (IS_TRACKED(op))
+            return 0;
+        _Py_SetImmortal(op);
+        (void) Py_TYPE(op)->tp_traverse(op, visit_immortalize, NULL);
+    }
+    else
+        _Py_SetImmortal(op);
+    return 0;
+}
+
+/* Make the objects in list and everything they refer to immortal, and
+ * untrack them.  Returns the number of objects untracked. */
+static Py_ssize_t
+immortalize_list(PyGC_Head *list)
+{
+    Py_ssize_t n = 0;
+
+    while (!gc_list_is_empty(list)) {
+        PyGC_Head *gc = list->gc.gc_next;
+        PyObject *op = FROM_GC(gc);
+        gc_list_remove(gc);
+        gc->gc.gc_refs = GC_UNTRACKED;
+        _Py_SetImmortal(op);
+        (void) Py_TYPE(op)->tp_traverse(op, visit_immortalize, NULL);
+        n++;
+    }
+    return n;
+}
+
+PyDoc_STRVAR(gc_immortalize__doc__,
+"immortalize() -> n\n"
+"\n"
+"Make all objects tracked by the collector, the objects they refer to,\n"
+"and all interned strings immortal:  they are never freed, and taking\n"
+"or dropping references to them no longer writes to them.  The tracked\n"
+"objects are untracked.  Calling this after start-up keeps threads from\n"
+"contending for the cache lines of shared objects, and keeps their pages\n"
+"shared with children after fork().\n"
+"Returns the number of objects untracked.  This can't be undone.\n");
+
+static PyObject *
+gc_immortalize(PyObject *self, PyObject *noargs)
+{
+    int i;
+    Py_ssize_t n = 0;
+
+    abandon_pass();
+    for (i = 0; i < NUM_GENERATIONS; i++) {
+        n += immortalize_list(GEN_HEAD(i));
+        generations[i].count = 0;
+    }
+    n += immortalize_list(&permanent_generation);
+    long_lived_total = 0;
+    long_lived_pending = 0;
+    (void)_PyString_ImmortalizeInterned();
+    return PyInt_FromSsize_t(n);
+}
+
 
 PyDoc_STRVAR(gc__doc__,
 "This module provides access to the garbage collector for reference cycles.\n"
@@ -1353,10 +2622,22 @@ PyDoc_STRVAR(gc__doc__,
 "get_debug() -- Get debugging flags.\n"
 "set_threshold() -- Set the collection thresholds.\n"
 "get_threshold() -- Return the current the collection thresholds.\n"
+"set_pause_budget() -- Set the time budget of incremental collection.\n"
+"get_pause_budget() -- Return the time budget of incremental collection.\n"
+"get_incremental_stats() -- Return statistics of incremental collection.\n"
+"get_stats() -- Return pause and object statistics for each generation.\n"
+"set_mark_threads() -- Set the number of threads marking in full collections.\n"
+"get_mark_threads() -- Return the number of threads marking in full collections.\n"
+"set_side_refs() -- Keep collection bookkeeping out of the objects.\n"
+"get_side_refs() -- Return true if collection bookkeeping is kept out of the objects.\n"
 "get_objects() -- Return a list of all objects tracked by the collector.\n"
 "is_tracked() -- Returns true if a given object is tracked.\n"
 "get_referrers() -- Return the list of objects that refer to an object.\n"
-"get_referents() -- Return the list of objects that an object refers to.\n");
+"get_referents() -- Return the list of objects that an object refers to.\n"
+"freeze() -- Freeze all tracked objects and ignore them for future collections.\n"
+"unfreeze() -- Unfreeze all objects in the permanent generation.\n"
+"get_freeze_count() -- Return the number of objects in the permanent generation.\n"
+"immortalize() -- Make all objects alive now immortal.\n");
 
 static PyMethodDef GcMethods[] = {
     {"enable",             gc_enable,     METH_NOARGS,  gc_enable__doc__},
@@ -1367,6 +2648,21 @@ static PyMethodDef GcMethods[] = {
     {"get_count",          gc_get_count,  METH_NOARGS,  gc_get_count__doc__},
     {"set_threshold",  gc_set_thresh, METH_VARARGS, gc_set_thresh__doc__},
     {"get_threshold",  gc_get_thresh, METH_NOARGS,  gc_get_thresh__doc__},
+    {"set_pause_budget", gc_set_pause_budget, METH_VARARGS,
+        gc_set_pause_budget__doc__},
+    {"get_pause_budget", gc_get_pause_budget, METH_NOARGS,
+        gc_get_pause_budget__doc__},
+    {"get_incremental_stats", gc_get_incremental_stats, METH_NOARGS,
+        gc_get_incremental_stats__doc__},
+    {"get_stats",      gc_get_stats,  METH_NOARGS,  gc_get_stats__doc__},
+    {"set_mark_threads", gc_set_mark_threads, METH_VARARGS,
+        gc_set_mark_threads__doc__},
+    {"get_mark_threads", gc_get_mark_threads, METH_NOARGS,
+        gc_get_mark_threads__doc__},
+    {"set_side_refs",  gc_set_side_refs, METH_VARARGS,
+        gc_set_side_refs__doc__},
+    {"get_side_refs",  gc_get_side_refs, METH_NOARGS,
+        gc_get_side_refs__doc__},
     {"collect",            (PyCFunction)gc_collect,
         METH_VARARGS | METH_KEYWORDS,           gc_collect__doc__},
     {"get_objects",    gc_get_objects,METH_NOARGS,  gc_get_objects__doc__},
@@ -1375,6 +2671,11 @@ static PyMethodDef GcMethods[] = {
         gc_get_referrers__doc__},
     {"get_referents",  gc_get_referents, METH_VARARGS,
         gc_get_referents__doc__},
+    {"freeze",         gc_freeze,     METH_NOARGS,  gc_freeze__doc__},
+    {"unfreeze",       gc_unfreeze,   METH_NOARGS,  gc_unfreeze__doc__},
+    {"get_freeze_count", gc_get_freeze_count, METH_NOARGS,
+        gc_get_freeze_count__doc__},
+    {"immortalize",    gc_immortalize, METH_NOARGS, gc_immortalize__doc__},
     {NULL,      NULL}           /* Sentinel */
 };
 
@@ -1400,6 +2701,15 @@ initgc(void)
     if (PyModule_AddObject(m, "garbage", garbage) < 0)
         return;
 
+    if (callbacks == NULL) {
+        callbacks = PyList_New(0);
+        if (callbacks == NULL)
+            return;
+    }
+    Py_INCREF(callbacks);
+    if (PyModule_AddObject(m, "callbacks", callbacks) < 0)
+        return;
+
     /* Importing can't be done in collect() because collect()
      * can be called via PyGC_Collect() in Py_Finalize().
      * This wouldn't be a problem, except that <initialized> is
@@ -1433,7 +2743,7 @@ PyGC_Collect(void)
         n = 0; /* already collecting, don't do anything */
     else {
         collecting = 1;
-        n = collect(NUM_GENERATIONS - 1);
+        n = collect_with_callback(NUM_GENERATIONS - 1, 0);
         collecting = 0;
     }
 
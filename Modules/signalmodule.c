@@ -175,7 +175,10 @@ trip_signal(int sig_num)
     /* Set is_tripped after setting .tripped, as it gets
        cleared in PyErr_CheckSignals() before .tripped. */
     is_tripped = 1;
-    Py_AddPendingCall(checksignals_witharg, NULL);
+    /* If the queue is full, let the next signal try again; .tripped is
+       kept, so this one gets handled then. */
+    if (Py_AddPendingCall(checksignals_witharg, NULL) < 0)
+        is_tripped = 0;
     if (wakeup_fd != -1)
         write(wakeup_fd, "\0", 1);
 }
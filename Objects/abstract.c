@@ -2524,9 +2524,23 @@ PyObject_Call(PyObject *func, PyObject *arg, PyObject *kw)
 
     if ((call = func->ob_type->tp_call) != NULL) {
         PyObject *result;
+        PyThreadState *tstate = PyThreadState_GET();
         if (Py_EnterRecursiveCall(" while calling a Python object"))
             return NULL;
-        result = (*call)(func, arg, kw);
+        if (tstate->use_tracing && tstate->c_profilefunc != NULL &&
+            PyCFunction_Check(func)) {
+            if (_PyEval_CallProfile(tstate, PyTrace_C_CALL, func) < 0)
+                result = NULL;
+            else {
+                result = (*call)(func, arg, kw);
+                if (_PyEval_CallProfile(tstate, result != NULL ?
+                                        PyTrace_C_RETURN :
+                                        PyTrace_C_EXCEPTION, func) < 0)
+                    Py_CLEAR(result);
+            }
+        }
+        else
+            result = (*call)(func, arg, kw);
         Py_LeaveRecursiveCall();
         if (result == NULL && !PyErr_Occurred())
             PyErr_SetString(
@@ -2738,6 +2752,128 @@ PyObject_CallMethodObjArgs(PyObject *callable, PyObject *name, ...)
     return tmp;
 }
 
+/* Return a tuple of self, if not NULL, followed by the nargs items of args */
+static PyObject *
+args_tuple(PyObject *self, PyObject **args, Py_ssize_t nargs)
+{
+    PyObject *result, *tmp;
+    Py_ssize_t i, skip = self != NULL;
+
+    result = PyTuple_New(nargs + skip);
+    if (result == NULL)
+        return NULL;
+    if (self != NULL) {
+        Py_INCREF(self);
+        PyTuple_SET_ITEM(result, 0, self);
+    }
+    for (i = 0; i < nargs; i++) {
+        tmp = args[i];
+        Py_INCREF(tmp);
+        PyTuple_SET_ITEM(result, i + skip, tmp);
+    }
+    return result;
+}
+
+/* Call the C function of descr on self, as the builtin method that descr
+   would bind to self would be called. */
+static PyObject *
+call_method_descr(PyMethodDescrObject *descr, PyObject *self,
+                  PyObject **args, Py_ssize_t nargs)
+{
+    PyMethodDef *ml = descr->d_method;
+    PyThreadState *tstate = PyThreadState_GET();
+    PyObject *func, *argtuple, *result;
+    int flags;
+
+    flags = ml->ml_flags & ~(METH_CLASS | METH_STATIC | METH_COEXIST);
+    /* Old-style argument passing, and calls the profiler should hear
+       about, go through the bound builtin method as usual. */
+    if ((flags != METH_NOARGS && flags != METH_O && flags != METH_VARARGS &&
+         flags != (METH_VARARGS | METH_KEYWORDS)) ||
+        (tstate->use_tracing && tstate->c_profilefunc != NULL)) {
+        func = PyCFunction_New(ml, self);
+        if (func == NULL)
+            return NULL;
+        argtuple = args_tuple(NULL, args, nargs);
+        if (argtuple == NULL)
+            result = NULL;
+        else {
+            result = PyObject_Call(func, argtuple, NULL);
+            Py_DECREF(argtuple);
+        }
+        Py_DECREF(func);
+        return result;
+    }
+
+    if (flags == METH_NOARGS && nargs != 0) {
+        PyErr_Format(PyExc_TypeError,
+            "%.200s() takes no arguments (%zd given)",
+            ml->ml_name, nargs);
+        return NULL;
+    }
+    if (flags == METH_O && nargs != 1) {
+        PyErr_Format(PyExc_TypeError,
+            "%.200s() takes exactly one argument (%zd given)",
+            ml->ml_name, nargs);
+        return NULL;
+    }
+    if (Py_EnterRecursiveCall(" while calling a Python object"))
+        return NULL;
+    if (flags == METH_NOARGS)
+        result = (*ml->ml_meth)(self, NULL);
+    else if (flags == METH_O)
+        result = (*ml->ml_meth)(self, args[0]);
+    else {
+        argtuple = args_tuple(NULL, args, nargs);
+        if (argtuple == NULL)
+            result = NULL;
+        else {
+            if (flags & METH_KEYWORDS)
+                result = (*(PyCFunctionWithKeywords)ml->ml_meth)(
+                    self, argtuple, NULL);
+            else
+                result = (*ml->ml_meth)(self, argtuple);
+            Py_DECREF(argtuple);
+        }
+    }
+    Py_LeaveRecursiveCall();
+    if (result == NULL && !PyErr_Occurred())
+        PyErr_SetString(PyExc_SystemError,
+                        "NULL result without error in PyObject_Call");
+    return result;
+}
+
+PyObject *
+_PyObject_CallMethodArray(PyObject *obj, PyObject *name,
+                          PyObject **args, Py_ssize_t nargs)
+{
+    PyObject *method, *argtuple, *result;
+    int unbound;
+
+    if (obj == NULL || name == NULL)
+        return null_error();
+
+    unbound = _PyObject_GetMethod(obj, name, &method);
+    if (method == NULL)
+        return NULL;
+    if (unbound && Py_TYPE(method) == &PyMethodDescr_Type)
+        result = call_method_descr((PyMethodDescrObject *)method, obj,
+                                   args, nargs);
+    else {
+        /* A function gets obj as its first argument instead of being
+           bound to it. */
+        argtuple = args_tuple(unbound ? obj : NULL, args, nargs);
+        if (argtuple == NULL)
+            result = NULL;
+        else {
+            result = PyObject_Call(method, argtuple, NULL);
+            Py_DECREF(argtuple);
+        }
+    }
+    Py_DECREF(method);
+    return result;
+}
+
 PyObject *
 PyObject_CallFunctionObjArgs(PyObject *callable, ...)
 {
@@ -192,11 +192,13 @@ PyTypeObject PyBool_Type = {
 
 /* Named Zero for link-level compatibility */
 PyIntObject _Py_ZeroStruct = {
-    PyObject_HEAD_INIT(&PyBool_Type)
+    _PyObject_EXTRA_INIT
+    _Py_IMMORTAL_REFCNT, &PyBool_Type,
     0
 };
 
 PyIntObject _Py_TrueStruct = {
-    PyObject_HEAD_INIT(&PyBool_Type)
+    _PyObject_EXTRA_INIT
+    _Py_IMMORTAL_REFCNT, &PyBool_Type,
     1
 };
@@ -3,6 +3,7 @@
 
 #include "Python.h"
 #include "structmember.h"
+#include "funcobject.h"
 
 /* Free list for method objects to save malloc/free overhead
  * The im_self element is used to chain the elements.
@@ -24,6 +25,92 @@ static PyObject *instance_getattr2(PyInstanceObject *, PyObject *);
 
 static PyObject *getattrstr, *setattrstr, *delattrstr;
 
+/* Lookup cache, like the method cache of types in typeobject.c.  An entry
+   holds what class_lookup() found for a name in a class, valid while
+   - the class keeps its version tag, which changes with its bases or its
+     dict object,
+   - the class's dict keeps its version tag, which changes with its
+     contents, and
+   - no dict of a class used as a base changes.  These dicts are watched
+     (see _PyDict_Watch()), and a change to any of them starts a new
+     generation of the cache.
+   The cache can keep references to the names alive for longer than they
+   normally would, so it only takes short ones. */
+#define CCACHE_MAX_ATTR_SIZE    100
+#define CCACHE_SIZE_EXP         10
+#define CCACHE_HASH(version, name)                                      \
+        (((unsigned int)(version) *                                     \
+          (unsigned int)((PyStringObject *)(name))->ob_shash)           \
+         >> (8*sizeof(unsigned int) - CCACHE_SIZE_EXP))
+#define CCACHE_CACHEABLE_NAME(name)                                     \
+        (PyString_CheckExact(name) &&                                   \
+         PyString_GET_SIZE(name) <= CCACHE_MAX_ATTR_SIZE)
+#define CLASS_DICT_VERSION(cp)                                          \
+        (((PyDictObject *)(cp)->cl_dict)->ma_version_tag)
+
+struct class_cache_entry {
+    unsigned int version;       /* of the class; 0 if unused */
+    unsigned int generation;
+    unsigned PY_LONG_LONG dict_version;
+    PyObject *name;             /* reference to exactly a str */
+    PyObject *value;            /* borrowed; NULL if not found */
+    PyClassObject *klass;       /* borrowed; where value was found */
+};
+
+static struct class_cache_entry class_cache[1 << CCACHE_SIZE_EXP];
+static unsigned int class_cache_generation = 0;
+static unsigned int next_class_version = 0;
+
+static void
+class_cache_clear(void)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < (1 << CCACHE_SIZE_EXP); i++) {
+        class_cache[i].version = 0;
+        Py_CLEAR(class_cache[i].name);
+        class_cache[i].value = NULL;
+    }
+}
+
+static void
+assign_version_tag(PyClassObject *c)
+{
+    c->cl_version_tag = ++next_class_version;
+    if (c->cl_version_tag == 0) {
+        /* Wrapped around:  tags of dead classes may come back. */
+        class_cache_clear();
+        c->cl_version_tag = ++next_class_version;
+    }
+}
+
+/* Invalidate the cache after a change to the bases or the dict object of
+   c, which subclasses see too. */
+static void
+class_modified(PyClassObject *c)
+{
+    assign_version_tag(c);
+    _PyClass_DictModified(NULL);
+}
+
+void
+_PyClass_DictModified(PyObject *dict)
+{
+    if (++class_cache_generation == 0)
+        class_cache_clear();
+}
+
+/* Make changes to the dicts of the bases invalidate the lookup cache */
+static void
+watch_bases(PyObject *bases)
+{
+    Py_ssize_t i, n;
+
+    n = PyTuple_GET_SIZE(bases);
+    for (i = 0; i < n; i++)
+        _PyDict_Watch(((PyClassObject *)PyTuple_GET_ITEM(bases, i))->cl_dict);
+}
+
 
 PyObject *
 PyClass_New(PyObject *bases, PyObject *dict, PyObject *name)
@@ -124,6 +211,9 @@ alloc_error:
     Py_XINCREF(name);
     op->cl_name = name;
     op->cl_weakreflist = NULL;
+    op->cl_cached_keys = _PyDict_NewKeysForClass();
+    assign_version_tag(op);
+    watch_bases(bases);
 
     op->cl_getattr = class_lookup(op, getattrstr, &dummy);
     op->cl_setattr = class_lookup(op, setattrstr, &dummy);
@@ -197,11 +287,13 @@ class_dealloc(PyClassObject *op)
     Py_XDECREF(op->cl_getattr);
     Py_XDECREF(op->cl_setattr);
     Py_XDECREF(op->cl_delattr);
+    if (op->cl_cached_keys != NULL)
+        _PyDictKeys_DecRef(op->cl_cached_keys);
     PyObject_GC_Del(op);
 }
 
 static PyObject *
-class_lookup(PyClassObject *cp, PyObject *name, PyClassObject **pclass)
+class_lookup_bases(PyClassObject *cp, PyObject *name, PyClassObject **pclass)
 {
     Py_ssize_t i, n;
     PyObject *value = PyDict_GetItem(cp->cl_dict, name);
@@ -212,7 +304,7 @@ class_lookup(PyClassObject *cp, PyObject *name, PyClassObject **pclass)
     n = PyTuple_Size(cp->cl_bases);
     for (i = 0; i < n; i++) {
         /* XXX What if one of the bases is not a class? */
-        PyObject *v = class_lookup(
+        PyObject *v = class_lookup_bases(
             (PyClassObject *)
             PyTuple_GetItem(cp->cl_bases, i), name, pclass);
         if (v != NULL)
@@ -221,6 +313,45 @@ class_lookup(PyClassObject *cp, PyObject *name, PyClassObject **pclass)
     return NULL;
 }
 
+static PyObject *
+class_lookup(PyClassObject *cp, PyObject *name, PyClassObject **pclass)
+{
+    struct class_cache_entry *entry;
+    unsigned int version, generation;
+    unsigned PY_LONG_LONG dict_version;
+    PyObject *value;
+
+    if (!CCACHE_CACHEABLE_NAME(name))
+        return class_lookup_bases(cp, name, pclass);
+    version = cp->cl_version_tag;
+    generation = class_cache_generation;
+    dict_version = CLASS_DICT_VERSION(cp);
+    entry = &class_cache[CCACHE_HASH(version, name)];
+    if (entry->version == version && entry->name == name &&
+        entry->dict_version == dict_version &&
+        entry->generation == generation) {
+        if (entry->value != NULL)
+            *pclass = entry->klass;
+        return entry->value;
+    }
+
+    value = class_lookup_bases(cp, name, pclass);
+    /* Comparing keys may have run code that changed some class. */
+    if (cp->cl_version_tag == version &&
+        class_cache_generation == generation &&
+        CLASS_DICT_VERSION(cp) == dict_version) {
+        entry->version = version;
+        entry->generation = generation;
+        entry->dict_version = dict_version;
+        entry->value = value;
+        entry->klass = value != NULL ? *pclass : NULL;
+        Py_INCREF(name);
+        Py_XDECREF(entry->name);
+        entry->name = name;
+    }
+    return value;
+}
+
 static PyObject *
 class_getattr(register PyClassObject *op, PyObject *name)
 {
@@ -298,6 +429,9 @@ set_dict(PyClassObject *c, PyObject *v)
     if (v == NULL || !PyDict_Check(v))
         return "__dict__ must be a dictionary object";
     set_slot(&c->cl_dict, v);
+    /* c may be a base of other classes */
+    _PyDict_Watch(v);
+    class_modified(c);
     set_attr_slots(c);
     return "";
 }
@@ -318,6 +452,8 @@ set_bases(PyClassObject *c, PyObject *v)
             return "a __bases__ item causes an inheritance cycle";
     }
     set_slot(&c->cl_bases, v);
+    watch_bases(v);
+    class_modified(c);
     set_attr_slots(c);
     return "";
 }
@@ -522,7 +658,7 @@ PyInstance_NewRaw(PyObject *klass, PyObject *dict)
         return NULL;
     }
     if (dict == NULL) {
-        dict = PyDict_New();
+        dict = _PyDict_NewShared(((PyClassObject *)klass)->cl_cached_keys);
         if (dict == NULL)
             return NULL;
     }
@@ -807,6 +943,39 @@ _PyInstance_Lookup(PyObject *pinst, PyObject *name)
     return v;
 }
 
+int
+_PyInstance_GetMethod(PyObject *pinst, PyObject *name, PyObject **method)
+{
+    PyInstanceObject *inst = (PyInstanceObject *)pinst;
+    PyClassObject *klass;
+    PyObject *v;
+    char *sname;
+
+    assert(PyInstance_Check(pinst));
+    if (!PyString_CheckExact(name))
+        goto getattr;
+    /* Names instance_getattr1() answers itself */
+    sname = PyString_AS_STRING(name);
+    if (sname[0] == '_' && sname[1] == '_' &&
+        (strcmp(sname, "__dict__") == 0 || strcmp(sname, "__class__") == 0))
+        goto getattr;
+    v = PyDict_GetItem(inst->in_dict, name);
+    if (v != NULL) {
+        Py_INCREF(v);
+        *method = v;
+        return 0;
+    }
+    v = class_lookup(inst->in_class, name, &klass);
+    if (v != NULL && PyFunction_Check(v)) {
+        Py_INCREF(v);
+        *method = v;
+        return 1;
+    }
+  getattr:
+    *method = PyObject_GetAttr(pinst, name);
+    return 0;
+}
+
 static int
 instance_setattr1(PyInstanceObject *inst, PyObject *name, PyObject *v)
 {
@@ -820,7 +989,8 @@ instance_setattr1(PyInstanceObject *inst, PyObject *name, PyObject *v)
         return rv;
     }
     else
-        return PyDict_SetItem(inst->in_dict, name, v);
+        return _PyDict_SetItemShared(&inst->in_class->cl_cached_keys,
+                                     inst->in_dict, name, v);
 }
 
 static int
@@ -2693,4 +2863,5 @@ void
 PyMethod_Fini(void)
 {
     (void)PyMethod_ClearFreeList();
+    class_cache_clear();
 }
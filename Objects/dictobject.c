@@ -134,21 +134,207 @@ practice, this probably won't make a lick of difference for many years (at
 which point everyone will have terabytes of RAM on 64-bit boxes).
 */
 
-/* Object used as dummy key to fill deleted entries */
-static PyObject *dummy = NULL; /* Initialized by first call to newPyDictObject() */
+/*
+The table is split in two.  The hash index, dk_indices, is a sparse array of
+dk_size small integers; each holds either DKIX_EMPTY, DKIX_DUMMY (a deleted
+slot, needed so probe sequences continue past it) or the position of a live
+entry in the entries array that follows it.  The entries array is dense:
+new items are appended to it, so iterating over it yields the items in
+insertion order, and at 2/3 load only 2/3 of dk_size entries are
+allocated.  Each index is 1, 2, 4 or 8 bytes wide, as dk_size requires, so
+for small and medium dicts the sparse part costs a byte or two per slot
+instead of a full PyDictEntry.
+
+A deleted item leaves its entry behind with me_key and me_value NULL.
+Entries are only ever appended, so dk_usable counts down to 0 as items are
+added, after which the next insertion rebuilds the table, compacting the
+entries (and growing the table unless enough deletions left it mostly
+empty).
+*/
+
+#define DKIX_EMPTY (-1)
+#define DKIX_DUMMY (-2)  /* Used internally */
+#define DKIX_ERROR (-3)
+#define DKIX_RESTART (-4)  /* See search_keys() */
+
+typedef Py_ssize_t (*dict_lookup_func)
+    (PyDictObject *mp, PyObject *key, long hash, Py_ssize_t *hashpos);
+
+struct _dictkeysobject {
+    /* Number of dicts (and classes) sharing this keys object.  Always 1
+       for a combined table. */
+    Py_ssize_t dk_refcnt;
+
+    /* Size of the hash index, dk_indices.  A power of 2. */
+    Py_ssize_t dk_size;
+
+    /* Function to lookup in the hash table (dk_indices):
+
+       - lookdict(): general-purpose, and may raise an exception
+       - lookdict_string(): specialized for string keys, never raises;
+         split tables always use it
+       - lookdict_int(): specialized for int keys, never raises
+       - lookdict_resizing(): searches this table and dk_old, while
+         the dict is being resized incrementally
+
+       Returns the position of the entry in the entries array, DKIX_EMPTY
+       if the key is not there, or DKIX_ERROR if a comparison raised. */
+    dict_lookup_func dk_lookup;
+
+    /* Number of entries that can still be appended to the entries array */
+    Py_ssize_t dk_usable;
+
+    /* Number of used entries in the entries array, deleted ones included */
+    Py_ssize_t dk_nentries;
+
+    /* While the table is being resized incrementally, the table it
+       replaces; NULL otherwise.  See resize_step(). */
+    struct _dictkeysobject *dk_old;
+
+    /* Actual hash table of dk_size indices, followed by the entries array
+       of USABLE_FRACTION(dk_size) PyDictEntry.  The width of an index
+       depends on dk_size:
+
+       - 1 byte if dk_size <= 0x80
+       - 2 bytes if dk_size <= 0x8000
+       - 4 bytes if dk_size <= 0x80000000
+       - 8 bytes otherwise */
+    union {
+        signed char as_1[8];
+        short as_2[4];
+        PY_INT32_T as_4[2];
+#if SIZEOF_VOID_P > 4
+        Py_ssize_t as_8[1];
+#endif
+    } dk_indices;
+};
 
+#define DK_SIZE(dk) ((dk)->dk_size)
+#define DK_MASK(dk) (DK_SIZE(dk) - 1)
+#if SIZEOF_VOID_P > 4
+#define DK_IXSIZE(dk)                           \
+    (DK_SIZE(dk) <= 0x80 ? 1 :                  \
+     DK_SIZE(dk) <= 0x8000 ? 2 :                \
+     DK_SIZE(dk) <= 0x80000000L ? 4 : 8)
+#else
+#define DK_IXSIZE(dk)                           \
+    (DK_SIZE(dk) <= 0x80 ? 1 :                  \
+     DK_SIZE(dk) <= 0x8000 ? 2 : 4)
+#endif
+#define DK_ENTRIES(dk) \
+    ((PyDictEntry *)((char *)&(dk)->dk_indices + \
+                     DK_SIZE(dk) * DK_IXSIZE(dk)))
+
+static void free_keys_object(PyDictKeysObject *keys);
+
+#define DK_INCREF(dk) ((dk)->dk_refcnt++)
+#define DK_DECREF(dk) do {                                              \
+    if (--(dk)->dk_refcnt == 0)                                         \
+        free_keys_object(dk);                                           \
+    } while (0)
+
+static void resize_step(PyDictObject *mp, Py_ssize_t n);
+
+/* Complete any incremental resize of mp, before reading its entries. */
+#define FINISH_RESIZE(mp) do {                                          \
+    if ((mp)->ma_keys->dk_old != NULL)                                  \
+        resize_step((mp), PY_SSIZE_T_MAX);                              \
+    } while (0)
+
+/* The value of entry i, in a combined or a split table. */
+#define DICT_VALUE(mp, i)                                               \
+    ((mp)->ma_values != NULL ? (mp)->ma_values[i] :                     \
+     DK_ENTRIES((mp)->ma_keys)[i].me_value)
+
+/* USABLE_FRACTION is the maximum dictionary load: the number of entries
+ * a table of size n can hold before it's rebuilt.  2/3 keeps the probe
+ * sequences short, as it always has.
+ */
+#define USABLE_FRACTION(n) (((n) << 1) / 3)
+
+/* ESTIMATE_SIZE is the inverse of USABLE_FRACTION: passed to dictresize(),
+ * it yields a table that holds n items without another rebuild.
+ */
+#define ESTIMATE_SIZE(n) (((n) * 3 + 1) >> 1)
+
+/* lookup indices.  returns DKIX_EMPTY, DKIX_DUMMY, or ix >= 0 */
+Py_LOCAL_INLINE(Py_ssize_t)
+dk_get_index(PyDictKeysObject *keys, Py_ssize_t i)
+{
+    Py_ssize_t s = DK_SIZE(keys);
+
+    if (s <= 0x80)
+        return keys->dk_indices.as_1[i];
+    else if (s <= 0x8000)
+        return keys->dk_indices.as_2[i];
+#if SIZEOF_VOID_P > 4
+    else if (s <= 0x80000000L)
+        return keys->dk_indices.as_4[i];
+    else
+        return keys->dk_indices.as_8[i];
+#else
+    else
+        return keys->dk_indices.as_4[i];
+#endif
+}
+
+/* write to indices. */
+Py_LOCAL_INLINE(void)
+dk_set_index(PyDictKeysObject *keys, Py_ssize_t i, Py_ssize_t ix)
+{
+    Py_ssize_t s = DK_SIZE(keys);
+
+    if (s <= 0x80)
+        keys->dk_indices.as_1[i] = (signed char)ix;
+    else if (s <= 0x8000)
+        keys->dk_indices.as_2[i] = (short)ix;
+#if SIZEOF_VOID_P > 4
+    else if (s <= 0x80000000L)
+        keys->dk_indices.as_4[i] = (PY_INT32_T)ix;
+    else
+        keys->dk_indices.as_8[i] = ix;
+#else
+    else
+        keys->dk_indices.as_4[i] = (PY_INT32_T)ix;
+#endif
+}
+
+/* forward declarations */
+static Py_ssize_t
+lookdict(PyDictObject *mp, PyObject *key, long hash, Py_ssize_t *hashpos);
+static Py_ssize_t
+lookdict_string(PyDictObject *mp, PyObject *key, long hash,
+                Py_ssize_t *hashpos);
+static Py_ssize_t
+lookdict_int(PyDictObject *mp, PyObject *key, long hash,
+             Py_ssize_t *hashpos);
+
+/* Every empty dict shares this keys object, so creating one doesn't
+   allocate a table; the first insertion replaces it with a real one.
+   It is never written to, and never freed. */
+static PyDictKeysObject empty_keys_struct = {
+    1,                                  /* dk_refcnt (never released) */
+    PyDict_MINSIZE,                     /* dk_size */
+    lookdict,                           /* dk_lookup */
+    0,                                  /* dk_usable (immutable) */
+    0,                                  /* dk_nentries */
+    NULL,                               /* dk_old */
+    {{DKIX_EMPTY, DKIX_EMPTY, DKIX_EMPTY, DKIX_EMPTY,
+      DKIX_EMPTY, DKIX_EMPTY, DKIX_EMPTY, DKIX_EMPTY}},   /* dk_indices */
+};
+
+#define Py_EMPTY_KEYS &empty_keys_struct
+
+/* There is no dummy key any more (deleted slots are DKIX_DUMMY indices),
+   so there are no dummy references to discount. */
 #ifdef Py_REF_DEBUG
 PyObject *
 _PyDict_Dummy(void)
 {
-    return dummy;
+    return NULL;
 }
 #endif
 
-/* forward declarations */
-static PyDictEntry *
-lookdict_string(PyDictObject *mp, PyObject *key, long hash);
-
 #ifdef SHOW_CONVERSION_COUNTS
 static long created = 0L;
 static long converted = 0L;
@@ -198,32 +384,49 @@ show_track(void)
 #endif
 
 
-/* Initialization macros.
+/* The source of ma_version_tag values.  Tags are handed out under the GIL,
+   and 0 is never one of them, so a zeroed cache never matches.  They are
+   even:  the low bit of ma_version_tag marks a watched dict. */
+static unsigned PY_LONG_LONG pydict_global_version = 0;
+
+#define DICT_NEXT_VERSION() (pydict_global_version += 2)
+
+#define DICT_WATCHED 1
+
+/* Give mp a new tag after a change to its contents, telling the watchers
+   if it is watched.  The only ones are classic classes, which watch the
+   dicts of their bases to keep their lookup cache valid. */
+#define DICT_MODIFIED(mp) do {                                          \
+        if ((mp)->ma_version_tag & DICT_WATCHED) {                      \
+            (mp)->ma_version_tag = DICT_NEXT_VERSION() | DICT_WATCHED;  \
+            _PyClass_DictModified((PyObject *)(mp));                    \
+        }                                                               \
+        else                                                            \
+            (mp)->ma_version_tag = DICT_NEXT_VERSION();                 \
+    } while (0)
+
+/* Initialization macro.
    There are two ways to create a dict:  PyDict_New() is the main C API
-   function, and the tp_new slot maps to dict_new().  In the latter case we
-   can save a little time over what PyDict_New does because it's guaranteed
-   that the PyDictObject struct is already zeroed out.
-   Everyone except dict_new() should use EMPTY_TO_MINSIZE (unless they have
-   an excellent reason not to).
+   function, and the tp_new slot maps to dict_new().  Both start out with
+   the shared empty keys object.
 */
 
-#define INIT_NONZERO_DICT_SLOTS(mp) do {                                \
-    (mp)->ma_table = (mp)->ma_smalltable;                               \
-    (mp)->ma_mask = PyDict_MINSIZE - 1;                                 \
+#define INIT_EMPTY_DICT(mp) do {                                        \
+    (mp)->ma_keys = Py_EMPTY_KEYS;                                      \
+    (mp)->ma_values = NULL;                                             \
+    (mp)->ma_used = 0;                                                  \
+    (mp)->ma_version_tag = DICT_NEXT_VERSION();                         \
     } while(0)
 
-#define EMPTY_TO_MINSIZE(mp) do {                                       \
-    memset((mp)->ma_smalltable, 0, sizeof((mp)->ma_smalltable));        \
-    (mp)->ma_used = (mp)->ma_fill = 0;                                  \
-    INIT_NONZERO_DICT_SLOTS(mp);                                        \
-    } while(0)
-
-/* Dictionary reuse scheme to save calls to malloc, free, and memset */
+/* Dictionary reuse scheme to save calls to malloc and free.  Keys objects
+   of the minimum size get a free list of their own. */
 #ifndef PyDict_MAXFREELIST
 #define PyDict_MAXFREELIST 80
 #endif
 static PyDictObject *free_list[PyDict_MAXFREELIST];
 static int numfree = 0;
+static PyDictKeysObject *keys_free_list[PyDict_MAXFREELIST];
+static int numfreekeys = 0;
 
 void
 PyDict_Fini(void)
@@ -235,16 +438,132 @@ PyDict_Fini(void)
         assert(PyDict_CheckExact(op));
         PyObject_GC_Del(op);
     }
+    while (numfreekeys)
+        PyObject_FREE(keys_free_list[--numfreekeys]);
+}
+
+/* Bytes needed for a keys object with a hash index of the given size. */
+static Py_ssize_t
+keys_nbytes(Py_ssize_t size)
+{
+    Py_ssize_t ixsize;
+
+    if (size <= 0x80)
+        ixsize = 1;
+    else if (size <= 0x8000)
+        ixsize = 2;
+#if SIZEOF_VOID_P > 4
+    else if (size <= 0x80000000L)
+        ixsize = 4;
+    else
+        ixsize = 8;
+#else
+    else
+        ixsize = 4;
+#endif
+    return (sizeof(PyDictKeysObject) - sizeof(((PyDictKeysObject *)0)->dk_indices)
+            + ixsize * size
+            + sizeof(PyDictEntry) * USABLE_FRACTION(size));
+}
+
+static PyDictKeysObject *
+new_keys_object(Py_ssize_t size)
+{
+    PyDictKeysObject *dk;
+    Py_ssize_t nbytes;
+
+    assert(size >= PyDict_MINSIZE);
+    assert((size & (size - 1)) == 0);
+    if (size == PyDict_MINSIZE && numfreekeys)
+        dk = keys_free_list[--numfreekeys];
+    else {
+        nbytes = keys_nbytes(size);
+        dk = (PyDictKeysObject *)PyObject_MALLOC(nbytes);
+        if (dk == NULL) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+    }
+    dk->dk_refcnt = 1;
+    dk->dk_size = size;
+    dk->dk_lookup = lookdict_string;
+    dk->dk_usable = USABLE_FRACTION(size);
+    dk->dk_nentries = 0;
+    dk->dk_old = NULL;
+    /* DKIX_EMPTY is all bits set at any index width.  The entries are
+       left alone:  nothing reads past dk_nentries. */
+    memset(&dk->dk_indices, 0xff, DK_IXSIZE(dk) * size);
+    return dk;
+}
+
+/* Release the storage of a keys object whose entries have been moved
+   elsewhere or released already. */
+static void
+dealloc_keys(PyDictKeysObject *keys)
+{
+    assert(keys != Py_EMPTY_KEYS);
+    assert(keys->dk_refcnt <= 1);
+    if (keys->dk_size == PyDict_MINSIZE && numfreekeys < PyDict_MAXFREELIST)
+        keys_free_list[numfreekeys++] = keys;
+    else
+        PyObject_FREE(keys);
+}
+
+/* Drop the references held by the entries, then release the storage.
+   The keys object must already be detached from its dict:  the decrefs
+   can run arbitrary code, which may mutate the dict.  Shared keys have no
+   values in their entries, only keys. */
+static void
+free_keys_object(PyDictKeysObject *keys)
+{
+    PyDictEntry *entries = DK_ENTRIES(keys);
+    Py_ssize_t i, n;
+
+    for (i = 0, n = keys->dk_nentries; i < n; i++) {
+        Py_XDECREF(entries[i].me_key);
+        Py_XDECREF(entries[i].me_value);
+    }
+    dealloc_keys(keys);
+}
+
+/* The values array of a split table.  It has room for all the entries
+   the shared keys can ever hold, so appending to them never outgrows it. */
+static PyObject **
+new_values(Py_ssize_t size)
+{
+    PyObject **values;
+
+    values = (PyObject **)PyObject_MALLOC(size * sizeof(PyObject *));
+    if (values == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    memset(values, 0, size * sizeof(PyObject *));
+    return values;
+}
+
+#define free_values(values) PyObject_FREE(values)
+
+/* Drop the values of a split table that has been detached from its dict,
+   then its share of the keys. */
+static void
+free_split_table(PyDictKeysObject *keys, PyObject **values)
+{
+    Py_ssize_t i, n;
+
+    for (i = 0, n = keys->dk_nentries; i < n; i++)
+        Py_XDECREF(values[i]);
+    free_values(values);
+    DK_DECREF(keys);
 }
 
 PyObject *
 PyDict_New(void)
 {
     register PyDictObject *mp;
-    if (dummy == NULL) { /* Auto-initialize dummy */
-        dummy = PyString_FromString("<dummy key>");
-        if (dummy == NULL)
-            return NULL;
+    static int initialized = 0;
+    if (!initialized) {
+        initialized = 1;
 #ifdef SHOW_CONVERSION_COUNTS
         Py_AtExit(show_counts);
 #endif
@@ -260,16 +579,6 @@ PyDict_New(void)
         assert (mp != NULL);
         assert (Py_TYPE(mp) == &PyDict_Type);
         _Py_NewReference((PyObject *)mp);
-        if (mp->ma_fill) {
-            EMPTY_TO_MINSIZE(mp);
-        } else {
-            /* At least set ma_table and ma_mask; these are wrong
-               if an empty but presized dict is added to freelist */
-            INIT_NONZERO_DICT_SLOTS(mp);
-        }
-        assert (mp->ma_used == 0);
-        assert (mp->ma_table == mp->ma_smalltable);
-        assert (mp->ma_mask == PyDict_MINSIZE - 1);
 #ifdef SHOW_ALLOC_COUNT
         count_reuse++;
 #endif
@@ -277,12 +586,11 @@ PyDict_New(void)
         mp = PyObject_GC_New(PyDictObject, &PyDict_Type);
         if (mp == NULL)
             return NULL;
-        EMPTY_TO_MINSIZE(mp);
 #ifdef SHOW_ALLOC_COUNT
         count_alloc++;
 #endif
     }
-    mp->ma_lookup = lookdict_string;
+    INIT_EMPTY_DICT(mp);
 #ifdef SHOW_TRACK_COUNT
     count_untracked++;
 #endif
@@ -292,6 +600,28 @@ PyDict_New(void)
     return (PyObject *)mp;
 }
 
+/* Search the index of the entry at position ix; used when the entry is
+   already known, as in popitem(). */
+static Py_ssize_t
+lookdict_index(PyDictKeysObject *k, long hash, Py_ssize_t index)
+{
+    register size_t i;
+    register size_t perturb;
+    size_t mask = (size_t)DK_MASK(k);
+    Py_ssize_t ix;
+
+    i = (size_t)hash & mask;
+    for (perturb = hash; ; perturb >>= PERTURB_SHIFT) {
+        ix = dk_get_index(k, i);
+        if (ix == index)
+            return i;
+        assert(ix != DKIX_EMPTY);
+        i = ((i << 2) + i + perturb + 1) & mask;
+    }
+    assert(0);          /* NOT REACHED */
+    return DKIX_ERROR;
+}
+
 /*
 The basic lookup function used by all operations.
 This is based on Algorithm D from Knuth Vol. 3, Sec. 6.4.
@@ -307,89 +637,86 @@ All arithmetic on hash should ignore overflow.
 contributions by Reimer Behrends, Jyrki Alakuijala, Vladimir Marangozov and
 Christian Tismer).
 
-lookdict() is general-purpose, and may return NULL if (and only if) a
+lookdict() is general-purpose, and may return DKIX_ERROR if (and only if) a
 comparison raises an exception (this was new in Python 2.5).
 lookdict_string() below is specialized to string keys, comparison of which can
-never raise an exception; that function can never return NULL.  For both, when
-the key isn't found a PyDictEntry* is returned for which the me_value field is
-NULL; this is the slot in the dict at which the key would have been found, and
-the caller can (if it wishes) add the <key, value> pair to the returned
-PyDictEntry*.
+never raise an exception; that function never returns DKIX_ERROR, and neither
+does lookdict_int(), which does the same for int keys.  All of them
+return the position of the key's entry in DK_ENTRIES(mp->ma_keys), or
+DKIX_EMPTY when the key isn't found.  If hashpos isn't NULL, *hashpos is set
+to the slot of the hash index holding the entry's position or, when the key
+isn't found, to the slot where it should be stored on insertion.
 */
-static PyDictEntry *
-lookdict(PyDictObject *mp, PyObject *key, register long hash)
+static Py_ssize_t
+lookdict(PyDictObject *mp, PyObject *key, register long hash,
+         Py_ssize_t *hashpos)
 {
     register size_t i;
     register size_t perturb;
-    register PyDictEntry *freeslot;
-    register size_t mask = (size_t)mp->ma_mask;
-    PyDictEntry *ep0 = mp->ma_table;
-    register PyDictEntry *ep;
+    register Py_ssize_t ix, freeslot;
     register int cmp;
+    register PyDictEntry *ep;
+    PyDictKeysObject *dk;
+    PyDictEntry *ep0;
+    size_t mask;
     PyObject *startkey;
 
+  top:
+    dk = mp->ma_keys;
+    mask = (size_t)DK_MASK(dk);
+    ep0 = DK_ENTRIES(dk);
+    freeslot = -1;
     i = (size_t)hash & mask;
-    ep = &ep0[i];
-    if (ep->me_key == NULL || ep->me_key == key)
-        return ep;
-
-    if (ep->me_key == dummy)
-        freeslot = ep;
-    else {
-        if (ep->me_hash == hash) {
-            startkey = ep->me_key;
-            Py_INCREF(startkey);
-            cmp = PyObject_RichCompareBool(startkey, key, Py_EQ);
-            Py_DECREF(startkey);
-            if (cmp < 0)
-                return NULL;
-            if (ep0 == mp->ma_table && ep->me_key == startkey) {
-                if (cmp > 0)
-                    return ep;
-            }
-            else {
-                /* The compare did major nasty stuff to the
-                 * dict:  start over.
-                 * XXX A clever adversary could prevent this
-                 * XXX from terminating.
-                 */
-                return lookdict(mp, key, hash);
-            }
-        }
-        freeslot = NULL;
-    }
 
-    /* In the loop, me_key == dummy is by far (factor of 100s) the
-       least likely outcome, so test for that last. */
+    /* In the loop, DKIX_DUMMY is by far (factor of 100s) the least likely
+       outcome, so test for that last. */
     for (perturb = hash; ; perturb >>= PERTURB_SHIFT) {
-        i = (i << 2) + i + perturb + 1;
-        ep = &ep0[i & mask];
-        if (ep->me_key == NULL)
-            return freeslot == NULL ? ep : freeslot;
-        if (ep->me_key == key)
-            return ep;
-        if (ep->me_hash == hash && ep->me_key != dummy) {
-            startkey = ep->me_key;
-            Py_INCREF(startkey);
-            cmp = PyObject_RichCompareBool(startkey, key, Py_EQ);
-            Py_DECREF(startkey);
-            if (cmp < 0)
-                return NULL;
-            if (ep0 == mp->ma_table && ep->me_key == startkey) {
-                if (cmp > 0)
-                    return ep;
+        ix = dk_get_index(dk, i);
+        if (ix == DKIX_EMPTY) {
+            if (hashpos != NULL)
+                *hashpos = (freeslot == -1) ? (Py_ssize_t)i : freeslot;
+            return DKIX_EMPTY;
+        }
+        if (ix >= 0) {
+            ep = &ep0[ix];
+            assert(ep->me_key != NULL);
+            if (ep->me_key == key) {
+                if (hashpos != NULL)
+                    *hashpos = i;
+                return ix;
             }
-            else {
-                /* The compare did major nasty stuff to the
-                 * dict:  start over.
-                 * XXX A clever adversary could prevent this
-                 * XXX from terminating.
-                 */
-                return lookdict(mp, key, hash);
+            if (ep->me_hash == hash) {
+                startkey = ep->me_key;
+                Py_INCREF(startkey);
+                cmp = PyObject_RichCompareBool(startkey, key, Py_EQ);
+                Py_DECREF(startkey);
+                if (cmp < 0)
+                    return DKIX_ERROR;
+                if (dk == mp->ma_keys && ep->me_key == startkey) {
+                    if (cmp > 0) {
+                        if (hashpos != NULL)
+                            *hashpos = i;
+                        return ix;
+                    }
+                }
+                else {
+                    /* The compare did major nasty stuff to the
+                     * dict:  start over.  The table may not even be
+                     * ours to search any more, if it started being
+                     * resized.
+                     * XXX A clever adversary could prevent this
+                     * XXX from terminating.
+                     */
+                    if (mp->ma_keys->dk_lookup != lookdict)
+                        return mp->ma_keys->dk_lookup(mp, key, hash,
+                                                      hashpos);
+                    goto top;
+                }
             }
         }
-        else if (ep->me_key == dummy && freeslot == NULL)
-            freeslot = ep;
+        else if (freeslot == -1)
+            freeslot = i;
+        i = ((i << 2) + i + perturb + 1) & mask;
     }
     assert(0);          /* NOT REACHED */
     return 0;
@@ -404,58 +731,134 @@ lookdict(PyDictObject *mp, PyObject *key, register long hash)
  *
  * This is valuable because dicts with only string keys are very common.
  */
-static PyDictEntry *
-lookdict_string(PyDictObject *mp, PyObject *key, register long hash)
+static Py_ssize_t
+lookdict_string(PyDictObject *mp, PyObject *key, register long hash,
+                Py_ssize_t *hashpos)
 {
     register size_t i;
     register size_t perturb;
-    register PyDictEntry *freeslot;
-    register size_t mask = (size_t)mp->ma_mask;
-    PyDictEntry *ep0 = mp->ma_table;
+    register Py_ssize_t ix, freeslot;
     register PyDictEntry *ep;
+    PyDictKeysObject *dk = mp->ma_keys;
+    size_t mask = (size_t)DK_MASK(dk);
+    PyDictEntry *ep0 = DK_ENTRIES(dk);
 
     /* Make sure this function doesn't have to handle non-string keys,
        including subclasses of str; e.g., one reason to subclass
        strings is to override __eq__, and for speed we don't cater to
        that here. */
     if (!PyString_CheckExact(key)) {
+        /* Shared keys stay string-specialized for the other dicts. */
+        if (mp->ma_values != NULL)
+            return lookdict(mp, key, hash, hashpos);
+        /* A table with no keys yet can go to ints instead. */
+        if (PyInt_CheckExact(key) && dk->dk_nentries == 0) {
+            dk->dk_lookup = lookdict_int;
+            return lookdict_int(mp, key, hash, hashpos);
+        }
 #ifdef SHOW_CONVERSION_COUNTS
         ++converted;
 #endif
-        mp->ma_lookup = lookdict;
-        return lookdict(mp, key, hash);
+        dk->dk_lookup = lookdict;
+        return lookdict(mp, key, hash, hashpos);
     }
-    i = hash & mask;
-    ep = &ep0[i];
-    if (ep->me_key == NULL || ep->me_key == key)
-        return ep;
-    if (ep->me_key == dummy)
-        freeslot = ep;
-    else {
-        if (ep->me_hash == hash && _PyString_Eq(ep->me_key, key))
-            return ep;
-        freeslot = NULL;
+    freeslot = -1;
+    i = (size_t)hash & mask;
+    for (perturb = hash; ; perturb >>= PERTURB_SHIFT) {
+        ix = dk_get_index(dk, i);
+        if (ix == DKIX_EMPTY) {
+            if (hashpos != NULL)
+                *hashpos = (freeslot == -1) ? (Py_ssize_t)i : freeslot;
+            return DKIX_EMPTY;
+        }
+        if (ix >= 0) {
+            ep = &ep0[ix];
+            if (ep->me_key == key
+                || (ep->me_hash == hash && _PyString_Eq(ep->me_key, key))) {
+                if (hashpos != NULL)
+                    *hashpos = i;
+                return ix;
+            }
+        }
+        else if (freeslot == -1)
+            freeslot = i;
+        i = ((i << 2) + i + perturb + 1) & mask;
     }
+    assert(0);          /* NOT REACHED */
+    return 0;
+}
+
+/*
+ * Another hacked up version of lookdict, for dicts whose keys are all ints:
+ * tables keyed by ids and counters are common too.  Ints are equal when
+ * their values are, so there is no need to call PyObject_RichCompareBool()
+ * and nothing can raise.  As with strings, subclasses of int are left to
+ * lookdict(), which the table switches to for good on the first key that
+ * isn't an int.
+ */
+static Py_ssize_t
+lookdict_int(PyDictObject *mp, PyObject *key, register long hash,
+             Py_ssize_t *hashpos)
+{
+    register size_t i;
+    register size_t perturb;
+    register Py_ssize_t ix, freeslot;
+    register PyDictEntry *ep;
+    register long ival;
+    PyDictKeysObject *dk = mp->ma_keys;
+    size_t mask = (size_t)DK_MASK(dk);
+    PyDictEntry *ep0 = DK_ENTRIES(dk);
 
-    /* In the loop, me_key == dummy is by far (factor of 100s) the
-       least likely outcome, so test for that last. */
+    assert(mp->ma_values == NULL);
+    if (!PyInt_CheckExact(key)) {
+#ifdef SHOW_CONVERSION_COUNTS
+        ++converted;
+#endif
+        dk->dk_lookup = lookdict;
+        return lookdict(mp, key, hash, hashpos);
+    }
+    ival = PyInt_AS_LONG(key);
+    freeslot = -1;
+    i = (size_t)hash & mask;
     for (perturb = hash; ; perturb >>= PERTURB_SHIFT) {
-        i = (i << 2) + i + perturb + 1;
-        ep = &ep0[i & mask];
-        if (ep->me_key == NULL)
-            return freeslot == NULL ? ep : freeslot;
-        if (ep->me_key == key
-            || (ep->me_hash == hash
-            && ep->me_key != dummy
-            && _PyString_Eq(ep->me_key, key)))
-            return ep;
-        if (ep->me_key == dummy && freeslot == NULL)
-            freeslot = ep;
+        ix = dk_get_index(dk, i);
+        if (ix == DKIX_EMPTY) {
+            if (hashpos != NULL)
+                *hashpos = (freeslot == -1) ? (Py_ssize_t)i : freeslot;
+            return DKIX_EMPTY;
+        }
+        if (ix >= 0) {
+            ep = &ep0[ix];
+            if (ep->me_key == key
+                || (ep->me_hash == hash && PyInt_AS_LONG(ep->me_key) == ival)) {
+                if (hashpos != NULL)
+                    *hashpos = i;
+                return ix;
+            }
+        }
+        else if (freeslot == -1)
+            freeslot = i;
+        i = ((i << 2) + i + perturb + 1) & mask;
     }
     assert(0);          /* NOT REACHED */
     return 0;
 }
 
+/* Switch dk away from a specialized lookup function that can't handle
+   key, which is about to be stored in it, or looked up in it, without
+   going through that function. */
+Py_LOCAL_INLINE(void)
+lookup_accept_key(PyDictKeysObject *dk, PyObject *key)
+{
+    if (dk->dk_lookup == lookdict_string) {
+        if (!PyString_CheckExact(key))
+            dk->dk_lookup = (PyInt_CheckExact(key) && dk->dk_nentries == 0)
+                            ? lookdict_int : lookdict;
+    }
+    else if (dk->dk_lookup == lookdict_int && !PyInt_CheckExact(key))
+        dk->dk_lookup = lookdict;
+}
+
 #ifdef SHOW_TRACK_COUNT
 #define INCREASE_TRACK_COUNT \
     (count_tracked++, count_untracked--);
@@ -482,17 +885,22 @@ _PyDict_MaybeUntrack(PyObject *op)
 {
     PyDictObject *mp;
     PyObject *value;
-    Py_ssize_t mask, i;
+    Py_ssize_t i, n;
     PyDictEntry *ep;
 
     if (!PyDict_CheckExact(op) || !_PyObject_GC_IS_TRACKED(op))
         return;
 
     mp = (PyDictObject *) op;
-    ep = mp->ma_table;
-    mask = mp->ma_mask;
-    for (i = 0; i <= mask; i++) {
-        if ((value = ep[i].me_value) == NULL)
+    /* A dict being resized is big, and likely to hold some container:
+       it stays tracked rather than have the collector finish the
+       resize. */
+    if (mp->ma_keys->dk_old != NULL)
+        return;
+    ep = DK_ENTRIES(mp->ma_keys);
+    n = mp->ma_keys->dk_nentries;
+    for (i = 0; i < n; i++) {
+        if ((value = DICT_VALUE(mp, i)) == NULL)
             continue;
         if (_PyObject_GC_MAY_BE_TRACKED(value) ||
             _PyObject_GC_MAY_BE_TRACKED(ep[i].me_key))
@@ -502,108 +910,451 @@ _PyDict_MaybeUntrack(PyObject *op)
     _PyObject_GC_UNTRACK(op);
 }
 
+/* Internal function to find the slot for an item from its hash when it is
+   known that the key is not present in the table.  The first DKIX_EMPTY
+   slot of the probe sequence will do, even if DKIX_DUMMY slots come
+   before it. */
+static Py_ssize_t
+find_empty_slot(PyDictKeysObject *keys, long hash)
+{
+    register size_t i;
+    register size_t perturb;
+    size_t mask = (size_t)DK_MASK(keys);
+
+    i = (size_t)hash & mask;
+    for (perturb = hash; dk_get_index(keys, i) != DKIX_EMPTY;
+         perturb >>= PERTURB_SHIFT)
+        i = ((i << 2) + i + perturb + 1) & mask;
+    return i;
+}
+
+/*
+Incremental resizing.  Rebuilding the table of a huge dict in one go stalls
+the program for as long as it takes to rehash every entry, so dictresize()
+only allocates the new table when the old one has INCREMENTAL_RESIZE_MIN
+entries or more, and hangs the old table off it, in dk_old.  The entries
+are then moved over a few at a time, keeping their positions:  the new
+table reserves the first dk_nentries of the old one for them, and new items
+are appended after those.
+
+Each lookup, and so each insertion, moves the next RESIZE_STEP entries,
+then searches both tables.  A key found in the old table has its entry
+moved there and then, so every position a lookup returns is one in
+ma_keys.  Apart from lookups, dict_traverse() and dict_next_item(),
+nothing may read the entries of a dict being resized; FINISH_RESIZE()
+must come first.
+RESIZE_STEP is large enough that the resize is done before the entries
+reserved for new items run out.
+
+Moving an entry copies it, and leaves the old one alone, so the old hash
+index needn't be updated.  Positions below DK_MOVED() are skipped when
+searching the old table instead.  An entry moved out of turn is cleared
+and marked with ENTRY_MOVED, and its old index slot becomes a DKIX_DUMMY.
+*/
+#ifndef INCREMENTAL_RESIZE_MIN
+#define INCREMENTAL_RESIZE_MIN 100000
+#endif
+#ifndef RESIZE_STEP
+#define RESIZE_STEP 8
+#endif
+
+/* The old table has no room to offer:  its dk_usable counts the entries
+   moved so far instead. */
+#define DK_MOVED(oldkeys) ((oldkeys)->dk_usable)
+
+/* me_hash of a cleared old entry whose item was moved out of turn.  No
+   hash is ever -1. */
+#define ENTRY_MOVED (-1)
+
+/* Move up to n more entries of a dict being resized to its new table, and
+   release the old table once they're all there. */
+static void
+resize_step(PyDictObject *mp, Py_ssize_t n)
+{
+    PyDictKeysObject *newkeys = mp->ma_keys;
+    PyDictKeysObject *oldkeys = newkeys->dk_old;
+    PyDictEntry *oldep = DK_ENTRIES(oldkeys);
+    PyDictEntry *newep = DK_ENTRIES(newkeys);
+    Py_ssize_t i = DK_MOVED(oldkeys);
+    Py_ssize_t end = oldkeys->dk_nentries;
+
+    if (end - i > n)
+        end = i + n;
+    for (; i < end; i++) {
+        if (oldep[i].me_value != NULL) {
+            newep[i] = oldep[i];
+            dk_set_index(newkeys,
+                         find_empty_slot(newkeys, (long)oldep[i].me_hash),
+                         i);
+        }
+        else if (oldep[i].me_hash != ENTRY_MOVED) {
+            /* Deleted before the resize started.  The hash must not
+               pass for ENTRY_MOVED in the next resize. */
+            newep[i].me_hash = 0;
+            newep[i].me_key = NULL;
+            newep[i].me_value = NULL;
+        }
+    }
+    DK_MOVED(oldkeys) = i;
+    if (i == oldkeys->dk_nentries) {
+        /* The old table's lookup function was kept up to date with the
+           keys inserted since. */
+        newkeys->dk_lookup = oldkeys->dk_lookup;
+        newkeys->dk_old = NULL;
+        dealloc_keys(oldkeys);
+    }
+}
+
+/* Entries moved out of turn, by all dicts.  A lookup that ran arbitrary
+   code checks it hasn't changed, as that code may have moved its key. */
+static size_t moved_out_of_turn = 0;
+
+/* Search dk, the new or the old table of mp, which is being resized, for
+   key, like lookdict() does.  DKIX_RESTART means that a comparison changed
+   the dict so much that the search must start over. */
+static Py_ssize_t
+search_keys(PyDictObject *mp, PyDictKeysObject *newkeys,
+            PyDictKeysObject *dk, PyObject *key, long hash,
+            Py_ssize_t *hashpos)
+{
+    register size_t i;
+    register size_t perturb;
+    register Py_ssize_t ix, freeslot;
+    register PyDictEntry *ep;
+    PyDictKeysObject *oldkeys = newkeys->dk_old;
+    PyDictEntry *ep0 = DK_ENTRIES(dk);
+    size_t mask = (size_t)DK_MASK(dk);
+    PyObject *startkey;
+    int cmp;
+
+    freeslot = -1;
+    i = (size_t)hash & mask;
+    for (perturb = hash; ; perturb >>= PERTURB_SHIFT) {
+        ix = dk_get_index(dk, i);
+        if (ix == DKIX_EMPTY) {
+            *hashpos = (freeslot == -1) ? (Py_ssize_t)i : freeslot;
+            return DKIX_EMPTY;
+        }
+        /* Entries of the old table below DK_MOVED() belong to the new
+           one now, which may have deleted them already. */
+        if (ix >= 0 && (dk == newkeys || ix >= DK_MOVED(oldkeys))) {
+            ep = &ep0[ix];
+            if (ep->me_key == key) {
+                *hashpos = i;
+                return ix;
+            }
+            if (ep->me_hash == hash) {
+                startkey = ep->me_key;
+                if (PyString_CheckExact(startkey) &&
+                    PyString_CheckExact(key))
+                    cmp = _PyString_Eq(startkey, key);
+                else if (PyInt_CheckExact(startkey) && PyInt_CheckExact(key))
+                    cmp = PyInt_AS_LONG(startkey) == PyInt_AS_LONG(key);
+                else {
+                    Py_INCREF(startkey);
+                    cmp = PyObject_RichCompareBool(startkey, key, Py_EQ);
+                    Py_DECREF(startkey);
+                    if (cmp < 0)
+                        return DKIX_ERROR;
+                    if (mp->ma_keys != newkeys ||
+                        newkeys->dk_old != oldkeys ||
+                        ep->me_key != startkey)
+                        return DKIX_RESTART;
+                }
+                if (cmp > 0) {
+                    *hashpos = i;
+                    return ix;
+                }
+            }
+        }
+        else if (ix == DKIX_DUMMY && freeslot == -1)
+            freeslot = i;
+        i = ((i << 2) + i + perturb + 1) & mask;
+    }
+    assert(0);          /* NOT REACHED */
+    return 0;
+}
+
+static Py_ssize_t
+lookdict_resizing(PyDictObject *mp, PyObject *key, long hash,
+                  Py_ssize_t *hashpos)
+{
+    PyDictKeysObject *newkeys, *oldkeys;
+    PyDictEntry *oldep;
+    Py_ssize_t ix, pos, oldpos, moved;
+    unsigned PY_LONG_LONG version;
+    size_t out_of_turn;
+
+  top:
+    if (mp->ma_keys->dk_lookup != lookdict_resizing)
+        return mp->ma_keys->dk_lookup(mp, key, hash, hashpos);
+    resize_step(mp, RESIZE_STEP);
+    newkeys = mp->ma_keys;
+    oldkeys = newkeys->dk_old;
+    if (oldkeys == NULL)
+        return newkeys->dk_lookup(mp, key, hash, hashpos);
+    /* The old table's lookup function is handed on to the new table. */
+    lookup_accept_key(oldkeys, key);
+
+    version = mp->ma_version_tag;
+    moved = DK_MOVED(oldkeys);
+    out_of_turn = moved_out_of_turn;
+    ix = search_keys(mp, newkeys, newkeys, key, hash, &pos);
+    if (ix == DKIX_RESTART)
+        goto top;
+    if (ix != DKIX_EMPTY) {
+        if (ix >= 0 && hashpos != NULL)
+            *hashpos = pos;
+        return ix;
+    }
+    ix = search_keys(mp, newkeys, oldkeys, key, hash, &oldpos);
+    if (ix == DKIX_RESTART)
+        goto top;
+    if (ix == DKIX_ERROR)
+        return ix;
+    /* Unless comparisons changed the dict, or moved the key into the new
+       table, pos is still the place for it there. */
+    if (mp->ma_version_tag != version || DK_MOVED(oldkeys) != moved ||
+        moved_out_of_turn != out_of_turn)
+        goto top;
+    if (ix >= 0) {
+        /* Found in the old table:  move the entry now, out of turn. */
+        oldep = &DK_ENTRIES(oldkeys)[ix];
+        DK_ENTRIES(newkeys)[ix] = *oldep;
+        dk_set_index(newkeys, pos, ix);
+        dk_set_index(oldkeys, oldpos, DKIX_DUMMY);
+        oldep->me_key = NULL;
+        oldep->me_value = NULL;
+        oldep->me_hash = ENTRY_MOVED;
+        moved_out_of_turn++;
+    }
+    if (hashpos != NULL)
+        *hashpos = pos;
+    return ix;
+}
+
+/* Start resizing mp, whose table has many entries, to newsize, unless the
+   new table can't take enough insertions for the resize to be done before
+   it fills up (because most of the old entries are deleted ones).  Return
+   1 if the resize was started, 0 if a full rebuild is needed, -1 on
+   error. */
+static int
+start_resize(PyDictObject *mp, Py_ssize_t newsize)
+{
+    PyDictKeysObject *oldkeys = mp->ma_keys, *newkeys;
+    Py_ssize_t reserved = oldkeys->dk_nentries;
+
+    if ((USABLE_FRACTION(newsize) - reserved) * RESIZE_STEP < reserved)
+        return 0;
+    newkeys = new_keys_object(newsize);
+    if (newkeys == NULL)
+        return -1;
+    newkeys->dk_lookup = lookdict_resizing;
+    newkeys->dk_usable -= reserved;
+    newkeys->dk_nentries = reserved;
+    newkeys->dk_old = oldkeys;
+    DK_MOVED(oldkeys) = 0;
+    mp->ma_keys = newkeys;
+    return 1;
+}
+
+static int dictresize(PyDictObject *mp, Py_ssize_t minused);
+
 /*
-Internal routine to insert a new item into the table when you have entry object.
-Used by insertdict.
+Restructure the table when the entries array is full.  Quadrupling the
+size improves average dictionary sparseness (reducing collisions) at the
+cost of some memory.  It also halves the number of expensive resize
+operations in a growing dictionary.  Very large dictionaries (over 50K
+items) use doubling instead; this may help applications with severe memory
+constraints.  When many items have been deleted, the new table may be no
+larger than the old one; the rebuild then only compacts the entries.
 */
 static int
-insertdict_by_entry(register PyDictObject *mp, PyObject *key, long hash,
-                    PyDictEntry *ep, PyObject *value)
+insertion_resize(PyDictObject *mp)
 {
-    PyObject *old_value;
+    return dictresize(mp, (mp->ma_used > 50000 ? 2 : 4) * mp->ma_used);
+}
+
+/*
+Internal routine to append a new item to the entries when the key is known
+to be absent; hashpos is the slot of the hash index found for it by the
+lookup, and is ignored if the table must be rebuilt first.
+Eats a reference to key and one to value.
+Returns -1 if an error occurred, or 0 on success.
+*/
+static int
+insert_new_entry(register PyDictObject *mp, PyObject *key, long hash,
+                 Py_ssize_t hashpos, PyObject *value)
+{
+    PyDictKeysObject *dk;
+    PyDictEntry *ep;
 
+    assert(mp->ma_values == NULL);
+    if (mp->ma_keys->dk_usable <= 0) {
+        if (insertion_resize(mp) != 0) {
+            Py_DECREF(key);
+            Py_DECREF(value);
+            return -1;
+        }
+        hashpos = find_empty_slot(mp->ma_keys, hash);
+        /* The first table of an empty dict starts out string-specialized,
+           and this key didn't go through its lookup function. */
+        if (mp->ma_keys->dk_old != NULL)
+            lookup_accept_key(mp->ma_keys->dk_old, key);
+        else
+            lookup_accept_key(mp->ma_keys, key);
+    }
     MAINTAIN_TRACKING(mp, key, value);
-    if (ep->me_value != NULL) {
-        old_value = ep->me_value;
-        ep->me_value = value;
+    dk = mp->ma_keys;
+    ep = &DK_ENTRIES(dk)[dk->dk_nentries];
+    dk_set_index(dk, hashpos, dk->dk_nentries);
+    ep->me_key = key;
+    ep->me_hash = (Py_ssize_t)hash;
+    ep->me_value = value;
+    mp->ma_used++;
+    DICT_MODIFIED(mp);
+    dk->dk_usable--;
+    dk->dk_nentries++;
+    assert(dk->dk_usable >= 0);
+    return 0;
+}
+
+/* Give a split dict a combined table of its own, as needed before any
+   change the shared keys can't express. */
+static int
+unshare_table(PyDictObject *mp)
+{
+    assert(mp->ma_values != NULL);
+    return dictresize(mp, ESTIMATE_SIZE(mp->ma_used));
+}
+
+static int insertdict(register PyDictObject *mp, PyObject *key, long hash,
+                      PyObject *value);
+
+/*
+Insertion into a split table, given the result of the lookup.  The values
+stay a prefix of the shared entries:  a key the shared keys have already
+is fine when it comes next, and a new string key is appended to the shared
+keys when this dict is the one with the most keys.  Anything else makes the
+table combined.
+*/
+static int
+insertdict_split(PyDictObject *mp, PyObject *key, long hash,
+                 Py_ssize_t ix, Py_ssize_t hashpos, PyObject *value)
+{
+    PyDictKeysObject *dk = mp->ma_keys;
+    PyObject *old_value;
+
+    if (ix >= 0 && mp->ma_values[ix] != NULL) {
+        MAINTAIN_TRACKING(mp, key, value);
+        old_value = mp->ma_values[ix];
+        mp->ma_values[ix] = value;
+        DICT_MODIFIED(mp);
         Py_DECREF(old_value); /* which **CAN** re-enter */
         Py_DECREF(key);
+        return 0;
     }
-    else {
-        if (ep->me_key == NULL)
-            mp->ma_fill++;
-        else {
-            assert(ep->me_key == dummy);
-            Py_DECREF(dummy);
-        }
+    if (ix == mp->ma_used)
+        /* The shared keys own the key already. */
+        Py_DECREF(key);
+    else if (ix == DKIX_EMPTY && mp->ma_used == dk->dk_nentries &&
+             dk->dk_usable > 0 && PyString_CheckExact(key)) {
+        /* The shared keys take over the reference to the key. */
+        PyDictEntry *ep = &DK_ENTRIES(dk)[dk->dk_nentries];
+        dk_set_index(dk, hashpos, dk->dk_nentries);
         ep->me_key = key;
         ep->me_hash = (Py_ssize_t)hash;
-        ep->me_value = value;
-        mp->ma_used++;
+        ep->me_value = NULL;
+        dk->dk_usable--;
+        ix = dk->dk_nentries++;
+    }
+    else {
+        if (unshare_table(mp) != 0) {
+            Py_DECREF(key);
+            Py_DECREF(value);
+            return -1;
+        }
+        return insertdict(mp, key, hash, value);
     }
+    MAINTAIN_TRACKING(mp, key, value);
+    mp->ma_values[ix] = value;
+    mp->ma_used++;
+    DICT_MODIFIED(mp);
     return 0;
 }
 
-
 /*
 Internal routine to insert a new item into the table.
-Used both by the internal resize routine and by the public insert routine.
+Used by the public insert routines.
 Eats a reference to key and one to value.
 Returns -1 if an error occurred, or 0 on success.
 */
 static int
 insertdict(register PyDictObject *mp, PyObject *key, long hash, PyObject *value)
 {
-    register PyDictEntry *ep;
+    Py_ssize_t ix, hashpos;
+    PyDictEntry *ep;
+    PyObject *old_value;
 
-    assert(mp->ma_lookup != NULL);
-    ep = mp->ma_lookup(mp, key, hash);
-    if (ep == NULL) {
+    assert(mp->ma_keys->dk_lookup != NULL);
+    ix = mp->ma_keys->dk_lookup(mp, key, hash, &hashpos);
+    if (ix == DKIX_ERROR) {
         Py_DECREF(key);
         Py_DECREF(value);
         return -1;
     }
-    return insertdict_by_entry(mp, key, hash, ep, value);
+    if (mp->ma_values != NULL)
+        return insertdict_split(mp, key, hash, ix, hashpos, value);
+    if (ix == DKIX_EMPTY)
+        return insert_new_entry(mp, key, hash, hashpos, value);
+
+    MAINTAIN_TRACKING(mp, key, value);
+    ep = &DK_ENTRIES(mp->ma_keys)[ix];
+    old_value = ep->me_value;
+    ep->me_value = value;
+    DICT_MODIFIED(mp);
+    Py_DECREF(old_value); /* which **CAN** re-enter */
+    Py_DECREF(key);
+    return 0;
 }
 
-/*
-Internal routine used by dictresize() to insert an item which is
-known to be absent from the dict.  This routine also assumes that
-the dict contains no deleted entries.  Besides the performance benefit,
-using insertdict() in dictresize() is dangerous (SF bug #1456209).
-Note that no refcounts are changed by this routine; if needed, the caller
-is responsible for incref'ing `key` and `value`.
-*/
+/* Fill the hash index of a freshly allocated keys object from its first n
+   entries, none of which may be deleted. */
 static void
-insertdict_clean(register PyDictObject *mp, PyObject *key, long hash,
-                 PyObject *value)
+build_indices(PyDictKeysObject *keys, PyDictEntry *ep, Py_ssize_t n)
 {
-    register size_t i;
-    register size_t perturb;
-    register size_t mask = (size_t)mp->ma_mask;
-    PyDictEntry *ep0 = mp->ma_table;
-    register PyDictEntry *ep;
-
-    MAINTAIN_TRACKING(mp, key, value);
-    i = hash & mask;
-    ep = &ep0[i];
-    for (perturb = hash; ep->me_key != NULL; perturb >>= PERTURB_SHIFT) {
-        i = (i << 2) + i + perturb + 1;
-        ep = &ep0[i & mask];
+    size_t mask = (size_t)DK_MASK(keys);
+    Py_ssize_t ix;
+
+    for (ix = 0; ix != n; ix++, ep++) {
+        size_t hash = (size_t)ep->me_hash;
+        size_t i = hash & mask;
+        size_t perturb;
+
+        for (perturb = hash; dk_get_index(keys, i) != DKIX_EMPTY;
+             perturb >>= PERTURB_SHIFT)
+            i = ((i << 2) + i + perturb + 1) & mask;
+        dk_set_index(keys, i, ix);
     }
-    assert(ep->me_value == NULL);
-    mp->ma_fill++;
-    ep->me_key = key;
-    ep->me_hash = (Py_ssize_t)hash;
-    ep->me_value = value;
-    mp->ma_used++;
 }
 
 /*
 Restructure the table by allocating a new table and reinserting all
 items again.  When entries have been deleted, the new table may
-actually be smaller than the old one.
+actually be smaller than the old one.  The live entries move over in
+order, which keeps the insertion order and is refcount-neutral.  Tables
+with many entries may be resized incrementally instead; see resize_step().
 */
 static int
 dictresize(PyDictObject *mp, Py_ssize_t minused)
 {
-    Py_ssize_t newsize;
-    PyDictEntry *oldtable, *newtable, *ep;
-    Py_ssize_t i;
-    int is_oldtable_malloced;
-    PyDictEntry small_copy[PyDict_MINSIZE];
+    Py_ssize_t newsize, i, n;
+    PyDictKeysObject *oldkeys, *newkeys;
+    PyDictEntry *oldentries, *newentries;
+    int was_split = 0;
 
     assert(minused >= 0);
+    FINISH_RESIZE(mp);
 
     /* Find the smallest table size > minused. */
     for (newsize = PyDict_MINSIZE;
@@ -614,66 +1365,59 @@ dictresize(PyDictObject *mp, Py_ssize_t minused)
         PyErr_NoMemory();
         return -1;
     }
-
-    /* Get space for a new table. */
-    oldtable = mp->ma_table;
-    assert(oldtable != NULL);
-    is_oldtable_malloced = oldtable != mp->ma_smalltable;
-
-    if (newsize == PyDict_MINSIZE) {
-        /* A large table is shrinking, or we can't get any smaller. */
-        newtable = mp->ma_smalltable;
-        if (newtable == oldtable) {
-            if (mp->ma_fill == mp->ma_used) {
-                /* No dummies, so no point doing anything. */
-                return 0;
-            }
-            /* We're not going to resize it, but rebuild the
-               table anyway to purge old dummy entries.
-               Subtle:  This is *necessary* if fill==size,
-               as lookdict needs at least one virgin slot to
-               terminate failing searches.  If fill < size, it's
-               merely desirable, as dummies slow searches. */
-            assert(mp->ma_fill > mp->ma_used);
-            memcpy(small_copy, oldtable, sizeof(small_copy));
-            oldtable = small_copy;
-        }
-    }
-    else {
-        newtable = PyMem_NEW(PyDictEntry, newsize);
-        if (newtable == NULL) {
-            PyErr_NoMemory();
-            return -1;
-        }
+    assert(USABLE_FRACTION(newsize) >= mp->ma_used);
+
+    oldkeys = mp->ma_keys;
+    if (mp->ma_values == NULL &&
+        oldkeys->dk_nentries >= INCREMENTAL_RESIZE_MIN) {
+        int started = start_resize(mp, newsize);
+        if (started != 0)
+            return started < 0 ? -1 : 0;
     }
-
-    /* Make the dict empty, using the new table. */
-    assert(newtable != oldtable);
-    mp->ma_table = newtable;
-    mp->ma_mask = newsize - 1;
-    memset(newtable, 0, sizeof(PyDictEntry) * newsize);
-    mp->ma_used = 0;
-    i = mp->ma_fill;
-    mp->ma_fill = 0;
-
-    /* Copy the data over; this is refcount-neutral for active entries;
-       dummy entries aren't copied over, of course */
-    for (ep = oldtable; i > 0; ep++) {
-        if (ep->me_value != NULL) {             /* active entry */
-            --i;
-            insertdict_clean(mp, ep->me_key, (long)ep->me_hash,
-                             ep->me_value);
+    newkeys = new_keys_object(newsize);
+    if (newkeys == NULL)
+        return -1;
+    if (oldkeys != Py_EMPTY_KEYS)
+        newkeys->dk_lookup = oldkeys->dk_lookup;
+
+    /* Copy the live entries over; deleted ones are simply dropped. */
+    oldentries = DK_ENTRIES(oldkeys);
+    newentries = DK_ENTRIES(newkeys);
+    n = oldkeys->dk_nentries;
+    if (mp->ma_values != NULL) {
+        /* A split table becomes combined.  The shared keys keep their
+           references, so the new entries need their own. */
+        PyObject **oldvalues = mp->ma_values;
+        was_split = 1;
+        for (i = 0; i < mp->ma_used; i++) {
+            assert(oldvalues[i] != NULL);
+            newentries[i].me_key = oldentries[i].me_key;
+            Py_INCREF(newentries[i].me_key);
+            newentries[i].me_hash = oldentries[i].me_hash;
+            newentries[i].me_value = oldvalues[i];
         }
-        else if (ep->me_key != NULL) {          /* dummy entry */
-            --i;
-            assert(ep->me_key == dummy);
-            Py_DECREF(ep->me_key);
+        mp->ma_values = NULL;
+        free_values(oldvalues);
+    }
+    else if (n == mp->ma_used)
+        memcpy(newentries, oldentries, n * sizeof(PyDictEntry));
+    else {
+        PyDictEntry *ep = newentries;
+        for (i = 0; i < n; i++) {
+            if (oldentries[i].me_value != NULL)
+                *ep++ = oldentries[i];
         }
-        /* else key == value == NULL:  nothing to do */
+        assert(ep - newentries == mp->ma_used);
     }
-
-    if (is_oldtable_malloced)
-        PyMem_DEL(oldtable);
+    build_indices(newkeys, newentries, mp->ma_used);
+    newkeys->dk_usable -= mp->ma_used;
+    newkeys->dk_nentries = mp->ma_used;
+
+    mp->ma_keys = newkeys;
+    if (was_split)
+        DK_DECREF(oldkeys);
+    else if (oldkeys != Py_EMPTY_KEYS)
+        dealloc_keys(oldkeys);
     return 0;
 }
 
@@ -687,7 +1431,8 @@ _PyDict_NewPresized(Py_ssize_t minused)
 {
     PyObject *op = PyDict_New();
 
-    if (minused>5 && op != NULL && dictresize((PyDictObject *)op, minused) == -1) {
+    if (minused > USABLE_FRACTION(PyDict_MINSIZE) && op != NULL &&
+        dictresize((PyDictObject *)op, ESTIMATE_SIZE(minused)) == -1) {
         Py_DECREF(op);
         return NULL;
     }
@@ -704,22 +1449,23 @@ _PyDict_NewPresized(Py_ssize_t minused)
  * function hits a stack-depth error, which can cause this to return NULL
  * even if the key is present.
  */
-PyObject *
-PyDict_GetItem(PyObject *op, PyObject *key)
+/* Look key up in mp the way PyDict_GetItem() does, ignoring errors and
+   leaving any pending exception alone.  Return the entry's position, or
+   a negative number if key isn't there. */
+static Py_ssize_t
+getitem_index(PyDictObject *mp, PyObject *key)
 {
     long hash;
-    PyDictObject *mp = (PyDictObject *)op;
-    PyDictEntry *ep;
+    Py_ssize_t ix;
     PyThreadState *tstate;
-    if (!PyDict_Check(op))
-        return NULL;
+
     if (!PyString_CheckExact(key) ||
         (hash = ((PyStringObject *) key)->ob_shash) == -1)
     {
         hash = PyObject_Hash(key);
         if (hash == -1) {
             PyErr_Clear();
-            return NULL;
+            return DKIX_ERROR;
         }
     }
 
@@ -733,59 +1479,56 @@ PyDict_GetItem(PyObject *op, PyObject *key)
         /* preserve the existing exception */
         PyObject *err_type, *err_value, *err_tb;
         PyErr_Fetch(&err_type, &err_value, &err_tb);
-        ep = (mp->ma_lookup)(mp, key, hash);
+        ix = (mp->ma_keys->dk_lookup)(mp, key, hash, NULL);
         /* ignore errors */
         PyErr_Restore(err_type, err_value, err_tb);
-        if (ep == NULL)
-            return NULL;
     }
     else {
-        ep = (mp->ma_lookup)(mp, key, hash);
-        if (ep == NULL) {
+        ix = (mp->ma_keys->dk_lookup)(mp, key, hash, NULL);
+        if (ix == DKIX_ERROR)
             PyErr_Clear();
-            return NULL;
-        }
     }
-    return ep->me_value;
+    return ix;
 }
 
-static int
-dict_set_item_by_hash_or_entry(register PyObject *op, PyObject *key,
-                               long hash, PyDictEntry *ep, PyObject *value)
+PyObject *
+PyDict_GetItem(PyObject *op, PyObject *key)
 {
-    register PyDictObject *mp;
-    register Py_ssize_t n_used;
+    PyDictObject *mp = (PyDictObject *)op;
+    Py_ssize_t ix;
 
-    mp = (PyDictObject *)op;
-    assert(mp->ma_fill <= mp->ma_mask);  /* at least one empty slot */
-    n_used = mp->ma_used;
-    Py_INCREF(value);
-    Py_INCREF(key);
-    if (ep == NULL) {
-        if (insertdict(mp, key, hash, value) != 0)
-            return -1;
-    }
-    else {
-        if (insertdict_by_entry(mp, key, hash, ep, value) != 0)
-            return -1;
-    }
-    /* If we added a key, we can safely resize.  Otherwise just return!
-     * If fill >= 2/3 size, adjust size.  Normally, this doubles or
-     * quaduples the size, but it's also possible for the dict to shrink
-     * (if ma_fill is much larger than ma_used, meaning a lot of dict
-     * keys have been * deleted).
-     *
-     * Quadrupling the size improves average dictionary sparseness
-     * (reducing collisions) at the cost of some memory and iteration
-     * speed (which loops over every possible entry).  It also halves
-     * the number of expensive resize operations in a growing dictionary.
-     *
-     * Very large dictionaries (over 50K items) use doubling instead.
-     * This may help applications with severe memory constraints.
-     */
-    if (!(mp->ma_used > n_used && mp->ma_fill*3 >= (mp->ma_mask+1)*2))
-        return 0;
-    return dictresize(mp, (mp->ma_used > 50000 ? 2 : 4) * mp->ma_used);
+    if (!PyDict_Check(op))
+        return NULL;
+    ix = getitem_index(mp, key);
+    if (ix < 0)
+        return NULL;
+    return DICT_VALUE(mp, ix);
+}
+
+/* Like PyDict_GetItem(), but try the entry at *hint first, and set *hint
+   to where key was found.  Dicts sharing keys, or built by inserting the
+   same keys in the same order, keep each key at the same position, so a
+   hint kept for a given key usually saves hashing and probing. */
+PyObject *
+_PyDict_GetItemHint(PyObject *op, PyObject *key, Py_ssize_t *hint)
+{
+    PyDictObject *mp = (PyDictObject *)op;
+    PyDictKeysObject *dk;
+    Py_ssize_t ix = *hint;
+
+    if (!PyDict_Check(op))
+        return NULL;
+    dk = mp->ma_keys;
+    /* Deleted entries have no key.  Past the moved ones, the entries of
+       a table being resized aren't filled in yet. */
+    if (ix >= 0 && ix < dk->dk_nentries && dk->dk_old == NULL &&
+        DK_ENTRIES(dk)[ix].me_key == key)
+        return DICT_VALUE(mp, ix);
+    ix = getitem_index(mp, key);
+    if (ix < 0)
+        return NULL;
+    *hint = ix;
+    return DICT_VALUE(mp, ix);
 }
 
 /* CAUTION: PyDict_SetItem() must guarantee that it won't resize the
@@ -815,7 +1558,28 @@ PyDict_SetItem(register PyObject *op, PyObject *key, PyObject *value)
         if (hash == -1)
             return -1;
     }
-    return dict_set_item_by_hash_or_entry(op, key, hash, NULL, value);
+    Py_INCREF(key);
+    Py_INCREF(value);
+    return insertdict((PyDictObject *)op, key, hash, value);
+}
+
+/* Remove the entry at position ix, whose hash index slot is hashpos, and
+   hand its references over to the caller.  The table must be combined. */
+static void
+delitem_common(PyDictObject *mp, Py_ssize_t hashpos, Py_ssize_t ix,
+               PyObject **pkey, PyObject **pvalue)
+{
+    PyDictEntry *ep = &DK_ENTRIES(mp->ma_keys)[ix];
+
+    assert(mp->ma_values == NULL);
+    assert(dk_get_index(mp->ma_keys, hashpos) == ix);
+    dk_set_index(mp->ma_keys, hashpos, DKIX_DUMMY);
+    *pkey = ep->me_key;
+    *pvalue = ep->me_value;
+    ep->me_key = NULL;
+    ep->me_value = NULL;
+    mp->ma_used--;
+    DICT_MODIFIED(mp);
 }
 
 int
@@ -823,7 +1587,7 @@ PyDict_DelItem(PyObject *op, PyObject *key)
 {
     register PyDictObject *mp;
     register long hash;
-    register PyDictEntry *ep;
+    Py_ssize_t ix, hashpos;
     PyObject *old_value, *old_key;
 
     if (!PyDict_Check(op)) {
@@ -838,19 +1602,21 @@ PyDict_DelItem(PyObject *op, PyObject *key)
             return -1;
     }
     mp = (PyDictObject *)op;
-    ep = (mp->ma_lookup)(mp, key, hash);
-    if (ep == NULL)
+    ix = (mp->ma_keys->dk_lookup)(mp, key, hash, &hashpos);
+    if (ix == DKIX_ERROR)
         return -1;
-    if (ep->me_value == NULL) {
+    if (ix == DKIX_EMPTY || DICT_VALUE(mp, ix) == NULL) {
         set_key_error(key);
         return -1;
     }
-    old_key = ep->me_key;
-    Py_INCREF(dummy);
-    ep->me_key = dummy;
-    old_value = ep->me_value;
-    ep->me_value = NULL;
-    mp->ma_used--;
+    if (mp->ma_values != NULL) {
+        /* Split tables don't allow deletion.  Entries keep their
+           positions when the table is combined. */
+        if (unshare_table(mp) != 0)
+            return -1;
+        hashpos = lookdict_index(mp->ma_keys, hash, ix);
+    }
+    delitem_common(mp, hashpos, ix, &old_key, &old_value);
     Py_DECREF(old_value);
     Py_DECREF(old_key);
     return 0;
@@ -860,69 +1626,74 @@ void
 PyDict_Clear(PyObject *op)
 {
     PyDictObject *mp;
-    PyDictEntry *ep, *table;
-    int table_is_malloced;
-    Py_ssize_t fill;
-    PyDictEntry small_copy[PyDict_MINSIZE];
-#ifdef Py_DEBUG
-    Py_ssize_t i, n;
-#endif
+    PyDictKeysObject *oldkeys;
+    PyObject **oldvalues;
 
     if (!PyDict_Check(op))
         return;
     mp = (PyDictObject *)op;
-#ifdef Py_DEBUG
-    n = mp->ma_mask + 1;
-    i = 0;
-#endif
-
-    table = mp->ma_table;
-    assert(table != NULL);
-    table_is_malloced = table != mp->ma_smalltable;
+    FINISH_RESIZE(mp);
+    oldkeys = mp->ma_keys;
+    oldvalues = mp->ma_values;
+    if (oldkeys == Py_EMPTY_KEYS)
+        return;
 
     /* This is delicate.  During the process of clearing the dict,
      * decrefs can cause the dict to mutate.  To avoid fatal confusion
      * (voice of experience), we have to make the dict empty before
-     * clearing the slots, and never refer to anything via mp->xxx while
-     * clearing.
+     * clearing the entries, which then belong to nobody else.
      */
-    fill = mp->ma_fill;
-    if (table_is_malloced)
-        EMPTY_TO_MINSIZE(mp);
-
-    else if (fill > 0) {
-        /* It's a small table with something that needs to be cleared.
-         * Afraid the only safe way is to copy the dict entries into
-         * another small table first.
-         */
-        memcpy(small_copy, table, sizeof(small_copy));
-        table = small_copy;
-        EMPTY_TO_MINSIZE(mp);
-    }
-    /* else it's a small table that's already empty */
+    mp->ma_keys = Py_EMPTY_KEYS;
+    mp->ma_values = NULL;
+    mp->ma_used = 0;
+    DICT_MODIFIED(mp);
+    if (oldvalues != NULL)
+        free_split_table(oldkeys, oldvalues);
+    else
+        DK_DECREF(oldkeys);
+}
 
-    /* Now we can finally clear things.  If C had refcounts, we could
-     * assert that the refcount on table is 1 now, i.e. that this function
-     * has unique access to it, so decref side-effects can't alter it.
-     */
-    for (ep = table; fill > 0; ++ep) {
-#ifdef Py_DEBUG
-        assert(i < n);
-        ++i;
-#endif
-        if (ep->me_key) {
-            --fill;
-            Py_DECREF(ep->me_key);
-            Py_XDECREF(ep->me_value);
+/* Return the position of the first item of mp at i or after, or -1 if
+   there is none, and the entry and value of that item in *pep and *pvalue.
+   The entries of a dict being resized that haven't been moved yet are read
+   from the old table, as in dict_traverse(), so iterating over a huge dict
+   doesn't stall to finish the resize.  (Split tables are never resized
+   incrementally.) */
+static Py_ssize_t
+dict_next_item(PyDictObject *mp, Py_ssize_t i, PyDictEntry **pep,
+               PyObject **pvalue)
+{
+    PyDictKeysObject *keys = mp->ma_keys, *oldkeys = keys->dk_old;
+    PyDictEntry *ep = DK_ENTRIES(keys), *oldep = NULL;
+    Py_ssize_t n = keys->dk_nentries, moved = 0, oldn = 0;
+    PyObject *value;
+
+    if (mp->ma_values != NULL) {
+        for (; i < n; i++) {
+            if ((value = mp->ma_values[i]) != NULL) {
+                *pep = &ep[i];
+                *pvalue = value;
+                return i;
+            }
         }
-#ifdef Py_DEBUG
-        else
-            assert(ep->me_value == NULL);
-#endif
+        return -1;
     }
-
-    if (table_is_malloced)
-        PyMem_DEL(table);
+    if (oldkeys != NULL) {
+        oldep = DK_ENTRIES(oldkeys);
+        moved = DK_MOVED(oldkeys);
+        oldn = oldkeys->dk_nentries;
+    }
+    for (; i < n; i++) {
+        PyDictEntry *p = &ep[i];
+        if (i >= moved && i < oldn && oldep[i].me_hash != ENTRY_MOVED)
+            p = &oldep[i];
+        if (p->me_value != NULL) {
+            *pep = p;
+            *pvalue = p->me_value;
+            return i;
+        }
+    }
+    return -1;
 }
 
 /*
@@ -935,6 +1706,8 @@ PyDict_Clear(PyObject *op)
  *              Refer to borrowed references in key and value.
  *     }
  *
+ * Items come out in insertion order.
+ *
  * CAUTION:  In general, it isn't safe to use PyDict_Next in a loop that
  * mutates the dict.  One exception:  it is safe if the loop merely changes
  * the values associated with the keys (but doesn't insert new keys or
@@ -943,26 +1716,27 @@ PyDict_Clear(PyObject *op)
 int
 PyDict_Next(PyObject *op, Py_ssize_t *ppos, PyObject **pkey, PyObject **pvalue)
 {
-    register Py_ssize_t i;
-    register Py_ssize_t mask;
-    register PyDictEntry *ep;
+    Py_ssize_t i;
+    PyDictEntry *ep;
+    PyObject *value;
+    PyDictObject *mp;
 
     if (!PyDict_Check(op))
         return 0;
     i = *ppos;
     if (i < 0)
         return 0;
-    ep = ((PyDictObject *)op)->ma_table;
-    mask = ((PyDictObject *)op)->ma_mask;
-    while (i <= mask && ep[i].me_value == NULL)
-        i++;
-    *ppos = i+1;
-    if (i > mask)
+    mp = (PyDictObject *)op;
+    i = dict_next_item(mp, i, &ep, &value);
+    if (i < 0) {
+        *ppos = mp->ma_keys->dk_nentries + 1;
         return 0;
+    }
+    *ppos = i+1;
     if (pkey)
-        *pkey = ep[i].me_key;
+        *pkey = ep->me_key;
     if (pvalue)
-        *pvalue = ep[i].me_value;
+        *pvalue = value;
     return 1;
 }
 
@@ -970,27 +1744,28 @@ PyDict_Next(PyObject *op, Py_ssize_t *ppos, PyObject **pkey, PyObject **pvalue)
 int
 _PyDict_Next(PyObject *op, Py_ssize_t *ppos, PyObject **pkey, PyObject **pvalue, long *phash)
 {
-    register Py_ssize_t i;
-    register Py_ssize_t mask;
-    register PyDictEntry *ep;
+    Py_ssize_t i;
+    PyDictEntry *ep;
+    PyObject *value;
+    PyDictObject *mp;
 
     if (!PyDict_Check(op))
         return 0;
     i = *ppos;
     if (i < 0)
         return 0;
-    ep = ((PyDictObject *)op)->ma_table;
-    mask = ((PyDictObject *)op)->ma_mask;
-    while (i <= mask && ep[i].me_value == NULL)
-        i++;
-    *ppos = i+1;
-    if (i > mask)
+    mp = (PyDictObject *)op;
+    i = dict_next_item(mp, i, &ep, &value);
+    if (i < 0) {
+        *ppos = mp->ma_keys->dk_nentries + 1;
         return 0;
-    *phash = (long)(ep[i].me_hash);
+    }
+    *ppos = i+1;
+    *phash = (long)(ep->me_hash);
     if (pkey)
-        *pkey = ep[i].me_key;
+        *pkey = ep->me_key;
     if (pvalue)
-        *pvalue = ep[i].me_value;
+        *pvalue = value;
     return 1;
 }
 
@@ -999,19 +1774,16 @@ _PyDict_Next(PyObject *op, Py_ssize_t *ppos, PyObject **pkey, PyObject **pvalue,
 static void
 dict_dealloc(register PyDictObject *mp)
 {
-    register PyDictEntry *ep;
-    Py_ssize_t fill = mp->ma_fill;
+    PyDictKeysObject *keys;
+    PyObject **values = mp->ma_values;
+    FINISH_RESIZE(mp);
+    keys = mp->ma_keys;
     PyObject_GC_UnTrack(mp);
     Py_TRASHCAN_SAFE_BEGIN(mp)
-    for (ep = mp->ma_table; fill > 0; ep++) {
-        if (ep->me_key) {
-            --fill;
-            Py_DECREF(ep->me_key);
-            Py_XDECREF(ep->me_value);
-        }
-    }
-    if (mp->ma_table != mp->ma_smalltable)
-        PyMem_DEL(mp->ma_table);
+    if (values != NULL)
+        free_split_table(keys, values);
+    else if (keys != Py_EMPTY_KEYS)
+        DK_DECREF(keys);
     if (numfree < PyDict_MAXFREELIST && Py_TYPE(mp) == &PyDict_Type)
         free_list[numfree++] = mp;
     else
@@ -1040,9 +1812,13 @@ dict_print(register PyDictObject *mp, register FILE *fp, register int flags)
     fprintf(fp, "{");
     Py_END_ALLOW_THREADS
     any = 0;
-    for (i = 0; i <= mp->ma_mask; i++) {
-        PyDictEntry *ep = mp->ma_table + i;
-        PyObject *pvalue = ep->me_value;
+    for (i = 0; i < mp->ma_keys->dk_nentries; i++) {
+        PyDictEntry *ep;
+        PyObject *pvalue;
+        /* Printing runs arbitrary code. */
+        FINISH_RESIZE(mp);
+        ep = &DK_ENTRIES(mp->ma_keys)[i];
+        pvalue = DICT_VALUE(mp, i);
         if (pvalue != NULL) {
             /* Prevent PyObject_Repr from deleting value during
                key format */
@@ -1165,19 +1941,17 @@ dict_subscript(PyDictObject *mp, register PyObject *key)
 {
     PyObject *v;
     long hash;
-    PyDictEntry *ep;
-    assert(mp->ma_table != NULL);
+    Py_ssize_t ix;
     if (!PyString_CheckExact(key) ||
         (hash = ((PyStringObject *) key)->ob_shash) == -1) {
         hash = PyObject_Hash(key);
         if (hash == -1)
             return NULL;
     }
-    ep = (mp->ma_lookup)(mp, key, hash);
-    if (ep == NULL)
+    ix = (mp->ma_keys->dk_lookup)(mp, key, hash, NULL);
+    if (ix == DKIX_ERROR)
         return NULL;
-    v = ep->me_value;
-    if (v == NULL) {
+    if (ix == DKIX_EMPTY || (v = DICT_VALUE(mp, ix)) == NULL) {
         if (!PyDict_CheckExact(mp)) {
             /* Look up __missing__ method if we're a subclass. */
             PyObject *missing, *res;
@@ -1197,8 +1971,7 @@ dict_subscript(PyDictObject *mp, register PyObject *key)
         set_key_error(key);
         return NULL;
     }
-    else
-        Py_INCREF(v);
+    Py_INCREF(v);
     return v;
 }
 
@@ -1223,7 +1996,7 @@ dict_keys(register PyDictObject *mp)
     register PyObject *v;
     register Py_ssize_t i, j;
     PyDictEntry *ep;
-    Py_ssize_t mask, n;
+    Py_ssize_t n, nentries;
 
   again:
     n = mp->ma_used;
@@ -1237,10 +2010,11 @@ dict_keys(register PyDictObject *mp)
         Py_DECREF(v);
         goto again;
     }
-    ep = mp->ma_table;
-    mask = mp->ma_mask;
-    for (i = 0, j = 0; i <= mask; i++) {
-        if (ep[i].me_value != NULL) {
+    FINISH_RESIZE(mp);
+    ep = DK_ENTRIES(mp->ma_keys);
+    nentries = mp->ma_keys->dk_nentries;
+    for (i = 0, j = 0; i < nentries; i++) {
+        if (DICT_VALUE(mp, i) != NULL) {
             PyObject *key = ep[i].me_key;
             Py_INCREF(key);
             PyList_SET_ITEM(v, j, key);
@@ -1256,8 +2030,7 @@ dict_values(register PyDictObject *mp)
 {
     register PyObject *v;
     register Py_ssize_t i, j;
-    PyDictEntry *ep;
-    Py_ssize_t mask, n;
+    Py_ssize_t n, nentries;
 
   again:
     n = mp->ma_used;
@@ -1271,11 +2044,11 @@ dict_values(register PyDictObject *mp)
         Py_DECREF(v);
         goto again;
     }
-    ep = mp->ma_table;
-    mask = mp->ma_mask;
-    for (i = 0, j = 0; i <= mask; i++) {
-        if (ep[i].me_value != NULL) {
-            PyObject *value = ep[i].me_value;
+    FINISH_RESIZE(mp);
+    nentries = mp->ma_keys->dk_nentries;
+    for (i = 0, j = 0; i < nentries; i++) {
+        PyObject *value = DICT_VALUE(mp, i);
+        if (value != NULL) {
             Py_INCREF(value);
             PyList_SET_ITEM(v, j, value);
             j++;
@@ -1290,7 +2063,7 @@ dict_items(register PyDictObject *mp)
 {
     register PyObject *v;
     register Py_ssize_t i, j, n;
-    Py_ssize_t mask;
+    Py_ssize_t nentries;
     PyObject *item, *key, *value;
     PyDictEntry *ep;
 
@@ -1319,10 +2092,11 @@ dict_items(register PyDictObject *mp)
         goto again;
     }
     /* Nothing we do below makes any function calls. */
-    ep = mp->ma_table;
-    mask = mp->ma_mask;
-    for (i = 0, j = 0; i <= mask; i++) {
-        if ((value=ep[i].me_value) != NULL) {
+    FINISH_RESIZE(mp);
+    ep = DK_ENTRIES(mp->ma_keys);
+    nentries = mp->ma_keys->dk_nentries;
+    for (i = 0, j = 0; i < nentries; i++) {
+        if ((value = DICT_VALUE(mp, i)) != NULL) {
             key = ep[i].me_key;
             item = PyList_GET_ITEM(v, j);
             Py_INCREF(key);
@@ -1361,7 +2135,7 @@ dict_fromkeys(PyObject *cls, PyObject *args)
             PyObject *key;
             long hash;
 
-            if (dictresize(mp, Py_SIZE(seq))) {
+            if (dictresize(mp, ESTIMATE_SIZE(((PyDictObject *)seq)->ma_used))) {
                 Py_DECREF(d);
                 return NULL;
             }
@@ -1382,7 +2156,7 @@ dict_fromkeys(PyObject *cls, PyObject *args)
             PyObject *key;
             long hash;
 
-            if (dictresize(mp, PySet_GET_SIZE(seq))) {
+            if (dictresize(mp, ESTIMATE_SIZE(PySet_GET_SIZE(seq)))) {
                 Py_DECREF(d);
                 return NULL;
             }
@@ -1578,20 +2352,24 @@ PyDict_Merge(PyObject *a, PyObject *b, int override)
          * incrementally resizing as we insert new items.  Expect
          * that there will be no (or few) overlapping keys.
          */
-        if ((mp->ma_fill + other->ma_used)*3 >= (mp->ma_mask+1)*2) {
-           if (dictresize(mp, (mp->ma_used + other->ma_used)*2) != 0)
+        if (mp->ma_keys->dk_usable < other->ma_used) {
+           if (dictresize(mp, ESTIMATE_SIZE(mp->ma_used + other->ma_used)) != 0)
                return -1;
         }
-        for (i = 0; i <= other->ma_mask; i++) {
-            entry = &other->ma_table[i];
-            if (entry->me_value != NULL &&
+        for (i = 0; i < other->ma_keys->dk_nentries; i++) {
+            PyObject *value;
+            /* Insertions run arbitrary code. */
+            FINISH_RESIZE(other);
+            value = DICT_VALUE(other, i);
+            entry = &DK_ENTRIES(other->ma_keys)[i];
+            if (value != NULL &&
                 (override ||
                  PyDict_GetItem(a, entry->me_key) == NULL)) {
                 Py_INCREF(entry->me_key);
-                Py_INCREF(entry->me_value);
+                Py_INCREF(value);
                 if (insertdict(mp, entry->me_key,
                                (long)entry->me_hash,
-                               entry->me_value) != 0)
+                               value) != 0)
                     return -1;
             }
         }
@@ -1649,15 +2427,75 @@ dict_copy(register PyDictObject *mp)
     return PyDict_Copy((PyObject*)mp);
 }
 
+/* Copy a dict without deleted entries by duplicating its table wholesale,
+   which saves looking up and rehashing every key. */
+static PyObject *
+clone_dict(PyDictObject *orig)
+{
+    PyDictObject *mp;
+    PyDictKeysObject *keys = orig->ma_keys, *newkeys;
+    PyDictEntry *ep;
+    Py_ssize_t i, n;
+
+    assert(orig->ma_used > 0 && orig->ma_used == keys->dk_nentries);
+    mp = (PyDictObject *)PyDict_New();
+    if (mp == NULL)
+        return NULL;
+    newkeys = new_keys_object(DK_SIZE(keys));
+    if (newkeys == NULL) {
+        Py_DECREF(mp);
+        return NULL;
+    }
+    memcpy(newkeys, keys, keys_nbytes(DK_SIZE(keys)));
+    ep = DK_ENTRIES(newkeys);
+    for (i = 0, n = newkeys->dk_nentries; i < n; i++) {
+        Py_INCREF(ep[i].me_key);
+        Py_INCREF(ep[i].me_value);
+    }
+    mp->ma_keys = newkeys;
+    mp->ma_used = orig->ma_used;
+    if (_PyObject_GC_IS_TRACKED(orig)) {
+        _PyObject_GC_TRACK(mp);
+        INCREASE_TRACK_COUNT
+    }
+    return (PyObject *)mp;
+}
+
 PyObject *
 PyDict_Copy(PyObject *o)
 {
     PyObject *copy;
+    PyDictObject *mp;
 
     if (o == NULL || !PyDict_Check(o)) {
         PyErr_BadInternalCall();
         return NULL;
     }
+    mp = (PyDictObject *)o;
+    FINISH_RESIZE(mp);
+    if (mp->ma_values != NULL) {
+        /* Split tables are copied as split tables sharing the same keys. */
+        PyDictObject *split_copy;
+        Py_ssize_t i;
+
+        copy = _PyDict_NewShared(mp->ma_keys);
+        if (copy == NULL)
+            return NULL;
+        split_copy = (PyDictObject *)copy;
+        for (i = 0; i < mp->ma_used; i++) {
+            PyObject *value = mp->ma_values[i];
+            Py_INCREF(value);
+            split_copy->ma_values[i] = value;
+        }
+        split_copy->ma_used = mp->ma_used;
+        if (_PyObject_GC_IS_TRACKED(mp) && !_PyObject_GC_IS_TRACKED(copy)) {
+            _PyObject_GC_TRACK(copy);
+            INCREASE_TRACK_COUNT
+        }
+        return copy;
+    }
+    if (mp->ma_used > 0 && mp->ma_used == mp->ma_keys->dk_nentries)
+        return clone_dict(mp);
     copy = PyDict_New();
     if (copy == NULL)
         return NULL;
@@ -1667,6 +2505,113 @@ PyDict_Copy(PyObject *o)
     return NULL;
 }
 
+/* Key-sharing dictionaries.  Instances of a class tend to get the same
+   attributes, set in the same order, so a class keeps one keys object that
+   the __dict__ of each of its instances can use, holding only a values
+   array of its own.  See insertdict_split() for when a dict has to give the
+   shared keys up. */
+
+/* Return new shared keys for a class, or NULL if they can't be had.  No
+   exception is set in the latter case; the class just won't share keys. */
+PyDictKeysObject *
+_PyDict_NewKeysForClass(void)
+{
+    PyDictKeysObject *keys = new_keys_object(PyDict_MINSIZE);
+    if (keys == NULL)
+        PyErr_Clear();
+    return keys;
+}
+
+void
+_PyDictKeys_DecRef(PyDictKeysObject *keys)
+{
+    DK_DECREF(keys);
+}
+
+/* Return a new empty dict using the cached keys, or a plain dict if there
+   aren't any. */
+PyObject *
+_PyDict_NewShared(PyDictKeysObject *cached)
+{
+    PyDictObject *mp;
+    PyObject **values;
+
+    if (cached == NULL)
+        return PyDict_New();
+    values = new_values(USABLE_FRACTION(DK_SIZE(cached)));
+    if (values == NULL)
+        return NULL;
+    mp = (PyDictObject *)PyDict_New();
+    if (mp == NULL) {
+        free_values(values);
+        return NULL;
+    }
+    DK_INCREF(cached);
+    mp->ma_keys = cached;
+    mp->ma_values = values;
+    return (PyObject *)mp;
+}
+
+/* Turn the combined table of mp into shared keys plus a values array for
+   mp, and return a new reference to the keys.  Only tables of string keys
+   without deletions qualify; NULL is returned otherwise, with no error set
+   unless memory ran out. */
+static PyDictKeysObject *
+make_keys_shared(PyDictObject *mp)
+{
+    PyDictKeysObject *keys = mp->ma_keys;
+    PyDictEntry *ep;
+    PyObject **values;
+    Py_ssize_t i;
+
+    if (mp->ma_values != NULL || keys == Py_EMPTY_KEYS ||
+        keys->dk_lookup != lookdict_string ||
+        keys->dk_nentries != mp->ma_used)
+        return NULL;
+    values = new_values(USABLE_FRACTION(DK_SIZE(keys)));
+    if (values == NULL)
+        return NULL;
+    ep = DK_ENTRIES(keys);
+    for (i = 0; i < mp->ma_used; i++) {
+        values[i] = ep[i].me_value;
+        ep[i].me_value = NULL;
+    }
+    mp->ma_values = values;
+    DK_INCREF(keys);
+    return keys;
+}
+
+/* PyDict_SetItem() for the __dict__ of an instance whose class keeps its
+   shared keys in *cachedp.  When the dict had to stop sharing because the
+   shared keys were full, its new, larger table becomes the shared keys for
+   instances created from now on. */
+int
+_PyDict_SetItemShared(PyDictKeysObject **cachedp, PyObject *op,
+                      PyObject *key, PyObject *value)
+{
+    PyDictObject *mp = (PyDictObject *)op;
+    PyDictKeysObject *cached = *cachedp, *keys;
+    int was_shared;
+
+    assert(PyDict_Check(op));
+    was_shared = cached != NULL && mp->ma_keys == cached &&
+        mp->ma_values != NULL;
+    if (PyDict_SetItem(op, key, value) < 0)
+        return -1;
+    if (was_shared && mp->ma_values == NULL && *cachedp == cached &&
+        cached->dk_usable == 0) {
+        keys = make_keys_shared(mp);
+        if (keys == NULL) {
+            if (PyErr_Occurred())
+                PyErr_Clear();
+            return 0;
+        }
+        *cachedp = keys;
+        DK_DECREF(cached);
+    }
+    return 0;
+}
+
 Py_ssize_t
 PyDict_Size(PyObject *mp)
 {
@@ -1723,11 +2668,13 @@ characterize(PyDictObject *a, PyDictObject *b, PyObject **pval)
     Py_ssize_t i;
     int cmp;
 
-    for (i = 0; i <= a->ma_mask; i++) {
+    for (i = 0; i < a->ma_keys->dk_nentries; i++) {
         PyObject *thiskey, *thisaval, *thisbval;
-        if (a->ma_table[i].me_value == NULL)
+        /* The comparisons run arbitrary code. */
+        FINISH_RESIZE(a);
+        if (DICT_VALUE(a, i) == NULL)
             continue;
-        thiskey = a->ma_table[i].me_key;
+        thiskey = DK_ENTRIES(a->ma_keys)[i].me_key;
         Py_INCREF(thiskey);  /* keep alive across compares */
         if (akey != NULL) {
             cmp = PyObject_RichCompareBool(akey, thiskey, Py_LT);
@@ -1735,9 +2682,10 @@ characterize(PyDictObject *a, PyDictObject *b, PyObject **pval)
                 Py_DECREF(thiskey);
                 goto Fail;
             }
+            FINISH_RESIZE(a);
             if (cmp > 0 ||
-                i > a->ma_mask ||
-                a->ma_table[i].me_value == NULL)
+                i >= a->ma_keys->dk_nentries ||
+                DICT_VALUE(a, i) == NULL)
             {
                 /* Not the *smallest* a key; or maybe it is
                  * but the compare shrunk the dict so we can't
@@ -1751,7 +2699,7 @@ characterize(PyDictObject *a, PyDictObject *b, PyObject **pval)
         }
 
         /* Compare a[thiskey] to b[thiskey]; cmp <- true iff equal. */
-        thisaval = a->ma_table[i].me_value;
+        thisaval = DICT_VALUE(a, i);
         assert(thisaval);
         Py_INCREF(thisaval);   /* keep alive */
         thisbval = PyDict_GetItem((PyObject *)b, thiskey);
@@ -1851,12 +2799,17 @@ dict_equal(PyDictObject *a, PyDictObject *b)
         return 0;
 
     /* Same # of entries -- check all of 'em.  Exit early on any diff. */
-    for (i = 0; i <= a->ma_mask; i++) {
-        PyObject *aval = a->ma_table[i].me_value;
+    for (i = 0; i < a->ma_keys->dk_nentries; i++) {
+        PyDictEntry *ep;
+        PyObject *aval;
+        /* The comparisons run arbitrary code. */
+        FINISH_RESIZE(a);
+        ep = &DK_ENTRIES(a->ma_keys)[i];
+        aval = DICT_VALUE(a, i);
         if (aval != NULL) {
             int cmp;
             PyObject *bval;
-            PyObject *key = a->ma_table[i].me_key;
+            PyObject *key = ep->me_key;
             /* temporarily bump aval's refcount to ensure it stays
                alive until we're done with it */
             Py_INCREF(aval);
@@ -1908,7 +2861,7 @@ static PyObject *
 dict_contains(register PyDictObject *mp, PyObject *key)
 {
     long hash;
-    PyDictEntry *ep;
+    Py_ssize_t ix;
 
     if (!PyString_CheckExact(key) ||
         (hash = ((PyStringObject *) key)->ob_shash) == -1) {
@@ -1916,10 +2869,10 @@ dict_contains(register PyDictObject *mp, PyObject *key)
         if (hash == -1)
             return NULL;
     }
-    ep = (mp->ma_lookup)(mp, key, hash);
-    if (ep == NULL)
+    ix = (mp->ma_keys->dk_lookup)(mp, key, hash, NULL);
+    if (ix == DKIX_ERROR)
         return NULL;
-    return PyBool_FromLong(ep->me_value != NULL);
+    return PyBool_FromLong(ix >= 0 && DICT_VALUE(mp, ix) != NULL);
 }
 
 static PyObject *
@@ -1938,7 +2891,7 @@ dict_get(register PyDictObject *mp, PyObject *args)
     PyObject *failobj = Py_None;
     PyObject *val = NULL;
     long hash;
-    PyDictEntry *ep;
+    Py_ssize_t ix;
 
     if (!PyArg_UnpackTuple(args, "get", 1, 2, &key, &failobj))
         return NULL;
@@ -1949,11 +2902,10 @@ dict_get(register PyDictObject *mp, PyObject *args)
         if (hash == -1)
             return NULL;
     }
-    ep = (mp->ma_lookup)(mp, key, hash);
-    if (ep == NULL)
+    ix = (mp->ma_keys->dk_lookup)(mp, key, hash, NULL);
+    if (ix == DKIX_ERROR)
         return NULL;
-    val = ep->me_value;
-    if (val == NULL)
+    if (ix == DKIX_EMPTY || (val = DICT_VALUE(mp, ix)) == NULL)
         val = failobj;
     Py_INCREF(val);
     return val;
@@ -1967,7 +2919,7 @@ dict_setdefault(register PyDictObject *mp, PyObject *args)
     PyObject *failobj = Py_None;
     PyObject *val = NULL;
     long hash;
-    PyDictEntry *ep;
+    Py_ssize_t ix, hashpos;
 
     if (!PyArg_UnpackTuple(args, "setdefault", 1, 2, &key, &failobj))
         return NULL;
@@ -1978,14 +2930,18 @@ dict_setdefault(register PyDictObject *mp, PyObject *args)
         if (hash == -1)
             return NULL;
     }
-    ep = (mp->ma_lookup)(mp, key, hash);
-    if (ep == NULL)
+    ix = (mp->ma_keys->dk_lookup)(mp, key, hash, &hashpos);
+    if (ix == DKIX_ERROR)
         return NULL;
-    val = ep->me_value;
-    if (val == NULL) {
-        if (dict_set_item_by_hash_or_entry((PyObject*)mp, key, hash, ep,
-                                           failobj) == 0)
-            val = failobj;
+    if (ix == DKIX_EMPTY || (val = DICT_VALUE(mp, ix)) == NULL) {
+        int err;
+        Py_INCREF(key);
+        Py_INCREF(failobj);
+        if (mp->ma_values != NULL)
+            err = insertdict(mp, key, hash, failobj);
+        else
+            err = insert_new_entry(mp, key, hash, hashpos, failobj);
+        val = err == 0 ? failobj : NULL;
     }
     Py_XINCREF(val);
     return val;
@@ -2003,7 +2959,7 @@ static PyObject *
 dict_pop(PyDictObject *mp, PyObject *args)
 {
     long hash;
-    PyDictEntry *ep;
+    Py_ssize_t ix, hashpos;
     PyObject *old_value, *old_key;
     PyObject *key, *deflt = NULL;
 
@@ -2023,10 +2979,10 @@ dict_pop(PyDictObject *mp, PyObject *args)
         if (hash == -1)
             return NULL;
     }
-    ep = (mp->ma_lookup)(mp, key, hash);
-    if (ep == NULL)
+    ix = (mp->ma_keys->dk_lookup)(mp, key, hash, &hashpos);
+    if (ix == DKIX_ERROR)
         return NULL;
-    if (ep->me_value == NULL) {
+    if (ix == DKIX_EMPTY || DICT_VALUE(mp, ix) == NULL) {
         if (deflt) {
             Py_INCREF(deflt);
             return deflt;
@@ -2034,12 +2990,12 @@ dict_pop(PyDictObject *mp, PyObject *args)
         set_key_error(key);
         return NULL;
     }
-    old_key = ep->me_key;
-    Py_INCREF(dummy);
-    ep->me_key = dummy;
-    old_value = ep->me_value;
-    ep->me_value = NULL;
-    mp->ma_used--;
+    if (mp->ma_values != NULL) {
+        if (unshare_table(mp) != 0)
+            return NULL;
+        hashpos = lookdict_index(mp->ma_keys, hash, ix);
+    }
+    delitem_common(mp, hashpos, ix, &old_key, &old_value);
     Py_DECREF(old_key);
     return old_value;
 }
@@ -2047,8 +3003,8 @@ dict_pop(PyDictObject *mp, PyObject *args)
 static PyObject *
 dict_popitem(PyDictObject *mp)
 {
-    Py_ssize_t i = 0;
-    PyDictEntry *ep;
+    Py_ssize_t i, j;
+    PyDictEntry *ep0, *ep;
     PyObject *res;
 
     /* Allocate the result tuple before checking the size.  Believe it
@@ -2069,49 +3025,68 @@ dict_popitem(PyDictObject *mp)
                         "popitem(): dictionary is empty");
         return NULL;
     }
-    /* Set ep to "the first" dict entry with a value.  We abuse the hash
-     * field of slot 0 to hold a search finger:
-     * If slot 0 has a value, use slot 0.
-     * Else slot 0 is being used to hold a search finger,
-     * and we use its hash value as the first index to look.
-     */
-    ep = &mp->ma_table[0];
-    if (ep->me_value == NULL) {
-        i = ep->me_hash;
-        /* The hash field may be a real hash value, or it may be a
-         * legit search finger, or it may be a once-legit search
-         * finger that's out of bounds now because it wrapped around
-         * or the table shrunk -- simply make sure it's in bounds now.
-         */
-        if (i > mp->ma_mask || i < 1)
-            i = 1;              /* skip slot 0 */
-        while ((ep = &mp->ma_table[i])->me_value == NULL) {
-            i++;
-            if (i > mp->ma_mask)
-                i = 1;
-        }
+    if (mp->ma_values != NULL && unshare_table(mp) != 0) {
+        Py_DECREF(res);
+        return NULL;
     }
+    FINISH_RESIZE(mp);
+    /* Pop the last entry with a value, i.e. the most recently inserted
+     * item.  Trailing deleted entries are dropped along the way, so
+     * repeated popitem() calls don't rescan them.
+     */
+    ep0 = DK_ENTRIES(mp->ma_keys);
+    i = mp->ma_keys->dk_nentries - 1;
+    while (i >= 0 && ep0[i].me_value == NULL)
+        i--;
+    assert(i >= 0);
+    ep = &ep0[i];
+    j = lookdict_index(mp->ma_keys, (long)ep->me_hash, i);
+    assert(j >= 0);
+    dk_set_index(mp->ma_keys, j, DKIX_DUMMY);
     PyTuple_SET_ITEM(res, 0, ep->me_key);
     PyTuple_SET_ITEM(res, 1, ep->me_value);
-    Py_INCREF(dummy);
-    ep->me_key = dummy;
+    ep->me_key = NULL;
     ep->me_value = NULL;
+    /* The index slot stays a DKIX_DUMMY, so dk_usable can't grow back. */
+    mp->ma_keys->dk_nentries = i;
     mp->ma_used--;
-    assert(mp->ma_table[0].me_value == NULL);
-    mp->ma_table[0].me_hash = i + 1;  /* next place to start */
+    DICT_MODIFIED(mp);
     return res;
 }
 
 static int
 dict_traverse(PyObject *op, visitproc visit, void *arg)
 {
-    Py_ssize_t i = 0;
-    PyObject *pk;
-    PyObject *pv;
-
-    while (PyDict_Next(op, &i, &pk, &pv)) {
-        Py_VISIT(pk);
-        Py_VISIT(pv);
+    PyDictObject *mp = (PyDictObject *)op;
+    PyDictKeysObject *keys = mp->ma_keys, *oldkeys = keys->dk_old;
+    PyDictEntry *ep = DK_ENTRIES(keys), *oldep = NULL;
+    Py_ssize_t i = 0, moved = 0, oldn = 0;
+
+    if (mp->ma_values != NULL) {
+        /* The shared keys are owned by the class, and are all strings. */
+        for (i = 0; i < keys->dk_nentries; i++)
+            Py_VISIT(mp->ma_values[i]);
+        return 0;
+    }
+    /* The collector may traverse from several threads at once, so a
+       resize in progress is left alone:  the entries not moved yet are
+       read from the old table. */
+    if (oldkeys != NULL) {
+        oldep = DK_ENTRIES(oldkeys);
+        moved = DK_MOVED(oldkeys);
+        oldn = oldkeys->dk_nentries;
+    }
+    for (i = 0; i < keys->dk_nentries; i++) {
+        if (i >= moved && i < oldn && oldep[i].me_hash != ENTRY_MOVED) {
+            if (oldep[i].me_value != NULL) {
+                Py_VISIT(oldep[i].me_key);
+                Py_VISIT(oldep[i].me_value);
+            }
+        }
+        else if (ep[i].me_value != NULL) {
+            Py_VISIT(ep[i].me_key);
+            Py_VISIT(ep[i].me_value);
+        }
     }
     return 0;
 }
@@ -2153,8 +3128,13 @@ dict_sizeof(PyDictObject *mp)
     Py_ssize_t res;
 
     res = sizeof(PyDictObject);
-    if (mp->ma_table != mp->ma_smalltable)
-        res = res + (mp->ma_mask + 1) * sizeof(PyDictEntry);
+    if (mp->ma_values != NULL)
+        res += USABLE_FRACTION(DK_SIZE(mp->ma_keys)) * sizeof(PyObject *);
+    /* Shared keys are accounted to the class, not to each instance dict. */
+    if (mp->ma_keys != Py_EMPTY_KEYS && mp->ma_keys->dk_refcnt == 1)
+        res += keys_nbytes(DK_SIZE(mp->ma_keys));
+    if (mp->ma_keys->dk_old != NULL)
+        res += keys_nbytes(DK_SIZE(mp->ma_keys->dk_old));
     return PyInt_FromSsize_t(res);
 }
 
@@ -2180,8 +3160,8 @@ PyDoc_STRVAR(pop__doc__,
 If key is not found, d is returned if given, otherwise KeyError is raised");
 
 PyDoc_STRVAR(popitem__doc__,
-"D.popitem() -> (k, v), remove and return some (key, value) pair as a\n\
-2-tuple; but raise KeyError if D is empty.");
+"D.popitem() -> (k, v), remove and return the most recently inserted\n\
+(key, value) pair as a 2-tuple; but raise KeyError if D is empty.");
 
 PyDoc_STRVAR(keys__doc__,
 "D.keys() -> list of D's keys");
@@ -2281,7 +3261,7 @@ PyDict_Contains(PyObject *op, PyObject *key)
 {
     long hash;
     PyDictObject *mp = (PyDictObject *)op;
-    PyDictEntry *ep;
+    Py_ssize_t ix;
 
     if (!PyString_CheckExact(key) ||
         (hash = ((PyStringObject *) key)->ob_shash) == -1) {
@@ -2289,8 +3269,10 @@ PyDict_Contains(PyObject *op, PyObject *key)
         if (hash == -1)
             return -1;
     }
-    ep = (mp->ma_lookup)(mp, key, hash);
-    return ep == NULL ? -1 : (ep->me_value != NULL);
+    ix = (mp->ma_keys->dk_lookup)(mp, key, hash, NULL);
+    if (ix == DKIX_ERROR)
+        return -1;
+    return ix >= 0 && DICT_VALUE(mp, ix) != NULL;
 }
 
 /* Internal version of PyDict_Contains used when the hash value is already known */
@@ -2298,10 +3280,80 @@ int
 _PyDict_Contains(PyObject *op, PyObject *key, long hash)
 {
     PyDictObject *mp = (PyDictObject *)op;
-    PyDictEntry *ep;
+    Py_ssize_t ix;
+
+    ix = (mp->ma_keys->dk_lookup)(mp, key, hash, NULL);
+    if (ix == DKIX_ERROR)
+        return -1;
+    return ix >= 0 && DICT_VALUE(mp, ix) != NULL;
+}
+
+void
+_PyDict_Watch(PyObject *op)
+{
+    assert(PyDict_Check(op));
+    ((PyDictObject *)op)->ma_version_tag |= DICT_WATCHED;
+}
+
+unsigned PY_LONG_LONG
+_PyDict_GetVersion(PyObject *op)
+{
+    if (op == NULL || !PyDict_Check(op)) {
+        PyErr_BadInternalCall();
+        return 0;
+    }
+    return ((PyDictObject *)op)->ma_version_tag;
+}
+
+PyObject *
+_PyDict_LoadGlobal(PyObject *globals, PyObject *builtins, PyObject *key,
+                   _PyDictLookupCache *cache)
+{
+    PyDictObject *g = (PyDictObject *)globals;
+    PyDictObject *b = (PyDictObject *)builtins;
+    unsigned PY_LONG_LONG gversion, bversion;
+    PyObject *value;
+    Py_ssize_t ix;
+    long hash;
+
+    if (globals == NULL || !PyDict_Check(globals) ||
+        (builtins != NULL && !PyDict_Check(builtins))) {
+        PyErr_BadInternalCall();
+        return NULL;
+    }
+    gversion = g->ma_version_tag;
+    if (cache->globals_version == gversion &&
+        (cache->builtins_version == 0 ||
+         (b != NULL && cache->builtins_version == b->ma_version_tag)))
+        return cache->value;
 
-    ep = (mp->ma_lookup)(mp, key, hash);
-    return ep == NULL ? -1 : (ep->me_value != NULL);
+    if (!PyString_CheckExact(key) ||
+        (hash = ((PyStringObject *) key)->ob_shash) == -1) {
+        hash = PyObject_Hash(key);
+        if (hash == -1)
+            return NULL;
+    }
+    /* The tags are read before looking:  a comparison that changes
+       either dict then also leaves the cache stale. */
+    ix = (g->ma_keys->dk_lookup)(g, key, hash, NULL);
+    if (ix == DKIX_ERROR)
+        return NULL;
+    if (ix >= 0 && (value = DICT_VALUE(g, ix)) != NULL) {
+        cache->globals_version = gversion;
+        cache->builtins_version = 0;
+        cache->value = value;
+        return value;
+    }
+    if (b == NULL)
+        return NULL;
+    bversion = b->ma_version_tag;
+    ix = (b->ma_keys->dk_lookup)(b, key, hash, NULL);
+    if (ix == DKIX_ERROR || ix < 0 || (value = DICT_VALUE(b, ix)) == NULL)
+        return NULL;
+    cache->globals_version = gversion;
+    cache->builtins_version = bversion;
+    cache->value = value;
+    return value;
 }
 
 /* Hack to implement "key in dict" */
@@ -2328,9 +3380,8 @@ dict_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
     if (self != NULL) {
         PyDictObject *d = (PyDictObject *)self;
         /* It's guaranteed that tp->alloc zeroed out the struct. */
-        assert(d->ma_table == NULL && d->ma_fill == 0 && d->ma_used == 0);
-        INIT_NONZERO_DICT_SLOTS(d);
-        d->ma_lookup = lookdict_string;
+        assert(d->ma_keys == NULL && d->ma_used == 0);
+        INIT_EMPTY_DICT(d);
         /* The object has been implicitly tracked by tp_alloc */
         if (type == &PyDict_Type)
             _PyObject_GC_UNTRACK(d);
@@ -2524,9 +3575,9 @@ static PyMethodDef dictiter_methods[] = {
 
 static PyObject *dictiter_iternextkey(dictiterobject *di)
 {
-    PyObject *key;
-    register Py_ssize_t i, mask;
-    register PyDictEntry *ep;
+    PyObject *key, *value;
+    Py_ssize_t i;
+    PyDictEntry *ep;
     PyDictObject *d = di->di_dict;
 
     if (d == NULL)
@@ -2543,15 +3594,12 @@ static PyObject *dictiter_iternextkey(dictiterobject *di)
     i = di->di_pos;
     if (i < 0)
         goto fail;
-    ep = d->ma_table;
-    mask = d->ma_mask;
-    while (i <= mask && ep[i].me_value == NULL)
-        i++;
-    di->di_pos = i+1;
-    if (i > mask)
+    i = dict_next_item(d, i, &ep, &value);
+    if (i < 0)
         goto fail;
+    di->di_pos = i+1;
     di->len--;
-    key = ep[i].me_key;
+    key = ep->me_key;
     Py_INCREF(key);
     return key;
 
@@ -2597,8 +3645,8 @@ PyTypeObject PyDictIterKey_Type = {
 static PyObject *dictiter_iternextvalue(dictiterobject *di)
 {
     PyObject *value;
-    register Py_ssize_t i, mask;
-    register PyDictEntry *ep;
+    Py_ssize_t i;
+    PyDictEntry *ep;
     PyDictObject *d = di->di_dict;
 
     if (d == NULL)
@@ -2613,15 +3661,11 @@ static PyObject *dictiter_iternextvalue(dictiterobject *di)
     }
 
     i = di->di_pos;
-    mask = d->ma_mask;
-    if (i < 0 || i > mask)
+    if (i < 0)
+        goto fail;
+    i = dict_next_item(d, i, &ep, &value);
+    if (i < 0)
         goto fail;
-    ep = d->ma_table;
-    while ((value=ep[i].me_value) == NULL) {
-        i++;
-        if (i > mask)
-            goto fail;
-    }
     di->di_pos = i+1;
     di->len--;
     Py_INCREF(value);
@@ -2669,8 +3713,8 @@ PyTypeObject PyDictIterValue_Type = {
 static PyObject *dictiter_iternextitem(dictiterobject *di)
 {
     PyObject *key, *value, *result = di->di_result;
-    register Py_ssize_t i, mask;
-    register PyDictEntry *ep;
+    Py_ssize_t i;
+    PyDictEntry *ep;
     PyDictObject *d = di->di_dict;
 
     if (d == NULL)
@@ -2687,13 +3731,10 @@ static PyObject *dictiter_iternextitem(dictiterobject *di)
     i = di->di_pos;
     if (i < 0)
         goto fail;
-    ep = d->ma_table;
-    mask = d->ma_mask;
-    while (i <= mask && ep[i].me_value == NULL)
-        i++;
-    di->di_pos = i+1;
-    if (i > mask)
+    i = dict_next_item(d, i, &ep, &value);
+    if (i < 0)
         goto fail;
+    di->di_pos = i+1;
 
     if (result->ob_refcnt == 1) {
         Py_INCREF(result);
@@ -2705,8 +3746,7 @@ static PyObject *dictiter_iternextitem(dictiterobject *di)
             return NULL;
     }
     di->len--;
-    key = ep[i].me_key;
-    value = ep[i].me_value;
+    key = ep->me_key;
     Py_INCREF(key);
     Py_INCREF(value);
     PyTuple_SET_ITEM(result, 0, key);
@@ -21,36 +21,69 @@ extern int finite(double);
 #endif
 
 /* Special free list -- see comments for same code in intobject.c. */
-#define BLOCK_SIZE      1000    /* 1K less typical malloc overhead */
-#define BHEAD_SIZE      8       /* Enough for a 64-bit pointer */
-#define N_FLOATOBJECTS  ((BLOCK_SIZE - BHEAD_SIZE) / sizeof(PyFloatObject))
-
-struct _floatblock {
-    struct _floatblock *next;
-    PyFloatObject objects[N_FLOATOBJECTS];
-};
-
-typedef struct _floatblock PyFloatBlock;
+#ifndef PyFloat_MAXFREELIST
+#define PyFloat_MAXFREELIST     10000
+#endif
 
-static PyFloatBlock *block_list = NULL;
 static PyFloatObject *free_list = NULL;
+static int numfree = 0;
+static int lowwater = 0;
+static int highwater = 0;
+
+static Py_ssize_t count_hits = 0;
+static Py_ssize_t count_misses = 0;
+static Py_ssize_t count_frees = 0;
+static Py_ssize_t count_released = 0;
 
 static PyFloatObject *
-fill_free_list(void)
+float_alloc(void)
+{
+    PyFloatObject *op = free_list;
+    if (op != NULL) {
+        free_list = (PyFloatObject *)Py_TYPE(op);
+        if (--numfree < lowwater)
+            lowwater = numfree;
+        count_hits++;
+        return op;
+    }
+    op = (PyFloatObject *)PyObject_MALLOC(sizeof(PyFloatObject));
+    if (op == NULL)
+        return (PyFloatObject *)PyErr_NoMemory();
+    count_misses++;
+    return op;
+}
+
+static void
+float_release(PyFloatObject *op)
+{
+    count_frees++;
+    if (numfree < PyFloat_MAXFREELIST) {
+        Py_TYPE(op) = (struct _typeobject *)free_list;
+        free_list = op;
+        if (++numfree > highwater)
+            highwater = numfree;
+    }
+    else {
+        PyObject_FREE(op);
+        count_released++;
+    }
+}
+
+static int
+release_free_list(int n)
 {
-    PyFloatObject *p, *q;
-    /* XXX Float blocks escape the object heap. Use PyObject_MALLOC ??? */
-    p = (PyFloatObject *) PyMem_MALLOC(sizeof(PyFloatBlock));
-    if (p == NULL)
-        return (PyFloatObject *) PyErr_NoMemory();
-    ((PyFloatBlock *)p)->next = block_list;
-    block_list = (PyFloatBlock *)p;
-    p = &((PyFloatBlock *)p)->objects[0];
-    q = p + N_FLOATOBJECTS;
-    while (--q > p)
-        Py_TYPE(q) = (struct _typeobject *)(q-1);
-    Py_TYPE(q) = NULL;
-    return p + N_FLOATOBJECTS - 1;
+    PyFloatObject *op;
+    int i;
+
+    for (i = 0; i < n && free_list != NULL; i++) {
+        op = free_list;
+        free_list = (PyFloatObject *)Py_TYPE(op);
+        PyObject_FREE(op);
+    }
+    numfree -= i;
+    count_released += i;
+    lowwater = numfree;
+    return i;
 }
 
 double
@@ -142,13 +175,9 @@ PyObject *
 PyFloat_FromDouble(double fval)
 {
     register PyFloatObject *op;
-    if (free_list == NULL) {
-        if ((free_list = fill_free_list()) == NULL)
-            return NULL;
-    }
+    if ((op = float_alloc()) == NULL)
+        return NULL;
     /* Inline PyObject_New */
-    op = free_list;
-    free_list = (PyFloatObject *)Py_TYPE(op);
     PyObject_INIT(op, &PyFloat_Type);
     op->ob_fval = fval;
     return (PyObject *) op;
@@ -239,10 +268,8 @@ PyFloat_FromString(PyObject *v, char **pend)
 static void
 float_dealloc(PyFloatObject *op)
 {
-    if (PyFloat_CheckExact(op)) {
-        Py_TYPE(op) = (struct _typeobject *)free_list;
-        free_list = op;
-    }
+    if (PyFloat_CheckExact(op))
+        float_release(op);
     else
         Py_TYPE(op)->tp_free((PyObject *)op);
 }
@@ -2204,96 +2231,49 @@ _PyFloat_Init(void)
 int
 PyFloat_ClearFreeList(void)
 {
-    PyFloatObject *p;
-    PyFloatBlock *list, *next;
-    int i;
-    int u;                      /* remaining unfreed ints per block */
-    int freelist_size = 0;
-
-    list = block_list;
-    block_list = NULL;
-    free_list = NULL;
-    while (list != NULL) {
-        u = 0;
-        for (i = 0, p = &list->objects[0];
-             i < N_FLOATOBJECTS;
-             i++, p++) {
-            if (PyFloat_CheckExact(p) && Py_REFCNT(p) != 0)
-                u++;
-        }
-        next = list->next;
-        if (u) {
-            list->next = block_list;
-            block_list = list;
-            for (i = 0, p = &list->objects[0];
-                 i < N_FLOATOBJECTS;
-                 i++, p++) {
-                if (!PyFloat_CheckExact(p) ||
-                    Py_REFCNT(p) == 0) {
-                    Py_TYPE(p) = (struct _typeobject *)
-                        free_list;
-                    free_list = p;
-                }
-            }
-        }
-        else {
-            PyMem_FREE(list);
-        }
-        freelist_size += u;
-        list = next;
-    }
-    return freelist_size;
+    return release_free_list(numfree);
+}
+
+int
+_PyFloat_TrimFreeList(void)
+{
+    return release_free_list(lowwater);
+}
+
+PyObject *
+_PyFloat_GetFreeListStats(void)
+{
+    return Py_BuildValue("{sisisisisnsnsnsnsn}",
+                         "size", numfree,
+                         "limit", PyFloat_MAXFREELIST,
+                         "highwater", highwater,
+                         "lowwater", lowwater,
+                         "hits", count_hits,
+                         "misses", count_misses,
+                         "frees", count_frees,
+                         "released", count_released,
+                         "live", count_hits + count_misses - count_frees);
 }
 
 void
 PyFloat_Fini(void)
 {
-    PyFloatObject *p;
-    PyFloatBlock *list;
-    int i;
-    int u;                      /* total unfreed floats per block */
+    Py_ssize_t u;               /* total unfreed floats */
 
-    u = PyFloat_ClearFreeList();
+    (void)PyFloat_ClearFreeList();
 
     if (!Py_VerboseFlag)
         return;
+    u = count_hits + count_misses - count_frees;
     fprintf(stderr, "# cleanup floats");
     if (!u) {
         fprintf(stderr, "\n");
     }
     else {
         fprintf(stderr,
-            ": %d unfreed float%s\n",
+            ": %" PY_FORMAT_SIZE_T "d unfreed float%s\n",
             u, u == 1 ? "" : "s");
     }
-    if (Py_VerboseFlag > 1) {
-        list = block_list;
-        while (list != NULL) {
-            for (i = 0, p = &list->objects[0];
-                 i < N_FLOATOBJECTS;
-                 i++, p++) {
-                if (PyFloat_CheckExact(p) &&
-                    Py_REFCNT(p) != 0) {
-                    char *buf = PyOS_double_to_string(
-                        PyFloat_AS_DOUBLE(p), 'r',
-                        0, 0, NULL);
-                    if (buf) {
-                        /* XXX(twouters) cast
-                           refcount to long
-                           until %zd is
-                           universally
-                           available
-                        */
-                        fprintf(stderr,
-                 "#   <float at %p, refcnt=%ld, val=%s>\n",
-                                    p, (long)Py_REFCNT(p), buf);
-                                    PyMem_Free(buf);
-                            }
-                }
-            }
-            list = list->next;
-        }
-    }
 }
 
 /*----------------------------------------------------------------------------
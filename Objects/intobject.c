@@ -18,50 +18,87 @@ PyInt_GetMax(void)
    but require extra checks for this special case throughout the code.)
    Since a typical Python program spends much of its time allocating
    and deallocating integers, these operations should be very fast.
-   Therefore we use a dedicated allocation scheme with a much lower
-   overhead (in space and time) than straight malloc(): a simple
-   dedicated free list, filled when necessary with memory from malloc().
-
-   block_list is a singly-linked list of all PyIntBlocks ever allocated,
-   linked via their next members.  PyIntBlocks are never returned to the
-   system before shutdown (PyInt_Fini).
+   Therefore we keep a dedicated free list of dead int objects in front
+   of the object allocator.
 
    free_list is a singly-linked list of available PyIntObjects, linked
-   via abuse of their ob_type members.
+   via abuse of their ob_type members.  Every int object comes from
+   PyObject_MALLOC, so the free list is bounded: at most
+   PyInt_MAXFREELIST objects are kept, and the rest go straight back to
+   obmalloc, where emptied pools and arenas can be reused or returned to
+   the system.
+
+   The list is also trimmed by the garbage collector.  lowwater is the
+   shortest the list has been since the last trim; that many objects sat
+   unused for the whole interval, so _PyInt_TrimFreeList() releases them.
+   A full collection empties the list (PyInt_ClearFreeList).
 */
 
-#define BLOCK_SIZE      1000    /* 1K less typical malloc overhead */
-#define BHEAD_SIZE      8       /* Enough for a 64-bit pointer */
-#define N_INTOBJECTS    ((BLOCK_SIZE - BHEAD_SIZE) / sizeof(PyIntObject))
-
-struct _intblock {
-    struct _intblock *next;
-    PyIntObject objects[N_INTOBJECTS];
-};
-
-typedef struct _intblock PyIntBlock;
+#ifndef PyInt_MAXFREELIST
+#define PyInt_MAXFREELIST       10000
+#endif
 
-static PyIntBlock *block_list = NULL;
 static PyIntObject *free_list = NULL;
+static int numfree = 0;
+static int lowwater = 0;
+static int highwater = 0;
+
+/* Free list statistics, reported by sys.getfreeliststats(). */
+static Py_ssize_t count_hits = 0;       /* allocations from free_list */
+static Py_ssize_t count_misses = 0;     /* allocations from obmalloc */
+static Py_ssize_t count_frees = 0;      /* exact ints deallocated */
+static Py_ssize_t count_released = 0;   /* objects given back to obmalloc */
 
 static PyIntObject *
-fill_free_list(void)
+int_alloc(void)
 {
-    PyIntObject *p, *q;
-    /* Python's object allocator isn't appropriate for large blocks. */
-    p = (PyIntObject *) PyMem_MALLOC(sizeof(PyIntBlock));
-    if (p == NULL)
-        return (PyIntObject *) PyErr_NoMemory();
-    ((PyIntBlock *)p)->next = block_list;
-    block_list = (PyIntBlock *)p;
-    /* Link the int objects together, from rear to front, then return
-       the address of the last int object in the block. */
-    p = &((PyIntBlock *)p)->objects[0];
-    q = p + N_INTOBJECTS;
-    while (--q > p)
-        Py_TYPE(q) = (struct _typeobject *)(q-1);
-    Py_TYPE(q) = NULL;
-    return p + N_INTOBJECTS - 1;
+    PyIntObject *v = free_list;
+    if (v != NULL) {
+        free_list = (PyIntObject *)Py_TYPE(v);
+        if (--numfree < lowwater)
+            lowwater = numfree;
+        count_hits++;
+        return v;
+    }
+    v = (PyIntObject *)PyObject_MALLOC(sizeof(PyIntObject));
+    if (v == NULL)
+        return (PyIntObject *)PyErr_NoMemory();
+    count_misses++;
+    return v;
+}
+
+static void
+int_release(PyIntObject *v)
+{
+    count_frees++;
+    if (numfree < PyInt_MAXFREELIST) {
+        Py_TYPE(v) = (struct _typeobject *)free_list;
+        free_list = v;
+        if (++numfree > highwater)
+            highwater = numfree;
+    }
+    else {
+        PyObject_FREE(v);
+        count_released++;
+    }
+}
+
+/* Give the first n objects on the free list back to obmalloc. */
+static int
+release_free_list(int n)
+{
+    PyIntObject *v;
+    int i;
+
+    for (i = 0; i < n && free_list != NULL; i++) {
+        v = free_list;
+        free_list = (PyIntObject *)Py_TYPE(v);
+        PyObject_FREE(v);
+    }
+    numfree -= i;
+    count_released += i;
+    lowwater = numfree;
+    return i;
 }
 
 #ifndef NSMALLPOSINTS
@@ -75,6 +112,7 @@ fill_free_list(void)
    can be shared.
    The integers that are saved are those in the range
    -NSMALLNEGINTS (inclusive) to NSMALLPOSINTS (not inclusive).
+   They are immortal, so sharing them writes nothing.
 */
 static PyIntObject *small_ints[NSMALLNEGINTS + NSMALLPOSINTS];
 #endif
@@ -100,13 +138,9 @@ PyInt_FromLong(long ival)
         return (PyObject *) v;
     }
 #endif
-    if (free_list == NULL) {
-        if ((free_list = fill_free_list()) == NULL)
-            return NULL;
-    }
+    if ((v = int_alloc()) == NULL)
+        return NULL;
     /* Inline PyObject_New */
-    v = free_list;
-    free_list = (PyIntObject *)Py_TYPE(v);
     PyObject_INIT(v, &PyInt_Type);
     v->ob_ival = ival;
     return (PyObject *) v;
@@ -131,10 +165,8 @@ PyInt_FromSsize_t(Py_ssize_t ival)
 static void
 int_dealloc(PyIntObject *v)
 {
-    if (PyInt_CheckExact(v)) {
-        Py_TYPE(v) = (struct _typeobject *)free_list;
-        free_list = v;
-    }
+    if (PyInt_CheckExact(v))
+        int_release(v);
     else
         Py_TYPE(v)->tp_free((PyObject *)v);
 }
@@ -142,8 +174,7 @@ int_dealloc(PyIntObject *v)
 static void
 int_free(PyIntObject *v)
 {
-    Py_TYPE(v) = (struct _typeobject *)free_list;
-    free_list = v;
+    int_release(v);
 }
 
 long
@@ -1461,13 +1492,12 @@ _PyInt_Init(void)
     int ival;
 #if NSMALLNEGINTS + NSMALLPOSINTS > 0
     for (ival = -NSMALLNEGINTS; ival < NSMALLPOSINTS; ival++) {
-          if (!free_list && (free_list = fill_free_list()) == NULL)
-                    return 0;
+        if ((v = int_alloc()) == NULL)
+            return 0;
         /* PyObject_New is inlined */
-        v = free_list;
-        free_list = (PyIntObject *)Py_TYPE(v);
         PyObject_INIT(v, &PyInt_Type);
         v->ob_ival = ival;
+        _Py_SetImmortal((PyObject *)v);
         small_ints[ival + NSMALLNEGINTS] = v;
     }
 #endif
@@ -1477,105 +1507,53 @@ _PyInt_Init(void)
 int
 PyInt_ClearFreeList(void)
 {
-    PyIntObject *p;
-    PyIntBlock *list, *next;
-    int i;
-    int u;                      /* remaining unfreed ints per block */
-    int freelist_size = 0;
-
-    list = block_list;
-    block_list = NULL;
-    free_list = NULL;
-    while (list != NULL) {
-        u = 0;
-        for (i = 0, p = &list->objects[0];
-             i < N_INTOBJECTS;
-             i++, p++) {
-            if (PyInt_CheckExact(p) && p->ob_refcnt != 0)
-                u++;
-        }
-        next = list->next;
-        if (u) {
-            list->next = block_list;
-            block_list = list;
-            for (i = 0, p = &list->objects[0];
-                 i < N_INTOBJECTS;
-                 i++, p++) {
-                if (!PyInt_CheckExact(p) ||
-                    p->ob_refcnt == 0) {
-                    Py_TYPE(p) = (struct _typeobject *)
-                        free_list;
-                    free_list = p;
-                }
-#if NSMALLNEGINTS + NSMALLPOSINTS > 0
-                else if (-NSMALLNEGINTS <= p->ob_ival &&
-                         p->ob_ival < NSMALLPOSINTS &&
-                         small_ints[p->ob_ival +
-                                    NSMALLNEGINTS] == NULL) {
-                    Py_INCREF(p);
-                    small_ints[p->ob_ival +
-                               NSMALLNEGINTS] = p;
-                }
-#endif
-            }
-        }
-        else {
-            PyMem_FREE(list);
-        }
-        freelist_size += u;
-        list = next;
-    }
+    return release_free_list(numfree);
+}
 
-    return freelist_size;
+/* Called by the garbage collector after collecting a young generation. */
+int
+_PyInt_TrimFreeList(void)
+{
+    return release_free_list(lowwater);
+}
+
+PyObject *
+_PyInt_GetFreeListStats(void)
+{
+    return Py_BuildValue("{sisisisisnsnsnsnsn}",
+                         "size", numfree,
+                         "limit", PyInt_MAXFREELIST,
+                         "highwater", highwater,
+                         "lowwater", lowwater,
+                         "hits", count_hits,
+                         "misses", count_misses,
+                         "frees", count_frees,
+                         "released", count_released,
+                         "live", count_hits + count_misses - count_frees);
 }
 
 void
 PyInt_Fini(void)
 {
-    PyIntObject *p;
-    PyIntBlock *list;
-    int i;
-    int u;                      /* total unfreed ints per block */
+    Py_ssize_t u;               /* total unfreed ints */
 
 #if NSMALLNEGINTS + NSMALLPOSINTS > 0
-    PyIntObject **q;
-
-    i = NSMALLNEGINTS + NSMALLPOSINTS;
-    q = small_ints;
-    while (--i >= 0) {
-        Py_XDECREF(*q);
-        *q++ = NULL;
-    }
+    /* The small ints are immortal:  they are left alone, and not
+       reported below. */
+    memset(small_ints, 0, sizeof(small_ints));
 #endif
-    u = PyInt_ClearFreeList();
+    (void)PyInt_ClearFreeList();
     if (!Py_VerboseFlag)
         return;
+    u = count_hits + count_misses - count_frees -
+        (NSMALLNEGINTS + NSMALLPOSINTS);
     fprintf(stderr, "# cleanup ints");
     if (!u) {
         fprintf(stderr, "\n");
     }
     else {
         fprintf(stderr,
-            ": %d unfreed int%s\n",
+            ": %" PY_FORMAT_SIZE_T "d unfreed int%s\n",
             u, u == 1 ? "" : "s");
     }
-    if (Py_VerboseFlag > 1) {
-        list = block_list;
-        while (list != NULL) {
-            for (i = 0, p = &list->objects[0];
-                 i < N_INTOBJECTS;
-                 i++, p++) {
-                if (PyInt_CheckExact(p) && p->ob_refcnt != 0)
-                    /* XXX(twouters) cast refcount to
-                       long until %zd is universally
-                       available
-                     */
-                    fprintf(stderr,
-                "#   <int at %p, refcnt=%ld, val=%ld>\n",
-                                p, (long)p->ob_refcnt,
-                                p->ob_ival);
-            }
-            list = list->next;
-        }
-    }
 }
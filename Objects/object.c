@@ -3,6 +3,7 @@
 
 #include "Python.h"
 #include "funcobject.h"
+#include "structmember.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -214,6 +215,19 @@ Py_DecRef(PyObject *o)
     Py_XDECREF(o);
 }
 
+/* Make op immortal; see Include/object.h.  This can't be undone. */
+void
+_Py_SetImmortal(PyObject *op)
+{
+    if (_Py_IsImmortal(op))
+        return;
+#ifdef Py_REF_DEBUG
+    /* Py_DECREF won't give these back. */
+    _Py_RefTotal -= op->ob_refcnt;
+#endif
+    op->ob_refcnt = _Py_IMMORTAL_REFCNT;
+}
+
 PyObject *
 PyObject_Init(PyObject *op, PyTypeObject *tp)
 {
@@ -1461,6 +1475,157 @@ PyObject_GenericGetAttr(PyObject *obj, PyObject *name)
     return _PyObject_GenericGetAttrWithDict(obj, name, NULL);
 }
 
+/* How a _PyAttrCache finds the attribute */
+#define ATTR_CACHE_DATA         1       /* data descriptor */
+#define ATTR_CACHE_MEMBER       2       /* object slot, read directly */
+#define ATTR_CACHE_INSTANCE     3       /* instance dict, then descr */
+
+/* Remember what the lookup of name in obj's type found.  Return 0 if it
+   can't be cached, for the caller to use PyObject_GetAttr() instead. */
+static int
+fill_attr_cache(PyObject *obj, PyObject *name, _PyAttrCache *cache)
+{
+    PyTypeObject *tp = Py_TYPE(obj);
+    PyObject *descr;
+    PyMemberDef *member;
+
+    if (tp->tp_getattro != PyObject_GenericGetAttr ||
+        !PyString_CheckExact(name) || tp->tp_dict == NULL)
+        return 0;
+    descr = _PyType_Lookup(tp, name);
+    /* _PyType_Lookup() assigns the version tag, when it can. */
+    if (!PyType_HasFeature(tp, Py_TPFLAGS_VALID_VERSION_TAG))
+        return 0;
+    cache->type = tp;
+    cache->version = tp->tp_version_tag;
+    cache->descr = descr;
+    cache->kind = ATTR_CACHE_INSTANCE;
+    if (descr != NULL &&
+        PyType_HasFeature(descr->ob_type, Py_TPFLAGS_HAVE_CLASS) &&
+        descr->ob_type->tp_descr_get != NULL && PyDescr_IsData(descr)) {
+        cache->kind = ATTR_CACHE_DATA;
+        if (Py_TYPE(descr) == &PyMemberDescr_Type) {
+            member = ((PyMemberDescrObject *)descr)->d_member;
+            if ((member->type == T_OBJECT || member->type == T_OBJECT_EX) &&
+                !(member->flags & READ_RESTRICTED)) {
+                cache->kind = ATTR_CACHE_MEMBER;
+                cache->offset = member->offset;
+            }
+        }
+    }
+    return 1;
+}
+
+PyObject *
+_PyObject_GetAttrCached(PyObject *obj, PyObject *name, _PyAttrCache *cache)
+{
+    PyTypeObject *tp = Py_TYPE(obj);
+    PyObject *descr, *dict, *res;
+    PyObject **dictptr;
+    descrgetfunc f;
+
+    if (cache->type == tp && cache->version == tp->tp_version_tag &&
+        PyType_HasFeature(tp, Py_TPFLAGS_VALID_VERSION_TAG))
+        cache->hits++;
+    else {
+        cache->misses++;
+        if (!fill_attr_cache(obj, name, cache))
+            return PyObject_GetAttr(obj, name);
+    }
+
+    /* The type holds on to descr, but the code run below may change it. */
+    descr = cache->descr;
+    switch (cache->kind) {
+    case ATTR_CACHE_MEMBER:
+        res = *(PyObject **)((char *)obj + cache->offset);
+        if (res != NULL) {
+            Py_INCREF(res);
+            return res;
+        }
+        /* Let the descriptor supply None, or raise AttributeError */
+        /* fall through */
+    case ATTR_CACHE_DATA:
+        Py_INCREF(descr);
+        res = descr->ob_type->tp_descr_get(descr, obj, (PyObject *)tp);
+        Py_DECREF(descr);
+        return res;
+    }
+
+    Py_XINCREF(descr);
+    if (tp->tp_dictoffset > 0)
+        dictptr = (PyObject **)((char *)obj + tp->tp_dictoffset);
+    else
+        dictptr = _PyObject_GetDictPtr(obj);
+    if (dictptr != NULL && *dictptr != NULL) {
+        dict = *dictptr;
+        Py_INCREF(dict);
+        res = _PyDict_GetItemHint(dict, name, &cache->hint);
+        if (res != NULL) {
+            Py_INCREF(res);
+            Py_DECREF(dict);
+            Py_XDECREF(descr);
+            return res;
+        }
+        Py_DECREF(dict);
+    }
+    if (descr == NULL) {
+        PyErr_Format(PyExc_AttributeError,
+                     "'%.50s' object has no attribute '%.400s'",
+                     tp->tp_name, PyString_AS_STRING(name));
+        return NULL;
+    }
+    f = NULL;
+    if (PyType_HasFeature(descr->ob_type, Py_TPFLAGS_HAVE_CLASS))
+        f = descr->ob_type->tp_descr_get;
+    if (f == NULL)
+        return descr;
+    res = f(descr, obj, (PyObject *)tp);
+    Py_DECREF(descr);
+    return res;
+}
+
+int
+_PyObject_GetMethod(PyObject *obj, PyObject *name, PyObject **method)
+{
+    PyTypeObject *tp = Py_TYPE(obj);
+    PyObject *descr, *attr;
+    PyObject **dictptr;
+
+    if (PyInstance_Check(obj))
+        return _PyInstance_GetMethod(obj, name, method);
+    if (tp->tp_getattro != PyObject_GenericGetAttr ||
+        !PyString_CheckExact(name) || tp->tp_dict == NULL)
+        goto getattr;
+    descr = _PyType_Lookup(tp, name);
+    if (descr == NULL)
+        goto getattr;
+    /* These are what function and method descriptors bind to, as
+       their __get__ would. */
+    if (!PyFunction_Check(descr) &&
+        !(Py_TYPE(descr) == &PyMethodDescr_Type &&
+          PyObject_TypeCheck(obj, ((PyMethodDescrObject *)descr)->d_type)))
+        goto getattr;
+
+    /* They aren't data descriptors:  the instance dict comes first. */
+    Py_INCREF(descr);
+    dictptr = _PyObject_GetDictPtr(obj);
+    if (dictptr != NULL && *dictptr != NULL) {
+        attr = PyDict_GetItem(*dictptr, name);
+        if (attr != NULL) {
+            Py_INCREF(attr);
+            Py_DECREF(descr);
+            *method = attr;
+            return 0;
+        }
+    }
+    *method = descr;
+    return 1;
+
+  getattr:
+    *method = PyObject_GetAttr(obj, name);
+    return 0;
+}
+
 int
 _PyObject_GenericSetAttrWithDict(PyObject *obj, PyObject *name,
                                  PyObject *value, PyObject *dict)
@@ -1469,6 +1634,7 @@ _PyObject_GenericSetAttrWithDict(PyObject *obj, PyObject *name,
     PyObject *descr;
     descrsetfunc f;
     PyObject **dictptr;
+    PyDictKeysObject **cachedp = NULL;
     int res = -1;
 
     if (!PyString_Check(name)){
@@ -1512,9 +1678,15 @@ _PyObject_GenericSetAttrWithDict(PyObject *obj, PyObject *name,
     if (dict == NULL) {
         dictptr = _PyObject_GetDictPtr(obj);
         if (dictptr != NULL) {
+            /* Instances of heap types share the keys of their __dict__ */
+            if (tp->tp_flags & Py_TPFLAGS_HEAPTYPE)
+                cachedp = &((PyHeapTypeObject *)tp)->ht_cached_keys;
             dict = *dictptr;
             if (dict == NULL && value != NULL) {
-                dict = PyDict_New();
+                if (cachedp != NULL)
+                    dict = _PyDict_NewShared(*cachedp);
+                else
+                    dict = PyDict_New();
                 if (dict == NULL)
                     goto done;
                 *dictptr = dict;
@@ -1525,10 +1697,15 @@ _PyObject_GenericSetAttrWithDict(PyObject *obj, PyObject *name,
         Py_INCREF(dict);
         if (value == NULL)
             res = PyDict_DelItem(dict, name);
+        else if (cachedp != NULL && PyDict_Check(dict))
+            res = _PyDict_SetItemShared(cachedp, dict, name, value);
         else
             res = PyDict_SetItem(dict, name, value);
         if (res < 0 && PyErr_ExceptionMatches(PyExc_KeyError))
             PyErr_SetObject(PyExc_AttributeError, name);
+        else if (_PyObject_GC_IS_TRACKED(dict))
+            /* value may be a container */
+            _PyObject_Retrack(obj);
         Py_DECREF(dict);
         goto done;
     }
@@ -2031,7 +2208,7 @@ static PyTypeObject PyNone_Type = {
 
 PyObject _Py_NoneStruct = {
   _PyObject_EXTRA_INIT
-  1, &PyNone_Type
+  _Py_IMMORTAL_REFCNT, &PyNone_Type
 };
 
 /* NotImplemented is an object that can be used to signal that an
@@ -2062,7 +2239,7 @@ static PyTypeObject PyNotImplemented_Type = {
 
 PyObject _Py_NotImplementedStruct = {
     _PyObject_EXTRA_INIT
-    1, &PyNotImplemented_Type
+    _Py_IMMORTAL_REFCNT, &PyNotImplemented_Type
 };
 
 void
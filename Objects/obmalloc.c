@@ -198,6 +198,30 @@ static int running_on_valgrind = -1;
  */
 #define ARENA_SIZE              (256 << 10)     /* 256KB */
 
+/*
+ * Where madvise() is available, memory that stays unused for a while is
+ * given back to the system without being unmapped:  pools that have been
+ * empty, and (in hugepage mode) arena slots that have been free, for at
+ * least the purge delay.  In hugepage mode, arenas are carved out of
+ * REGION_SIZE-aligned regions that the kernel is asked to back with
+ * transparent huge pages; a region is unmapped once all its arenas have
+ * been purged.  Both are configured with the PYTHONARENAS environment
+ * variable, a comma-separated list of
+ *
+ *     hugepages           carve arenas from huge-page regions
+ *     purge=SECONDS       the purge delay; negative disables purging
+ *     lazy                use MADV_FREE rather than MADV_DONTNEED
+ *
+ * and the delay with sys.setarenapurgedelay().
+ */
+#if defined(ARENAS_USE_MMAP) && defined(MADV_DONTNEED)
+#define WITH_ARENA_PURGE
+#endif
+
+#define REGION_SIZE             (2 << 20)       /* 2MB */
+#define ARENAS_PER_REGION       (REGION_SIZE / ARENA_SIZE)
+#define DEFAULT_PURGE_DELAY     1.0             /* seconds */
+
 #ifdef WITH_MEMORY_LIMITS
 #define MAX_ARENAS              (SMALL_MEMORY_LIMIT / ARENA_SIZE)
 #endif
@@ -231,13 +255,77 @@ static int running_on_valgrind = -1;
  */
 
 /*
- * Python's threads are serialized, so object malloc locking is disabled.
+ * Small blocks may be allocated and freed without holding the GIL, so the
+ * pools are protected by a spin lock.  It is only held for a few list
+ * operations at a time, or while a new arena is obtained from the system.
+ * Where we don't know how to build one, Python's threads are serialized
+ * by the GIL and object malloc locking is disabled.
  */
+#if defined(WITH_THREAD) && defined(_MSC_VER)
+
+#include <windows.h>
+#define OBMALLOC_TAS(lock)      InterlockedExchange((lock), 1)
+#define OBMALLOC_RELEASE(lock)  InterlockedExchange((lock), 0)
+#define OBMALLOC_YIELD()        SwitchToThread()
+#define OBMALLOC_BARRIER()      MemoryBarrier()
+#define OBMALLOC_SPINLOCK
+
+#elif defined(WITH_THREAD) && defined(__GNUC__)
+
+#include <sched.h>
+#define OBMALLOC_TAS(lock)      __sync_lock_test_and_set((lock), 1)
+#define OBMALLOC_RELEASE(lock)  __sync_lock_release(lock)
+#define OBMALLOC_YIELD()        sched_yield()
+#define OBMALLOC_BARRIER()      __sync_synchronize()
+#define OBMALLOC_SPINLOCK
+
+#endif
+
+#ifdef OBMALLOC_SPINLOCK
+
+static void
+obmalloc_spin(volatile long *lock)
+{
+    int n = 0;
+    do {
+        /* don't burn a whole time slice if the holder was preempted */
+        if (++n == 100) {
+            n = 0;
+            OBMALLOC_YIELD();
+        }
+    } while (*lock || OBMALLOC_TAS(lock));
+}
+
+#define SIMPLELOCK_DECL(lock)   static volatile long lock = 0;
+#define SIMPLELOCK_INIT(lock)
+#define SIMPLELOCK_FINI(lock)
+#define SIMPLELOCK_LOCK(lock)                                   \
+    do {                                                        \
+        if (OBMALLOC_TAS(&lock))                                \
+            obmalloc_spin(&lock);                               \
+    } while (0)
+#define SIMPLELOCK_UNLOCK(lock) OBMALLOC_RELEASE(&lock)
+
+#else
+
 #define SIMPLELOCK_DECL(lock)   /* simple lock declaration              */
 #define SIMPLELOCK_INIT(lock)   /* allocate (if needed) and initialize  */
 #define SIMPLELOCK_FINI(lock)   /* free/destroy an existing lock        */
 #define SIMPLELOCK_LOCK(lock)   /* acquire released lock */
 #define SIMPLELOCK_UNLOCK(lock) /* release acquired lock */
+#define OBMALLOC_BARRIER()
+
+#endif
+
+/*
+ * Per-thread block caches are used where the compiler has thread-local
+ * variables and pthread keys can flush them when a thread exits.
+ */
+#if defined(OBMALLOC_SPINLOCK) && defined(__GNUC__) && \
+    defined(HAVE_PTHREAD_H) && !defined(Py_NO_THREAD_LOCAL)
+#define WITH_PYMALLOC_CACHE
+#include <pthread.h>
+#endif
 
 /*
  * Basic types
@@ -258,6 +346,8 @@ static int running_on_valgrind = -1;
 /* When you say memory, my mind reasons in terms of (pointers to) blocks */
 typedef uchar block;
 
+#define PURGE_WORDS     ((ARENA_SIZE / POOL_SIZE + 31) / 32)
+
 /* Pool for small blocks. */
 struct pool_header {
     union { block *_padding;
@@ -312,6 +402,22 @@ struct arena_object {
      */
     struct arena_object* nextarena;
     struct arena_object* prevarena;
+
+    /* The cycle collector's per-pool gc_refs tables, or NULL; see
+     * _PyObject_GCSideRefs().
+     */
+    struct gc_side_table** gc_side;
+
+#ifdef WITH_ARENA_PURGE
+    /* Free pools whose memory was given back to the system.  They are
+     * not on the freepools list, but are counted in nfreepools.
+     */
+    uint purgedpools[PURGE_WORDS];
+
+    /* In hugepage mode, the region and slot the arena occupies. */
+    struct arena_region* region;
+    uint slot;
+#endif
 };
 
 #undef  ROUNDUP
@@ -523,12 +629,321 @@ static struct arena_object* usable_arenas = NULL;
 /* Number of arenas allocated that haven't been free()'d. */
 static size_t narenas_currently_allocated = 0;
 
-#ifdef PYMALLOC_DEBUG
 /* Total number of times malloc() called to allocate an arena. */
 static size_t ntimes_arena_allocated = 0;
 /* High water mark (max value ever seen) for narenas_currently_allocated. */
 static size_t narenas_highwater = 0;
+
+/* Per size class counters for _PyObject_GetAllocStats(), maintained under
+ * the malloc lock:  the pools currently holding blocks of each class, and
+ * the blocks of each class handed out by them (including blocks sitting
+ * in thread caches).
+ */
+static size_t class_pools[NB_SMALL_SIZE_CLASSES];
+static size_t class_blocks[NB_SMALL_SIZE_CLASSES];
+
+/* Arena and pool purging; see WITH_ARENA_PURGE above.  The counters are
+ * kept whether or not purging is available, for _PyObject_GetArenaStats().
+ */
+static double purge_delay = DEFAULT_PURGE_DELAY;
+static int arena_hugepages = 0;
+static size_t npools_purged = 0;        /* pools purged, ever */
+static size_t nslots_purged = 0;        /* arena slots purged, ever */
+static size_t nregions = 0;             /* hugepage regions mapped */
+static size_t bytes_purged = 0;         /* purged and still mapped */
+static size_t bytes_returned = 0;       /* purged, ever */
+
+#ifdef WITH_ARENA_PURGE
+
+#include <time.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+/* A REGION_SIZE-aligned mapping holding ARENAS_PER_REGION arena slots.
+ * Regions with at least one free slot are on the partial_regions list.
+ */
+struct arena_region {
+    uptr address;
+    uint used;                  /* slots holding a live arena */
+    uint marked;                /* free slots seen by the last purge pass */
+    uint purged;                /* free slots given back to the system */
+    struct arena_region *next;
+    struct arena_region *prev;
+};
+
+#define ALL_SLOTS       ((uint)((1UL << ARENAS_PER_REGION) - 1))
+
+static struct arena_region *partial_regions = NULL;
+static int purge_advice = MADV_DONTNEED;
+static int arena_config_read = 0;
+static double purge_last = 0.0;
+
+static double
+purge_clock(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+static void
+read_arena_config(void)
+{
+    char *p, *q;
+
+    arena_config_read = 1;
+    p = Py_GETENV("PYTHONARENAS");
+    while (p != NULL && *p != '\0') {
+        if (strncmp(p, "hugepages", 9) == 0)
+            arena_hugepages = 1;
+        else if (strncmp(p, "purge=", 6) == 0)
+            purge_delay = atof(p + 6);
+#ifdef MADV_FREE
+        else if (strncmp(p, "lazy", 4) == 0)
+            purge_advice = MADV_FREE;
+#endif
+        q = strchr(p, ',');
+        p = q ? q + 1 : NULL;
+    }
+}
+
+static void
+region_link(struct arena_region *r)
+{
+    r->prev = NULL;
+    r->next = partial_regions;
+    if (partial_regions != NULL)
+        partial_regions->prev = r;
+    partial_regions = r;
+}
+
+static void
+region_unlink(struct arena_region *r)
+{
+    if (r->prev != NULL)
+        r->prev->next = r->next;
+    else
+        partial_regions = r->next;
+    if (r->next != NULL)
+        r->next->prev = r->prev;
+}
+
+static struct arena_region *
+new_region(void)
+{
+    struct arena_region *r;
+    uptr base, aligned;
+    void *address;
+
+    r = (struct arena_region *)malloc(sizeof(*r));
+    if (r == NULL)
+        return NULL;
+    /* map twice the size and trim to alignment */
+    address = mmap(NULL, 2 * REGION_SIZE, PROT_READ|PROT_WRITE,
+                   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (address == MAP_FAILED) {
+        free(r);
+        return NULL;
+    }
+    base = (uptr)address;
+    aligned = (base + REGION_SIZE - 1) & ~(uptr)(REGION_SIZE - 1);
+    if (aligned > base)
+        munmap((void *)base, aligned - base);
+    if (aligned + REGION_SIZE < base + 2 * REGION_SIZE)
+        munmap((void *)(aligned + REGION_SIZE),
+               base + REGION_SIZE - aligned);
+#ifdef MADV_HUGEPAGE
+    madvise((void *)aligned, REGION_SIZE, MADV_HUGEPAGE);
 #endif
+    r->address = aligned;
+    r->used = r->marked = r->purged = 0;
+    region_link(r);
+    ++nregions;
+    return r;
+}
+
+/* Find an arena's worth of memory in a region, preferring slots that
+ * were not purged (their pages are still resident).
+ */
+static void *
+region_alloc_arena(struct arena_object *ao)
+{
+    struct arena_region *r = partial_regions;
+    uint avail, slot;
+
+    if (r == NULL && (r = new_region()) == NULL)
+        return NULL;
+    avail = ~r->used & ALL_SLOTS;
+    if (avail & ~r->purged)
+        avail &= ~r->purged;
+    for (slot = 0; !(avail & (1U << slot)); slot++)
+        ;
+    if (r->purged & (1U << slot)) {
+        r->purged &= ~(1U << slot);
+        bytes_purged -= ARENA_SIZE;
+    }
+    r->marked &= ~(1U << slot);
+    r->used |= 1U << slot;
+    if (r->used == ALL_SLOTS)
+        region_unlink(r);
+    ao->region = r;
+    ao->slot = slot;
+    return (void *)(r->address + slot * ARENA_SIZE);
+}
+
+static void
+region_free_arena(struct arena_object *ao)
+{
+    struct arena_region *r = ao->region;
+
+    if (r->used == ALL_SLOTS)
+        region_link(r);
+    r->used &= ~(1U << ao->slot);
+    r->marked &= ~(1U << ao->slot);
+}
+
+/* The first pool of an arena:  index 0 of purgedpools. */
+#define FIRST_POOL(AO) \
+    (((AO)->address + POOL_SIZE_MASK) & ~(uptr)POOL_SIZE_MASK)
+
+static void
+purge_memory(void *p, size_t nbytes)
+{
+    madvise(p, nbytes, purge_advice);
+    bytes_purged += nbytes;
+    bytes_returned += nbytes;
+}
+
+/* One purge pass; the caller holds the malloc lock.  Free pools and free
+ * arena slots are marked the first time a pass sees them, and purged if
+ * they are still free (and so still marked) at the next one.  A free
+ * pool is marked by pointing its prevpool, which the freepools list
+ * doesn't use, at itself.
+ */
+static void
+purge_pass(void)
+{
+    struct arena_object *ao;
+    struct arena_region *r, *rnext;
+
+    for (ao = usable_arenas; ao != NULL; ao = ao->nextarena) {
+        poolp *link = &ao->freepools;
+        poolp pool;
+        while ((pool = *link) != NULL) {
+            uint i;
+            if (pool->prevpool != pool) {
+                pool->prevpool = pool;
+                link = &pool->nextpool;
+                continue;
+            }
+            *link = pool->nextpool;
+            i = (uint)(((uptr)pool - FIRST_POOL(ao)) / POOL_SIZE);
+            ao->purgedpools[i / 32] |= 1U << (i % 32);
+            purge_memory(pool, POOL_SIZE);
+            ++npools_purged;
+        }
+    }
+
+    for (r = partial_regions; r != NULL; r = rnext) {
+        uint idle = ~r->used & ALL_SLOTS & ~r->purged;
+        uint slot;
+        rnext = r->next;
+        for (slot = 0; slot < ARENAS_PER_REGION; slot++) {
+            uint bit = 1U << slot;
+            if (!(idle & bit))
+                continue;
+            if (r->marked & bit) {
+                purge_memory((void *)(r->address + slot * ARENA_SIZE),
+                             ARENA_SIZE);
+                r->purged |= bit;
+                ++nslots_purged;
+            }
+            else
+                r->marked |= bit;
+        }
+        if (r->used == 0 && r->purged == ALL_SLOTS) {
+            region_unlink(r);
+            munmap((void *)r->address, REGION_SIZE);
+            bytes_purged -= REGION_SIZE;
+            --nregions;
+            free(r);
+        }
+    }
+}
+
+/* Called with the malloc lock held whenever a pool becomes empty, and by
+ * _PyObject_PurgeArenas().
+ */
+static void
+maybe_purge(void)
+{
+    double now;
+
+    if (purge_delay < 0.0)
+        return;
+    now = purge_clock();
+    if (now - purge_last < purge_delay)
+        return;
+    purge_last = now;
+    purge_pass();
+}
+
+/* Put one of ao's purged pools back on its (empty) freepools list, with a
+ * fresh header.
+ */
+static void
+unpurge_pool(struct arena_object *ao)
+{
+    uint i, bit;
+    poolp pool;
+
+    assert(ao->freepools == NULL);
+    for (i = 0; ao->purgedpools[i] == 0; i++)
+        assert(i < PURGE_WORDS - 1);
+    for (bit = 0; !(ao->purgedpools[i] & (1U << bit)); bit++)
+        ;
+    ao->purgedpools[i] &= ~(1U << bit);
+    pool = (poolp)(FIRST_POOL(ao) + (i * 32 + bit) * POOL_SIZE);
+    pool->arenaindex = (uint)(ao - arenas);
+    pool->szidx = DUMMY_SIZE_IDX;
+    pool->nextpool = NULL;
+    ao->freepools = pool;
+    bytes_purged -= POOL_SIZE;
+}
+
+static int
+has_purged_pools(struct arena_object *ao)
+{
+    uint i;
+    for (i = 0; i < PURGE_WORDS; i++) {
+        if (ao->purgedpools[i])
+            return 1;
+    }
+    return 0;
+}
+
+/* Forget ao's purged pools when the arena itself goes away. */
+static void
+drop_purged_pools(struct arena_object *ao)
+{
+    uint i, bit;
+    for (i = 0; i < PURGE_WORDS; i++) {
+        for (bit = 0; bit < 32; bit++) {
+            if (ao->purgedpools[i] & (1U << bit))
+                bytes_purged -= POOL_SIZE;
+        }
+        ao->purgedpools[i] = 0;
+    }
+}
+
+#endif /* WITH_ARENA_PURGE */
 
 /* Allocate a new arena.  If we run out of memory, return NULL.  Else
  * allocate a new arena, and return the address of an arena_object
@@ -563,9 +978,24 @@ new_arena(void)
             return NULL;                /* overflow */
 #endif
         nbytes = numarenas * sizeof(*arenas);
+#ifdef OBMALLOC_SPINLOCK
+        /* Py_ADDRESS_IN_RANGE() reads arenas without the lock, so
+         * the old vector must stay valid:  copy instead of realloc,
+         * and never free it.  The vectors double in size, so this
+         * wastes less than the current one.  arenas is published
+         * before maxarenas grows.
+         */
+        arenaobj = (struct arena_object *)malloc(nbytes);
+        if (arenaobj == NULL)
+            return NULL;
+        if (maxarenas)
+            memcpy(arenaobj, arenas, maxarenas * sizeof(*arenas));
+        OBMALLOC_BARRIER();
+#else
         arenaobj = (struct arena_object *)realloc(arenas, nbytes);
         if (arenaobj == NULL)
             return NULL;
+#endif
         arenas = arenaobj;
 
         /* We might need to fix pointers that were copied.  However,
@@ -580,12 +1010,14 @@ new_arena(void)
         /* Put the new arenas on the unused_arena_objects list. */
         for (i = maxarenas; i < numarenas; ++i) {
             arenas[i].address = 0;              /* mark as unassociated */
+            arenas[i].gc_side = NULL;
             arenas[i].nextarena = i < numarenas - 1 ?
                                    &arenas[i+1] : NULL;
         }
 
         /* Update globals. */
         unused_arena_objects = &arenas[maxarenas];
+        OBMALLOC_BARRIER();
         maxarenas = numarenas;
     }
 
@@ -594,7 +1026,21 @@ new_arena(void)
     arenaobj = unused_arena_objects;
     unused_arena_objects = arenaobj->nextarena;
     assert(arenaobj->address == 0);
-#ifdef ARENAS_USE_MMAP
+#ifdef WITH_ARENA_PURGE
+    if (!arena_config_read)
+        read_arena_config();
+    if (arena_hugepages) {
+        address = region_alloc_arena(arenaobj);
+        err = (address == NULL);
+    }
+    else {
+        address = mmap(NULL, ARENA_SIZE, PROT_READ|PROT_WRITE,
+                       MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        err = (address == MAP_FAILED);
+        arenaobj->region = NULL;
+    }
+    memset(arenaobj->purgedpools, 0, sizeof(arenaobj->purgedpools));
+#elif defined(ARENAS_USE_MMAP)
     address = mmap(NULL, ARENA_SIZE, PROT_READ|PROT_WRITE,
                    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
     err = (address == MAP_FAILED);
@@ -613,11 +1059,9 @@ new_arena(void)
     arenaobj->address = (uptr)address;
 
     ++narenas_currently_allocated;
-#ifdef PYMALLOC_DEBUG
     ++ntimes_arena_allocated;
     if (narenas_currently_allocated > narenas_highwater)
         narenas_highwater = narenas_currently_allocated;
-#endif
     arenaobj->freepools = NULL;
     /* pool_address <- first pool-aligned address in the arena
        nfreepools <- number of whole pools that fit after alignment */
@@ -767,424 +1211,814 @@ int Py_ADDRESS_IN_RANGE(void *P, poolp pool) Py_NO_INLINE;
  * Unless the optimizer reorders everything, being too smart...
  */
 
-#undef PyObject_Malloc
-void *
-PyObject_Malloc(size_t nbytes)
+/* Take a block of size class `size` from the pools, or return NULL if
+ * no arena can be had.  The caller must hold the malloc lock.
+ */
+static block *
+allocate_from_pools(uint size)
 {
     block *bp;
     poolp pool;
     poolp next;
-    uint size;
-
-#ifdef WITH_VALGRIND
-    if (UNLIKELY(running_on_valgrind == -1))
-        running_on_valgrind = RUNNING_ON_VALGRIND;
-    if (UNLIKELY(running_on_valgrind))
-        goto redirect;
-#endif
 
-    /*
-     * Limit ourselves to PY_SSIZE_T_MAX bytes to prevent security holes.
-     * Most python internals blindly use a signed Py_ssize_t to track
-     * things without checking for overflows or negatives.
-     * As size_t is unsigned, checking for nbytes < 0 is not required.
-     */
-    if (nbytes > PY_SSIZE_T_MAX)
-        return NULL;
-
-    /*
-     * This implicitly redirects malloc(0).
-     */
-    if ((nbytes - 1) < SMALL_REQUEST_THRESHOLD) {
-        LOCK();
+    ++class_blocks[size];
+    pool = usedpools[size + size];
+    if (pool != pool->nextpool) {
         /*
-         * Most frequent paths first
+         * There is a used pool for this size class.
+         * Pick up the head block of its free list.
          */
-        size = (uint)(nbytes - 1) >> ALIGNMENT_SHIFT;
-        pool = usedpools[size + size];
-        if (pool != pool->nextpool) {
-            /*
-             * There is a used pool for this size class.
-             * Pick up the head block of its free list.
-             */
-            ++pool->ref.count;
-            bp = pool->freeblock;
-            assert(bp != NULL);
-            if ((pool->freeblock = *(block **)bp) != NULL) {
-                UNLOCK();
-                return (void *)bp;
-            }
-            /*
-             * Reached the end of the free list, try to extend it.
-             */
-            if (pool->nextoffset <= pool->maxnextoffset) {
-                /* There is room for another block. */
-                pool->freeblock = (block*)pool +
-                                  pool->nextoffset;
-                pool->nextoffset += INDEX2SIZE(size);
-                *(block **)(pool->freeblock) = NULL;
-                UNLOCK();
-                return (void *)bp;
-            }
-            /* Pool is full, unlink from used pools. */
-            next = pool->nextpool;
-            pool = pool->prevpool;
-            next->prevpool = pool;
-            pool->nextpool = next;
-            UNLOCK();
-            return (void *)bp;
+        ++pool->ref.count;
+        bp = pool->freeblock;
+        assert(bp != NULL);
+        if ((pool->freeblock = *(block **)bp) != NULL) {
+            return bp;
         }
-
-        /* There isn't a pool of the right size class immediately
-         * available:  use a free pool.
+        /*
+         * Reached the end of the free list, try to extend it.
          */
-        if (usable_arenas == NULL) {
-            /* No arena has a free pool:  allocate a new arena. */
+        if (pool->nextoffset <= pool->maxnextoffset) {
+            /* There is room for another block. */
+            pool->freeblock = (block*)pool +
+                              pool->nextoffset;
+            pool->nextoffset += INDEX2SIZE(size);
+            *(block **)(pool->freeblock) = NULL;
+            return bp;
+        }
+        /* Pool is full, unlink from used pools. */
+        next = pool->nextpool;
+        pool = pool->prevpool;
+        next->prevpool = pool;
+        pool->nextpool = next;
+        return bp;
+    }
+
+    /* There isn't a pool of the right size class immediately
+     * available:  use a free pool.
+     */
+    if (usable_arenas == NULL) {
+        /* No arena has a free pool:  allocate a new arena. */
 #ifdef WITH_MEMORY_LIMITS
-            if (narenas_currently_allocated >= MAX_ARENAS) {
-                UNLOCK();
-                goto redirect;
-            }
-#endif
-            usable_arenas = new_arena();
-            if (usable_arenas == NULL) {
-                UNLOCK();
-                goto redirect;
-            }
-            usable_arenas->nextarena =
-                usable_arenas->prevarena = NULL;
+        if (narenas_currently_allocated >= MAX_ARENAS) {
+            --class_blocks[size];
+            return NULL;
         }
-        assert(usable_arenas->address != 0);
-
-        /* Try to get a cached free pool. */
-        pool = usable_arenas->freepools;
-        if (pool != NULL) {
-            /* Unlink from cached pools. */
-            usable_arenas->freepools = pool->nextpool;
-
-            /* This arena already had the smallest nfreepools
-             * value, so decreasing nfreepools doesn't change
-             * that, and we don't need to rearrange the
-             * usable_arenas list.  However, if the arena has
-             * become wholly allocated, we need to remove its
-             * arena_object from usable_arenas.
-             */
-            --usable_arenas->nfreepools;
-            if (usable_arenas->nfreepools == 0) {
-                /* Wholly allocated:  remove. */
-                assert(usable_arenas->freepools == NULL);
-                assert(usable_arenas->nextarena == NULL ||
-                       usable_arenas->nextarena->prevarena ==
-                       usable_arenas);
-
-                usable_arenas = usable_arenas->nextarena;
-                if (usable_arenas != NULL) {
-                    usable_arenas->prevarena = NULL;
-                    assert(usable_arenas->address != 0);
-                }
-            }
-            else {
-                /* nfreepools > 0:  it must be that freepools
-                 * isn't NULL, or that we haven't yet carved
-                 * off all the arena's pools for the first
-                 * time.
-                 */
-                assert(usable_arenas->freepools != NULL ||
-                       usable_arenas->pool_address <=
-                       (block*)usable_arenas->address +
-                           ARENA_SIZE - POOL_SIZE);
-            }
-        init_pool:
-            /* Frontlink to used pools. */
-            next = usedpools[size + size]; /* == prev */
-            pool->nextpool = next;
-            pool->prevpool = next;
-            next->nextpool = pool;
-            next->prevpool = pool;
-            pool->ref.count = 1;
-            if (pool->szidx == size) {
-                /* Luckily, this pool last contained blocks
-                 * of the same size class, so its header
-                 * and free list are already initialized.
-                 */
-                bp = pool->freeblock;
-                pool->freeblock = *(block **)bp;
-                UNLOCK();
-                return (void *)bp;
-            }
-            /*
-             * Initialize the pool header, set up the free list to
-             * contain just the second block, and return the first
-             * block.
-             */
-            pool->szidx = size;
-            size = INDEX2SIZE(size);
-            bp = (block *)pool + POOL_OVERHEAD;
-            pool->nextoffset = POOL_OVERHEAD + (size << 1);
-            pool->maxnextoffset = POOL_SIZE - size;
-            pool->freeblock = bp + size;
-            *(block **)(pool->freeblock) = NULL;
-            UNLOCK();
-            return (void *)bp;
+#endif
+        usable_arenas = new_arena();
+        if (usable_arenas == NULL) {
+            --class_blocks[size];
+            return NULL;
         }
+        usable_arenas->nextarena =
+            usable_arenas->prevarena = NULL;
+    }
+    assert(usable_arenas->address != 0);
 
-        /* Carve off a new pool. */
-        assert(usable_arenas->nfreepools > 0);
-        assert(usable_arenas->freepools == NULL);
-        pool = (poolp)usable_arenas->pool_address;
-        assert((block*)pool <= (block*)usable_arenas->address +
-                               ARENA_SIZE - POOL_SIZE);
-        pool->arenaindex = usable_arenas - arenas;
-        assert(&arenas[pool->arenaindex] == usable_arenas);
-        pool->szidx = DUMMY_SIZE_IDX;
-        usable_arenas->pool_address += POOL_SIZE;
-        --usable_arenas->nfreepools;
+#ifdef WITH_ARENA_PURGE
+    if (usable_arenas->freepools == NULL &&
+        has_purged_pools(usable_arenas))
+        unpurge_pool(usable_arenas);
+#endif
 
+    /* Try to get a cached free pool. */
+    pool = usable_arenas->freepools;
+    if (pool != NULL) {
+        /* Unlink from cached pools. */
+        usable_arenas->freepools = pool->nextpool;
+
+        /* This arena already had the smallest nfreepools
+         * value, so decreasing nfreepools doesn't change
+         * that, and we don't need to rearrange the
+         * usable_arenas list.  However, if the arena has
+         * become wholly allocated, we need to remove its
+         * arena_object from usable_arenas.
+         */
+        --usable_arenas->nfreepools;
         if (usable_arenas->nfreepools == 0) {
+            /* Wholly allocated:  remove. */
+            assert(usable_arenas->freepools == NULL);
             assert(usable_arenas->nextarena == NULL ||
                    usable_arenas->nextarena->prevarena ==
                    usable_arenas);
-            /* Unlink the arena:  it is completely allocated. */
+
             usable_arenas = usable_arenas->nextarena;
             if (usable_arenas != NULL) {
                 usable_arenas->prevarena = NULL;
                 assert(usable_arenas->address != 0);
             }
         }
-
-        goto init_pool;
+        else {
+            /* nfreepools > 0:  it must be that freepools
+             * isn't NULL, or that we haven't yet carved
+             * off all the arena's pools for the first
+             * time.
+             */
+            assert(usable_arenas->freepools != NULL ||
+                   usable_arenas->pool_address <=
+                   (block*)usable_arenas->address +
+                       ARENA_SIZE - POOL_SIZE ||
+                   has_purged_pools(usable_arenas));
+        }
+    init_pool:
+        /* Frontlink to used pools. */
+        next = usedpools[size + size]; /* == prev */
+        pool->nextpool = next;
+        pool->prevpool = next;
+        next->nextpool = pool;
+        next->prevpool = pool;
+        pool->ref.count = 1;
+        ++class_pools[size];
+        if (pool->szidx == size) {
+            /* Luckily, this pool last contained blocks
+             * of the same size class, so its header
+             * and free list are already initialized.
+             */
+            bp = pool->freeblock;
+            pool->freeblock = *(block **)bp;
+            return bp;
+        }
+        /*
+         * Initialize the pool header, set up the free list to
+         * contain just the second block, and return the first
+         * block.
+         */
+        pool->szidx = size;
+        size = INDEX2SIZE(size);
+        bp = (block *)pool + POOL_OVERHEAD;
+        pool->nextoffset = POOL_OVERHEAD + (size << 1);
+        pool->maxnextoffset = POOL_SIZE - size;
+        pool->freeblock = bp + size;
+        *(block **)(pool->freeblock) = NULL;
+        return bp;
     }
 
-    /* The small block allocator ends here. */
+    /* Carve off a new pool. */
+    assert(usable_arenas->nfreepools > 0);
+    assert(usable_arenas->freepools == NULL);
+    pool = (poolp)usable_arenas->pool_address;
+    assert((block*)pool <= (block*)usable_arenas->address +
+                           ARENA_SIZE - POOL_SIZE);
+    pool->arenaindex = usable_arenas - arenas;
+    assert(&arenas[pool->arenaindex] == usable_arenas);
+    pool->szidx = DUMMY_SIZE_IDX;
+    usable_arenas->pool_address += POOL_SIZE;
+    --usable_arenas->nfreepools;
+
+    if (usable_arenas->nfreepools == 0) {
+        assert(usable_arenas->nextarena == NULL ||
+               usable_arenas->nextarena->prevarena ==
+               usable_arenas);
+        /* Unlink the arena:  it is completely allocated. */
+        usable_arenas = usable_arenas->nextarena;
+        if (usable_arenas != NULL) {
+            usable_arenas->prevarena = NULL;
+            assert(usable_arenas->address != 0);
+        }
+    }
 
-redirect:
-    /* Redirect the original request to the underlying (libc) allocator.
-     * We jump here on bigger requests, on error in the code above (as a
-     * last chance to serve the request) or when the max memory limit
-     * has been reached.
-     */
-    if (nbytes == 0)
-        nbytes = 1;
-    return (void *)malloc(nbytes);
+    goto init_pool;
 }
 
-/* free */
+/*==========================================================================*/
+/* gc_refs side tables.
+
+   In side-table mode (gc.set_side_refs()), the cycle collector keeps the
+   gc_refs of objects that live in pools here instead of in their
+   PyGC_Head, so that a collection only reads the pages of the objects
+   that survive it.  After fork(), those pages stay shared with the parent.
+   Tables are made per pool, on the first store into one of its blocks,
+   and are all dropped when the collection ends.  Blocks nothing was stored
+   for read as _PyGC_SIDE_UNSET.
+*/
 
-#undef PyObject_Free
-void
-PyObject_Free(void *p)
+#define POOLS_PER_ARENA (ARENA_SIZE / POOL_SIZE)
+
+struct gc_side_table {
+    uint szidx;                 /* size class the table was made for */
+    Py_ssize_t refs[1];         /* NUMBLOCKS(szidx) entries */
+};
+
+/* Free the tables of arena ao.  The caller must hold the malloc lock. */
+static void
+free_side_tables(struct arena_object *ao)
 {
-    poolp pool;
-    block *lastfree;
-    poolp next, prev;
-    uint size;
-#ifndef Py_USING_MEMORY_DEBUGGER
-    uint arenaindex_temp;
-#endif
+    uint i;
 
-    if (p == NULL)      /* free(NULL) has no effect */
+    if (ao->gc_side == NULL)
         return;
+    for (i = 0; i < POOLS_PER_ARENA; i++)
+        free(ao->gc_side[i]);
+    free(ao->gc_side);
+    ao->gc_side = NULL;
+}
 
-#ifdef WITH_VALGRIND
-    if (UNLIKELY(running_on_valgrind > 0))
-        goto redirect;
+/* Return the table for pool number i of arena ao, made for size class
+ * szidx, creating it if needed.  The caller must hold the malloc lock.
+ */
+static struct gc_side_table *
+make_side_table(struct arena_object *ao, uint i, uint szidx)
+{
+    struct gc_side_table *t;
+    uint j, n;
+
+    if (ao->gc_side == NULL) {
+        ao->gc_side = (struct gc_side_table **)calloc(
+            POOLS_PER_ARENA, sizeof(struct gc_side_table *));
+        if (ao->gc_side == NULL)
+            return NULL;
+    }
+    t = ao->gc_side[i];
+    if (t != NULL && t->szidx == szidx)
+        return t;
+    /* The pool was emptied and reused for another size class. */
+    free(t);
+    n = NUMBLOCKS(szidx);
+    t = (struct gc_side_table *)malloc(sizeof(struct gc_side_table) +
+                                       (n - 1) * sizeof(Py_ssize_t));
+    ao->gc_side[i] = t;
+    if (t == NULL)
+        return NULL;
+    t->szidx = szidx;
+    for (j = 0; j < n; j++)
+        t->refs[j] = _PyGC_SIDE_UNSET;
+    return t;
+}
+
+/* Return the side table entry of the block holding p, or NULL if p isn't
+ * in a pool.  Unless create is true, NULL is also returned when no table
+ * exists yet.  Only the collector calls this, with the GIL held.
+ */
+Py_ssize_t *
+_PyObject_GCSideRefs(void *p, int create)
+{
+    poolp pool = POOL_ADDR(p);
+#ifndef Py_USING_MEMORY_DEBUGGER
+    uint arenaindex_temp;
 #endif
+    struct arena_object *ao;
+    struct gc_side_table *t;
+    uint i;
 
-    pool = POOL_ADDR(p);
-    if (Py_ADDRESS_IN_RANGE(p, pool)) {
-        /* We allocated this address. */
-        LOCK();
-        /* Link p to the start of the pool's freeblock list.  Since
-         * the pool had at least the p block outstanding, the pool
-         * wasn't empty (so it's already in a usedpools[] list, or
-         * was full and is in no list -- it's not in the freeblocks
-         * list in any case).
+    if (!Py_ADDRESS_IN_RANGE(p, pool))
+        return NULL;
+    ao = &arenas[pool->arenaindex];
+    i = (uint)(((uptr)pool - ao->address) / POOL_SIZE);
+    t = ao->gc_side != NULL ? ao->gc_side[i] : NULL;
+    if (t == NULL || t->szidx != pool->szidx) {
+        if (!create)
+            return NULL;
+        /* Threads allocating without the GIL may copy the arenas vector
+         * meanwhile, so the table is stored through the current one.
          */
-        assert(pool->ref.count > 0);            /* else it was empty */
-        *(block **)p = lastfree = pool->freeblock;
-        pool->freeblock = (block *)p;
-        if (lastfree) {
-            struct arena_object* ao;
-            uint nf;  /* ao->nfreepools */
-
-            /* freeblock wasn't NULL, so the pool wasn't full,
-             * and the pool is in a usedpools[] list.
-             */
-            if (--pool->ref.count != 0) {
-                /* pool isn't empty:  leave it in usedpools */
-                UNLOCK();
-                return;
-            }
-            /* Pool is now empty:  unlink from usedpools, and
-             * link to the front of freepools.  This ensures that
-             * previously freed pools will be allocated later
-             * (being not referenced, they are perhaps paged out).
-             */
-            next = pool->nextpool;
-            prev = pool->prevpool;
-            next->prevpool = prev;
-            prev->nextpool = next;
+        LOCK();
+        t = make_side_table(&arenas[pool->arenaindex], i, pool->szidx);
+        UNLOCK();
+        if (t == NULL)
+            return NULL;
+    }
+    return &t->refs[((block *)p - ((block *)pool + POOL_OVERHEAD)) /
+                    INDEX2SIZE(pool->szidx)];
+}
 
-            /* Link the pool to freepools.  This is a singly-linked
-             * list, and pool->prevpool isn't used there.
-             */
-            ao = &arenas[pool->arenaindex];
-            pool->nextpool = ao->freepools;
-            ao->freepools = pool;
-            nf = ++ao->nfreepools;
-
-            /* All the rest is arena management.  We just freed
-             * a pool, and there are 4 cases for arena mgmt:
-             * 1. If all the pools are free, return the arena to
-             *    the system free().
-             * 2. If this is the only free pool in the arena,
-             *    add the arena back to the `usable_arenas` list.
-             * 3. If the "next" arena has a smaller count of free
-             *    pools, we have to "slide this arena right" to
-             *    restore that usable_arenas is sorted in order of
-             *    nfreepools.
-             * 4. Else there's nothing more to do.
-             */
-            if (nf == ao->ntotalpools) {
-                /* Case 1.  First unlink ao from usable_arenas.
-                 */
-                assert(ao->prevarena == NULL ||
-                       ao->prevarena->address != 0);
-                assert(ao ->nextarena == NULL ||
-                       ao->nextarena->address != 0);
+/* Drop all side tables, at the end of a collection. */
+void
+_PyObject_GCSideClear(void)
+{
+    uint i;
 
-                /* Fix the pointer in the prevarena, or the
-                 * usable_arenas pointer.
-                 */
-                if (ao->prevarena == NULL) {
-                    usable_arenas = ao->nextarena;
-                    assert(usable_arenas == NULL ||
-                           usable_arenas->address != 0);
-                }
-                else {
-                    assert(ao->prevarena->nextarena == ao);
-                    ao->prevarena->nextarena =
-                        ao->nextarena;
-                }
-                /* Fix the pointer in the nextarena. */
-                if (ao->nextarena != NULL) {
-                    assert(ao->nextarena->prevarena == ao);
-                    ao->nextarena->prevarena =
-                        ao->prevarena;
-                }
-                /* Record that this arena_object slot is
-                 * available to be reused.
-                 */
-                ao->nextarena = unused_arena_objects;
-                unused_arena_objects = ao;
+    LOCK();
+    for (i = 0; i < maxarenas; i++)
+        free_side_tables(&arenas[i]);
+    UNLOCK();
+}
 
-                /* Free the entire arena. */
-#ifdef ARENAS_USE_MMAP
-                munmap((void *)ao->address, ARENA_SIZE);
-#else
-                free((void *)ao->address);
+/* Return block p, which lives in pool, to the pools.  The caller must
+ * hold the malloc lock.
+ */
+static void
+free_to_pool(block *p, poolp pool)
+{
+    block *lastfree;
+    poolp next, prev;
+    uint size;
+
+    /* Link p to the start of the pool's freeblock list.  Since
+     * the pool had at least the p block outstanding, the pool
+     * wasn't empty (so it's already in a usedpools[] list, or
+     * was full and is in no list -- it's not in the freeblocks
+     * list in any case).
+     */
+    assert(pool->ref.count > 0);            /* else it was empty */
+    --class_blocks[pool->szidx];
+    *(block **)p = lastfree = pool->freeblock;
+    pool->freeblock = (block *)p;
+    if (lastfree) {
+        struct arena_object* ao;
+        uint nf;  /* ao->nfreepools */
+
+        /* freeblock wasn't NULL, so the pool wasn't full,
+         * and the pool is in a usedpools[] list.
+         */
+        if (--pool->ref.count != 0) {
+            /* pool isn't empty:  leave it in usedpools */
+            return;
+        }
+        /* Pool is now empty:  unlink from usedpools, and
+         * link to the front of freepools.  This ensures that
+         * previously freed pools will be allocated later
+         * (being not referenced, they are perhaps paged out).
+         */
+        next = pool->nextpool;
+        prev = pool->prevpool;
+        next->prevpool = prev;
+        prev->nextpool = next;
+        --class_pools[pool->szidx];
+
+        /* Link the pool to freepools.  This is a singly-linked
+         * list, and pool->prevpool isn't used there (except as
+         * the purge mark, which a newly freed pool doesn't have).
+         */
+        ao = &arenas[pool->arenaindex];
+        pool->nextpool = ao->freepools;
+        pool->prevpool = NULL;
+        ao->freepools = pool;
+        nf = ++ao->nfreepools;
+#ifdef WITH_ARENA_PURGE
+        maybe_purge();
 #endif
-                ao->address = 0;                        /* mark unassociated */
-                --narenas_currently_allocated;
 
-                UNLOCK();
-                return;
-            }
-            if (nf == 1) {
-                /* Case 2.  Put ao at the head of
-                 * usable_arenas.  Note that because
-                 * ao->nfreepools was 0 before, ao isn't
-                 * currently on the usable_arenas list.
-                 */
-                ao->nextarena = usable_arenas;
-                ao->prevarena = NULL;
-                if (usable_arenas)
-                    usable_arenas->prevarena = ao;
-                usable_arenas = ao;
-                assert(usable_arenas->address != 0);
+        /* All the rest is arena management.  We just freed
+         * a pool, and there are 4 cases for arena mgmt:
+         * 1. If all the pools are free, return the arena to
+         *    the system free().
+         * 2. If this is the only free pool in the arena,
+         *    add the arena back to the `usable_arenas` list.
+         * 3. If the "next" arena has a smaller count of free
+         *    pools, we have to "slide this arena right" to
+         *    restore that usable_arenas is sorted in order of
+         *    nfreepools.
+         * 4. Else there's nothing more to do.
+         */
+        if (nf == ao->ntotalpools) {
+            /* Case 1.  First unlink ao from usable_arenas.
+             */
+            assert(ao->prevarena == NULL ||
+                   ao->prevarena->address != 0);
+            assert(ao ->nextarena == NULL ||
+                   ao->nextarena->address != 0);
 
-                UNLOCK();
-                return;
-            }
-            /* If this arena is now out of order, we need to keep
-             * the list sorted.  The list is kept sorted so that
-             * the "most full" arenas are used first, which allows
-             * the nearly empty arenas to be completely freed.  In
-             * a few un-scientific tests, it seems like this
-             * approach allowed a lot more memory to be freed.
+            /* Fix the pointer in the prevarena, or the
+             * usable_arenas pointer.
              */
-            if (ao->nextarena == NULL ||
-                         nf <= ao->nextarena->nfreepools) {
-                /* Case 4.  Nothing to do. */
-                UNLOCK();
-                return;
+            if (ao->prevarena == NULL) {
+                usable_arenas = ao->nextarena;
+                assert(usable_arenas == NULL ||
+                       usable_arenas->address != 0);
             }
-            /* Case 3:  We have to move the arena towards the end
-             * of the list, because it has more free pools than
-             * the arena to its right.
-             * First unlink ao from usable_arenas.
-             */
-            if (ao->prevarena != NULL) {
-                /* ao isn't at the head of the list */
+            else {
                 assert(ao->prevarena->nextarena == ao);
-                ao->prevarena->nextarena = ao->nextarena;
+                ao->prevarena->nextarena =
+                    ao->nextarena;
             }
-            else {
-                /* ao is at the head of the list */
-                assert(usable_arenas == ao);
-                usable_arenas = ao->nextarena;
+            /* Fix the pointer in the nextarena. */
+            if (ao->nextarena != NULL) {
+                assert(ao->nextarena->prevarena == ao);
+                ao->nextarena->prevarena =
+                    ao->prevarena;
             }
-            ao->nextarena->prevarena = ao->prevarena;
+            /* Record that this arena_object slot is
+             * available to be reused.
+             */
+            ao->nextarena = unused_arena_objects;
+            unused_arena_objects = ao;
+
+            /* Free the entire arena. */
+            free_side_tables(ao);
+#ifdef WITH_ARENA_PURGE
+            drop_purged_pools(ao);
+            if (ao->region != NULL)
+                region_free_arena(ao);
+            else
+                munmap((void *)ao->address, ARENA_SIZE);
+#elif defined(ARENAS_USE_MMAP)
+            munmap((void *)ao->address, ARENA_SIZE);
+#else
+            free((void *)ao->address);
+#endif
+            ao->address = 0;                        /* mark unassociated */
+            --narenas_currently_allocated;
 
-            /* Locate the new insertion point by iterating over
-             * the list, using our nextarena pointer.
+            return;
+        }
+        if (nf == 1) {
+            /* Case 2.  Put ao at the head of
+             * usable_arenas.  Note that because
+             * ao->nfreepools was 0 before, ao isn't
+             * currently on the usable_arenas list.
              */
-            while (ao->nextarena != NULL &&
-                            nf > ao->nextarena->nfreepools) {
-                ao->prevarena = ao->nextarena;
-                ao->nextarena = ao->nextarena->nextarena;
+            ao->nextarena = usable_arenas;
+            ao->prevarena = NULL;
+            if (usable_arenas)
+                usable_arenas->prevarena = ao;
+            usable_arenas = ao;
+            assert(usable_arenas->address != 0);
+
+            return;
+        }
+        /* If this arena is now out of order, we need to keep
+         * the list sorted.  The list is kept sorted so that
+         * the "most full" arenas are used first, which allows
+         * the nearly empty arenas to be completely freed.  In
+         * a few un-scientific tests, it seems like this
+         * approach allowed a lot more memory to be freed.
+         */
+        if (ao->nextarena == NULL ||
+                     nf <= ao->nextarena->nfreepools) {
+            /* Case 4.  Nothing to do. */
+            return;
+        }
+        /* Case 3:  We have to move the arena towards the end
+         * of the list, because it has more free pools than
+         * the arena to its right.
+         * First unlink ao from usable_arenas.
+         */
+        if (ao->prevarena != NULL) {
+            /* ao isn't at the head of the list */
+            assert(ao->prevarena->nextarena == ao);
+            ao->prevarena->nextarena = ao->nextarena;
+        }
+        else {
+            /* ao is at the head of the list */
+            assert(usable_arenas == ao);
+            usable_arenas = ao->nextarena;
+        }
+        ao->nextarena->prevarena = ao->prevarena;
+
+        /* Locate the new insertion point by iterating over
+         * the list, using our nextarena pointer.
+         */
+        while (ao->nextarena != NULL &&
+                        nf > ao->nextarena->nfreepools) {
+            ao->prevarena = ao->nextarena;
+            ao->nextarena = ao->nextarena->nextarena;
+        }
+
+        /* Insert ao at this point. */
+        assert(ao->nextarena == NULL ||
+            ao->prevarena == ao->nextarena->prevarena);
+        assert(ao->prevarena->nextarena == ao->nextarena);
+
+        ao->prevarena->nextarena = ao;
+        if (ao->nextarena != NULL)
+            ao->nextarena->prevarena = ao;
+
+        /* Verify that the swaps worked. */
+        assert(ao->nextarena == NULL ||
+                  nf <= ao->nextarena->nfreepools);
+        assert(ao->prevarena == NULL ||
+                  nf > ao->prevarena->nfreepools);
+        assert(ao->nextarena == NULL ||
+            ao->nextarena->prevarena == ao);
+        assert((usable_arenas == ao &&
+            ao->prevarena == NULL) ||
+            ao->prevarena->nextarena == ao);
+
+        return;
+    }
+    /* Pool was full, so doesn't currently live in any list:
+     * link it to the front of the appropriate usedpools[] list.
+     * This mimics LRU pool usage for new allocations and
+     * targets optimal filling when several pools contain
+     * blocks of the same size class.
+     */
+    --pool->ref.count;
+    assert(pool->ref.count > 0);            /* else the pool is empty */
+    size = pool->szidx;
+    next = usedpools[size + size];
+    prev = next->prevpool;
+    /* insert pool before next:   prev <-> pool <-> next */
+    pool->nextpool = next;
+    pool->prevpool = prev;
+    next->prevpool = pool;
+    prev->nextpool = pool;
+    return;
+}
+
+#ifdef WITH_PYMALLOC_CACHE
+
+/*
+ * Per-thread block caches.
+ *
+ * Every thread keeps a "magazine" of free blocks for each size class: a
+ * singly-linked list threaded through the blocks themselves, like a pool's
+ * free list.  Small mallocs and frees only touch the calling thread's
+ * magazines, so no lock is taken and a thread keeps reusing the memory it
+ * has touched recently.  An empty magazine is refilled, and a full one
+ * half flushed, CACHE_BATCH(I) blocks at a time under the malloc lock.
+ * When a thread exits, its magazines are flushed back to the pools.
+ */
+
+/* A magazine holds about CACHE_BYTES bytes of blocks, and at least 4 */
+#define CACHE_BYTES             2048
+#define CACHE_CAPACITY(I)       (INDEX2SIZE(I) * 4 > CACHE_BYTES ?     \
+                                 4 : CACHE_BYTES / INDEX2SIZE(I))
+#define CACHE_BATCH(I)          (CACHE_CAPACITY(I) / 2)
+
+struct magazine {
+    block *head;                        /* free list of cached blocks */
+    uint count;                         /* number of blocks in it     */
+};
+
+struct thread_cache {
+    struct magazine mags[NB_SMALL_SIZE_CLASSES];
+    int registered;                     /* flushed by cache_key at exit */
+    int exiting;                        /* flushed for good:  bypassed */
+    struct thread_cache *next;          /* in all_caches, if registered */
+    struct thread_cache *prev;
+};
+
+static __thread struct thread_cache tcache;
+/* the registered caches of all threads, protected by the malloc lock */
+static struct thread_cache *all_caches = NULL;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+/* Give the n least recently cached blocks of mag back to the pools. */
+static void
+cache_flush(struct magazine *mag, uint n)
+{
+    block **link = &mag->head;
+    block *bp;
+    uint keep = mag->count - n;
+
+    while (keep-- > 0)
+        link = (block **)*link;
+    bp = *link;
+    *link = NULL;
+    mag->count -= n;
+
+    LOCK();
+    while (bp != NULL) {
+        block *next = *(block **)bp;
+        free_to_pool(bp, POOL_ADDR(bp));
+        bp = next;
+    }
+    UNLOCK();
+}
+
+static void
+cache_flush_all(void *arg)
+{
+    struct thread_cache *tc = (struct thread_cache *)arg;
+    uint i;
+
+    /* The thread is exiting.  Blocks freed after this, by later TLS
+       destructors, go straight to the pools:  registering again could
+       leave tc in all_caches after the thread and its tcache are gone. */
+    tc->registered = 0;
+    tc->exiting = 1;
+    LOCK();
+    if (tc->prev != NULL)
+        tc->prev->next = tc->next;
+    else
+        all_caches = tc->next;
+    if (tc->next != NULL)
+        tc->next->prev = tc->prev;
+    UNLOCK();
+    for (i = 0; i < NB_SMALL_SIZE_CLASSES; i++) {
+        if (tc->mags[i].count)
+            cache_flush(&tc->mags[i], tc->mags[i].count);
+    }
+}
+
+/* Keep the pools consistent across fork():  no thread may be halfway
+ * through a pool operation when the child's copy is made.
+ */
+static void
+cache_before_fork(void)
+{
+    LOCK();
+}
+
+static void
+cache_after_fork(void)
+{
+    UNLOCK();
+}
+
+/* Only the forking thread lives on in the child.  The other threads'
+ * caches would never be flushed, and their storage isn't theirs any
+ * more:  give their blocks back and forget them.
+ */
+static void
+cache_after_fork_child(void)
+{
+    struct thread_cache *tc;
+    block *bp, *next;
+    uint i;
+
+    for (tc = all_caches; tc != NULL; tc = tc->next) {
+        if (tc == &tcache)
+            continue;
+        for (i = 0; i < NB_SMALL_SIZE_CLASSES; i++) {
+            for (bp = tc->mags[i].head; bp != NULL; bp = next) {
+                next = *(block **)bp;
+                free_to_pool(bp, POOL_ADDR(bp));
             }
+        }
+    }
+    if (tcache.registered) {
+        tcache.prev = tcache.next = NULL;
+        all_caches = &tcache;
+    }
+    else
+        all_caches = NULL;
+    UNLOCK();
+}
 
-            /* Insert ao at this point. */
-            assert(ao->nextarena == NULL ||
-                ao->prevarena == ao->nextarena->prevarena);
-            assert(ao->prevarena->nextarena == ao->nextarena);
+static void
+cache_init_key(void)
+{
+    if (pthread_key_create(&cache_key, cache_flush_all) != 0)
+        Py_FatalError("obmalloc: can't create thread cache key");
+    pthread_atfork(cache_before_fork, cache_after_fork,
+                   cache_after_fork_child);
+}
 
-            ao->prevarena->nextarena = ao;
-            if (ao->nextarena != NULL)
-                ao->nextarena->prevarena = ao;
+static void
+cache_register(void)
+{
+    pthread_once(&cache_key_once, cache_init_key);
+    if (pthread_setspecific(cache_key, &tcache) == 0) {
+        tcache.registered = 1;
+        LOCK();
+        tcache.prev = NULL;
+        tcache.next = all_caches;
+        if (all_caches != NULL)
+            all_caches->prev = &tcache;
+        all_caches = &tcache;
+        UNLOCK();
+    }
+}
 
-            /* Verify that the swaps worked. */
-            assert(ao->nextarena == NULL ||
-                      nf <= ao->nextarena->nfreepools);
-            assert(ao->prevarena == NULL ||
-                      nf > ao->prevarena->nfreepools);
-            assert(ao->nextarena == NULL ||
-                ao->nextarena->prevarena == ao);
-            assert((usable_arenas == ao &&
-                ao->prevarena == NULL) ||
-                ao->prevarena->nextarena == ao);
+/* Slow path of cache_malloc():  take a batch of blocks from the pools,
+ * return one and cache the rest.
+ */
+static block *
+cache_refill(uint size)
+{
+    struct magazine *mag = &tcache.mags[size];
+    block *bp, *result;
+    uint n = CACHE_BATCH(size);
+
+    if (!tcache.registered) {
+        if (tcache.exiting) {
+            LOCK();
+            result = allocate_from_pools(size);
+            UNLOCK();
+            return result;
+        }
+        cache_register();
+    }
+    LOCK();
+    result = allocate_from_pools(size);
+    if (result != NULL) {
+        while (--n > 0 && (bp = allocate_from_pools(size)) != NULL) {
+            *(block **)bp = mag->head;
+            mag->head = bp;
+            mag->count++;
+        }
+    }
+    UNLOCK();
+    return result;
+}
+
+static block *
+cache_malloc(uint size)
+{
+    struct magazine *mag = &tcache.mags[size];
+    block *bp = mag->head;
 
+    if (bp != NULL) {
+        mag->head = *(block **)bp;
+        mag->count--;
+        return bp;
+    }
+    return cache_refill(size);
+}
+
+static void
+cache_free(block *p, poolp pool)
+{
+    /* szidx can't change while the pool has p outstanding */
+    uint size = pool->szidx;
+    struct magazine *mag = &tcache.mags[size];
+
+    if (!tcache.registered) {
+        if (tcache.exiting) {
+            LOCK();
+            free_to_pool(p, pool);
             UNLOCK();
             return;
         }
-        /* Pool was full, so doesn't currently live in any list:
-         * link it to the front of the appropriate usedpools[] list.
-         * This mimics LRU pool usage for new allocations and
-         * targets optimal filling when several pools contain
-         * blocks of the same size class.
-         */
-        --pool->ref.count;
-        assert(pool->ref.count > 0);            /* else the pool is empty */
-        size = pool->szidx;
-        next = usedpools[size + size];
-        prev = next->prevpool;
-        /* insert pool before next:   prev <-> pool <-> next */
-        pool->nextpool = next;
-        pool->prevpool = prev;
-        next->prevpool = pool;
-        prev->nextpool = pool;
+        cache_register();
+    }
+    if (mag->count >= CACHE_CAPACITY(size)) {
+        /* keep the most recently freed half */
+        cache_flush(mag, CACHE_BATCH(size));
+    }
+    *(block **)p = mag->head;
+    mag->head = p;
+    mag->count++;
+}
+
+#endif /* WITH_PYMALLOC_CACHE */
+
+#undef PyObject_Malloc
+void *
+PyObject_Malloc(size_t nbytes)
+{
+    block *bp;
+    uint size;
+
+#ifdef WITH_VALGRIND
+    if (UNLIKELY(running_on_valgrind == -1))
+        running_on_valgrind = RUNNING_ON_VALGRIND;
+    if (UNLIKELY(running_on_valgrind))
+        goto redirect;
+#endif
+
+    /*
+     * Limit ourselves to PY_SSIZE_T_MAX bytes to prevent security holes.
+     * Most python internals blindly use a signed Py_ssize_t to track
+     * things without checking for overflows or negatives.
+     * As size_t is unsigned, checking for nbytes < 0 is not required.
+     */
+    if (nbytes > PY_SSIZE_T_MAX)
+        return NULL;
+
+    /*
+     * This implicitly redirects malloc(0).
+     */
+    if ((nbytes - 1) < SMALL_REQUEST_THRESHOLD) {
+        size = (uint)(nbytes - 1) >> ALIGNMENT_SHIFT;
+#ifdef WITH_PYMALLOC_CACHE
+        bp = cache_malloc(size);
+        if (bp != NULL)
+            return (void *)bp;
+#else
+        LOCK();
+        bp = allocate_from_pools(size);
+        UNLOCK();
+        if (bp != NULL)
+            return (void *)bp;
+#endif
+    }
+
+    /* The small block allocator ends here. */
+
+#ifdef WITH_VALGRIND
+redirect:
+#endif
+    /* Redirect the original request to the underlying (libc) allocator.
+     * We jump here on bigger requests, on error in the code above (as a
+     * last chance to serve the request) or when the max memory limit
+     * has been reached.
+     */
+    if (nbytes == 0)
+        nbytes = 1;
+    return (void *)malloc(nbytes);
+}
+
+/* free */
+
+#undef PyObject_Free
+void
+PyObject_Free(void *p)
+{
+    poolp pool;
+#ifndef Py_USING_MEMORY_DEBUGGER
+    uint arenaindex_temp;
+#endif
+
+    if (p == NULL)      /* free(NULL) has no effect */
+        return;
+
+#ifdef WITH_VALGRIND
+    if (UNLIKELY(running_on_valgrind > 0))
+        goto redirect;
+#endif
+
+    pool = POOL_ADDR(p);
+    if (Py_ADDRESS_IN_RANGE(p, pool)) {
+        /* We allocated this address. */
+#ifdef WITH_PYMALLOC_CACHE
+        cache_free((block *)p, pool);
+#else
+        LOCK();
+        free_to_pool((block *)p, pool);
         UNLOCK();
+#endif
         return;
     }
 
@@ -1281,6 +2115,150 @@ PyObject_Realloc(void *p, size_t nbytes)
     return bp ? bp : p;
 }
 
+/* The arena purge delay, in seconds.  A negative value disables purging.
+ * Without madvise() the value is kept but has no effect.
+ */
+void
+_PyObject_SetArenaPurgeDelay(double delay)
+{
+    LOCK();
+    purge_delay = delay;
+    UNLOCK();
+}
+
+double
+_PyObject_GetArenaPurgeDelay(void)
+{
+    return purge_delay;
+}
+
+/* Run a purge pass if the purge delay has passed since the last one.  The
+ * passes otherwise only run when a pool becomes empty, so the collector
+ * calls this after each collection too:  a process that stops freeing
+ * memory still gets back what it left idle.  With force, every free pool
+ * and arena slot is purged at once, whatever the delay.  Returns the
+ * number of bytes given back.
+ */
+size_t
+_PyObject_PurgeArenas(int force)
+{
+#ifdef WITH_ARENA_PURGE
+    size_t n;
+
+    LOCK();
+    n = bytes_returned;
+    if (force) {
+        /* The first pass marks what the previous one didn't see. */
+        purge_pass();
+        purge_pass();
+        purge_last = purge_clock();
+    }
+    else
+        maybe_purge();
+    n = bytes_returned - n;
+    UNLOCK();
+    return n;
+#else
+    return 0;
+#endif
+}
+
+/* The counters behind sys.getarenastats().  They are read without the
+ * lock, so they may be slightly inconsistent with each other.
+ */
+PyObject *
+_PyObject_GetArenaStats(void)
+{
+    return Py_BuildValue("{sNsnsnsnsnsnsnsn}",
+                         "hugepages", PyBool_FromLong(arena_hugepages),
+                         "arenas", (Py_ssize_t)narenas_currently_allocated,
+                         "regions", (Py_ssize_t)nregions,
+                         "pools_purged", (Py_ssize_t)npools_purged,
+                         "arenas_purged", (Py_ssize_t)nslots_purged,
+                         "bytes_purged", (Py_ssize_t)bytes_purged,
+                         "bytes_returned", (Py_ssize_t)bytes_returned,
+                         "arena_size", (Py_ssize_t)ARENA_SIZE);
+}
+
+/* The implementation of sys.getallocstats().  The counters are copied
+ * under the malloc lock and converted afterwards, since building the
+ * result allocates.
+ */
+PyObject *
+_PyObject_GetAllocStats(void)
+{
+    size_t pools[NB_SMALL_SIZE_CLASSES];
+    size_t blocks[NB_SMALL_SIZE_CLASSES];
+    size_t cached[NB_SMALL_SIZE_CLASSES];
+    size_t narenas, nallocated, nhighwater, npurged;
+    size_t used_bytes = 0, pool_bytes = 0, mapped;
+    PyObject *classes, *result;
+    uint i;
+
+    LOCK();
+    memcpy(pools, class_pools, sizeof(pools));
+    memcpy(blocks, class_blocks, sizeof(blocks));
+    memset(cached, 0, sizeof(cached));
+#ifdef WITH_PYMALLOC_CACHE
+    {
+        struct thread_cache *tc;
+        for (tc = all_caches; tc != NULL; tc = tc->next) {
+            for (i = 0; i < NB_SMALL_SIZE_CLASSES; i++)
+                cached[i] += tc->mags[i].count;
+        }
+    }
+#endif
+    narenas = narenas_currently_allocated;
+    nallocated = ntimes_arena_allocated;
+    nhighwater = narenas_highwater;
+    npurged = bytes_purged;
+    UNLOCK();
+
+    classes = PyList_New(NB_SMALL_SIZE_CLASSES);
+    if (classes == NULL)
+        return NULL;
+    for (i = 0; i < NB_SMALL_SIZE_CLASSES; i++) {
+        size_t size = INDEX2SIZE(i);
+        /* a thread may have cached blocks since the lock was released */
+        size_t inuse = blocks[i] > cached[i] ? blocks[i] - cached[i] : 0;
+        size_t nfree = pools[i] * NUMBLOCKS(i) - blocks[i];
+        PyObject *v = Py_BuildValue("{snsnsnsnsn}",
+                                    "size", (Py_ssize_t)size,
+                                    "blocks_in_use", (Py_ssize_t)inuse,
+                                    "free_blocks", (Py_ssize_t)nfree,
+                                    "cached_blocks", (Py_ssize_t)cached[i],
+                                    "pools", (Py_ssize_t)pools[i]);
+        if (v == NULL) {
+            Py_DECREF(classes);
+            return NULL;
+        }
+        PyList_SET_ITEM(classes, i, v);
+        used_bytes += inuse * size;
+        pool_bytes += pools[i] * POOL_SIZE;
+    }
+
+    /* fragmentation is the share of the mapped, resident arena memory
+       that doesn't hold live blocks */
+    mapped = narenas * ARENA_SIZE;
+#ifdef WITH_ARENA_PURGE
+    if (arena_hugepages)
+        mapped = nregions * REGION_SIZE;
+#endif
+    result = Py_BuildValue("{sNsnsnsnsnsnsnsnsnsd}",
+        "size_classes", classes,
+        "arenas", (Py_ssize_t)narenas,
+        "arenas_allocated", (Py_ssize_t)nallocated,
+        "arenas_freed", (Py_ssize_t)(nallocated - narenas),
+        "arenas_highwater", (Py_ssize_t)nhighwater,
+        "bytes_mapped", (Py_ssize_t)mapped,
+        "bytes_purged", (Py_ssize_t)npurged,
+        "bytes_in_pools", (Py_ssize_t)pool_bytes,
+        "bytes_in_use", (Py_ssize_t)used_bytes,
+        "fragmentation", mapped > npurged ?
+            1.0 - (double)used_bytes / (mapped - npurged) : 0.0);
+    return result;
+}
+
 #else   /* ! WITH_PYMALLOC */
 
 /*==========================================================================*/
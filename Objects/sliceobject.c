@@ -47,7 +47,7 @@ PyTypeObject PyEllipsis_Type = {
 
 PyObject _Py_EllipsisObject = {
     _PyObject_EXTRA_INIT
-    1, &PyEllipsis_Type
+    _Py_IMMORTAL_REFCNT, &PyEllipsis_Type
 };
 
 
@@ -4772,10 +4772,30 @@ PyString_InternImmortal(PyObject **p)
     PyString_InternInPlace(p);
     if (PyString_CHECK_INTERNED(*p) != SSTATE_INTERNED_IMMORTAL) {
         PyString_CHECK_INTERNED(*p) = SSTATE_INTERNED_IMMORTAL;
-        Py_INCREF(*p);
+        _Py_SetImmortal(*p);
     }
 }
 
+/* Make all interned strings immortal, for gc.immortalize().  Returns the
+   number of strings that were mortal. */
+Py_ssize_t
+_PyString_ImmortalizeInterned(void)
+{
+    Py_ssize_t pos = 0, n = 0;
+    PyObject *key, *value;
+
+    if (interned == NULL)
+        return 0;
+    while (PyDict_Next(interned, &pos, &key, &value)) {
+        if (PyString_CHECK_INTERNED(key) == SSTATE_INTERNED_MORTAL) {
+            PyString_CHECK_INTERNED(key) = SSTATE_INTERNED_IMMORTAL;
+            _Py_SetImmortal(key);
+            n++;
+        }
+    }
+    return n;
+}
+
 
 PyObject *
 PyString_InternFromString(const char *cp)
@@ -848,6 +848,57 @@ subtype_traverse(PyObject *self, visitproc visit, void *arg)
     return 0;
 }
 
+/* True if instances of type can be untracked while their __dict__ is.
+ * Such an instance refers only to its __dict__ and its type, so it can't
+ * be part of a cycle unless its __dict__ holds a container, or the cycle
+ * runs through the type.  The type must be immortal (see gc.immortalize())
+ * to rule out the latter, and add nothing but __dict__ and __weakref__ to
+ * object.
+ */
+static int
+instances_untrackable(PyTypeObject *type)
+{
+    PyTypeObject *base;
+
+    if (!(type->tp_flags & Py_TPFLAGS_HEAPTYPE) ||
+        type->tp_dictoffset <= 0 || !_Py_IsImmortal(type))
+        return 0;
+    for (base = type; base->tp_traverse == subtype_traverse;
+         base = base->tp_base) {
+        if (Py_SIZE(base))
+            return 0;           /* has slots */
+    }
+    return base->tp_traverse == NULL;
+}
+
+/* Untrack op if it is such an instance and its __dict__ is untracked,
+ * just as _PyDict_MaybeUntrack() does for dicts.  The collector calls
+ * this; _PyObject_Retrack() tracks the instance again when its __dict__
+ * may get a container.  That only covers stores made through the
+ * instance, so the __dict__ must not be referenced from anywhere else:
+ * whoever holds it could store a container into it directly. */
+void
+_PyObject_MaybeUntrack(PyObject *op)
+{
+    PyObject *dict;
+
+    if (!instances_untrackable(Py_TYPE(op)) || !_PyObject_GC_IS_TRACKED(op))
+        return;
+    dict = *_PyObject_GetDictPtr(op);
+    if (dict != NULL &&
+        (!PyDict_CheckExact(dict) || _PyObject_GC_IS_TRACKED(dict) ||
+         Py_REFCNT(dict) != 1))
+        return;
+    _PyObject_GC_UNTRACK(op);
+}
+
+void
+_PyObject_Retrack(PyObject *op)
+{
+    if (instances_untrackable(Py_TYPE(op)) && !_PyObject_GC_IS_TRACKED(op))
+        _PyObject_GC_TRACK(op);
+}
+
 static void
 clear_slots(PyTypeObject *type, PyObject *self)
 {
@@ -1867,8 +1918,17 @@ subtype_dict(PyObject *obj, void *context)
         return NULL;
     }
     dict = *dictptr;
-    if (dict == NULL)
-        *dictptr = dict = PyDict_New();
+    if (dict == NULL) {
+        PyTypeObject *tp = Py_TYPE(obj);
+        if (tp->tp_flags & Py_TPFLAGS_HEAPTYPE)
+            dict = _PyDict_NewShared(
+                ((PyHeapTypeObject *)tp)->ht_cached_keys);
+        else
+            dict = PyDict_New();
+        *dictptr = dict;
+    }
+    /* The caller may store containers into it. */
+    _PyObject_Retrack(obj);
     Py_XINCREF(dict);
     return dict;
 }
@@ -1911,6 +1971,7 @@ subtype_setdict(PyObject *obj, PyObject *value, void *context)
     dict = *dictptr;
     Py_XINCREF(value);
     *dictptr = value;
+    _PyObject_Retrack(obj);
     Py_XDECREF(dict);
     return 0;
 }
@@ -2477,6 +2538,10 @@ type_new(PyTypeObject *metatype, PyObject *args, PyObject *kwds)
     /* Put the proper slots in place */
     fixup_slot_dispatchers(type);
 
+    /* Let the instance dicts share their keys */
+    if (type->tp_dictoffset)
+        et->ht_cached_keys = _PyDict_NewKeysForClass();
+
     return (PyObject *)type;
 }
 
@@ -2656,6 +2721,8 @@ type_dealloc(PyTypeObject *type)
     PyObject_Free((char *)type->tp_doc);
     Py_XDECREF(et->ht_name);
     Py_XDECREF(et->ht_slots);
+    if (et->ht_cached_keys != NULL)
+        _PyDictKeys_DecRef(et->ht_cached_keys);
     Py_TYPE(type)->tp_free((PyObject *)type);
 }
 
@@ -3126,6 +3193,8 @@ object_set_class(PyObject *self, PyObject *value, void *closure)
         return -1;
     }
     if (compatible_for_assignment(newto, oldto, "__class__")) {
+        /* The new type may not allow self to stay untracked. */
+        _PyObject_Retrack(self);
         Py_INCREF(newto);
         Py_TYPE(self) = newto;
         Py_DECREF(oldto);
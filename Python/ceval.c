@@ -49,43 +49,50 @@ _Py_CheckRecursiveCall(char *where)
     return 0;
 }
 
+int _Py_CheckInterval = 100;
+volatile int _Py_Ticker = 0; /* so that we hit a "tick" first thing */
+
 #ifdef WITH_THREAD
 
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
 #include "pythread.h"
+#include "ceval_gil.h"
 
-static PyThread_type_lock interpreter_lock = 0; /* This is the GIL */
-static PyThread_type_lock pending_lock = 0; /* for pending calls */
 static long main_thread = 0;
 
 int
 PyEval_ThreadsInitialized(void)
 {
-    return interpreter_lock != 0;
+    return gil_created();
 }
 
 void
 PyEval_InitThreads(void)
 {
-    if (interpreter_lock)
+    if (gil_created())
         return;
-    interpreter_lock = PyThread_allocate_lock();
-    PyThread_acquire_lock(interpreter_lock, 1);
+    create_gil();
+    take_gil(PyThreadState_GET());
     main_thread = PyThread_get_thread_ident();
 }
 
 void
 PyEval_AcquireLock(void)
 {
-    PyThread_acquire_lock(interpreter_lock, 1);
+    PyThreadState *tstate = PyThreadState_GET();
+    take_gil(tstate);
 }
 
 void
 PyEval_ReleaseLock(void)
 {
-    PyThread_release_lock(interpreter_lock);
+    /* This function must succeed when the current thread state is NULL.
+       We therefore avoid PyThreadState_GET() which dumps a fatal error
+       in debug mode.
+    */
+    drop_gil(_PyThreadState_Current);
 }
 
 void
@@ -94,8 +101,8 @@ PyEval_AcquireThread(PyThreadState *tstate)
     if (tstate == NULL)
         Py_FatalError("PyEval_AcquireThread: NULL new thread state");
     /* Check someone has called PyEval_InitThreads() to create the lock */
-    assert(interpreter_lock);
-    PyThread_acquire_lock(interpreter_lock, 1);
+    assert(gil_created());
+    take_gil(tstate);
     if (PyThreadState_Swap(tstate) != NULL)
         Py_FatalError(
             "PyEval_AcquireThread: non-NULL old thread state");
@@ -108,7 +115,60 @@ PyEval_ReleaseThread(PyThreadState *tstate)
         Py_FatalError("PyEval_ReleaseThread: NULL thread state");
     if (PyThreadState_Swap(NULL) != tstate)
         Py_FatalError("PyEval_ReleaseThread: wrong thread state");
-    PyThread_release_lock(interpreter_lock);
+    drop_gil(tstate);
+}
+
+PyObject *
+_PyGILStats_AsDict(PyGILStats *st)
+{
+    PyObject *hist, *result;
+    int i;
+
+    hist = PyTuple_New(PyGIL_HOLD_BUCKETS);
+    if (hist == NULL)
+        return NULL;
+    for (i = 0; i < PyGIL_HOLD_BUCKETS; i++) {
+        PyObject *v = PyInt_FromLong(st->hold_hist[i]);
+        if (v == NULL) {
+            Py_DECREF(hist);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(hist, i, v);
+    }
+    result = Py_BuildValue("{sl,sl,sl,sL,sL,sL,sN}",
+                           "acquisitions", st->acquisitions,
+                           "contended", st->contended,
+                           "forced_drops", st->forced_drops,
+                           "wait_ns", st->wait_ns,
+                           "max_wait_ns", st->max_wait_ns,
+                           "hold_ns", st->hold_ns,
+                           "hold_histogram", hist);
+    return result;
+}
+
+PyObject *
+_PyEval_GetGILStats(void)
+{
+    PyObject *result = _PyGILStats_AsDict(&gil_stats);
+    PyObject *v;
+
+    if (result == NULL)
+        return NULL;
+    v = PyLong_FromUnsignedLong(gil_switch_number);
+    if (v == NULL || PyDict_SetItemString(result, "switches", v) < 0) {
+        Py_XDECREF(v);
+        Py_DECREF(result);
+        return NULL;
+    }
+    Py_DECREF(v);
+    return result;
+}
+
+void
+_PyEval_ResetGILStats(void)
+{
+    memset(&gil_stats, 0, sizeof(gil_stats));
+    _PyThread_ResetGILStats();
 }
 
 /* This function is called from PyOS_AfterFork to ensure that newly
@@ -120,22 +180,16 @@ void
 PyEval_ReInitThreads(void)
 {
     PyObject *threading, *result;
-    PyThreadState *tstate;
+    PyThreadState *tstate = PyThreadState_GET();
 
-    if (!interpreter_lock)
+    if (!gil_created())
         return;
-    /*XXX Can't use PyThread_free_lock here because it does too
-      much error-checking.  Doing this cleanly would require
-      adding a new function to each thread_*.h.  Instead, just
-      create a new lock and waste a little bit of memory */
-    interpreter_lock = PyThread_allocate_lock();
-    pending_lock = PyThread_allocate_lock();
-    PyThread_acquire_lock(interpreter_lock, 1);
+    recreate_gil();
+    take_gil(tstate);
     main_thread = PyThread_get_thread_ident();
 
     /* Update the threading module with the new state.
      */
-    tstate = PyThreadState_GET();
     threading = PyMapping_GetItemString(tstate->interp->modules,
                                         "threading");
     if (threading == NULL) {
@@ -150,7 +204,8 @@ PyEval_ReInitThreads(void)
         Py_DECREF(result);
     Py_DECREF(threading);
 }
-#endif
+
+#endif /* WITH_THREAD */
 
 /* Functions save_thread and restore_thread are always defined so
    dynamically loaded modules needn't be compiled separately for use
@@ -163,8 +218,8 @@ PyEval_SaveThread(void)
     if (tstate == NULL)
         Py_FatalError("PyEval_SaveThread: NULL tstate");
 #ifdef WITH_THREAD
-    if (interpreter_lock)
-        PyThread_release_lock(interpreter_lock);
+    if (gil_created())
+        drop_gil(tstate);
 #endif
     return tstate;
 }
@@ -175,194 +230,297 @@ PyEval_RestoreThread(PyThreadState *tstate)
     if (tstate == NULL)
         Py_FatalError("PyEval_RestoreThread: NULL tstate");
 #ifdef WITH_THREAD
-    if (interpreter_lock) {
+    if (gil_created()) {
         int err = errno;
-        PyThread_acquire_lock(interpreter_lock, 1);
+        take_gil(tstate);
         errno = err;
     }
 #endif
     PyThreadState_Swap(tstate);
 }
 
-int _Py_CheckInterval = 100;
-volatile int _Py_Ticker = 0; /* so that we hit a "tick" first thing */
-
-#ifdef WITH_THREAD
+/* Pending calls.
+
+   Py_AddPendingCall() may be called from any thread and from signal
+   handlers, so it must never block: producers claim a slot of a ring
+   buffer with an atomic compare-and-swap on pending_head, fill it in and
+   then publish it by setting its ready flag.  Only one thread at a time
+   runs the calls (the main thread, once threads are initialized); it
+   drains every published slot it finds in one batch.  A producer that is
+   interrupted between claiming and publishing its slot only delays the
+   calls queued behind it.
+
+   The ring holds NPENDINGCALLS calls by default.  Embedders can change
+   that with Py_SetPendingCallCapacity() before Py_Initialize(), or users
+   with the PYTHONPENDINGCALLS environment variable.  Calls that do not
+   fit are dropped, Py_AddPendingCall() returns -1 for them, and
+   sys.getpendingcallstats() counts them.  That is deliberate:  spilling
+   them to an overflow list would take a lock, and a signal handler that
+   interrupted the thread holding it would deadlock.  The old queue, with
+   its 32 slots, dropped calls the same way. */
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#pragma intrinsic(_InterlockedCompareExchange, _InterlockedExchangeAdd)
+#define PENDING_CAS(p, old, new) \
+    (_InterlockedCompareExchange((volatile long *)(p), (new), (old)) == (old))
+#define PENDING_ADD(p, v) _InterlockedExchangeAdd((volatile long *)(p), (v))
+#define PENDING_BARRIER() _mm_mfence()
+#elif defined(__GNUC__)
+#define PENDING_CAS(p, old, new) __sync_bool_compare_and_swap((p), (old), (new))
+#define PENDING_ADD(p, v) __sync_fetch_and_add((p), (v))
+#define PENDING_BARRIER() __sync_synchronize()
+#else
+/* No atomic operations: only safe without threads, as before. */
+#define PENDING_CAS(p, old, new) (*(p) == (old) ? (*(p) = (new), 1) : 0)
+#define PENDING_ADD(p, v) ((*(p) += (v)) - (v))
+#define PENDING_BARRIER()
+#endif
 
-/* The WITH_THREAD implementation is thread-safe.  It allows
-   scheduling to be made from any thread, and even from an executing
-   callback.
- */
+#define NPENDINGCALLS 1024
 
-#define NPENDINGCALLS 32
-static struct {
+typedef struct {
     int (*func)(void *);
     void *arg;
-} pendingcalls[NPENDINGCALLS];
-static int pendingfirst = 0;
-static int pendinglast = 0;
-static volatile int pendingcalls_to_do = 1; /* trigger initialization of lock */
-static char pendingbusy = 0;
+    volatile int ready;
+} pendingcall;
+
+static pendingcall pendingcalls_static[NPENDINGCALLS];
+static pendingcall *pendingcalls = pendingcalls_static;
+static long pending_capacity = NPENDINGCALLS;   /* a power of 2 */
+/* Positions only ever grow; the slot is position & (capacity - 1).
+   They are compared by unsigned difference, so wrapping is harmless. */
+static volatile long pending_head = 0;          /* next slot to claim */
+static volatile long pending_tail = 0;          /* next slot to run */
+static volatile int pendingcalls_to_do = 0;
+static volatile int pendingbusy = 0;
+
+/* Statistics, see _PyEval_GetPendingCallStats() */
+static volatile long pending_added = 0;
+static volatile long pending_dropped = 0;
+static volatile long pending_max_depth = 0;
+static long pending_run = 0;
+
+#define PENDING_DEPTH(head, tail) \
+    ((long)((unsigned long)(head) - (unsigned long)(tail)))
+
+int
+Py_SetPendingCallCapacity(int n)
+{
+    long capacity = 2;
+    pendingcall *cells;
+
+    if (n <= 0 || n > (1 << 24))
+        return -1;
+    while (capacity < n)
+        capacity <<= 1;
+    if (capacity == pending_capacity)
+        return 0;
+    /* Only possible while nothing is queued and nobody can be queueing,
+       i.e. before Py_Initialize() has installed any signal handlers. */
+    if (pending_head != pending_tail)
+        return -1;
+    cells = (pendingcall *)calloc(capacity, sizeof(pendingcall));
+    if (cells == NULL)
+        return -1;
+    if (pendingcalls != pendingcalls_static)
+        free(pendingcalls);
+    pendingcalls = cells;
+    pending_capacity = capacity;
+    return 0;
+}
 
 int
 Py_AddPendingCall(int (*func)(void *), void *arg)
 {
-    int i, j, result=0;
-    PyThread_type_lock lock = pending_lock;
-
-    /* try a few times for the lock.  Since this mechanism is used
-     * for signal handling (on the main thread), there is a (slim)
-     * chance that a signal is delivered on the same thread while we
-     * hold the lock during the Py_MakePendingCalls() function.
-     * This avoids a deadlock in that case.
-     * Note that signals can be delivered on any thread.  In particular,
-     * on Windows, a SIGINT is delivered on a system-created worker
-     * thread.
-     * We also check for lock being NULL, in the unlikely case that
-     * this function is called before any bytecode evaluation takes place.
-     */
-    if (lock != NULL) {
-        for (i = 0; i<100; i++) {
-            if (PyThread_acquire_lock(lock, NOWAIT_LOCK))
-                break;
-        }
-        if (i == 100)
+    long head, depth, max;
+    pendingcall *cell;
+
+    /* claim a slot */
+    do {
+        head = pending_head;
+        depth = PENDING_DEPTH(head, pending_tail);
+        if (depth >= pending_capacity) {
+            PENDING_ADD(&pending_dropped, 1); /* Queue full */
+            _Py_Ticker = 0;
+            pendingcalls_to_do = 1;
             return -1;
-    }
+        }
+    } while (!PENDING_CAS(&pending_head, head, head + 1));
+
+    cell = &pendingcalls[head & (pending_capacity - 1)];
+    cell->func = func;
+    cell->arg = arg;
+    PENDING_BARRIER();
+    cell->ready = 1;
+
+    PENDING_ADD(&pending_added, 1);
+    depth++;
+    while ((max = pending_max_depth) < depth &&
+           !PENDING_CAS(&pending_max_depth, max, depth))
+        ;
 
-    i = pendinglast;
-    j = (i + 1) % NPENDINGCALLS;
-    if (j == pendingfirst) {
-        result = -1; /* Queue full */
-    } else {
-        pendingcalls[i].func = func;
-        pendingcalls[i].arg = arg;
-        pendinglast = j;
-    }
     /* signal main loop */
     _Py_Ticker = 0;
     pendingcalls_to_do = 1;
-    if (lock != NULL)
-        PyThread_release_lock(lock);
-    return result;
+    return 0;
 }
 
 int
 Py_MakePendingCalls(void)
 {
-    int i;
+    long tail, head;
     int r = 0;
 
-    if (!pending_lock) {
-        /* initial allocation of the lock */
-        pending_lock = PyThread_allocate_lock();
-        if (pending_lock == NULL)
-            return -1;
-    }
-
+#ifdef WITH_THREAD
     /* only service pending calls on main thread */
     if (main_thread && PyThread_get_thread_ident() != main_thread)
         return 0;
+#endif
     /* don't perform recursive pending calls */
-    if (pendingbusy)
+    if (!PENDING_CAS(&pendingbusy, 0, 1))
         return 0;
-    pendingbusy = 1;
-    /* perform a bounded number of calls, in case of recursion */
-    for (i=0; i<NPENDINGCALLS; i++) {
-        int j;
+    /* Clear the flag before looking at the queue: a producer publishing
+       anything we miss sets it again afterwards. */
+    pendingcalls_to_do = 0;
+    PENDING_BARRIER();
+
+    /* Run what is queued now, but not calls added by the calls
+       themselves, in case of recursion. */
+    tail = pending_tail;
+    head = pending_head;
+    while (tail != head) {
+        pendingcall *cell = &pendingcalls[tail & (pending_capacity - 1)];
         int (*func)(void *);
-        void *arg = NULL;
-
-        /* pop one item off the queue while holding the lock */
-        PyThread_acquire_lock(pending_lock, WAIT_LOCK);
-        j = pendingfirst;
-        if (j == pendinglast) {
-            func = NULL; /* Queue empty */
-        } else {
-            func = pendingcalls[j].func;
-            arg = pendingcalls[j].arg;
-            pendingfirst = (j + 1) % NPENDINGCALLS;
-        }
-        pendingcalls_to_do = pendingfirst != pendinglast;
-        PyThread_release_lock(pending_lock);
-        /* having released the lock, perform the callback */
-        if (func == NULL)
+        void *arg;
+
+        if (!cell->ready) {
+            /* claimed but not yet filled in; its producer will set
+               pendingcalls_to_do once it has */
             break;
+        }
+        PENDING_BARRIER();
+        func = cell->func;
+        arg = cell->arg;
+        cell->ready = 0;
+        PENDING_BARRIER();
+        pending_tail = ++tail;
+        pending_run++;
         r = func(arg);
         if (r)
             break;
     }
+    if (tail != pending_head)
+        pendingcalls_to_do = 1; /* We're not done yet */
     pendingbusy = 0;
     return r;
 }
 
-#else /* if ! defined WITH_THREAD */
+PyObject *
+_PyEval_GetPendingCallStats(void)
+{
+    return Py_BuildValue("{sl,sl,sl,sl,sl,sl}",
+                         "capacity", pending_capacity,
+                         "depth", PENDING_DEPTH(pending_head, pending_tail),
+                         "max_depth", (long)pending_max_depth,
+                         "added", (long)pending_added,
+                         "run", pending_run,
+                         "dropped", (long)pending_dropped);
+}
 
-#define NPENDINGCALLS 32
-static struct {
-    int (*func)(void *);
-    void *arg;
-} pendingcalls[NPENDINGCALLS];
-static volatile int pendingfirst = 0;
-static volatile int pendinglast = 0;
-static volatile int pendingcalls_to_do = 0;
+/* Called by the compiled code whenever _Py_Ticker drops below zero.
+   Services pending calls and, if another thread has been waiting for the
+   GIL longer than the switch interval, hands the GIL over to it.
+   Returns -1 with an exception set if a pending call failed. */
 
 int
-Py_AddPendingCall(int (*func)(void *), void *arg)
+_PyEval_HandleTick(void)
 {
-    static volatile int busy = 0;
-    int i, j;
-    /* XXX Begin critical section */
-    if (busy)
-        return -1;
-    busy = 1;
-    i = pendinglast;
-    j = (i + 1) % NPENDINGCALLS;
-    if (j == pendingfirst) {
-        busy = 0;
-        return -1; /* Queue full */
+    PyThreadState *tstate = PyThreadState_GET();
+
+    _Py_Ticker = _Py_CheckInterval;
+    tstate->tick_counter++;
+    if (pendingcalls_to_do) {
+        if (Py_MakePendingCalls() < 0)
+            return -1;
+        if (pendingcalls_to_do)
+            /* MakePendingCalls() didn't succeed.
+               Force early re-execution of this
+               "periodic" code, possibly after
+               a thread switch */
+            _Py_Ticker = 0;
     }
-    pendingcalls[i].func = func;
-    pendingcalls[i].arg = arg;
-    pendinglast = j;
+#ifdef WITH_THREAD
+    if (gil_drop_request) {
+        /* Give another thread a chance */
+        if (PyThreadState_Swap(NULL) != tstate)
+            Py_FatalError("_PyEval_HandleTick: wrong thread state");
+        drop_gil(tstate);
 
-    _Py_Ticker = 0;
-    pendingcalls_to_do = 1; /* Signal main loop */
-    busy = 0;
-    /* XXX End critical section */
+        /* Other threads may run now */
+
+        take_gil(tstate);
+        if (PyThreadState_Swap(tstate) != NULL)
+            Py_FatalError("_PyEval_HandleTick: orphan tstate");
+    }
+#endif
     return 0;
 }
 
+/* Profiling.  There are no frame objects, so the profile function is
+   called with a NULL frame and the callable as its argument: the compiled
+   function for PyTrace_CALL and PyTrace_RETURN, the builtin for
+   PyTrace_C_CALL, PyTrace_C_RETURN and PyTrace_C_EXCEPTION.  Nested
+   events raised while the profile function itself runs are ignored. */
+
+void
+PyEval_SetProfile(Py_tracefunc func, PyObject *arg)
+{
+    PyThreadState *tstate = PyThreadState_GET();
+    PyObject *temp = tstate->c_profileobj;
+    Py_XINCREF(arg);
+    tstate->c_profilefunc = NULL;
+    tstate->c_profileobj = NULL;
+    /* Must make sure that tracing is not ignored if 'temp' is freed */
+    tstate->use_tracing = tstate->c_tracefunc != NULL;
+    Py_XDECREF(temp);
+    tstate->c_profilefunc = func;
+    tstate->c_profileobj = arg;
+    /* Flag that tracing or profiling is turned on */
+    tstate->use_tracing = (func != NULL) || (tstate->c_tracefunc != NULL);
+}
+
 int
-Py_MakePendingCalls(void)
+_PyEval_CallProfile(PyThreadState *tstate, int what, PyObject *arg)
 {
-    static int busy = 0;
-    if (busy)
+    PyObject *type = NULL, *value = NULL, *traceback = NULL;
+    int result, protect;
+
+    if (tstate->tracing || tstate->c_profilefunc == NULL)
         return 0;
-    busy = 1;
-    pendingcalls_to_do = 0;
-    for (;;) {
-        int i;
-        int (*func)(void *);
-        void *arg;
-        i = pendingfirst;
-        if (i == pendinglast)
-            break; /* Queue empty */
-        func = pendingcalls[i].func;
-        arg = pendingcalls[i].arg;
-        pendingfirst = (i + 1) % NPENDINGCALLS;
-        if (func(arg) < 0) {
-            busy = 0;
-            pendingcalls_to_do = 1; /* We're not done yet */
-            return -1;
+    /* The exit events must not clobber the exception being propagated;
+       if the profile function fails, its error replaces it. */
+    protect = what != PyTrace_CALL && what != PyTrace_C_CALL;
+    if (protect)
+        PyErr_Fetch(&type, &value, &traceback);
+    tstate->tracing++;
+    tstate->use_tracing = 0;
+    result = tstate->c_profilefunc(tstate->c_profileobj, NULL, what, arg);
+    tstate->use_tracing = ((tstate->c_tracefunc != NULL)
+                           || (tstate->c_profilefunc != NULL));
+    tstate->tracing--;
+    if (protect) {
+        if (result == 0)
+            PyErr_Restore(type, value, traceback);
+        else {
+            Py_XDECREF(type);
+            Py_XDECREF(value);
+            Py_XDECREF(traceback);
         }
     }
-    busy = 0;
-    return 0;
+    return result;
 }
 
-#endif /* WITH_THREAD */
-
 int
 PyEval_GetRestricted(void)
 {
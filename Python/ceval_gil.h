@@ -0,0 +1,418 @@
+/*
+ * Implementation of the Global Interpreter Lock (GIL).
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+
+
+/* First some general settings */
+
+/* microseconds (the Python API uses seconds, though) */
+#define DEFAULT_INTERVAL 5000
+static unsigned long gil_interval = DEFAULT_INTERVAL;
+#define INTERVAL (gil_interval >= 1UL ? gil_interval : 1UL)
+
+/* Enable if you want to force the switching of threads at least every
+   `gil_interval`.  With it, a thread dropping the GIL because another
+   thread asked for it waits until that other thread has actually taken
+   the GIL, so it can't grab it straight back. */
+#undef FORCE_SWITCHING
+#define FORCE_SWITCHING
+
+
+/*
+   Notes about the implementation:
+
+   - The GIL is just a boolean variable (gil_locked) whose access is protected
+     by a mutex (gil_mutex), and whose changes are signalled by a condition
+     variable (gil_cond). gil_mutex is taken for short periods of time,
+     and therefore mostly uncontended.
+
+   - In the GIL-holding thread, the compiled code must be able to release
+     the GIL on demand by another thread. A volatile boolean
+     variable (gil_drop_request) is used for that purpose, which is checked
+     at every tick by _PyEval_HandleTick().  The compiled code only reaches
+     that function when _Py_Ticker runs out, so whoever sets
+     gil_drop_request also zeroes _Py_Ticker.
+
+   - A thread wanting to take the GIL will first let pass a given amount of
+     time (`interval` microseconds) before setting gil_drop_request. This
+     encourages a defined switching period, but doesn't enforce it since
+     opcodes can take an arbitrary time to execute.
+
+     The `interval` value is available for the user to read and modify
+     using the Python API `sys.{get,set}switchinterval()`.
+
+   - When a thread releases the GIL and gil_drop_request is set, that thread
+     ensures that another GIL-awaiting thread gets scheduled.
+     It does so by waiting on a condition variable (switch_cond) until
+     the value of gil_last_holder is changed to something else than its
+     own thread state pointer, indicating that another thread was able to
+     take the GIL.
+
+     This is meant to prohibit the latency-adverse behaviour on multi-core
+     machines where one thread would speculatively release the GIL, but still
+     run and end up being the first to re-acquire it, making the "timeslices"
+     much longer than expected.
+     (Note: this mechanism is enabled with FORCE_SWITCHING above)
+*/
+
+#ifdef NT_THREADS
+
+#include <windows.h>
+
+/* Windows XP has no native condition variables, so they are emulated with
+   a semaphore and a waiter count.  The emulation can produce spurious
+   wakeups; every wait below re-checks its predicate in a loop. */
+
+typedef CRITICAL_SECTION gil_mutex_T;
+typedef struct {
+    HANDLE sem;
+    int waiting;
+} gil_cond_T;
+
+#define MUTEX_INIT(mut) \
+    InitializeCriticalSection(&(mut))
+#define MUTEX_FINI(mut) \
+    DeleteCriticalSection(&(mut))
+#define MUTEX_LOCK(mut) \
+    EnterCriticalSection(&(mut))
+#define MUTEX_UNLOCK(mut) \
+    LeaveCriticalSection(&(mut))
+
+#define COND_INIT(cond) \
+    if (((cond).sem = CreateSemaphore(NULL, 0, 100000, NULL)) == NULL) { \
+        Py_FatalError("CreateSemaphore(" #cond ") failed"); }; \
+    (cond).waiting = 0;
+#define COND_FINI(cond) \
+    CloseHandle((cond).sem)
+#define COND_SIGNAL(cond) \
+    if ((cond).waiting > 0) { \
+        (cond).waiting--; \
+        ReleaseSemaphore((cond).sem, 1, NULL); }
+#define COND_WAIT(cond, mut) \
+    { (cond).waiting++; \
+      MUTEX_UNLOCK(mut); \
+      if (WaitForSingleObject((cond).sem, INFINITE) != WAIT_OBJECT_0) { \
+          Py_FatalError("WaitForSingleObject(" #cond ") failed"); }; \
+      MUTEX_LOCK(mut); }
+#define COND_TIMED_WAIT(cond, mut, microseconds, timeout_result) \
+    { DWORD r; \
+      (cond).waiting++; \
+      MUTEX_UNLOCK(mut); \
+      r = WaitForSingleObject((cond).sem, (DWORD) ((microseconds) / 1000)); \
+      MUTEX_LOCK(mut); \
+      if (r == WAIT_TIMEOUT) { \
+          (cond).waiting--; \
+          timeout_result = 1; \
+      } \
+      else if (r != WAIT_OBJECT_0) \
+          Py_FatalError("WaitForSingleObject(" #cond ") failed"); \
+      else \
+          timeout_result = 0; \
+    }
+
+#else /* !NT_THREADS */
+
+#include <pthread.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+typedef pthread_mutex_t gil_mutex_T;
+typedef pthread_cond_t gil_cond_T;
+
+#define ADD_MICROSECONDS(tv, interval) \
+do { \
+    tv.tv_usec += (long) interval; \
+    tv.tv_sec += tv.tv_usec / 1000000; \
+    tv.tv_usec %= 1000000; \
+} while (0)
+
+/* We assume all modern POSIX systems have gettimeofday() */
+#ifdef GETTIMEOFDAY_NO_TZ
+#define GETTIMEOFDAY(ptv) gettimeofday(ptv)
+#else
+#define GETTIMEOFDAY(ptv) gettimeofday(ptv, (struct timezone *)NULL)
+#endif
+
+#define MUTEX_INIT(mut) \
+    if (pthread_mutex_init(&mut, NULL)) { \
+        Py_FatalError("pthread_mutex_init(" #mut ") failed"); };
+#define MUTEX_FINI(mut) \
+    if (pthread_mutex_destroy(&mut)) { \
+        Py_FatalError("pthread_mutex_destroy(" #mut ") failed"); };
+#define MUTEX_LOCK(mut) \
+    if (pthread_mutex_lock(&mut)) { \
+        Py_FatalError("pthread_mutex_lock(" #mut ") failed"); };
+#define MUTEX_UNLOCK(mut) \
+    if (pthread_mutex_unlock(&mut)) { \
+        Py_FatalError("pthread_mutex_unlock(" #mut ") failed"); };
+
+#define COND_INIT(cond) \
+    if (pthread_cond_init(&cond, NULL)) { \
+        Py_FatalError("pthread_cond_init(" #cond ") failed"); };
+#define COND_FINI(cond) \
+    if (pthread_cond_destroy(&cond)) { \
+        Py_FatalError("pthread_cond_destroy(" #cond ") failed"); };
+#define COND_SIGNAL(cond) \
+    if (pthread_cond_signal(&cond)) { \
+        Py_FatalError("pthread_cond_signal(" #cond ") failed"); };
+#define COND_WAIT(cond, mut) \
+    if (pthread_cond_wait(&cond, &mut)) { \
+        Py_FatalError("pthread_cond_wait(" #cond ") failed"); };
+#define COND_TIMED_WAIT(cond, mut, microseconds, timeout_result) \
+    { \
+        int r; \
+        struct timespec ts; \
+        struct timeval deadline; \
+        \
+        GETTIMEOFDAY(&deadline); \
+        ADD_MICROSECONDS(deadline, microseconds); \
+        ts.tv_sec = deadline.tv_sec; \
+        ts.tv_nsec = deadline.tv_usec * 1000; \
+        \
+        r = pthread_cond_timedwait(&cond, &mut, &ts); \
+        if (r == ETIMEDOUT) \
+            timeout_result = 1; \
+        else if (r) \
+            Py_FatalError("pthread_cond_timedwait(" #cond ") failed"); \
+        else \
+            timeout_result = 0; \
+    }
+
+#endif /* NT_THREADS */
+
+
+/* Monotonic clock for the contention statistics, in nanoseconds. */
+static PY_LONG_LONG
+gil_clock_ns(void)
+{
+#ifdef NT_THREADS
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER t;
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&t);
+    return (PY_LONG_LONG)((double)t.QuadPart * 1e9 / (double)freq.QuadPart);
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (PY_LONG_LONG)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    struct timeval tv;
+    GETTIMEOFDAY(&tv);
+    return (PY_LONG_LONG)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
+
+/* Whether the GIL is already taken (-1 if uninitialized). This is volatile
+   because it can be read without any lock taken in ceval.c. */
+static volatile int gil_locked = -1;
+/* Number of GIL switches since the beginning. */
+static unsigned long gil_switch_number = 0;
+/* Last thread holding / having held the GIL. This helps us know whether
+   anyone else was scheduled after we dropped the GIL. */
+static PyThreadState *gil_last_holder = NULL;
+/* Thread ident of the thread holding the GIL, 0 while it is free.  Unlike
+   a thread state, it can be read from a signal handler running on another
+   thread without the risk of the holder freeing it meanwhile. */
+volatile long _PyEval_GILHolder = 0;
+
+/* This condition variable allows one or several threads to wait until
+   the GIL is released. In addition, the mutex also protects the above
+   variables. */
+static gil_cond_T gil_cond;
+static gil_mutex_T gil_mutex;
+
+#ifdef FORCE_SWITCHING
+/* This condition variable helps the GIL-releasing thread wait for
+   a GIL-awaiting thread to be scheduled and take the GIL. */
+static gil_cond_T switch_cond;
+static gil_mutex_T switch_mutex;
+#endif
+
+/* Request for dropping the GIL.  Set by a thread which has waited more
+   than `interval` for the GIL; reset by whoever takes the GIL next. */
+static volatile int gil_drop_request = 0;
+
+/* Contention statistics (see sys.getgilstats()).  They are only ever
+   updated by the thread holding the GIL, which serializes them.  The
+   same figures are kept in the holder's thread state when there is one. */
+static PyGILStats gil_stats;
+/* When the current holder took the GIL, to compute hold times. */
+static PY_LONG_LONG gil_acquired_at = 0;
+
+#define SET_GIL_DROP_REQUEST() \
+    do { gil_drop_request = 1; _Py_Ticker = 0; } while (0)
+#define RESET_GIL_DROP_REQUEST() \
+    do { gil_drop_request = 0; } while (0)
+
+
+static int gil_created(void)
+{
+    return gil_locked >= 0;
+}
+
+static void create_gil(void)
+{
+    MUTEX_INIT(gil_mutex);
+#ifdef FORCE_SWITCHING
+    MUTEX_INIT(switch_mutex);
+#endif
+    COND_INIT(gil_cond);
+#ifdef FORCE_SWITCHING
+    COND_INIT(switch_cond);
+#endif
+    gil_last_holder = NULL;
+    _PyEval_GILHolder = 0;
+    gil_drop_request = 0;
+    gil_locked = 0;
+}
+
+static void recreate_gil(void)
+{
+    /* After a fork the GIL primitives may be in any state, including
+       locked by a thread which no longer exists.  Don't bother destroying
+       them (that could fail), just initialize them again. */
+    create_gil();
+}
+
+static void
+gil_stats_acquired(PyGILStats *st, PY_LONG_LONG waited)
+{
+    st->acquisitions++;
+    if (waited > 0) {
+        st->contended++;
+        st->wait_ns += waited;
+        if (waited > st->max_wait_ns)
+            st->max_wait_ns = waited;
+    }
+}
+
+static void
+gil_stats_released(PyGILStats *st, PY_LONG_LONG held, int forced)
+{
+    int bucket = 0;
+    PY_LONG_LONG us = held / 1000;
+
+    while (us > 0 && bucket < PyGIL_HOLD_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    st->hold_ns += held;
+    st->hold_hist[bucket]++;
+    if (forced)
+        st->forced_drops++;
+}
+
+static void drop_gil(PyThreadState *tstate)
+{
+    PY_LONG_LONG held;
+    int forced;
+
+    /* NOTE: tstate is allowed to be NULL. */
+    if (gil_locked <= 0)
+        Py_FatalError("drop_gil: GIL is not locked");
+    /* Sub-interpreter support: threads might have been switched
+       under our feet using PyThreadState_Swap(). Fix the GIL last
+       holder variable so that our heuristics work. */
+    if (tstate != NULL)
+        gil_last_holder = tstate;
+
+    /* We still hold the GIL, so the statistics are ours to update. */
+    held = gil_clock_ns() - gil_acquired_at;
+    forced = gil_drop_request;
+    gil_stats_released(&gil_stats, held, forced);
+    if (tstate != NULL)
+        gil_stats_released(&tstate->gil_stats, held, forced);
+
+    MUTEX_LOCK(gil_mutex);
+    _PyEval_GILHolder = 0;
+    gil_locked = 0;
+    COND_SIGNAL(gil_cond);
+    MUTEX_UNLOCK(gil_mutex);
+
+#ifdef FORCE_SWITCHING
+    if (gil_drop_request && tstate != NULL) {
+        MUTEX_LOCK(switch_mutex);
+        /* Not switched yet => wait.  A thread set gil_drop_request while
+           we held the GIL and it can only leave take_gil() by taking the
+           GIL, so someone is bound to replace us as gil_last_holder. */
+        while (gil_last_holder == tstate)
+            COND_WAIT(switch_cond, switch_mutex);
+        MUTEX_UNLOCK(switch_mutex);
+    }
+#endif
+}
+
+static void take_gil(PyThreadState *tstate)
+{
+    int err;
+    PY_LONG_LONG wait_start = 0, waited = 0;
+    /* NOTE: tstate is allowed to be NULL. */
+    err = errno;
+    MUTEX_LOCK(gil_mutex);
+
+    if (!gil_locked)
+        goto _ready;
+
+    wait_start = gil_clock_ns();
+
+    while (gil_locked) {
+        int timed_out = 0;
+        unsigned long saved_switchnum;
+
+        saved_switchnum = gil_switch_number;
+        COND_TIMED_WAIT(gil_cond, gil_mutex, INTERVAL, timed_out);
+        /* If we timed out and no switch occurred in the meantime, it is time
+           to ask the GIL-holding thread to drop it. */
+        if (timed_out && gil_locked &&
+            gil_switch_number == saved_switchnum) {
+            SET_GIL_DROP_REQUEST();
+        }
+    }
+_ready:
+#ifdef FORCE_SWITCHING
+    /* This mutex must be taken before modifying gil_last_holder (see
+       drop_gil()). */
+    MUTEX_LOCK(switch_mutex);
+#endif
+    /* We now hold the GIL */
+    gil_locked = 1;
+    _PyEval_GILHolder = PyThread_get_thread_ident();
+
+    if (tstate != gil_last_holder) {
+        gil_last_holder = tstate;
+        ++gil_switch_number;
+    }
+
+#ifdef FORCE_SWITCHING
+    COND_SIGNAL(switch_cond);
+    MUTEX_UNLOCK(switch_mutex);
+#endif
+    if (gil_drop_request)
+        RESET_GIL_DROP_REQUEST();
+
+    MUTEX_UNLOCK(gil_mutex);
+
+    gil_acquired_at = gil_clock_ns();
+    if (wait_start != 0)
+        waited = gil_acquired_at - wait_start;
+    gil_stats_acquired(&gil_stats, waited);
+    if (tstate != NULL)
+        gil_stats_acquired(&tstate->gil_stats, waited);
+    errno = err;
+}
+
+void _PyEval_SetSwitchInterval(unsigned long microseconds)
+{
+    gil_interval = microseconds;
+}
+
+unsigned long _PyEval_GetSwitchInterval(void)
+{
+    return gil_interval;
+}
@@ -53,6 +53,8 @@ extern void init_struct(void);
 extern void initdatetime(void);
 extern void init_functools(void);
 extern void init_json(void);
+extern void init_lsprof(void);
+extern void init_testcapi(void);
 extern void initzlib(void);
 extern void init_multibytecodec(void);
 extern void init_codecs_cn(void);
@@ -70,6 +72,9 @@ extern void initselect(void);
 extern void initunicodedata(void);
 extern void PyMarshal_Init(void);
 extern void initimp(void);
+#ifndef MS_WINDOWS
+extern void init_sampleprof(void);
+#endif
 
 struct _inittab _PyImport_Inittab[] = {
 #ifdef MS_WINDOWS
@@ -86,6 +91,7 @@ struct _inittab _PyImport_Inittab[] = {
 #endif
 #else
     {"posix", initposix},
+    {"_sampleprof", init_sampleprof},
 #endif
     {"array", initarray},
     {"binascii", initbinascii},
@@ -121,6 +127,8 @@ struct _inittab _PyImport_Inittab[] = {
     {"datetime", initdatetime},
     {"_functools", init_functools},
     {"_json", init_json},
+    {"_lsprof", init_lsprof},
+    {"_testcapi", init_testcapi},
     {"xxsubtype", initxxsubtype},
     {"zlib", initzlib},
 
@@ -37,7 +37,19 @@ static PyThread_type_lock head_mutex = NULL; /* Protects interp->tstate_head */
    GILState implementation
 */
 static PyInterpreterState *autoInterpreterState = NULL;
+
+/* Where the compiler supports thread-local variables, each thread's
+   GILState thread state is kept in one rather than behind a TLS key.
+   autoTLSgeneration is bumped by _PyGILState_Init() so that values left
+   behind by an earlier Py_Initialize()/Py_Finalize() cycle are ignored. */
+#if defined(__GNUC__) && !defined(Py_NO_THREAD_LOCAL)
+#define Py_THREAD_LOCAL __thread
+static long autoTLSgeneration = 0;
+static Py_THREAD_LOCAL PyThreadState *autoTLStstate = NULL;
+static Py_THREAD_LOCAL long autoTLStstate_generation = 0;
+#else
 static int autoTLSkey = 0;
+#endif
 #else
 #define HEAD_INIT() /* Nothing */
 #define HEAD_LOCK() /* Nothing */
@@ -51,6 +63,45 @@ PyThreadFrameGetter _PyThreadState_GetFrame = NULL;
 
 #ifdef WITH_THREAD
 static void _PyGILState_NoteThreadState(PyThreadState* tstate);
+
+/* Thread-local access to the GILState thread state of this thread, with
+   the semantics of the PyThread_*_key_value() functions. */
+static PyThreadState *
+autoTLS_get(void)
+{
+#ifdef Py_THREAD_LOCAL
+    if (autoTLStstate_generation != autoTLSgeneration)
+        return NULL;
+    return autoTLStstate;
+#else
+    return (PyThreadState *)PyThread_get_key_value(autoTLSkey);
+#endif
+}
+
+static int
+autoTLS_set(PyThreadState *tstate)
+{
+#ifdef Py_THREAD_LOCAL
+    if (autoTLS_get() == NULL) {
+        /* ignore value if already set */
+        autoTLStstate = tstate;
+        autoTLStstate_generation = autoTLSgeneration;
+    }
+    return 0;
+#else
+    return PyThread_set_key_value(autoTLSkey, (void *)tstate);
+#endif
+}
+
+static void
+autoTLS_delete(void)
+{
+#ifdef Py_THREAD_LOCAL
+    autoTLStstate = NULL;
+#else
+    PyThread_delete_key_value(autoTLSkey);
+#endif
+}
 #endif
 
 
@@ -195,6 +246,9 @@ new_threadstate(PyInterpreterState *interp, int init)
         tstate->trash_delete_nesting = 0;
         tstate->trash_delete_later = NULL;
 
+        memset(&tstate->gil_stats, 0, sizeof(tstate->gil_stats));
+        tstate->shadow_stack.depth = 0;
+
         if (init)
             _PyThreadState_Init(tstate);
 
@@ -300,8 +354,8 @@ PyThreadState_Delete(PyThreadState *tstate)
         Py_FatalError("PyThreadState_Delete: tstate is still current");
     tstate_delete_common(tstate);
 #ifdef WITH_THREAD
-    if (autoInterpreterState && PyThread_get_key_value(autoTLSkey) == tstate)
-        PyThread_delete_key_value(autoTLSkey);
+    if (autoInterpreterState && autoTLS_get() == tstate)
+        autoTLS_delete();
 #endif /* WITH_THREAD */
 }
 
@@ -315,8 +369,8 @@ PyThreadState_DeleteCurrent()
         Py_FatalError(
             "PyThreadState_DeleteCurrent: no current tstate");
     _PyThreadState_Current = NULL;
-    if (autoInterpreterState && PyThread_get_key_value(autoTLSkey) == tstate)
-        PyThread_delete_key_value(autoTLSkey);
+    if (autoInterpreterState && autoTLS_get() == tstate)
+        autoTLS_delete();
     tstate_delete_common(tstate);
     PyEval_ReleaseLock();
 }
@@ -495,6 +549,66 @@ _PyThread_CurrentFrames(void)
     return NULL;
 }
 
+#ifdef WITH_THREAD
+/* The per-thread part of sys.getgilstats().  Like _PyThread_CurrentFrames()
+   it is called with the GIL held and holds head_mutex while walking the
+   thread states.
+*/
+PyObject *
+_PyThread_GILStats(void)
+{
+    PyObject *result;
+    PyInterpreterState *i;
+
+    result = PyDict_New();
+    if (result == NULL)
+        return NULL;
+
+    HEAD_LOCK();
+    for (i = interp_head; i != NULL; i = i->next) {
+        PyThreadState *t;
+        for (t = i->tstate_head; t != NULL; t = t->next) {
+            PyObject *id, *stats;
+            int stat;
+            stats = _PyGILStats_AsDict(&t->gil_stats);
+            if (stats == NULL)
+                goto Fail;
+            id = PyInt_FromLong(t->thread_id);
+            if (id == NULL) {
+                Py_DECREF(stats);
+                goto Fail;
+            }
+            stat = PyDict_SetItem(result, id, stats);
+            Py_DECREF(id);
+            Py_DECREF(stats);
+            if (stat < 0)
+                goto Fail;
+        }
+    }
+    HEAD_UNLOCK();
+    return result;
+
+ Fail:
+    HEAD_UNLOCK();
+    Py_DECREF(result);
+    return NULL;
+}
+
+void
+_PyThread_ResetGILStats(void)
+{
+    PyInterpreterState *i;
+
+    HEAD_LOCK();
+    for (i = interp_head; i != NULL; i = i->next) {
+        PyThreadState *t;
+        for (t = i->tstate_head; t != NULL; t = t->next)
+            memset(&t->gil_stats, 0, sizeof(t->gil_stats));
+    }
+    HEAD_UNLOCK();
+}
+#endif /* WITH_THREAD */
+
 /* Python "auto thread state" API. */
 #ifdef WITH_THREAD
 
@@ -524,9 +638,13 @@ void
 _PyGILState_Init(PyInterpreterState *i, PyThreadState *t)
 {
     assert(i && t); /* must init with valid states */
+#ifdef Py_THREAD_LOCAL
+    autoTLSgeneration++;
+#else
     autoTLSkey = PyThread_create_key();
+#endif
     autoInterpreterState = i;
-    assert(PyThread_get_key_value(autoTLSkey) == NULL);
+    assert(autoTLS_get() == NULL);
     assert(t->gilstate_counter == 0);
 
     _PyGILState_NoteThreadState(t);
@@ -535,7 +653,9 @@ _PyGILState_Init(PyInterpreterState *i, PyThreadState *t)
 void
 _PyGILState_Fini(void)
 {
+#ifndef Py_THREAD_LOCAL
     PyThread_delete_key(autoTLSkey);
+#endif
     autoInterpreterState = NULL;
 }
 
@@ -567,7 +687,7 @@ _PyGILState_NoteThreadState(PyThreadState* tstate)
           state created for that given OS level thread will "win",
           which seems reasonable behaviour.
     */
-    if (PyThread_set_key_value(autoTLSkey, (void *)tstate) < 0)
+    if (autoTLS_set(tstate) < 0)
         Py_FatalError("Couldn't create autoTLSkey mapping");
 
     /* PyGILState_Release must not try to delete this thread state. */
@@ -580,7 +700,7 @@ PyGILState_GetThisThreadState(void)
 {
     if (autoInterpreterState == NULL)
         return NULL;
-    return (PyThreadState *)PyThread_get_key_value(autoTLSkey);
+    return autoTLS_get();
 }
 
 PyGILState_STATE
@@ -594,7 +714,7 @@ PyGILState_Ensure(void)
        called Py_Initialize() and usually PyEval_InitThreads().
     */
     assert(autoInterpreterState); /* Py_Initialize() hasn't been called! */
-    tcur = (PyThreadState *)PyThread_get_key_value(autoTLSkey);
+    tcur = autoTLS_get();
     if (tcur == NULL) {
         /* Create a new thread state for this thread */
         tcur = PyThreadState_New(autoInterpreterState);
@@ -621,8 +741,7 @@ PyGILState_Ensure(void)
 void
 PyGILState_Release(PyGILState_STATE oldstate)
 {
-    PyThreadState *tcur = (PyThreadState *)PyThread_get_key_value(
-                                                            autoTLSkey);
+    PyThreadState *tcur = autoTLS_get();
     if (tcur == NULL)
         Py_FatalError("auto-releasing thread-state, "
                       "but no thread-state for this thread");
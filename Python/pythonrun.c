@@ -160,6 +160,11 @@ Py_InitializeEx(int install_sigs)
 
     _PyRandom_Init();
 
+    if ((p = Py_GETENV("PYTHONPENDINGCALLS")) && *p != '\0')
+        if (Py_SetPendingCallCapacity(atoi(p)) < 0)
+            Py_FatalError("PYTHONPENDINGCALLS must be a positive integer "
+                          "no larger than 16777216");
+
     interp = PyInterpreterState_New();
     if (interp == NULL)
         Py_FatalError("Py_Initialize: can't make first interpreter");
@@ -356,7 +356,8 @@ PyDoc_STRVAR(setcheckinterval_doc,
 "setcheckinterval(n)\n\
 \n\
 Tell the Python interpreter to check for asynchronous events every\n\
-n instructions.  This also affects how often thread switches occur."
+n instructions.  Thread switches happen at these checks, but only once\n\
+another thread has waited for the switch interval; see setswitchinterval()."
 );
 
 static PyObject *
@@ -369,6 +370,212 @@ PyDoc_STRVAR(getcheckinterval_doc,
 "getcheckinterval() -> current check interval; see setcheckinterval()."
 );
 
+#ifdef WITH_THREAD
+static PyObject *
+sys_setswitchinterval(PyObject *self, PyObject *args)
+{
+    double d;
+    if (!PyArg_ParseTuple(args, "d:setswitchinterval", &d))
+        return NULL;
+    if (d <= 0.0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "switch interval must be strictly positive");
+        return NULL;
+    }
+    _PyEval_SetSwitchInterval((unsigned long) (1e6 * d));
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyDoc_STRVAR(setswitchinterval_doc,
+"setswitchinterval(n)\n\
+\n\
+Set the ideal thread switching delay inside the Python interpreter.\n\
+The actual frequency of switching threads can be lower if the\n\
+interpreter executes long sequences of uninterruptible code\n\
+(this is implementation-specific and workload-dependent).\n\
+\n\
+The parameter must represent the desired switching delay in seconds.\n\
+A typical value is 0.005 (5 milliseconds)."
+);
+
+static PyObject *
+sys_getswitchinterval(PyObject *self, PyObject *args)
+{
+    return PyFloat_FromDouble(1e-6 * _PyEval_GetSwitchInterval());
+}
+
+PyDoc_STRVAR(getswitchinterval_doc,
+"getswitchinterval() -> current thread switch interval; see setswitchinterval()."
+);
+
+static PyObject *
+sys_getgilstats(PyObject *self, PyObject *noargs)
+{
+    PyObject *global, *threads, *result;
+
+    global = _PyEval_GetGILStats();
+    if (global == NULL)
+        return NULL;
+    threads = _PyThread_GILStats();
+    if (threads == NULL) {
+        Py_DECREF(global);
+        return NULL;
+    }
+    result = Py_BuildValue("{sNsN}", "global", global, "threads", threads);
+    return result;
+}
+
+PyDoc_STRVAR(getgilstats_doc,
+"getgilstats() -> dictionary\n\
+\n\
+Return GIL contention statistics.  The 'global' entry holds the\n\
+process-wide figures and 'threads' maps each live thread id to its own.\n\
+Each entry counts acquisitions, how many of them were contended, the\n\
+total and longest wait (in nanoseconds), the total hold time, how often\n\
+the GIL was dropped because another thread asked for it, and a histogram\n\
+of hold times where bucket i counts holds shorter than 2**i microseconds."
+);
+
+static PyObject *
+sys_resetgilstats(PyObject *self, PyObject *noargs)
+{
+    _PyEval_ResetGILStats();
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyDoc_STRVAR(resetgilstats_doc,
+"resetgilstats()\n\
+\n\
+Clear the statistics reported by getgilstats()."
+);
+
+#endif /* WITH_THREAD */
+
+#ifdef WITH_PYMALLOC
+static PyObject *
+sys_setarenapurgedelay(PyObject *self, PyObject *args)
+{
+    double d;
+    if (!PyArg_ParseTuple(args, "d:setarenapurgedelay", &d))
+        return NULL;
+    _PyObject_SetArenaPurgeDelay(d);
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyDoc_STRVAR(setarenapurgedelay_doc,
+"setarenapurgedelay(seconds)\n\
+\n\
+Set how long memory of the small object allocator must stay unused\n\
+before it is given back to the operating system.  A negative value\n\
+disables this.  The initial value comes from the purge= option of the\n\
+PYTHONARENAS environment variable, and defaults to 1 second."
+);
+
+static PyObject *
+sys_getarenapurgedelay(PyObject *self, PyObject *noargs)
+{
+    return PyFloat_FromDouble(_PyObject_GetArenaPurgeDelay());
+}
+
+PyDoc_STRVAR(getarenapurgedelay_doc,
+"getarenapurgedelay() -> seconds; see setarenapurgedelay()."
+);
+
+static PyObject *
+sys_getarenastats(PyObject *self, PyObject *noargs)
+{
+    return _PyObject_GetArenaStats();
+}
+
+PyDoc_STRVAR(getarenastats_doc,
+"getarenastats() -> dictionary\n\
+\n\
+Return statistics about the arenas of the small object allocator:\n\
+whether they are carved from huge-page regions, how many arenas and\n\
+regions are allocated, how many pools and arenas were given back to the\n\
+operating system, and how many bytes that returned in total and is\n\
+still returned now."
+);
+
+static PyObject *
+sys_purgearenas(PyObject *self, PyObject *noargs)
+{
+    return PyInt_FromSize_t(_PyObject_PurgeArenas(1));
+}
+
+PyDoc_STRVAR(purgearenas_doc,
+"_purgearenas() -> number of bytes\n\
+\n\
+Give the memory of every free pool and arena of the small object\n\
+allocator back to the operating system now, without waiting for the\n\
+purge delay, and return how much that was.  Memory held in thread\n\
+caches is not free in this sense."
+);
+
+static PyObject *
+sys_getallocstats(PyObject *self, PyObject *noargs)
+{
+    return _PyObject_GetAllocStats();
+}
+
+PyDoc_STRVAR(getallocstats_doc,
+"getallocstats() -> dictionary\n\
+\n\
+Return statistics of the small object allocator.  'size_classes' lists,\n\
+for each block size, the blocks in use, the free blocks in its pools,\n\
+the free blocks held in thread caches and the number of pools.  The\n\
+other entries count arenas (current, allocated and freed in total, and\n\
+the high-water mark) and bytes:  mapped for arenas, given back to the\n\
+system, in pools and in use.  'fragmentation' is the share of the\n\
+resident arena memory that does not hold live blocks.  This is cheap\n\
+enough to call on a production process."
+);
+#endif /* WITH_PYMALLOC */
+
+static PyObject *
+sys_getfreeliststats(PyObject *self, PyObject *noargs)
+{
+    PyObject *ints, *floats, *result;
+
+    ints = _PyInt_GetFreeListStats();
+    floats = _PyFloat_GetFreeListStats();
+    if (ints == NULL || floats == NULL)
+        result = NULL;
+    else
+        result = Py_BuildValue("{sOsO}", "int", ints, "float", floats);
+    Py_XDECREF(ints);
+    Py_XDECREF(floats);
+    return result;
+}
+
+PyDoc_STRVAR(getfreeliststats_doc,
+"getfreeliststats() -> dictionary\n\
+\n\
+Return statistics of the int and float free lists: the current, maximum\n\
+and high-water length, the shortest length since the garbage collector\n\
+last trimmed the list, allocations served from the list ('hits') and\n\
+from the object allocator ('misses'), objects freed, objects given back\n\
+to the object allocator, and objects still alive."
+);
+
+static PyObject *
+sys_getpendingcallstats(PyObject *self, PyObject *noargs)
+{
+    return _PyEval_GetPendingCallStats();
+}
+
+PyDoc_STRVAR(getpendingcallstats_doc,
+"getpendingcallstats() -> dictionary\n\
+\n\
+Return statistics about the queue of calls scheduled by\n\
+Py_AddPendingCall(), e.g. by signal handlers: its capacity, current\n\
+and highest depth, and how many calls were added, run and dropped\n\
+because the queue was full."
+);
+
 #ifdef WITH_TSC
 static PyObject *
 sys_settscdump(PyObject *self, PyObject *args)
@@ -800,6 +1007,27 @@ static PyMethodDef sys_methods[] = {
      setcheckinterval_doc},
     {"getcheckinterval",        sys_getcheckinterval, METH_NOARGS,
      getcheckinterval_doc},
+#ifdef WITH_THREAD
+    {"setswitchinterval",       sys_setswitchinterval, METH_VARARGS,
+     setswitchinterval_doc},
+    {"getswitchinterval",       sys_getswitchinterval, METH_NOARGS,
+     getswitchinterval_doc},
+    {"getgilstats",     sys_getgilstats, METH_NOARGS, getgilstats_doc},
+    {"resetgilstats",   sys_resetgilstats, METH_NOARGS, resetgilstats_doc},
+#endif
+    {"getfreeliststats", sys_getfreeliststats, METH_NOARGS,
+     getfreeliststats_doc},
+    {"getpendingcallstats", sys_getpendingcallstats, METH_NOARGS,
+     getpendingcallstats_doc},
+#ifdef WITH_PYMALLOC
+    {"setarenapurgedelay", sys_setarenapurgedelay, METH_VARARGS,
+     setarenapurgedelay_doc},
+    {"getarenapurgedelay", sys_getarenapurgedelay, METH_NOARGS,
+     getarenapurgedelay_doc},
+    {"getarenastats",   sys_getarenastats, METH_NOARGS, getarenastats_doc},
+    {"_purgearenas",    sys_purgearenas, METH_NOARGS, purgearenas_doc},
+    {"getallocstats",   sys_getallocstats, METH_NOARGS, getallocstats_doc},
+#endif
 #ifdef HAVE_DLOPEN
     {"setdlopenflags", sys_setdlopenflags, METH_VARARGS,
      setdlopenflags_doc},
@@ -509,3 +509,59 @@ _pythread_pthread_set_stacksize(size_t size)
 }
 
 #define THREAD_SET_STACKSIZE(x) _pythread_pthread_set_stacksize(x)
+
+
+/* use native pthread TLS functions */
+#define Py_HAVE_NATIVE_TLS
+
+#ifdef Py_HAVE_NATIVE_TLS
+int
+PyThread_create_key(void)
+{
+    pthread_key_t key;
+    int fail = pthread_key_create(&key, NULL);
+    return fail ? -1 : (int)key;
+}
+
+void
+PyThread_delete_key(int key)
+{
+    pthread_key_delete((pthread_key_t)key);
+}
+
+/* We must be careful to emulate the strange semantics implemented in thread.c,
+ * where the value is only set if it hasn't been set before.
+ */
+int
+PyThread_set_key_value(int key, void *value)
+{
+    int fail;
+
+    assert(value != NULL);
+    if (pthread_getspecific((pthread_key_t)key) != NULL)
+        /* ignore value if already set */
+        return 0;
+    fail = pthread_setspecific((pthread_key_t)key, value);
+    return fail ? -1 : 0;
+}
+
+void *
+PyThread_get_key_value(int key)
+{
+    return pthread_getspecific((pthread_key_t)key);
+}
+
+void
+PyThread_delete_key_value(int key)
+{
+    pthread_setspecific((pthread_key_t)key, NULL);
+}
+
+/* The values of the forking thread survive fork() and those of the other
+ * threads are gone with them, so there is nothing to reinitialize.
+ */
+void
+PyThread_ReInitTLS(void)
+{}
+
+#endif